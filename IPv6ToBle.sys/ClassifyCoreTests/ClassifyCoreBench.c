@@ -0,0 +1,199 @@
+/*++
+
+Module Name:
+
+	ClassifyCoreBench.c
+
+Abstract:
+
+	This file contains a benchmark for the platform-neutral core of the
+	classify callouts (see ClassifyCore.c in the driver). It times parsing
+	the fixed IPv6 header and ports and making the classify decision, the
+	work the classify callouts do for every packet, and reports packets per
+	second on the border router for several runtime list sizes.
+
+	Both lists are filled with addresses under a single /64 prefix, as a
+	mesh usually is, and the packets alternate between list members and
+	addresses under the same prefix that aren't in the list, so half are
+	delivered and half permitted after the lookup. The lists are the
+	stand-ins in ListContainsStub.c, which use the driver's address table,
+	so the figures include the cost of the driver's list lookup but not of
+	WFP, NDIS, or the snapshot reader sequence.
+
+	An optional argument sets the number of packets classified per list
+	size and direction.
+
+Environment:
+
+	User mode on any platform
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ClassifyCore.h"
+#include "ListContainsStub.h"
+
+#define BENCH_DEFAULT_ITERATIONS    10000000UL
+#define BENCH_PACKET_COUNT          1024
+#define BENCH_PACKET_STRIDE         (CLASSIFY_CORE_HEADER_LENGTH + CLASSIFY_CORE_PORTS_LENGTH)
+
+static const UINT32 gListSizes[] = { 1, 16, 256, 4096, 65536 };
+
+//
+// Writes the address of device number index under the benchmark's /64
+// prefix. Even and odd indexes never collide, so odd indexes can stand for
+// devices that aren't in a list of even ones.
+//
+static
+void
+BenchAddress(
+	UINT8*	address,
+	UINT32	index
+)
+{
+	static const UINT8 prefix[8] = { 0xfd, 0x00, 0, 0, 0, 0, 0, 0x01 };
+
+	memcpy(address, prefix, sizeof(prefix));
+	memset(address + 8, 0, 4);
+	address[12] = (UINT8)(index >> 24);
+	address[13] = (UINT8)(index >> 16);
+	address[14] = (UINT8)(index >> 8);
+	address[15] = (UINT8)index;
+}
+
+//
+// Returns the wall clock time in seconds, at the clock's full resolution
+//
+static
+double
+BenchNow(void)
+{
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+int
+main(
+	int		argc,
+	char*	argv[]
+)
+{
+	unsigned long iterations = BENCH_DEFAULT_ITERATIONS;
+	if (argc > 1)
+	{
+		iterations = strtoul(argv[1], NULL, 10);
+		if (iterations == 0)
+		{
+			fprintf(stderr, "usage: %s [packets per run]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	UINT32 maxListSize = gListSizes[sizeof(gListSizes) / sizeof(gListSizes[0]) - 1];
+	UINT8* addresses = (UINT8*)malloc((size_t)maxListSize * CLASSIFY_CORE_ADDRESS_LENGTH);
+	UINT8* packets = (UINT8*)malloc((size_t)BENCH_PACKET_COUNT * BENCH_PACKET_STRIDE);
+	if (!addresses || !packets)
+	{
+		fprintf(stderr, "allocation failed\n");
+		free(addresses);
+		free(packets);
+		return 1;
+	}
+
+	printf("%10s  %-9s  %14s  %10s\n", "list size", "direction", "packets/sec", "delivered");
+
+	for (size_t size = 0; size < sizeof(gListSizes) / sizeof(gListSizes[0]); size++)
+	{
+		UINT32 listSize = gListSizes[size];
+
+		//
+		// Step 1
+		// Fill both lists with the even-numbered devices, and build packets
+		// from an external source to alternately a listed and an unlisted
+		// device spread over the list
+		//
+		for (UINT32 i = 0; i < listSize; i++)
+		{
+			BenchAddress(addresses + (size_t)i * CLASSIFY_CORE_ADDRESS_LENGTH, i * 2);
+		}
+
+		if (!ListStubSet(CLASSIFY_CORE_WHITE_LIST, addresses, listSize) ||
+			!ListStubSet(CLASSIFY_CORE_MESH_LIST, addresses, listSize))
+		{
+			fprintf(stderr, "allocation failed\n");
+			break;
+		}
+
+		for (UINT32 i = 0; i < BENCH_PACKET_COUNT; i++)
+		{
+			UINT8* packet = packets + (size_t)i * BENCH_PACKET_STRIDE;
+			UINT32 device = (UINT32)(((unsigned long long)i * listSize) / BENCH_PACKET_COUNT) * 2 + (i & 1);
+			UINT16 payloadLength = (UINT16)(64 + (i % 512));
+
+			memset(packet, 0, BENCH_PACKET_STRIDE);
+			packet[0] = 0x60;
+			packet[4] = (UINT8)(payloadLength >> 8);
+			packet[5] = (UINT8)payloadLength;
+			packet[6] = (i % 4 == 3) ? CLASSIFY_CORE_PROTOCOL_TCP : CLASSIFY_CORE_PROTOCOL_UDP;
+			packet[7] = 64;
+			BenchAddress(packet + 8, 0);	// Listed in the white list
+			BenchAddress(packet + 24, device);
+			packet[40] = (UINT8)(i >> 8);
+			packet[41] = (UINT8)i;
+			packet[42] = 0x16;
+			packet[43] = 0x33;
+		}
+
+		//
+		// Step 2
+		// Classify the packets round robin in each direction and time it
+		//
+		for (UINT8 direction = CLASSIFY_CORE_INBOUND; direction <= CLASSIFY_CORE_OUTBOUND; direction++)
+		{
+			unsigned long delivered = 0;
+
+			double start = BenchNow();
+			for (unsigned long i = 0; i < iterations; i++)
+			{
+				const UINT8* packet = packets + (i % BENCH_PACKET_COUNT) * BENCH_PACKET_STRIDE;
+				UINT32 packetLength = CLASSIFY_CORE_HEADER_LENGTH +
+									  (((UINT32)packet[4] << 8) | packet[5]);
+				IPV6_PACKET_INFO packetInfo;
+				const IPV6_PACKET_INFO* parsedPacketInfo = NULL;
+
+				if (IPv6ToBleClassifyCoreParseHeader(packet, packetLength, &packetInfo))
+				{
+					IPv6ToBleClassifyCoreParsePorts(packet + CLASSIFY_CORE_HEADER_LENGTH, &packetInfo);
+					parsedPacketInfo = &packetInfo;
+				}
+
+				if (IPv6ToBleClassifyCoreDecide(parsedPacketInfo,
+												direction,
+												CLASSIFY_CORE_FLAG_BORDER_ROUTER
+												) == CLASSIFY_CORE_DECISION_DELIVER)
+				{
+					delivered++;
+				}
+			}
+			double elapsed = BenchNow() - start;
+
+			printf("%10u  %-9s  %14.0f  %9.1f%%\n",
+				   listSize,
+				   direction == CLASSIFY_CORE_INBOUND ? "inbound" : "outbound",
+				   elapsed > 0 ? (double)iterations / elapsed : 0.0,
+				   100.0 * (double)delivered / (double)iterations
+				   );
+		}
+	}
+
+	ListStubClear();
+	free(addresses);
+	free(packets);
+
+	return 0;
+}
@@ -0,0 +1,318 @@
+/*++
+
+Module Name:
+
+	ClassifyCoreTests.c
+
+Abstract:
+
+	This file contains the unit tests for the platform-neutral core of the
+	classify callouts (see ClassifyCore.c in the driver): parsing the fixed
+	IPv6 header and the ports after it, and every path through the classify
+	decision on the border router and on a node device.
+
+	Packets are built in plain buffers and the runtime lists are the
+	stand-ins in ListContainsStub.c, backed by the driver's address table.
+	The program prints each failed check and exits with a non-zero status if
+	any failed.
+
+Environment:
+
+	User mode on any platform
+
+--*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ClassifyCore.h"
+#include "ListContainsStub.h"
+
+static unsigned gChecks;
+static unsigned gFailures;
+
+#define CHECK(condition)													\
+	do																		\
+	{																		\
+		gChecks++;															\
+		if (!(condition))													\
+		{																	\
+			gFailures++;													\
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);	\
+		}																	\
+	} while (0)
+
+//
+// Addresses used throughout: an external device that is white listed and
+// one that isn't, and a mesh device that is in the mesh list and one that
+// isn't but shares the mesh's /64 prefix
+//
+static const UINT8 gTrustedExternal[CLASSIFY_CORE_ADDRESS_LENGTH] =
+	{ 0x20, 0x01, 0x0d, 0xb8, 0x00, 0x0a, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01 };
+static const UINT8 gUntrustedExternal[CLASSIFY_CORE_ADDRESS_LENGTH] =
+	{ 0x20, 0x01, 0x0d, 0xb8, 0x00, 0x0a, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02 };
+static const UINT8 gMeshDevice[CLASSIFY_CORE_ADDRESS_LENGTH] =
+	{ 0xfd, 0x00, 0, 0, 0, 0, 0, 0x01, 0, 0, 0, 0, 0, 0, 0, 0x01 };
+static const UINT8 gNotMeshDevice[CLASSIFY_CORE_ADDRESS_LENGTH] =
+	{ 0xfd, 0x00, 0, 0, 0, 0, 0, 0x01, 0, 0, 0, 0, 0, 0, 0, 0x02 };
+
+//
+// Builds a packet with a fixed IPv6 header followed by the 4 bytes of a
+// UDP or TCP header's ports, and returns its total length
+//
+static
+UINT32
+BuildPacket(
+	UINT8*			packet,
+	const UINT8*	sourceAddress,
+	const UINT8*	destinationAddress,
+	UINT8			nextHeader,
+	UINT16			payloadLength
+)
+{
+	memset(packet, 0, CLASSIFY_CORE_HEADER_LENGTH + CLASSIFY_CORE_PORTS_LENGTH);
+
+	packet[0] = 0x6B;					// Version 6, traffic class 0xB8
+	packet[1] = 0x85;					// Flow label 0x51234
+	packet[2] = 0x12;
+	packet[3] = 0x34;
+	packet[4] = (UINT8)(payloadLength >> 8);
+	packet[5] = (UINT8)payloadLength;
+	packet[6] = nextHeader;
+	packet[7] = 64;						// Hop limit
+	memcpy(packet + 8, sourceAddress, CLASSIFY_CORE_ADDRESS_LENGTH);
+	memcpy(packet + 24, destinationAddress, CLASSIFY_CORE_ADDRESS_LENGTH);
+
+	packet[40] = 0xC0;					// Source port 49153
+	packet[41] = 0x01;
+	packet[42] = 0x16;					// Destination port 5683
+	packet[43] = 0x33;
+
+	return CLASSIFY_CORE_HEADER_LENGTH + payloadLength;
+}
+
+//
+// Parses a packet and decides on it, as the classify callouts do
+//
+static
+UINT8
+Classify(
+	const UINT8*	sourceAddress,
+	const UINT8*	destinationAddress,
+	UINT8			nextHeader,
+	UINT16			payloadLength,
+	UINT8			direction,
+	UINT8			flags
+)
+{
+	UINT8 packet[CLASSIFY_CORE_HEADER_LENGTH + CLASSIFY_CORE_PORTS_LENGTH];
+	IPV6_PACKET_INFO packetInfo;
+
+	UINT32 packetLength = BuildPacket(packet,
+									  sourceAddress,
+									  destinationAddress,
+									  nextHeader,
+									  payloadLength
+									  );
+	if (!IPv6ToBleClassifyCoreParseHeader(packet, packetLength, &packetInfo))
+	{
+		return IPv6ToBleClassifyCoreDecide(NULL, direction, flags);
+	}
+
+	return IPv6ToBleClassifyCoreDecide(&packetInfo, direction, flags);
+}
+
+static
+void
+TestParseHeader(void)
+{
+	UINT8 packet[CLASSIFY_CORE_HEADER_LENGTH + CLASSIFY_CORE_PORTS_LENGTH];
+	IPV6_PACKET_INFO packetInfo;
+
+	UINT32 packetLength = BuildPacket(packet,
+									  gTrustedExternal,
+									  gMeshDevice,
+									  CLASSIFY_CORE_PROTOCOL_UDP,
+									  100
+									  );
+
+	// A well-formed header is parsed field by field
+	CHECK(IPv6ToBleClassifyCoreParseHeader(packet, packetLength, &packetInfo));
+	CHECK(packetInfo.trafficClass == 0xB8);
+	CHECK(packetInfo.flowLabel == 0x51234);
+	CHECK(packetInfo.payloadLength == 100);
+	CHECK(packetInfo.nextHeader == CLASSIFY_CORE_PROTOCOL_UDP);
+	CHECK(packetInfo.hopLimit == 64);
+	CHECK(packetInfo.packetLength == 140);
+	CHECK(memcmp(packetInfo.sourceAddress, gTrustedExternal, CLASSIFY_CORE_ADDRESS_LENGTH) == 0);
+	CHECK(memcmp(packetInfo.destinationAddress, gMeshDevice, CLASSIFY_CORE_ADDRESS_LENGTH) == 0);
+	CHECK(packetInfo.sourcePort == 0);
+	CHECK(packetInfo.destinationPort == 0);
+
+	// Too short to hold a fixed header
+	CHECK(!IPv6ToBleClassifyCoreParseHeader(packet, CLASSIFY_CORE_HEADER_LENGTH - 1, &packetInfo));
+
+	// Not IPv6
+	packet[0] = 0x45;
+	CHECK(!IPv6ToBleClassifyCoreParseHeader(packet, packetLength, &packetInfo));
+}
+
+static
+void
+TestParsePorts(void)
+{
+	UINT8 packet[CLASSIFY_CORE_HEADER_LENGTH + CLASSIFY_CORE_PORTS_LENGTH];
+	IPV6_PACKET_INFO packetInfo;
+	UINT32 packetLength = 0;
+
+	// UDP and TCP ports are read
+	packetLength = BuildPacket(packet, gTrustedExternal, gMeshDevice, CLASSIFY_CORE_PROTOCOL_UDP, 8);
+	CHECK(IPv6ToBleClassifyCoreParseHeader(packet, packetLength, &packetInfo));
+	CHECK(IPv6ToBleClassifyCoreParsePorts(packet + CLASSIFY_CORE_HEADER_LENGTH, &packetInfo));
+	CHECK(packetInfo.sourcePort == 49153);
+	CHECK(packetInfo.destinationPort == 5683);
+
+	packetLength = BuildPacket(packet, gTrustedExternal, gMeshDevice, CLASSIFY_CORE_PROTOCOL_TCP, 20);
+	CHECK(IPv6ToBleClassifyCoreParseHeader(packet, packetLength, &packetInfo));
+	CHECK(IPv6ToBleClassifyCoreParsePorts(packet + CLASSIFY_CORE_HEADER_LENGTH, &packetInfo));
+	CHECK(packetInfo.sourcePort == 49153);
+	CHECK(packetInfo.destinationPort == 5683);
+
+	// Not UDP or TCP directly after the fixed header
+	packetLength = BuildPacket(packet, gTrustedExternal, gMeshDevice, 44, 16);
+	CHECK(IPv6ToBleClassifyCoreParseHeader(packet, packetLength, &packetInfo));
+	CHECK(!IPv6ToBleClassifyCoreParsePorts(packet + CLASSIFY_CORE_HEADER_LENGTH, &packetInfo));
+	CHECK(packetInfo.sourcePort == 0 && packetInfo.destinationPort == 0);
+
+	// Too short to hold the ports
+	packetLength = BuildPacket(packet, gTrustedExternal, gMeshDevice, CLASSIFY_CORE_PROTOCOL_UDP, 2);
+	CHECK(IPv6ToBleClassifyCoreParseHeader(packet, packetLength, &packetInfo));
+	CHECK(!IPv6ToBleClassifyCoreParsePorts(packet + CLASSIFY_CORE_HEADER_LENGTH, &packetInfo));
+	CHECK(packetInfo.sourcePort == 0 && packetInfo.destinationPort == 0);
+}
+
+static
+void
+TestDecidePermitBeforeParsing(void)
+{
+	// Injected and loopback packets are permitted without looking at them,
+	// injected first
+	CHECK(IPv6ToBleClassifyCoreDecide(NULL, CLASSIFY_CORE_OUTBOUND,
+									  CLASSIFY_CORE_FLAG_INJECTED | CLASSIFY_CORE_FLAG_LOOPBACK)
+		  == CLASSIFY_CORE_DECISION_PERMIT_INJECTED);
+	CHECK(IPv6ToBleClassifyCoreDecide(NULL, CLASSIFY_CORE_INBOUND,
+									  CLASSIFY_CORE_FLAG_BORDER_ROUTER | CLASSIFY_CORE_FLAG_INJECTED)
+		  == CLASSIFY_CORE_DECISION_PERMIT_INJECTED);
+	CHECK(IPv6ToBleClassifyCoreDecide(NULL, CLASSIFY_CORE_OUTBOUND,
+									  CLASSIFY_CORE_FLAG_LOOPBACK)
+		  == CLASSIFY_CORE_DECISION_PERMIT_LOOPBACK);
+
+	// Short and non-IPv6 packets can't be parsed, so they are permitted
+	UINT8 packet[CLASSIFY_CORE_HEADER_LENGTH + CLASSIFY_CORE_PORTS_LENGTH];
+	IPV6_PACKET_INFO packetInfo;
+	UINT32 packetLength = BuildPacket(packet,
+									  gTrustedExternal,
+									  gMeshDevice,
+									  CLASSIFY_CORE_PROTOCOL_UDP,
+									  100
+									  );
+
+	CHECK(!IPv6ToBleClassifyCoreParseHeader(packet, CLASSIFY_CORE_HEADER_LENGTH - 1, &packetInfo));
+	CHECK(IPv6ToBleClassifyCoreDecide(NULL, CLASSIFY_CORE_OUTBOUND, 0)
+		  == CLASSIFY_CORE_DECISION_PERMIT_UNPARSED);
+
+	packet[0] = 0x45;
+	CHECK(!IPv6ToBleClassifyCoreParseHeader(packet, packetLength, &packetInfo));
+	CHECK(IPv6ToBleClassifyCoreDecide(NULL, CLASSIFY_CORE_INBOUND, CLASSIFY_CORE_FLAG_BORDER_ROUTER)
+		  == CLASSIFY_CORE_DECISION_PERMIT_UNPARSED);
+}
+
+static
+void
+TestDecideBorderRouter(void)
+{
+	const UINT8 flags = CLASSIFY_CORE_FLAG_BORDER_ROUTER;
+
+	CHECK(ListStubSet(CLASSIFY_CORE_WHITE_LIST, gTrustedExternal, 1));
+	CHECK(ListStubSet(CLASSIFY_CORE_MESH_LIST, gMeshDevice, 1));
+
+	// Inbound: the source must be white listed and the destination in the
+	// mesh list
+	CHECK(Classify(gUntrustedExternal, gMeshDevice, CLASSIFY_CORE_PROTOCOL_UDP, 100,
+				   CLASSIFY_CORE_INBOUND, flags) == CLASSIFY_CORE_DECISION_PERMIT_NOT_WHITE_LISTED);
+	CHECK(Classify(gTrustedExternal, gNotMeshDevice, CLASSIFY_CORE_PROTOCOL_UDP, 100,
+				   CLASSIFY_CORE_INBOUND, flags) == CLASSIFY_CORE_DECISION_PERMIT_NOT_FOR_MESH);
+	CHECK(Classify(gTrustedExternal, gMeshDevice, CLASSIFY_CORE_PROTOCOL_UDP, 100,
+				   CLASSIFY_CORE_INBOUND, flags) == CLASSIFY_CORE_DECISION_DELIVER);
+
+	// Outbound: only the destination is looked up, so the source needn't be
+	// white listed
+	CHECK(Classify(gUntrustedExternal, gNotMeshDevice, CLASSIFY_CORE_PROTOCOL_UDP, 100,
+				   CLASSIFY_CORE_OUTBOUND, flags) == CLASSIFY_CORE_DECISION_PERMIT_NOT_FOR_MESH);
+	CHECK(Classify(gUntrustedExternal, gMeshDevice, CLASSIFY_CORE_PROTOCOL_UDP, 100,
+				   CLASSIFY_CORE_OUTBOUND, flags) == CLASSIFY_CORE_DECISION_DELIVER);
+
+	// Packets for the mesh that the mesh can't carry
+	CHECK(Classify(gTrustedExternal, gMeshDevice, 58, 100,
+				   CLASSIFY_CORE_INBOUND, flags) == CLASSIFY_CORE_DECISION_DROP_NOT_UDP);
+	CHECK(Classify(gTrustedExternal, gMeshDevice, 44, 100,
+				   CLASSIFY_CORE_INBOUND, flags) == CLASSIFY_CORE_DECISION_DROP_EXTENSION_HEADER);
+	CHECK(Classify(gTrustedExternal, gMeshDevice, CLASSIFY_CORE_PROTOCOL_UDP,
+				   CLASSIFY_CORE_MAX_PACKET_LENGTH - CLASSIFY_CORE_HEADER_LENGTH + 1,
+				   CLASSIFY_CORE_INBOUND, flags) == CLASSIFY_CORE_DECISION_DROP_TOO_LARGE);
+
+	// Packets not for the mesh are permitted before the protocol and size
+	// are looked at
+	CHECK(Classify(gTrustedExternal, gNotMeshDevice, 58, 2000,
+				   CLASSIFY_CORE_INBOUND, flags) == CLASSIFY_CORE_DECISION_PERMIT_NOT_FOR_MESH);
+
+	ListStubClear();
+
+	// With empty lists nothing is for the mesh
+	CHECK(Classify(gTrustedExternal, gMeshDevice, CLASSIFY_CORE_PROTOCOL_UDP, 100,
+				   CLASSIFY_CORE_INBOUND, flags) == CLASSIFY_CORE_DECISION_PERMIT_NOT_WHITE_LISTED);
+	CHECK(Classify(gTrustedExternal, gMeshDevice, CLASSIFY_CORE_PROTOCOL_UDP, 100,
+				   CLASSIFY_CORE_OUTBOUND, flags) == CLASSIFY_CORE_DECISION_PERMIT_NOT_FOR_MESH);
+}
+
+static
+void
+TestDecideNodeDevice(void)
+{
+	// A node device sends everything over BLE without looking at the lists,
+	// which are empty here
+	CHECK(Classify(gUntrustedExternal, gNotMeshDevice, CLASSIFY_CORE_PROTOCOL_UDP, 100,
+				   CLASSIFY_CORE_OUTBOUND, 0) == CLASSIFY_CORE_DECISION_DELIVER);
+	CHECK(Classify(gUntrustedExternal, gNotMeshDevice, CLASSIFY_CORE_PROTOCOL_TCP, 100,
+				   CLASSIFY_CORE_OUTBOUND, 0) == CLASSIFY_CORE_DECISION_DELIVER);
+
+	// It still drops what the mesh can't carry
+	CHECK(Classify(gUntrustedExternal, gNotMeshDevice, 58, 100,
+				   CLASSIFY_CORE_OUTBOUND, 0) == CLASSIFY_CORE_DECISION_DROP_NOT_UDP);
+	CHECK(Classify(gUntrustedExternal, gNotMeshDevice, 0, 100,
+				   CLASSIFY_CORE_OUTBOUND, 0) == CLASSIFY_CORE_DECISION_DROP_EXTENSION_HEADER);
+
+	// The Bluetooth MTU includes the IP header
+	CHECK(Classify(gUntrustedExternal, gNotMeshDevice, CLASSIFY_CORE_PROTOCOL_UDP,
+				   CLASSIFY_CORE_MAX_PACKET_LENGTH - CLASSIFY_CORE_HEADER_LENGTH,
+				   CLASSIFY_CORE_OUTBOUND, 0) == CLASSIFY_CORE_DECISION_DELIVER);
+	CHECK(Classify(gUntrustedExternal, gNotMeshDevice, CLASSIFY_CORE_PROTOCOL_UDP,
+				   CLASSIFY_CORE_MAX_PACKET_LENGTH - CLASSIFY_CORE_HEADER_LENGTH + 1,
+				   CLASSIFY_CORE_OUTBOUND, 0) == CLASSIFY_CORE_DECISION_DROP_TOO_LARGE);
+}
+
+int
+main(void)
+{
+	TestParseHeader();
+	TestParsePorts();
+	TestDecidePermitBeforeParsing();
+	TestDecideBorderRouter();
+	TestDecideNodeDevice();
+
+	ListStubClear();
+
+	printf("%u of %u checks passed\n", gChecks - gFailures, gChecks);
+
+	return gFailures == 0 ? 0 : 1;
+}
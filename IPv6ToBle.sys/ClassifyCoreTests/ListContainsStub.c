@@ -0,0 +1,92 @@
+/*++
+
+Module Name:
+
+	ListContainsStub.c
+
+Abstract:
+
+	This file contains a stand-in for the runtime lists, providing the
+	IPv6ToBleClassifyCoreListContains function the classify core needs from
+	its host.
+
+	The driver looks addresses up in the hash index of the published list
+	snapshot. Here each list is just that index: an address table built with
+	the driver's own Helpers_AddressTable.c, compiled against the kernel
+	stand-ins in Shim/AddressTableShim.h. Changes to the index therefore show
+	up in the tests and the benchmark.
+
+Environment:
+
+	User mode on any platform but Windows, with gcc or clang
+
+--*/
+
+#include "AddressTableShim.h"
+#include "ListContainsStub.h"
+
+static PADDRESS_TABLE gListStubs[2];
+
+BOOLEAN
+ListStubSet(
+	UINT32			targetList,
+	const UINT8*	addresses,
+	UINT32			addressCount
+)
+{
+	PADDRESS_TABLE* list = &gListStubs[targetList == CLASSIFY_CORE_MESH_LIST];
+	PADDRESS_TABLE newTable = NULL;
+
+	//
+	// Step 1
+	// Build a table sized for the addresses, as the driver does for each
+	// snapshot, with each address's position as its value
+	//
+	if (!NT_SUCCESS(IPv6ToBleAddressTableCreate(addressCount, &newTable)))
+	{
+		return FALSE;
+	}
+
+	for (UINT32 i = 0; i < addressCount; i++)
+	{
+		IN6_ADDR address;
+		memcpy(&address, addresses + (size_t)i * CLASSIFY_CORE_ADDRESS_LENGTH, sizeof(address));
+
+		if (!NT_SUCCESS(IPv6ToBleAddressTableInsert(newTable, &address, i)))
+		{
+			IPv6ToBleAddressTableDestroy(newTable);
+			return FALSE;
+		}
+	}
+
+	//
+	// Step 2
+	// Replace the old table
+	//
+	IPv6ToBleAddressTableDestroy(*list);
+	*list = newTable;
+
+	return TRUE;
+}
+
+void
+ListStubClear(void)
+{
+	for (size_t i = 0; i < sizeof(gListStubs) / sizeof(gListStubs[0]); i++)
+	{
+		IPv6ToBleAddressTableDestroy(gListStubs[i]);
+		gListStubs[i] = NULL;
+	}
+}
+
+BOOLEAN
+IPv6ToBleClassifyCoreListContains(
+	UINT32			targetList,
+	const UINT8*	ipv6Address
+)
+{
+	return IPv6ToBleAddressTableLookup(gListStubs[targetList == CLASSIFY_CORE_MESH_LIST],
+									   ipv6Address,
+									   NULL
+									   );
+}
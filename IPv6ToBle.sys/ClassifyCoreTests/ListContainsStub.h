@@ -0,0 +1,49 @@
+/*++
+
+Module Name:
+
+	ListContainsStub.h
+
+Abstract:
+
+	This file contains definitions for the stand-in runtime lists that the
+	classify core tests and benchmark link against. See ListContainsStub.c.
+
+Environment:
+
+	User mode on any platform
+
+--*/
+
+#ifndef _LISTCONTAINSSTUB_H_
+#define _LISTCONTAINSSTUB_H_
+
+#include "ClassifyCore.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Replaces the contents of a stand-in list with a copy of addressCount
+// addresses, packed CLASSIFY_CORE_ADDRESS_LENGTH bytes apiece. Returns FALSE
+// if the copy couldn't be allocated.
+//
+BOOLEAN
+ListStubSet(
+	UINT32			targetList,
+	const UINT8*	addresses,
+	UINT32			addressCount
+);
+
+//
+// Empties both stand-in lists and frees their memory
+//
+void
+ListStubClear(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	// _LISTCONTAINSSTUB_H_
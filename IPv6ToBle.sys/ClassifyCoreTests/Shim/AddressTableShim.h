@@ -0,0 +1,178 @@
+/*++
+
+Module Name:
+
+	AddressTableShim.h
+
+Abstract:
+
+	This file contains user-mode stand-ins for the kernel definitions that
+	the driver's Helpers_AddressTable.c uses, so the classify core tests and
+	benchmark can build the driver's real address table instead of a copy.
+
+	It is force-included ahead of Helpers_AddressTable.c. It defines
+	_INCLUDES_H_ so the driver's Includes.h adds nothing, then includes the
+	driver's Helpers_AddressTable.h. Pool allocations come from
+	aligned_alloc on cache line boundaries, as NonPagedPoolNxCacheAligned
+	does, and tracing compiles away.
+
+Environment:
+
+	User mode on any platform but Windows, with gcc or clang
+
+--*/
+
+#ifndef _ADDRESSTABLESHIM_H_
+#define _ADDRESSTABLESHIM_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ClassifyCore.h"
+
+//-----------------------------------------------------------------------------
+// Types, constants and annotations from the WDK headers
+//-----------------------------------------------------------------------------
+
+typedef uint32_t    ULONG;
+typedef uint64_t    ULONG64;
+typedef size_t      SIZE_T;
+typedef int32_t     NTSTATUS;
+
+#define VOID        void
+
+typedef struct _IN6_ADDR
+{
+	union
+	{
+		UINT8   Byte[16];
+		UINT16  Word[8];
+	} u;
+} IN6_ADDR;
+
+#define SHIM_CACHE_LINE         64
+
+#define DECLSPEC_CACHEALIGN     __attribute__((aligned(SHIM_CACHE_LINE)))
+#define FORCEINLINE             static inline
+#define ANYSIZE_ARRAY           1
+#define MAXULONG                0xffffffffUL
+
+#ifdef __cplusplus
+#define EXTERN_C_START          extern "C" {
+#define EXTERN_C_END            }
+#else
+#define EXTERN_C_START
+#define EXTERN_C_END
+#endif
+
+#define _IRQL_requires_min_(irql)
+#define _IRQL_requires_max_(irql)
+#define _IRQL_requires_same_
+#define _Check_return_
+#define _Success_(expression)
+#define _Out_opt_
+
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000L)
+#define STATUS_INTEGER_OVERFLOW         ((NTSTATUS)0xC0000095L)
+#define STATUS_INSUFFICIENT_RESOURCES   ((NTSTATUS)0xC000009AL)
+
+#define NT_SUCCESS(status)      (((NTSTATUS)(status)) >= 0)
+
+//-----------------------------------------------------------------------------
+// Definitions from the driver's own headers
+//-----------------------------------------------------------------------------
+
+#define IPV6_ADDRESS_LENGTH             16
+#define IPV6_TO_BLE_ADDRESS_TABLE_TAG   (UINT32)0x54414249   // 'TABI'
+
+#define TraceEvents(...)
+
+//-----------------------------------------------------------------------------
+// Memory and safe integer routines
+//-----------------------------------------------------------------------------
+
+#define RtlCopyMemory(destination, source, length)  memcpy((destination), (source), (length))
+#define RtlZeroMemory(destination, length)          memset((destination), 0, (length))
+#define RtlEqualMemory(first, second, length)       (!memcmp((first), (second), (length)))
+
+static inline
+NTSTATUS
+RtlULongMult(
+	ULONG   multiplicand,
+	ULONG   multiplier,
+	ULONG*  result
+)
+{
+	uint64_t product = (uint64_t)multiplicand * multiplier;
+
+	*result = (ULONG)product;
+	return product > MAXULONG ? STATUS_INTEGER_OVERFLOW : STATUS_SUCCESS;
+}
+
+static inline
+NTSTATUS
+RtlSizeTMult(
+	SIZE_T  multiplicand,
+	SIZE_T  multiplier,
+	SIZE_T* result
+)
+{
+	if (multiplier != 0 && multiplicand > SIZE_MAX / multiplier)
+	{
+		return STATUS_INTEGER_OVERFLOW;
+	}
+
+	*result = multiplicand * multiplier;
+	return STATUS_SUCCESS;
+}
+
+static inline
+NTSTATUS
+RtlSizeTAdd(
+	SIZE_T  augend,
+	SIZE_T  addend,
+	SIZE_T* result
+)
+{
+	if (augend > SIZE_MAX - addend)
+	{
+		return STATUS_INTEGER_OVERFLOW;
+	}
+
+	*result = augend + addend;
+	return STATUS_SUCCESS;
+}
+
+//
+// Every allocation is cache aligned, whatever the pool type. aligned_alloc
+// needs a size that is a multiple of the alignment, so it is rounded up.
+//
+static inline
+void*
+ShimAllocateCacheAligned(
+	SIZE_T  size
+)
+{
+	if (size > SIZE_MAX - (SHIM_CACHE_LINE - 1))
+	{
+		return NULL;
+	}
+
+	return aligned_alloc(SHIM_CACHE_LINE,
+						 (size + SHIM_CACHE_LINE - 1) & ~(SIZE_T)(SHIM_CACHE_LINE - 1)
+						 );
+}
+
+#define ExAllocatePoolWithTag(poolType, size, tag)  ShimAllocateCacheAligned(size)
+#define ExFreePoolWithTag(pointer, tag)             free(pointer)
+
+//-----------------------------------------------------------------------------
+// The driver's address table
+//-----------------------------------------------------------------------------
+
+#define _INCLUDES_H_
+
+#include "Helpers_AddressTable.h"
+
+#endif	// _ADDRESSTABLESHIM_H_
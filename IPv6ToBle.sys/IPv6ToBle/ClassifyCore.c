@@ -0,0 +1,282 @@
+/*++
+
+Module Name:
+
+	ClassifyCore.c
+
+Abstract:
+
+	This file contains the implementations for the platform-neutral core of
+	the classify callouts.
+
+	The classify callouts in callout.c deal with WFP and NDIS: they query the
+	injection state and loopback flag, find the IP header in the
+	NET_BUFFER_LIST, and carry out the decision by permitting, absorbing, or
+	delivering the packet. Which of those to do is decided here, from a plain
+	buffer holding the fixed IPv6 header and a few flags, so the decision can
+	be tested and timed outside the Windows kernel.
+
+	This file includes nothing but ClassifyCore.h and doesn't trace, so it
+	builds unchanged in the driver and in user mode on other platforms. The
+	only thing it needs from its host is IPv6ToBleClassifyCoreListContains.
+
+Environment:
+
+	Kernel-mode Driver Framework, or user mode on any platform
+
+--*/
+
+#include "ClassifyCore.h"
+
+//
+// Returns TRUE if a next header value is an IPv6 extension header rather
+// than an upper-layer protocol (RFC 8200 and the IANA IPv6 extension header
+// types registry)
+//
+static
+BOOLEAN
+IPv6ToBleClassifyCoreIsExtensionHeader(
+	_In_	UINT8	nextHeader
+)
+{
+	switch (nextHeader)
+	{
+		case 0:		// Hop-by-hop options
+		case 43:	// Routing
+		case 44:	// Fragment
+		case 51:	// Authentication
+		case 60:	// Destination options
+		case 135:	// Mobility
+		case 139:	// Host identity protocol
+		case 140:	// Shim6
+			return TRUE;
+		default:
+			return FALSE;
+	}
+}
+
+_Use_decl_annotations_
+BOOLEAN
+IPv6ToBleClassifyCoreParseHeader(
+	const UINT8*		header,
+	UINT32				packetLength,
+	PIPV6_PACKET_INFO	packetInfo
+)
+/*++
+Routine Description:
+
+	Pulls the fields the classify decision is made on out of the fixed IPv6
+	header of a packet. The header layout is:
+
+		0: version (4 bits), traffic class (8 bits), flow label (20 bits)
+		4: payload length (16 bits), next header (8), hop limit (8)
+		8: source address (16 bytes)
+		24: destination address (16 bytes)
+
+Arguments:
+
+	header - the first CLASSIFY_CORE_HEADER_LENGTH bytes of the packet. The
+	caller must make sure that many bytes can be read.
+
+	packetLength - the length of the whole packet, IP header included.
+
+	packetInfo - receives the parsed header fields.
+
+Return Value:
+
+	TRUE if the packet is long enough to hold a fixed IPv6 header and the
+	header is an IPv6 header, FALSE otherwise.
+
+--*/
+{
+	if (packetLength < CLASSIFY_CORE_HEADER_LENGTH ||
+		(header[0] >> 4) != 6)
+	{
+		return FALSE;
+	}
+
+	packetInfo->trafficClass = (UINT8)((header[0] << 4) | (header[1] >> 4));
+	packetInfo->flowLabel = ((UINT32)(header[1] & 0x0F) << 16) |
+							((UINT32)header[2] << 8) |
+							header[3];
+	packetInfo->payloadLength = (UINT16)((header[4] << 8) | header[5]);
+	packetInfo->nextHeader = header[6];
+	packetInfo->hopLimit = header[7];
+	packetInfo->packetLength = packetLength;
+	packetInfo->sourcePort = 0;
+	packetInfo->destinationPort = 0;
+
+	for (UINT32 i = 0; i < CLASSIFY_CORE_ADDRESS_LENGTH; i++)
+	{
+		packetInfo->sourceAddress[i] = header[8 + i];
+		packetInfo->destinationAddress[i] = header[24 + i];
+	}
+
+	return TRUE;
+}
+
+_Use_decl_annotations_
+BOOLEAN
+IPv6ToBleClassifyCoreParsePorts(
+	const UINT8*		transportHeader,
+	PIPV6_PACKET_INFO	packetInfo
+)
+/*++
+Routine Description:
+
+	Pulls the source and destination ports out of the UDP or TCP header that
+	directly follows the fixed IPv6 header, so the flow hash can tell apart
+	the flows between the same two addresses. Both headers start with the
+	source port followed by the destination port, 16 bits each.
+
+	Nothing is read unless the header parsed by
+	IPv6ToBleClassifyCoreParseHeader says UDP or TCP comes next and the
+	packet is long enough to hold the ports. Otherwise the ports stay 0.
+
+Arguments:
+
+	transportHeader - the CLASSIFY_CORE_PORTS_LENGTH bytes of the packet
+	right after the fixed IPv6 header. The caller must make sure that many
+	bytes can be read if the packet is long enough to hold them.
+
+	packetInfo - the parsed IPv6 header; receives the ports.
+
+Return Value:
+
+	TRUE if the ports were read, FALSE otherwise.
+
+--*/
+{
+	if ((packetInfo->nextHeader != CLASSIFY_CORE_PROTOCOL_UDP &&
+		 packetInfo->nextHeader != CLASSIFY_CORE_PROTOCOL_TCP) ||
+		packetInfo->packetLength < CLASSIFY_CORE_HEADER_LENGTH +
+								   CLASSIFY_CORE_PORTS_LENGTH)
+	{
+		return FALSE;
+	}
+
+	packetInfo->sourcePort = (UINT16)((transportHeader[0] << 8) |
+									  transportHeader[1]);
+	packetInfo->destinationPort = (UINT16)((transportHeader[2] << 8) |
+										   transportHeader[3]);
+
+	return TRUE;
+}
+
+_Use_decl_annotations_
+UINT8
+IPv6ToBleClassifyCoreDecide(
+	const IPV6_PACKET_INFO*	packetInfo,
+	UINT8					direction,
+	UINT8					flags
+)
+/*++
+Routine Description:
+
+	Decides what the classify callouts do with a packet, checking in the
+	same order the callouts always have:
+
+		1. Permit packets we injected ourselves, then loopback packets, then
+			packets whose IPv6 header couldn't be parsed.
+		2. On the border router, permit inbound packets whose source isn't
+			in the white list (the filters only match its /64 prefixes), then
+			permit packets whose destination isn't in the mesh list, as they
+			are normal traffic for the border router or destined elsewhere.
+			A node device sends everything over BLE, so it skips this step.
+		3. Drop packets with an extension header after the fixed header,
+			then packets that aren't UDP or TCP, then packets larger than
+			the Bluetooth MTU of 1280 bytes, IP header included.
+		4. Deliver anything left to the packet processing app.
+
+	The list lookups are the most expensive checks, so they are made only
+	for packets that get past step 1.
+
+Arguments:
+
+	packetInfo - the parsed IPv6 header, or NULL if it couldn't be parsed.
+	Not looked at if the packet was injected or is loopback.
+
+	direction - CLASSIFY_CORE_INBOUND or CLASSIFY_CORE_OUTBOUND.
+
+	flags - CLASSIFY_CORE_FLAG_* values describing the packet and where the
+	core is running.
+
+Return Value:
+
+	One of the CLASSIFY_CORE_DECISION_* values.
+
+--*/
+{
+	//
+	// Step 1
+	// Permit what we shouldn't or can't look at
+	//
+	if (flags & CLASSIFY_CORE_FLAG_INJECTED)
+	{
+		return CLASSIFY_CORE_DECISION_PERMIT_INJECTED;
+	}
+
+	if (flags & CLASSIFY_CORE_FLAG_LOOPBACK)
+	{
+		return CLASSIFY_CORE_DECISION_PERMIT_LOOPBACK;
+	}
+
+	if (!packetInfo)
+	{
+		return CLASSIFY_CORE_DECISION_PERMIT_UNPARSED;
+	}
+
+	//
+	// Step 2
+	// On the border router, permit traffic that isn't between a trusted
+	// external device and the mesh
+	//
+	if (flags & CLASSIFY_CORE_FLAG_BORDER_ROUTER)
+	{
+		if (direction == CLASSIFY_CORE_INBOUND &&
+			!IPv6ToBleClassifyCoreListContains(CLASSIFY_CORE_WHITE_LIST,
+											   packetInfo->sourceAddress
+											   ))
+		{
+			return CLASSIFY_CORE_DECISION_PERMIT_NOT_WHITE_LISTED;
+		}
+
+		if (!IPv6ToBleClassifyCoreListContains(CLASSIFY_CORE_MESH_LIST,
+											   packetInfo->destinationAddress
+											   ))
+		{
+			return CLASSIFY_CORE_DECISION_PERMIT_NOT_FOR_MESH;
+		}
+	}
+
+	//
+	// Step 3
+	// Drop what can't be carried over the mesh. Only UDP and TCP directly
+	// after the fixed header are carried, since the app, the MSS clamp and
+	// the flow hash expect the transport header there. Extension headers
+	// are counted separately so those drops aren't mistaken for other
+	// protocols. TCP segments fit because the driver clamps the MSS of each
+	// connection's SYN (see Helpers_Tcp.c).
+	//
+	if (IPv6ToBleClassifyCoreIsExtensionHeader(packetInfo->nextHeader))
+	{
+		return CLASSIFY_CORE_DECISION_DROP_EXTENSION_HEADER;
+	}
+
+	if (packetInfo->nextHeader != CLASSIFY_CORE_PROTOCOL_UDP &&
+		packetInfo->nextHeader != CLASSIFY_CORE_PROTOCOL_TCP)
+	{
+		return CLASSIFY_CORE_DECISION_DROP_NOT_UDP;
+	}
+
+	if (packetInfo->packetLength > CLASSIFY_CORE_MAX_PACKET_LENGTH)
+	{
+		return CLASSIFY_CORE_DECISION_DROP_TOO_LARGE;
+	}
+
+	//
+	// Step 4
+	// Everything else is for the mesh
+	//
+	return CLASSIFY_CORE_DECISION_DELIVER;
+}
@@ -0,0 +1,172 @@
+/*++
+
+Module Name:
+
+	ClassifyCore.h
+
+Abstract:
+
+	This file contains definitions for the platform-neutral core of the
+	classify callouts: parsing the fixed IPv6 header from a plain buffer and
+	deciding what to do with a packet. See ClassifyCore.c.
+
+	Unlike the rest of the driver's headers, this file doesn't rely on
+	Includes.h. It only needs the basic integer types, which it takes from
+	the WDK or Windows SDK when building for Windows and from stdint.h
+	otherwise, with the SAL annotations defined away. That way the core can
+	also be compiled into user-mode programs on other platforms, such as a
+	test or benchmark harness.
+
+Environment:
+
+	Kernel-mode Driver Framework, or user mode on any platform
+
+--*/
+
+#ifndef _CLASSIFYCORE_H_
+#define _CLASSIFYCORE_H_
+
+#if defined(_KERNEL_MODE)
+#include <ntdef.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#else
+#include <stdint.h>
+typedef uint8_t     UINT8;
+typedef uint16_t    UINT16;
+typedef uint32_t    UINT32;
+typedef uint8_t     BOOLEAN;
+#ifndef TRUE
+#define TRUE    1
+#endif
+#ifndef FALSE
+#define FALSE   0
+#endif
+#ifndef _Use_decl_annotations_
+#define _Use_decl_annotations_
+#define _In_
+#define _In_opt_
+#define _In_reads_bytes_(size)
+#define _Out_
+#define _Inout_
+#endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//-----------------------------------------------------------------------------
+// Constants used by the core. The driver checks that the ones it also
+// defines for itself match (see callout.c).
+//-----------------------------------------------------------------------------
+
+#define CLASSIFY_CORE_ADDRESS_LENGTH        16
+#define CLASSIFY_CORE_HEADER_LENGTH         40
+#define CLASSIFY_CORE_PORTS_LENGTH          4       // UDP or TCP source and destination port
+#define CLASSIFY_CORE_MAX_PACKET_LENGTH     1280    // Bluetooth MTU
+
+#define CLASSIFY_CORE_PROTOCOL_TCP          6
+#define CLASSIFY_CORE_PROTOCOL_UDP          17
+
+//
+// Directions, same values as INBOUND and OUTBOUND in callout.h
+//
+#define CLASSIFY_CORE_INBOUND               0
+#define CLASSIFY_CORE_OUTBOUND              1
+
+//
+// Lists, same values as WHITE_LIST and MESH_LIST in Driver.h
+//
+#define CLASSIFY_CORE_WHITE_LIST            0
+#define CLASSIFY_CORE_MESH_LIST             1
+
+//
+// What the caller knows about a packet before its header is parsed
+//
+#define CLASSIFY_CORE_FLAG_BORDER_ROUTER    0x01    // Running on the border router
+#define CLASSIFY_CORE_FLAG_INJECTED         0x02    // Injected by this driver
+#define CLASSIFY_CORE_FLAG_LOOPBACK         0x04    // Loopback traffic
+
+//
+// Decisions, same values as the IPV6_TO_BLE_DECISION_* values in Public.h.
+// The core never decides NO_RIGHTS, DELIVERED, DROP_NO_LISTENER or
+// DROP_OVER_RATE; those depend on the platform and are left to the caller.
+// CLASSIFY_CORE_DECISION_DELIVER means the packet is for the mesh and should
+// be handed to the packet processing app.
+//
+// The mesh only carries UDP datagrams and TCP segments directly after the
+// fixed IPv6 header, so a packet for the mesh with an extension header is
+// dropped as DROP_EXTENSION_HEADER, even if it carries UDP or TCP further
+// in, rather than being mistaken for some other protocol.
+//
+#define CLASSIFY_CORE_DECISION_PERMIT_INJECTED          1
+#define CLASSIFY_CORE_DECISION_PERMIT_LOOPBACK          2
+#define CLASSIFY_CORE_DECISION_PERMIT_UNPARSED          3
+#define CLASSIFY_CORE_DECISION_PERMIT_NOT_WHITE_LISTED  4
+#define CLASSIFY_CORE_DECISION_PERMIT_NOT_FOR_MESH      5
+#define CLASSIFY_CORE_DECISION_DROP_NOT_UDP             6
+#define CLASSIFY_CORE_DECISION_DROP_TOO_LARGE           7
+#define CLASSIFY_CORE_DECISION_DELIVER                  8
+#define CLASSIFY_CORE_DECISION_DROP_EXTENSION_HEADER    11
+
+//
+// The fields of an IPv6 header that the classify callouts care about, parsed
+// once per packet. See IPv6ToBleClassifyCoreParseHeader and
+// IPv6ToBleClassifyCoreParsePorts.
+//
+typedef struct _IPV6_PACKET_INFO
+{
+    UINT8       sourceAddress[CLASSIFY_CORE_ADDRESS_LENGTH];        // Network byte order
+    UINT8       destinationAddress[CLASSIFY_CORE_ADDRESS_LENGTH];   // Network byte order
+    UINT32      packetLength;       // IP header + payload, in bytes
+    UINT16      payloadLength;      // Payload length from the header
+    UINT8       nextHeader;         // Next header (protocol) value
+    UINT8       hopLimit;           // Hop limit
+    UINT8       trafficClass;       // Traffic class (DSCP + ECN)
+    UINT32      flowLabel;          // Flow label (20 bits)
+    UINT16      sourcePort;         // UDP or TCP source port, 0 if not read
+    UINT16      destinationPort;    // UDP or TCP destination port, 0 if not read
+} IPV6_PACKET_INFO, *PIPV6_PACKET_INFO;
+
+//-----------------------------------------------------------------------------
+// Functions to parse a packet and make the classify decision
+//-----------------------------------------------------------------------------
+
+BOOLEAN
+IPv6ToBleClassifyCoreParseHeader(
+	_In_reads_bytes_(CLASSIFY_CORE_HEADER_LENGTH)	const UINT8*		header,
+	_In_											UINT32				packetLength,
+	_Out_											PIPV6_PACKET_INFO	packetInfo
+);
+
+BOOLEAN
+IPv6ToBleClassifyCoreParsePorts(
+	_In_reads_bytes_(CLASSIFY_CORE_PORTS_LENGTH)	const UINT8*		transportHeader,
+	_Inout_											PIPV6_PACKET_INFO	packetInfo
+);
+
+UINT8
+IPv6ToBleClassifyCoreDecide(
+	_In_opt_	const IPV6_PACKET_INFO*	packetInfo,
+	_In_		UINT8					direction,
+	_In_		UINT8					flags
+);
+
+//-----------------------------------------------------------------------------
+// List membership lookup the core calls while deciding. It is not defined
+// here; whatever the core is compiled into provides it. The driver looks in
+// the published runtime list snapshots (see callout.c).
+//-----------------------------------------------------------------------------
+
+BOOLEAN
+IPv6ToBleClassifyCoreListContains(
+	_In_											UINT32			targetList,
+	_In_reads_bytes_(CLASSIFY_CORE_ADDRESS_LENGTH)	const UINT8*	ipv6Address
+);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	// _CLASSIFYCORE_H_
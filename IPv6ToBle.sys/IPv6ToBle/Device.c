@@ -106,6 +106,24 @@ Return Value:
 		goto Exit;
 	}
 
+	// Map and unmap the shared packet rings in the calling process, before
+	// requests are queued, and unmap them if the app closes its handle
+	// without doing so
+	WdfDeviceInitSetIoInCallerContextCallback(deviceInit,
+											  IPv6ToBleSharedRingsEvtIoInCallerContext
+											  );
+
+	WDF_FILEOBJECT_CONFIG fileObjectConfig;
+	WDF_FILEOBJECT_CONFIG_INIT(&fileObjectConfig,
+							   WDF_NO_EVENT_CALLBACK,
+							   WDF_NO_EVENT_CALLBACK,
+							   IPv6ToBleSharedRingsEvtFileCleanup
+							   );
+	WdfDeviceInitSetFileObjectConfig(deviceInit,
+									 &fileObjectConfig,
+									 WDF_NO_OBJECT_ATTRIBUTES
+									 );
+
     NT_ASSERT(irql == KeGetCurrentIrql());
 
 	//
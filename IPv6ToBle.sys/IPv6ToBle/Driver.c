@@ -71,6 +71,12 @@ Return Value:
     // Set the global callouts registered variable to FALSE to start
     gCalloutsRegistered = FALSE;
 
+    // Note the start time and that the start work item hasn't run yet
+    gStartTime = KeQueryPerformanceCounter(NULL).QuadPart;
+    gStartStatus = STATUS_PENDING;
+    gStartMicroseconds = 0;
+    KeInitializeEvent(&gStartCompleteEvent, NotificationEvent, FALSE);
+
 	// Initialize the driver config structure. Second parameter is does not
 	// have a pointer to a device add callback because there is no device add 
 	// callback in a non-PnP driver like this
@@ -186,82 +192,37 @@ Return Value:
 	{
 		//
 		// Step 10
-		// Initialize and start the periodic timer. This applies only to the border
-		// router.
+		// Initialize the one-shot timer that flushes changed lists to the
+		// registry. This applies only to the border router.
 		//
 		status = IPv6ToBleDriverInitTimer();
 		if (!NT_SUCCESS(status))
 		{
 			goto Exit;
 		}
-
-		//
-		// Step 11
-		// Populate the device context with runtime information about the white 
-		// list and mesh list if applicable. These function calls open and close
-		// the registry keys as needed.
-		//
-		// Note: This only applies to the border router device.
-		//
-
-		// Populate the lists. 
-		// 
-		// We still want to succeed DriverEntry if we were unsuccessful at
-		// loading info from the registry about the two lists. Record the error
-		// with tracing, then re-set status to SUCCESS and exit gracefully. This 
-		// will always happen the very first time the driver is installed because 
-		// there's nothing in the registry yet, or if the user cleared out one or
-		// both of the lists between reboots.
-		BOOLEAN whiteListLoaded = TRUE;
-		status = IPv6ToBleRegistryRetrieveRuntimeList(WHITE_LIST);
-		if (!NT_SUCCESS(status))
-		{
-			// We ignore status if this call fails because we stil want to check
-			// the mesh list. But we mark that it failed.
-			whiteListLoaded = FALSE;
-			TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER, "Loading registry info for the white list failed %!STATUS!", status);
-		}
-
-		BOOLEAN meshListLoaded = TRUE;
-		status = IPv6ToBleRegistryRetrieveRuntimeList(MESH_LIST);
-		if (!NT_SUCCESS(status))
-		{
-			meshListLoaded = FALSE;
-			TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER, "Loading registry info for the mesh list failed %!STATUS!", status);
-		}
-
-		// Still succeed if one failed but not the other, or if they both failed,
-		// but don't continue past here. Callout/filter is not registered, and the
-		// driver just sits waiting for the usermode app to give it enough info
-		// (i.e. add enough entries to the lists so each has at least one).
-		if ((!whiteListLoaded && meshListLoaded) ||
-			(whiteListLoaded && !meshListLoaded) ||
-			(!whiteListLoaded && !meshListLoaded))
-		{
-			status = STATUS_SUCCESS;
-			TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "Could not load both white list and mesh list, succeeding DriverEntry anyway.");
-			goto Exit;
-		}
 	}
 
 	//
-	// Step 12
-	// Register the callout(s) and filter. 
-    //
-    // BORDER_ROUTER device
-    // By getting this far, it means that we have at least one item in each of
-    // the lists and we are ready to listen for incoming IPv6 packets that 
-    // match the conditions. While we do need at least one item in each list, 
-    // we only match packets based on white list addresses to reduce
-    // performance impact. This is also to reduce complexity in the logic for 
-    // adding filters. Then we compare to the mesh list during the ClassifyFn.
-	//	
-    // Pi/IoT device
-    // We always hit this point, as we don't mess with the registry on this
-    // device.
-    //
+	// Step 11
+	// Queue the work item that loads the runtime lists (border router only)
+	// and registers the callout(s) and filter, and return. DriverEntry's
+	// duration no longer depends on the size of the lists or on how long the
+	// filter engine takes to add filters; the apps ask for readiness with
+	// IOCTL_IPV6_TO_BLE_QUERY_READINESS.
+	//
+	PIO_WORKITEM startWorkItem = IoAllocateWorkItem(gWdmDeviceObject);
+	if (!startWorkItem)
+	{
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER, "Allocating the start work item failed %!STATUS!", status);
+		goto Exit;
+	}
 
-	status = IPv6ToBleCalloutsRegister();
+	IoQueueWorkItemEx(startWorkItem,
+					  IPv6ToBleDriverStartWorkItemEx,
+					  DelayedWorkQueue,
+					  NULL
+					  );
 
 Exit:
 
@@ -276,6 +237,10 @@ Exit:
 		{
 			FwpsInjectionHandleDestroy0(gInjectionHandleNetwork);
 		}
+		IPv6ToBleListenCleanup();
+		IPv6ToBleShapingCleanup();
+		IPv6ToBlePacketTraceCleanup();
+		IPv6ToBleStatisticsCleanup();
 
         // Stop WPP Tracing if DriverEntry fails
         WPP_CLEANUP(DriverObject);
@@ -317,10 +282,12 @@ Return Value:
 
     //
     // Step 1
-    // Initialize the spin locks
+    // Initialize the locks
     //
 
-    // Listen request queue spinlock
+    // Listen request queue spinlock, which guards the switch between the
+    // listen channels and the shared listen ring. Each listen channel's own
+    // lock is created by IPv6ToBleListenInitialize.
     WDF_OBJECT_ATTRIBUTES listenRequestQueueLockAttributes;
     WDF_OBJECT_ATTRIBUTES_INIT(&listenRequestQueueLockAttributes);
     listenRequestQueueLockAttributes.ParentObject = gWdfDeviceObject;
@@ -334,6 +301,21 @@ Return Value:
         goto Exit;
     }
 
+    // Shared rings wait lock, which also serializes injection from the
+    // inject ring
+    WDF_OBJECT_ATTRIBUTES sharedRingsLockAttributes;
+    WDF_OBJECT_ATTRIBUTES_INIT(&sharedRingsLockAttributes);
+    sharedRingsLockAttributes.ParentObject = gWdfDeviceObject;
+
+    status = WdfWaitLockCreate(&sharedRingsLockAttributes,
+                               &gSharedRingsLock
+                               );
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER, "Creating shared rings wait lock failed %!STATUS!", status);
+        goto Exit;
+    }
+
 	if (gBorderRouterFlag)
 	{
 		// White list spinlock
@@ -395,6 +377,26 @@ Return Value:
 		}
 		InitializeListHead(gMeshListHead);
 
+		// Filter prefix group list heads. These are only populated while
+		// the callouts are registered.
+		InitializeListHead(&gWhiteListFilterGroups);
+		InitializeListHead(&gMeshListFilterGroups);
+
+		// Create the write lock and per-processor reader state used to
+		// publish snapshots of the lists to the classify callouts
+		status = IPv6ToBleRuntimeListSnapshotsInitialize();
+		if (!NT_SUCCESS(status))
+		{
+			goto Exit;
+		}
+
+		// Create the log of list changes for the list change IOCTL
+		status = IPv6ToBleListChangeInitialize();
+		if (!NT_SUCCESS(status))
+		{
+			goto Exit;
+		}
+
 		//
 		// Step 3
 		// Initialize the list booleans
@@ -405,14 +407,56 @@ Return Value:
 
     //
     // Step 4
-    // Create the NDIS pool data structure, which also populates it
+    // Create the per-processor data path statistics
+    //
+    status = IPv6ToBleStatisticsInitialize();
+    if (!NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
+
+    //
+    // Step 5
+    // Create the packet trace ring and apply the data path tracing settings
+    //
+    status = IPv6ToBlePacketTraceInitialize();
+    if (!NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
+
+    //
+    // Step 6
+    // Create the outbound shaping table. Shaping starts off.
     //
-    status = IPv6ToBleNDISPoolDataCreate(gNdisPoolData,
+    status = IPv6ToBleShapingInitialize();
+    if (!NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
+
+    //
+    // Step 7
+    // Create the listen channels and the pend queues that hold intercepted
+    // packets while no listen request is outstanding
+    //
+    status = IPv6ToBleListenInitialize();
+    if (!NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
+
+    //
+    // Step 8
+    // Create the NDIS pool data structure, which also populates it and
+    // preallocates the injection slabs
+    //
+    status = IPv6ToBleNDISPoolDataCreate(&gNdisPoolData,
                                          IPV6_TO_BLE_NDIS_TAG
                                          );
-    if (!NT_SUCCESS(status) && gNdisPoolData != NULL)
+    if (!NT_SUCCESS(status))
     {
-        IPv6ToBleNDISPoolDataDestroy(gNdisPoolData);
+        goto Exit;
     }
 
     NT_ASSERT(irql == KeGetCurrentIrql());
@@ -424,13 +468,149 @@ Exit:
     return status;
 }
 
+_Use_decl_annotations_
+VOID
+IPv6ToBleDriverStartWorkItemEx(
+    _In_     PVOID        IoObject,
+    _In_opt_ PVOID        Context,
+    _In_     PIO_WORKITEM IoWorkItem
+)
+/*++
+Routine Description:
+
+    Finishes starting the driver on a system worker thread, after DriverEntry
+    has returned: loads the runtime lists from the registry on the border
+    router, then registers the callout(s) and filter if the device is ready
+    to intercept packets. Signals gStartCompleteEvent when done, which is
+    what the readiness IOCTL and driver unload wait on.
+
+    Changes to the lists are refused until this finishes (see Queue.c), so
+    they can't be mixed with the entries being loaded.
+
+Arguments:
+
+    IoWorkItem - the work item object allocated in DriverEntry.
+
+Return Value:
+
+    None. The result is kept in gStartStatus for the readiness IOCTL.
+
+--*/
+{
+    UNREFERENCED_PARAMETER(IoObject);   // The WDM device object, unused
+    UNREFERENCED_PARAMETER(Context);
+
+    NTSTATUS status = STATUS_SUCCESS;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "%!FUNC! Entry");
+
+    if (gBorderRouterFlag)
+    {
+        //
+        // Step 1
+        // Populate the runtime lists from the registry. These function calls
+        // open and close the registry keys as needed.
+        //
+        // Note: This only applies to the border router device.
+        //
+        // We still want to finish starting if we were unsuccessful at loading
+        // info from the registry about the two lists. This will always happen
+        // the very first time the driver is installed because there's nothing
+        // in the registry yet, or if the user cleared out one or both of the
+        // lists between reboots.
+        //
+        status = IPv6ToBleRegistryRetrieveRuntimeList(WHITE_LIST);
+        if (!NT_SUCCESS(status))
+        {
+            // We ignore status if this call fails because we stil want to
+            // check the mesh list
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER, "Loading registry info for the white list failed %!STATUS!", status);
+        }
+
+        status = IPv6ToBleRegistryRetrieveRuntimeList(MESH_LIST);
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER, "Loading registry info for the mesh list failed %!STATUS!", status);
+        }
+
+        //
+        // Step 2
+        // Register the callout(s) and filter if each list has at least one
+        // entry. Otherwise the callouts are not registered, and the driver
+        // just sits waiting for the usermode app to give it enough info
+        // (i.e. add enough entries to the lists so each has at least one).
+        //
+        // While we do need at least one item in each list, we only match
+        // packets based on white list addresses to reduce performance impact.
+        // Then we compare to the mesh list during the ClassifyFn.
+        //
+        WdfWaitLockAcquire(gRuntimeListWriteLock, NULL);
+
+        status = STATUS_SUCCESS;
+        if (!IsListEmpty(gWhiteListHead) && !IsListEmpty(gMeshListHead))
+        {
+            status = IPv6ToBleCalloutsRegister();
+        }
+        else
+        {
+            TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "Could not load both white list and mesh list, waiting for the app to add entries.");
+        }
+
+        WdfWaitLockRelease(gRuntimeListWriteLock);
+    }
+    else
+    {
+        //
+        // Step 2
+        // Register the callout(s) and filter.
+        //
+        // Pi/IoT device
+        // We always get here, as we don't mess with the registry on this
+        // device.
+        //
+        status = IPv6ToBleCalloutsRegister();
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER, "Registering the callouts failed %!STATUS!", status);
+    }
+
+    //
+    // Step 3
+    // Record the result and how long starting took, then signal that the
+    // driver has started
+    //
+    gStartStatus = status;
+    if (gPerformanceFrequency)
+    {
+        gStartMicroseconds = (UINT64)(KeQueryPerformanceCounter(NULL).QuadPart - gStartTime) *
+                             1000000 / (UINT64)gPerformanceFrequency;
+    }
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "Driver started in %I64u us with %!STATUS!", gStartMicroseconds, status);
+
+    KeSetEvent(&gStartCompleteEvent, IO_NO_INCREMENT, FALSE);
+
+    //
+    // Step 4
+    // Free the work item
+    //
+    IoFreeWorkItem(IoWorkItem);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "%!FUNC! Exit");
+}
+
 _Use_decl_annotations_
 NTSTATUS
 IPv6ToBleDriverInitTimer()
 /*++
 Routine Description:
 
-    Initializes and starts the periodic timer object.
+    Initializes the one-shot timer object that flushes the runtime lists to
+    the registry. The timer is not started here; changing a list starts it
+    (see IPv6ToBleRegistryScheduleListFlush), so an idle driver does no
+    periodic work.
 
 Arguments:
 
@@ -451,11 +631,9 @@ Return Value:
     WDF_OBJECT_ATTRIBUTES timerAttributes;
 
     // Initialize the timer configuration object with the timer event callback
-    // and a period of 5 seconds (5000 milliseconds)
-    WDF_TIMER_CONFIG_INIT_PERIODIC(&timerConfig,
-                                   IPv6ToBleTimerCheckAndFlushLists,
-                                   5000
-                                   );
+    WDF_TIMER_CONFIG_INIT(&timerConfig,
+                          IPv6ToBleTimerCheckAndFlushLists
+                          );
 
     // Set the framework to automatically synchronize this with callbacks under
     // the parent object (the device)
@@ -476,8 +654,7 @@ Return Value:
         goto Exit;
     }
 
-    // Start the timer
-    WdfTimerStart(gRegistryTimer, WDF_REL_TIMEOUT_IN_MS(5000));
+    gRegistryTimerArmed = FALSE;
 
 Exit:
 
@@ -518,8 +695,15 @@ Return Value:
 
     //
     // Step 1
-    // Clean up callouts
+    // Wait for the start work item, which may still be loading the lists or
+    // registering the callouts, then clean up callouts
     //
+    KeWaitForSingleObject(&gStartCompleteEvent,
+                          Executive,
+                          KernelMode,
+                          FALSE,
+                          NULL
+                          );
 
 	// Unregister the callouts
 	IPv6ToBleCalloutsUnregister();
@@ -536,8 +720,15 @@ Return Value:
 	{
 		//
 		// Step 2
-		// Clean up the runtime lists
+		// Write any list changes still waiting for the flush timer to the
+		// registry, then clean up the runtime lists
 		//
+		if (gRegistryTimer)
+		{
+			WdfTimerStop(gRegistryTimer, TRUE);
+		}
+		IPv6ToBleRegistryFlushModifiedLists(FALSE);
+
 		IPv6ToBleRuntimeListPurgeRuntimeList(WHITE_LIST);
 		if (gWhiteListHead)
 		{
@@ -549,16 +740,41 @@ Return Value:
 		{
 			ExFreePoolWithTag(gMeshListHead, IPV6_TO_BLE_MESH_LIST_TAG);
 		}
+
+		IPv6ToBleRuntimeListSnapshotsCleanup();
+		IPv6ToBleListChangeCleanup();
 	}
 
     //
     // Step 3
+    // Clean up the listen pend queues. The callouts are unregistered, so
+    // nothing can pend a packet anymore.
+    //
+    IPv6ToBleListenCleanup();
+
+    //
+    // Step 4
     // Clean up the NDIS memory pool data structure
     //
+    // Every injection has completed by now, so every slab is back
+    NT_ASSERT(!gNdisPoolData ||
+              ExQueryDepthSList(&gNdisPoolData->injectSlabFreeList) == INJECT_SLAB_COUNT);
+
     IPv6ToBleNDISPoolDataDestroy(gNdisPoolData);
+    gNdisPoolData = NULL;
 
     //
-    // Step 4
+    // Step 5
+    // Clean up the statistics, the packet trace ring and the shaping table.
+    // Nothing is counted after the last injection completes, and nothing is
+    // sampled or shaped after the callouts are unregistered.
+    //
+    IPv6ToBleStatisticsCleanup();
+    IPv6ToBlePacketTraceCleanup();
+    IPv6ToBleShapingCleanup();
+
+    //
+    // Step 6
     // Deregister the NDIS interface provider handle
     /*if (gNdisIfProviderHandle)
     {
@@ -579,9 +795,9 @@ IPv6ToBleTimerCheckAndFlushLists(
 /*++
 Routine Description:
 
-    The framework calls this timer function every 5  seconds to check if the
-    runtime lists have changed. If they have, flush the runtime lists to the
-    registry.
+    The framework calls this timer function REGISTRY_FLUSH_COALESCE_MS after
+    the first change to a runtime list since the last flush. It queues a
+    work item to flush the changed lists to the registry.
 
     This behavior is to prevent loss of state; the driver generally works with
     the runtime lists so it doesn't have to open and close the registry keys
@@ -590,11 +806,12 @@ Routine Description:
 
     Since there is no way to guarantee that you will be able to flush to the
     registry once during device or driver unload, such as an unexpected
-    shutdown, the solution is to flush every 5 seconds, and only if the lists
-    have been modified. This is not a major load on the system.
+    shutdown, the lists are flushed soon after they change. The timer is
+    one-shot and only armed by a change, so changes that arrive together are
+    written once and nothing runs while the lists are idle.
 
-    This function is called at DISPATCH_LEVEL. If the lists have changed, it
-    queues a work item to assign the list to the registry at PASSIVE_LEVEL.
+    This function is called at DISPATCH_LEVEL. The work item assigns the lists
+    to the registry at PASSIVE_LEVEL.
 
 Arguments:
 
@@ -602,8 +819,7 @@ Arguments:
 
 Return Value:
 
-    None. The two functions called by this callback do return NTSTATUS, so if
-    they fail we log the error and continue because this function returns VOID.
+    None.
 
 --*/
 {
@@ -617,46 +833,35 @@ Return Value:
 
     //
     // Step 1
-    // Flush the white list if it has changed by scheduling a PASSIVE_LEVEL
-    // system worker thread. We use a system worker thread because assigning
-    // the list to the registry is expected to be very infrequent and doesn't
-    // take long to do (no delayed processing, etc.).
+    // Disarm first, so a change made from here on arms the timer again
+    // instead of being folded into a flush that may already have read the
+    // lists
     //
-    WdfSpinLockAcquire(gWhiteListModifiedLock);
-    if (gWhiteListModified)
-    {
-        PIO_WORKITEM workItem = IoAllocateWorkItem(gWdmDeviceObject);
-        if (workItem)
-        {
-            IoQueueWorkItemEx(workItem,
-                              IPv6ToBleRegistryFlushWhiteListWorkItemEx,
-                              DelayedWorkQueue,
-                              NULL
-                              );
-        }
-    }
-    WdfSpinLockRelease(gWhiteListModifiedLock);
-
-    NT_ASSERT(irql == KeGetCurrentIrql());
+    InterlockedExchange(&gRegistryTimerArmed, FALSE);
 
     //
     // Step 2
-    // Flush the mesh list if it has changed, also with a system worker thread.
+    // Flush the changed lists by scheduling a PASSIVE_LEVEL system worker
+    // thread. We use a system worker thread because assigning the lists to
+    // the registry is expected to be very infrequent and doesn't take long to
+    // do (no delayed processing, etc.). If the work item can't be allocated,
+    // try again after another delay.
     //
-    WdfSpinLockAcquire(gMeshListModifiedLock);
-    if (gMeshListModified)
+    PIO_WORKITEM workItem = IoAllocateWorkItem(gWdmDeviceObject);
+    if (workItem)
     {
-        PIO_WORKITEM workItem = IoAllocateWorkItem(gWdmDeviceObject);
-        if (workItem)
-        {
-            IoQueueWorkItemEx(workItem,
-                              IPv6ToBleRegistryFlushMeshListWorkItemEx,
-                              DelayedWorkQueue,
-                              NULL
-                              );
-        }
+        IoQueueWorkItemEx(workItem,
+                          IPv6ToBleRegistryFlushListsWorkItemEx,
+                          DelayedWorkQueue,
+                          NULL
+                          );
+    }
+    else
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_TIMER, "Allocating the registry flush work item failed, retrying later");
+
+        IPv6ToBleRegistryArmFlushTimer();
     }
-    WdfSpinLockRelease(gMeshListModifiedLock);
 
     NT_ASSERT(irql == KeGetCurrentIrql());
 
@@ -19,15 +19,37 @@ Environment:
 // Custom structures
 //-----------------------------------------------------------------------------
 
+//
+// A preallocated buffer for one packet to inject, with the NET_BUFFER_LIST
+// that describes it. Slabs are taken from a lock-free free list to inject a
+// packet and returned to it by the injection completion callback, so
+// injecting allocates nothing and the packet stays valid until NDIS is done
+// with it, however soon the request that supplied it is completed.
+//
+#define INJECT_PACKET_MAX_LENGTH    1280    // Bluetooth MTU
+#define INJECT_SLAB_COUNT           256
+
+typedef struct DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) _INJECT_SLAB {
+    SLIST_ENTRY         entry;  // Free list link
+    NET_BUFFER_LIST*    NBL;    // Describes data; its MDL is set up once
+    ULONG               direction;  // INBOUND or OUTBOUND, for statistics
+    BYTE                data[INJECT_PACKET_MAX_LENGTH];
+} INJECT_SLAB, *PINJECT_SLAB;
+
 //
 // This structure holds handles to the memory pools used to create
 // NET_BUFFER_LIST and NET_BUFFER structures. NDIS uses special pools for
 // performance reasons and so kernel executive memory is not fragmented.
 //
+// It also holds the injection slabs, whose NBLs come from the NBL pool.
+//
 typedef struct _NDIS_POOL_DATA {
     HANDLE	ndisHandle;		// NDIS_HANDLE
     HANDLE	nblPoolHandle;	// NDIS_HANDLE
     HANDLE	nbPoolHandle;	// NDIS_HANDLE
+
+    SLIST_HEADER    injectSlabFreeList;         // Slabs not being injected
+    PINJECT_SLAB    injectSlabs;                // All slabs, for cleanup
 } NDIS_POOL_DATA, *PNDIS_POOL_DATA;
 
 //
@@ -51,6 +73,247 @@ typedef struct _MESH_LIST_ENTRY
     LIST_ENTRY	listEntry;		// Links this list entry to the list
 } MESH_LIST_ENTRY, *PMESH_LIST_ENTRY;
 
+//
+// Structures for the read-only snapshots of the runtime lists that the
+// classify callouts read.
+//
+// The LIST_ENTRY lists above are the authoritative copies and are only touched
+// by writers holding gRuntimeListWriteLock. After every change the writer
+// builds a new, contiguous snapshot and publishes it with a single pointer
+// exchange. Readers never lock; they only mark themselves as active in their
+// processor's reader sequence (odd while reading) so the writer knows when
+// the old snapshot can be freed. See RuntimeList.c.
+//
+typedef struct _RUNTIME_LIST_SNAPSHOT_ENTRY
+{
+    IN6_ADDR    ipv6Address;    // The IPv6 address
+    ULONG       scopeId;        // The scope ID of the address
+} RUNTIME_LIST_SNAPSHOT_ENTRY, *PRUNTIME_LIST_SNAPSHOT_ENTRY;
+
+typedef struct _RUNTIME_LIST_SNAPSHOT
+{
+    ULONG                       entryCount; // Number of entries
+    PADDRESS_TABLE              index;      // Address -> position in entries
+    RUNTIME_LIST_SNAPSHOT_ENTRY entries[ANYSIZE_ARRAY];
+} RUNTIME_LIST_SNAPSHOT, *PRUNTIME_LIST_SNAPSHOT;
+
+//
+// Format of the REG_BINARY value each runtime list is persisted as: this
+// header followed by entryCount RUNTIME_LIST_SNAPSHOT_ENTRY structures, the
+// same packed entries the list's snapshot holds. The CRC-32 covers the
+// entries, so a torn or hand-edited value is detected and the legacy
+// REG_MULTI_SZ value is read instead. See Helpers_Registry.c.
+//
+#define REGISTRY_LIST_BLOB_VERSION  1
+
+typedef struct _REGISTRY_LIST_BLOB_HEADER
+{
+    ULONG   version;        // REGISTRY_LIST_BLOB_VERSION
+    ULONG   entryCount;     // Number of entries that follow
+    ULONG   crc32;          // CRC-32 of the entries
+} REGISTRY_LIST_BLOB_HEADER, *PREGISTRY_LIST_BLOB_HEADER;
+
+//
+// How long after a runtime list changes it is written to the registry, so a
+// burst of changes is persisted with one write
+//
+#define REGISTRY_FLUSH_COALESCE_MS  1000
+
+typedef struct DECLSPEC_CACHEALIGN _SNAPSHOT_READER_SEQUENCE
+{
+    volatile LONG   sequence;   // Odd while a reader on this CPU is active
+} SNAPSHOT_READER_SEQUENCE, *PSNAPSHOT_READER_SEQUENCE;
+
+//
+// On the border router, the WFP filters don't match runtime list addresses
+// one by one. Instead, addresses are grouped by their /64 prefix and each
+// group gets one filter with an address-and-mask condition, so the number of
+// filters (and the filter engine's work) tracks the number of prefixes rather
+// than the number of devices. The classify callouts then verify the exact
+// address against the list snapshots. See callout.c.
+//
+#define FILTER_GROUP_PREFIX_LENGTH 64
+
+typedef struct _FILTER_PREFIX_GROUP
+{
+    LIST_ENTRY  listEntry;      // Links this group to the group list
+    IN6_ADDR    prefix;         // The /64 prefix, with the host bits zeroed
+    ULONG       entryCount;     // Number of list entries under this prefix
+    UINT64      filterId;       // Runtime ID of the group's filter
+} FILTER_PREFIX_GROUP, *PFILTER_PREFIX_GROUP;
+
+//
+// Structures for holding intercepted packets while no listen request is
+// outstanding, e.g. while the packet processing app is between requests.
+// Each priority class and direction of each listen channel has its own
+// bounded ring of preallocated slots, so pending a packet is only a copy and
+// bulk traffic filling one class can't take the slots of another. All fields
+// are guarded by the owning channel's lock. See Listen.c.
+//
+#define LISTEN_PACKET_MAX_LENGTH        1280    // Bluetooth MTU
+
+#define LISTEN_PEND_QUEUE_DEFAULT_DEPTH 64
+#define LISTEN_PEND_QUEUE_MAX_DEPTH     1024
+
+#define LISTEN_DROP_NEWEST  0   // When full, drop the arriving packet
+#define LISTEN_DROP_OLDEST  1   // When full, drop the oldest pended packet
+
+//
+// How long a batched listen request waits after the first packet is pended,
+// so more packets can be returned in the same completion
+//
+#define LISTEN_BATCH_COALESCE_US    1000
+
+typedef struct _PENDED_PACKET
+{
+    UINT64  sequence;                       // Arrival order in the channel
+    UINT32  length;                         // Bytes of data in use
+    IPV6_TO_BLE_PACKET_METADATA metadata;   // Capture details, incl. time
+    BYTE    data[LISTEN_PACKET_MAX_LENGTH]; // The packet, incl. IP header
+} PENDED_PACKET, *PPENDED_PACKET;
+
+typedef struct _LISTEN_PEND_QUEUE
+{
+    PPENDED_PACKET  packets;        // Ring of slots; NULL if not pending
+    ULONG           depth;          // Number of slots
+    ULONG           head;           // Slot of the oldest pended packet
+    ULONG           count;          // Number of pended packets
+    ULONG           dropPolicy;     // LISTEN_DROP_NEWEST or LISTEN_DROP_OLDEST
+    LONG64          pendedCount;    // Packets pended
+    LONG64          deliveredCount; // Pended packets returned to the app
+    LONG64          droppedCount;   // Packets dropped from or by a full ring
+} LISTEN_PEND_QUEUE, *PLISTEN_PEND_QUEUE;
+
+//
+// Structures for the listen channels. Each channel has its own listen request
+// queues, pend queues, batch timer and lock, and intercepted packets are
+// steered to a channel by their flow hash, so several app threads can drain
+// the channels in parallel while the packets of one flow stay in order. The
+// number of channels is read from the registry; with the default of one the
+// driver behaves as it did before channels existed. See Listen.c.
+//
+#define LISTEN_CHANNEL_DEFAULT_COUNT    1
+#define LISTEN_CHANNEL_MAX_COUNT        8
+
+typedef struct DECLSPEC_CACHEALIGN _LISTEN_CHANNEL
+{
+    WDFSPINLOCK         lock;               // Guards the rest of the channel
+    WDFQUEUE            requestQueue;       // Waiting listen requests
+    WDFQUEUE            batchRequestQueue;  // Waiting batched listen requests
+    WDFTIMER            batchTimer;         // Coalesces packets for batched
+                                            // requests
+    BOOLEAN             batchTimerArmed;    // Batch timer is running
+    UINT64              pendSequence;       // Next pended packet sequence
+                                            // number
+    LISTEN_PEND_QUEUE   pendQueues[IPV6_TO_BLE_PRIORITY_COUNT][2];
+                                            // Packets waiting for a listen
+                                            // request, by priority class
+                                            // and INBOUND/OUTBOUND
+} LISTEN_CHANNEL, *PLISTEN_CHANNEL;
+
+//
+// Context of each channel's batch timer, so the timer callback knows which
+// channel to fill
+//
+typedef struct _LISTEN_BATCH_TIMER_CONTEXT
+{
+    PLISTEN_CHANNEL channel;
+} LISTEN_BATCH_TIMER_CONTEXT, *PLISTEN_BATCH_TIMER_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(LISTEN_BATCH_TIMER_CONTEXT, IPv6ToBleListenGetBatchTimerContext)
+
+//
+// Structure for the packet rings shared with the packet processing app (see
+// Public.h for the layout and protocol, and SharedRing.c).
+//
+// The app can write to the whole mapped region at any time, so the driver
+// keeps its own copies of the indices it owns and never trusts a value read
+// back from the region without checking it.
+//
+#define SHARED_RING_SLOT_COUNT 256
+
+typedef struct _SHARED_RINGS
+{
+    PVOID           kernelBase;     // The region, in non-paged pool
+    SIZE_T          regionLength;   // Length of the region, whole pages
+    PMDL            mdl;            // Describes the region
+    PVOID           userBase;       // The region mapped in the owner process
+    WDFFILEOBJECT   owner;          // File object that mapped the region
+    PEPROCESS       ownerProcess;   // Process that mapped the region
+    PKEVENT         listenEvent;    // Signalled when the app should wake
+
+    PIPV6_TO_BLE_SHARED_RING_HEADER listenRing; // Driver produces
+    PIPV6_TO_BLE_SHARED_RING_HEADER injectRing; // App produces
+
+    ULONG           listenProducer; // Driver's listen ring producer index
+    ULONG           injectConsumer; // Driver's inject ring consumer index
+
+    BOOLEAN         active;         // Listen ring is taking packets; written
+                                    // under gListenRequestQueueLock
+    LONG64          listenDroppedCount; // Packets dropped, listen ring full
+} SHARED_RINGS, *PSHARED_RINGS;
+
+//
+// Data path statistics and the delivery latency histogram, kept per
+// processor so the classify callouts and injection functions never contend
+// for a cache line to count a packet. The query IOCTLs add them up. See
+// Statistics.c.
+//
+typedef struct DECLSPEC_CACHEALIGN _PER_PROCESSOR_STATISTICS
+{
+    IPV6_TO_BLE_STATISTICS          counters;   // Only per-packet counters
+                                                // are used
+    IPV6_TO_BLE_LATENCY_HISTOGRAM   latency;    // Classify to delivery
+} PER_PROCESSOR_STATISTICS, *PPER_PROCESSOR_STATISTICS;
+
+//
+// Structures for sampling classify decisions into the packet trace ring (see
+// Public.h for the record format, and PacketTrace.c). Each processor counts
+// down to its next sample on its own cache line, so a packet that isn't
+// sampled never writes to shared memory. Sampled records go into one ring
+// guarded by gPacketTraceLock.
+//
+#define PACKET_TRACE_RING_SIZE  1024    // Records
+
+typedef struct DECLSPEC_CACHEALIGN _PER_PROCESSOR_PACKET_TRACE
+{
+    LONG    countdown;  // Packets until the next sample on this processor
+} PER_PROCESSOR_PACKET_TRACE, *PPER_PROCESSOR_PACKET_TRACE;
+
+//
+// Structures for the outbound shaping table: a token bucket for each
+// destination, kept in a fixed table of cache-aligned buckets hashed by
+// address. Each table bucket has its own spin lock and a few slots; when a
+// new destination finds every slot in use, the slot refilled longest ago is
+// reused, so the table never grows and a destination that comes back starts
+// with a full token bucket. See Shaping.c.
+//
+#define SHAPING_TABLE_BUCKET_COUNT  256     // Power of 2
+#define SHAPING_SLOTS_PER_BUCKET    3
+
+typedef struct _SHAPING_SLOT
+{
+    IN6_ADDR    destination;    // Destination address
+    LONGLONG    lastRefill;     // Performance counter at the last refill
+    LONG        tokens;         // Bytes the destination may still send
+    BOOLEAN     inUse;          // Whether the slot holds a destination
+} SHAPING_SLOT, *PSHAPING_SLOT;
+
+typedef struct DECLSPEC_CACHEALIGN _SHAPING_TABLE_BUCKET
+{
+    KSPIN_LOCK      lock;                               // Guards the slots
+    SHAPING_SLOT    slots[SHAPING_SLOTS_PER_BUCKET];
+} SHAPING_TABLE_BUCKET, *PSHAPING_TABLE_BUCKET;
+
+//
+// Size of the list change log, which holds the most recent changes to the
+// runtime lists for the list change IOCTL (see Public.h for the record
+// format, and ListChange.c). Record g is the change that took the lists from
+// generation g to g + 1, and lives at index g % LIST_CHANGE_LOG_LENGTH.
+// A caller further behind than this gets both lists in full instead.
+//
+#define LIST_CHANGE_LOG_LENGTH  1024    // Records, power of 2
+
 //-----------------------------------------------------------------------------
 // Global variables and objects (with a "g" prefix).
 //
@@ -80,14 +343,25 @@ UINT32 gOutboundIpPacketV6CalloutId; // Runtime ID,outbound IP packet v6 callout
 
 BOOLEAN gCalloutsRegistered;         // Tracker for whether callouts registered
 
+LIST_ENTRY gWhiteListFilterGroups;   // Inbound filter prefix groups (BR only)
+LIST_ENTRY gMeshListFilterGroups;    // Outbound filter prefix groups (BR only)
+
 HANDLE gFilterEngineHandle;	        // Handle to the WFP filter engine
 HANDLE gInjectionHandleNetwork;     // Handle for injecting packets
 
 //
 // Objects for listening for packets
 //
-WDFQUEUE	gListenRequestQueue;    // Queue to listen for inbound IPv6 packets
-WDFSPINLOCK gListenRequestQueueLock; // Lock to access listen request queue
+WDFSPINLOCK gListenRequestQueueLock; // Lock to switch between the listen
+                                     // channels and the listen ring
+
+LISTEN_CHANNEL gListenChannels[LISTEN_CHANNEL_MAX_COUNT]; // Listen request
+                                                          // queues and pend
+                                                          // queues, by channel
+ULONG gListenChannelCount;          // Number of channels in use
+
+SHARED_RINGS gSharedRings;          // Packet rings shared with the app
+WDFWAITLOCK gSharedRingsLock;       // Serializes map, unmap and inject
 
 //
 // Objects for kernel mode network I/O
@@ -98,6 +372,33 @@ UINT32 gNdisIfNetLuidIndex;          // 24-bit NET_LUID index value for being an
                                     // NDIS inferface provider
 NDIS_POOL_DATA* gNdisPoolData;	    // NDIS memory pools (see Helpers_NDIS.h) 
 
+//
+// Objects for the data path statistics
+//
+PPER_PROCESSOR_STATISTICS gStatistics;  // One per processor
+ULONG gStatisticsCount;                 // Number of processors
+LONGLONG gPerformanceFrequency;         // Performance counter ticks/second
+
+//
+// Objects for data path tracing and the sampled packet trace ring
+//
+volatile LONG gDataPathTracing;         // Data path WPP trace points are on
+volatile LONG gPacketTraceSampleRate;   // Sample 1 in N packets; 0 for none
+
+PPER_PROCESSOR_PACKET_TRACE gPacketTraceCountdowns; // One per processor
+PIPV6_TO_BLE_PACKET_TRACE_RECORD gPacketTraceRing;  // PACKET_TRACE_RING_SIZE
+                                                    // records
+UINT64 gPacketTraceProduced;        // Records ever written to the ring
+UINT64 gPacketTraceConsumed;        // Records read from or lost by the ring
+WDFSPINLOCK gPacketTraceLock;       // Guards the ring and both counts
+
+//
+// Objects for outbound shaping
+//
+volatile LONG gShapingRate;         // Bytes/second per destination; 0 for off
+volatile LONG gShapingBurst;        // Token bucket size per destination
+PSHAPING_TABLE_BUCKET gShapingTable; // SHAPING_TABLE_BUCKET_COUNT buckets
+
 //
 // Objects for the runtime white list and mesh list
 //
@@ -105,17 +406,47 @@ BOOLEAN gBorderRouterFlag;			// Flag to see if running on BR
 PLIST_ENTRY	gWhiteListHead;		    // Head of the white list
 PLIST_ENTRY	gMeshListHead;		    // Head of the mesh list   
 
+WDFWAITLOCK gRuntimeListWriteLock;  // Serializes changes to the lists
+
+PRUNTIME_LIST_SNAPSHOT gWhiteListSnapshot; // Published white list snapshot
+PRUNTIME_LIST_SNAPSHOT gMeshListSnapshot;  // Published mesh list snapshot
+
+PSNAPSHOT_READER_SEQUENCE gSnapshotReaders; // One per processor
+ULONG gSnapshotReaderCount;                 // Number of processors
+
 BOOLEAN gWhiteListModified;         // Tracker for whether white list changed
 BOOLEAN gMeshListModified;          // Tracker for whether mesh list changed
 WDFSPINLOCK gWhiteListModifiedLock; // Lock to check if white list changed
 WDFSPINLOCK gMeshListModifiedLock;  // Lock to check if mesh list changed
 
 //
-// Periodic timer object
+// Objects for list change notification (border router only). All of them
+// are guarded by gRuntimeListWriteLock.
+//
+WDFQUEUE gListChangeQueue;          // Requests waiting for the next change
+PIPV6_TO_BLE_LIST_CHANGE_RECORD gListChangeLog; // LIST_CHANGE_LOG_LENGTH
+                                                // records
+UINT64 gListGeneration;             // Generation of the lists
+UINT64 gListChangeOldest;           // Oldest record still in the log
+UINT64 gListChangeNext;             // Next record to log; records from
+                                    // gListGeneration on aren't committed
+
+//
+// Objects for the start work item, which loads the lists and registers the
+// callouts after DriverEntry returns
+//
+KEVENT gStartCompleteEvent;         // Signaled when the start work item ends
+NTSTATUS gStartStatus;              // Result of the start work item
+LONGLONG gStartTime;                // Performance counter at DriverEntry
+UINT64 gStartMicroseconds;          // DriverEntry until start work item ended
+
+//
+// One-shot timer object
 //
 WDFTIMER gRegistryTimer;            // Timer to flush runtime lists to registry
-                                    // periodically (if they changed), to avoid
+                                    // shortly after they change, to avoid
                                     // data loss 
+volatile LONG gRegistryTimerArmed;  // Set while gRegistryTimer is queued
 
 //-----------------------------------------------------------------------------
 // WDFDRIVER Events
@@ -140,7 +471,15 @@ NTSTATUS
 IPv6ToBleDriverInitGlobalObjects();
 
 //-----------------------------------------------------------------------------
-// Functions for periodic timer to flush runtime lists to the registry
+// Work item that finishes starting the driver after DriverEntry returns
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+IO_WORKITEM_ROUTINE_EX IPv6ToBleDriverStartWorkItemEx;
+
+//-----------------------------------------------------------------------------
+// Functions for the one-shot timer to flush runtime lists to the registry
 //-----------------------------------------------------------------------------
 
 _IRQL_requires_max_(PASSIVE_LEVEL)
@@ -164,15 +503,46 @@ EXTERN_C_END
 #define WHITE_LIST 0
 #define MESH_LIST  1
 
+//
+// Operations for bulk changes to a runtime list
+//
+#define BULK_LIST_ADD       0
+#define BULK_LIST_REMOVE    1
+#define BULK_LIST_REPLACE   2
+
 //
 // Length of an IPv6 address, in bytes
 //
 #define IPV6_ADDRESS_LENGTH 16
 
+//
+// Length of the fixed IPv6 header, in bytes
+//
+#define IPV6_HEADER_LENGTH 40
+
+//
+// Largest TCP maximum segment size that fits the BLE path MTU of 1280 bytes,
+// less the fixed IPv6 header and a TCP header without options. SYN segments
+// handed to the app are clamped to it. See Helpers_Tcp.c.
+//
+#define TCP_HEADER_LENGTH   20
+#define TCP_MSS_CLAMP       (LISTEN_PACKET_MAX_LENGTH - IPV6_HEADER_LENGTH - TCP_HEADER_LENGTH)
+
 //
 // Memory pool tags
 //
 #define IPV6_TO_BLE_NDIS_TAG		(UINT32)'TNBI'	// 'Ipv6 Ble Ndis Tag'
 #define IPV6_TO_BLE_NBL_TAG			(UINT32)'BNBI'	// 'Ipv6 Ble Net Buffer'
 #define IPV6_TO_BLE_WHITE_LIST_TAG	(UINT32)'LWBI'	// 'Ipv6 Ble White List'
-#define IPV6_TO_BLE_MESH_LIST_TAG	(UINT32)'LMBI'	// 'Ipv6 Ble Mesh List'
\ No newline at end of file
+#define IPV6_TO_BLE_MESH_LIST_TAG	(UINT32)'LMBI'	// 'Ipv6 Ble Mesh List'
+#define IPV6_TO_BLE_ADDRESS_TABLE_TAG	(UINT32)'TABI'	// 'Ipv6 Ble Address Table'
+#define IPV6_TO_BLE_SNAPSHOT_TAG	(UINT32)'SLBI'	// 'Ipv6 Ble List Snapshot'
+#define IPV6_TO_BLE_FILTER_GROUP_TAG	(UINT32)'GFBI'	// 'Ipv6 Ble Filter Group'
+#define IPV6_TO_BLE_PEND_QUEUE_TAG	(UINT32)'QPBI'	// 'Ipv6 Ble Pend Queue'
+#define IPV6_TO_BLE_SHARED_RING_TAG	(UINT32)'RSBI'	// 'Ipv6 Ble Shared Ring'
+#define IPV6_TO_BLE_STATISTICS_TAG	(UINT32)'TSBI'	// 'Ipv6 Ble Statistics'
+#define IPV6_TO_BLE_REGISTRY_TAG	(UINT32)'GRBI'	// 'Ipv6 Ble Registry'
+#define IPV6_TO_BLE_PACKET_TRACE_TAG	(UINT32)'TPBI'	// 'Ipv6 Ble Packet Trace'
+#define IPV6_TO_BLE_SHAPING_TAG		(UINT32)'HSBI'	// 'Ipv6 Ble Shaping'
+#define IPV6_TO_BLE_LIST_CHANGE_TAG	(UINT32)'CLBI'	// 'Ipv6 Ble List Change'
+#define IPV6_TO_BLE_INJECT_TAG		(UINT32)'JIBI'	// 'Ipv6 Ble Inject'
\ No newline at end of file
@@ -0,0 +1,290 @@
+/*++
+
+Module Name:
+
+	Helpers_AddressTable.c
+
+Abstract:
+
+	This file contains the implementations for helper functions to build and
+	query the hash index over runtime list IPv6 addresses.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#include "Includes.h"
+#include "Helpers_AddressTable.tmh" // auto-generated tracing file
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleAddressTableCreate(
+	_In_	ULONG			capacity,
+	_Out_	PADDRESS_TABLE*	addressTable
+)
+/*++
+Routine Description:
+
+	Allocates an empty address table large enough to hold the given number of
+	addresses while keeping the load factor at or below one half. The bucket
+	count is rounded up to a power of 2 so a bucket index is a simple mask.
+
+	The table comes from cache-aligned non-paged pool so that each bucket
+	occupies exactly one cache line and may be read at DISPATCH_LEVEL.
+
+Arguments:
+
+	capacity - the number of addresses the caller intends to insert.
+
+	addressTable - receives the new table on success.
+
+Return Value:
+
+	STATUS_SUCCESS if successful, appropriate NTSTATUS error codes otherwise.
+
+--*/
+{
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_HELPERS_IP_ADDRESS, "%!FUNC! Entry");
+
+	NTSTATUS status = STATUS_SUCCESS;
+
+	*addressTable = NULL;
+
+	//
+	// Step 1
+	// Work out how many buckets we need. Twice the capacity in slots keeps
+	// the table at most half full, which keeps probe sequences short.
+	//
+	ULONG bucketCount = 1;
+	ULONG slotsNeeded = 0;
+
+	status = RtlULongMult(capacity, 2, &slotsNeeded);
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_IP_ADDRESS, "Address table capacity too large during %!FUNC! with %!STATUS!", status);
+		goto Exit;
+	}
+
+	while (bucketCount * ADDRESS_TABLE_SLOTS_PER_BUCKET < slotsNeeded)
+	{
+		if (bucketCount > (MAXULONG >> 1) / ADDRESS_TABLE_SLOTS_PER_BUCKET)
+		{
+			status = STATUS_INTEGER_OVERFLOW;
+			TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_IP_ADDRESS, "Address table capacity too large during %!FUNC! with %!STATUS!", status);
+			goto Exit;
+		}
+		bucketCount <<= 1;
+	}
+
+	//
+	// Step 2
+	// Allocate and zero the table. The header is itself cache aligned, so
+	// the bucket array that follows it starts on a cache line boundary.
+	//
+	SIZE_T tableSize = 0;
+	status = RtlSizeTMult(bucketCount - 1,
+						  sizeof(ADDRESS_TABLE_BUCKET),
+						  &tableSize
+						  );
+	if (NT_SUCCESS(status))
+	{
+		status = RtlSizeTAdd(tableSize, sizeof(ADDRESS_TABLE), &tableSize);
+	}
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_IP_ADDRESS, "Address table size overflowed during %!FUNC! with %!STATUS!", status);
+		goto Exit;
+	}
+
+	PADDRESS_TABLE newTable = (PADDRESS_TABLE)ExAllocatePoolWithTag(
+									NonPagedPoolNxCacheAligned,
+									tableSize,
+									IPV6_TO_BLE_ADDRESS_TABLE_TAG
+								);
+	if (!newTable)
+	{
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_IP_ADDRESS, "Address table allocation failed during %!FUNC! with %!STATUS!", status);
+		goto Exit;
+	}
+
+	RtlZeroMemory(newTable, tableSize);
+	newTable->bucketMask = bucketCount - 1;
+
+	*addressTable = newTable;
+
+Exit:
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_HELPERS_IP_ADDRESS, "%!FUNC! Exit");
+
+	return status;
+}
+
+_Use_decl_annotations_
+VOID
+IPv6ToBleAddressTableDestroy(
+	_In_opt_ PADDRESS_TABLE	addressTable
+)
+/*++
+Routine Description:
+
+	Frees an address table previously created with
+	IPv6ToBleAddressTableCreate.
+
+	The caller must guarantee that no classify callout is still reading the
+	table.
+
+Arguments:
+
+	addressTable - the table to free. May be NULL.
+
+Return Value:
+
+	None.
+
+--*/
+{
+	if (addressTable)
+	{
+		ExFreePoolWithTag(addressTable, IPV6_TO_BLE_ADDRESS_TABLE_TAG);
+	}
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleAddressTableInsert(
+	_Inout_	PADDRESS_TABLE	addressTable,
+	_In_	const IN6_ADDR*	ipv6Address,
+	_In_	ULONG			value
+)
+/*++
+Routine Description:
+
+	Inserts an address and its associated value into an address table. If the
+	address is already present, its value is updated.
+
+	Tables are sized up front by the caller, so this does not grow the table.
+	Inserting more addresses than the capacity given at creation is still
+	safe as long as free slots remain; the table is only full when every
+	bucket is.
+
+Arguments:
+
+	addressTable - the table to insert into.
+
+	ipv6Address - the address to insert.
+
+	value - a caller-defined value to associate with the address.
+
+Return Value:
+
+	STATUS_SUCCESS if successful, STATUS_INSUFFICIENT_RESOURCES if the table
+	has no free slot.
+
+--*/
+{
+	ULONG bucketIndex = (ULONG)IPv6ToBleAddressTableHash(ipv6Address->u.Byte) &
+						addressTable->bucketMask;
+
+	for (ULONG probes = 0; probes <= addressTable->bucketMask; probes++)
+	{
+		PADDRESS_TABLE_BUCKET bucket = &addressTable->buckets[bucketIndex];
+
+		for (ULONG slot = 0; slot < bucket->count; slot++)
+		{
+			if (RtlEqualMemory(&bucket->addresses[slot],
+							   ipv6Address,
+							   IPV6_ADDRESS_LENGTH))
+			{
+				bucket->values[slot] = value;
+				return STATUS_SUCCESS;
+			}
+		}
+
+		if (bucket->count < ADDRESS_TABLE_SLOTS_PER_BUCKET)
+		{
+			bucket->addresses[bucket->count] = *ipv6Address;
+			bucket->values[bucket->count] = value;
+			bucket->count++;
+			addressTable->entryCount++;
+			return STATUS_SUCCESS;
+		}
+
+		bucketIndex = (bucketIndex + 1) & addressTable->bucketMask;
+	}
+
+	TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_IP_ADDRESS, "Address table is full during %!FUNC!");
+
+	return STATUS_INSUFFICIENT_RESOURCES;
+}
+
+_Use_decl_annotations_
+BOOLEAN
+IPv6ToBleAddressTableLookup(
+	_In_opt_	const ADDRESS_TABLE*	addressTable,
+	_In_		const UINT8*			ipv6Address,
+	_Out_opt_	ULONG*					value
+)
+/*++
+Routine Description:
+
+	Looks up an address in an address table. This is called from the classify
+	callouts for every packet, so it does not allocate, lock, or trace.
+
+	Because entries are never removed from a table (it is rebuilt instead),
+	a bucket that still has a free slot ends the probe sequence: nothing that
+	hashed to an earlier bucket could have overflowed past it.
+
+Arguments:
+
+	addressTable - the table to search. A NULL table is treated as empty.
+
+	ipv6Address - the 16 byte address to look for, in network byte order. It
+	does not need to be aligned.
+
+	value - receives the value associated with the address, if found.
+
+Return Value:
+
+	TRUE if the address is in the table, FALSE otherwise.
+
+--*/
+{
+	if (!addressTable || addressTable->entryCount == 0)
+	{
+		return FALSE;
+	}
+
+	ULONG bucketIndex = (ULONG)IPv6ToBleAddressTableHash(ipv6Address) &
+						addressTable->bucketMask;
+
+	for (ULONG probes = 0; probes <= addressTable->bucketMask; probes++)
+	{
+		const ADDRESS_TABLE_BUCKET* bucket = &addressTable->buckets[bucketIndex];
+
+		for (ULONG slot = 0; slot < bucket->count; slot++)
+		{
+			if (RtlEqualMemory(&bucket->addresses[slot],
+							   ipv6Address,
+							   IPV6_ADDRESS_LENGTH))
+			{
+				if (value)
+				{
+					*value = bucket->values[slot];
+				}
+				return TRUE;
+			}
+		}
+
+		if (bucket->count < ADDRESS_TABLE_SLOTS_PER_BUCKET)
+		{
+			break;
+		}
+
+		bucketIndex = (bucketIndex + 1) & addressTable->bucketMask;
+	}
+
+	return FALSE;
+}
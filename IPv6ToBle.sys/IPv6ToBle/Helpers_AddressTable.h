@@ -0,0 +1,141 @@
+/*++
+
+Module Name:
+
+	Helpers_AddressTable.h
+
+Abstract:
+
+	This file contains the structures of the hash index over runtime list
+	IPv6 addresses and definitions for the helper functions that build and
+	query it.
+
+	It needs nothing from the driver but the kernel headers, so the classify
+	core tests can build Helpers_AddressTable.c in user mode.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#ifndef _HELPERS_ADDRESS_TABLE_H_
+#define _HELPERS_ADDRESS_TABLE_H_
+
+EXTERN_C_START
+
+//-----------------------------------------------------------------------------
+// Structures for the hash index over runtime list addresses
+//-----------------------------------------------------------------------------
+
+//
+// The index lets the classify callouts check membership without walking a
+// linked list. It is an open-addressed table of buckets that are each exactly
+// one cache line, so a lookup usually touches a single line. Buckets are
+// probed linearly and the table is only ever rebuilt, never edited in place,
+// so a bucket that is not full ends the probe sequence.
+//
+#define ADDRESS_TABLE_SLOTS_PER_BUCKET 3
+
+typedef struct DECLSPEC_CACHEALIGN _ADDRESS_TABLE_BUCKET
+{
+	IN6_ADDR	addresses[ADDRESS_TABLE_SLOTS_PER_BUCKET];	// Keys
+	ULONG		values[ADDRESS_TABLE_SLOTS_PER_BUCKET];		// Per-key values
+	ULONG		count;										// Slots in use
+} ADDRESS_TABLE_BUCKET, *PADDRESS_TABLE_BUCKET;
+
+typedef struct DECLSPEC_CACHEALIGN _ADDRESS_TABLE
+{
+	ULONG					bucketMask;		// Bucket count - 1 (power of 2)
+	ULONG					entryCount;		// Number of addresses stored
+	ADDRESS_TABLE_BUCKET	buckets[ANYSIZE_ARRAY];
+} ADDRESS_TABLE, *PADDRESS_TABLE;
+
+//-----------------------------------------------------------------------------
+// Hash function for IPv6 addresses, shared with the outbound shaping table
+// (see Shaping.c)
+//-----------------------------------------------------------------------------
+
+//
+// Hashes a 16 byte IPv6 address to a 64-bit value. The two halves of the
+// address are folded together and then mixed with a multiplicative (Fibonacci)
+// hash so that addresses sharing a prefix still spread across the table.
+//
+// Callers keep only the low bits, and a multiply only carries bits upward. The
+// last bytes of an address, where devices in one prefix differ, are the high
+// bits of the little-endian second half, so they are folded down before the
+// multiply and the high half of the product is folded down after it.
+//
+// The address is read with RtlCopyMemory because the caller may hand us a
+// pointer straight into packet data with no particular alignment.
+//
+FORCEINLINE
+ULONG64
+IPv6ToBleAddressTableHash(
+	_In_ const UINT8* ipv6Address
+)
+{
+	ULONG64 halves[2];
+
+	RtlCopyMemory(halves, ipv6Address, sizeof(halves));
+
+	ULONG64 hash = halves[0] ^ halves[1];
+
+	hash ^= hash >> 32;
+	hash *= 0x9E3779B97F4A7C15ULL;
+
+	return hash ^ (hash >> 32);
+}
+
+//-----------------------------------------------------------------------------
+// Functions to create and destroy an address table
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+_Check_return_
+_Success_(return == STATUS_SUCCESS)
+NTSTATUS
+IPv6ToBleAddressTableCreate(
+	_In_	ULONG			capacity,
+	_Out_	PADDRESS_TABLE*	addressTable
+);
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+VOID
+IPv6ToBleAddressTableDestroy(
+	_In_opt_ PADDRESS_TABLE	addressTable
+);
+
+//-----------------------------------------------------------------------------
+// Functions to insert into and look up addresses in an address table
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+_Check_return_
+_Success_(return == STATUS_SUCCESS)
+NTSTATUS
+IPv6ToBleAddressTableInsert(
+	_Inout_	PADDRESS_TABLE	addressTable,
+	_In_	const IN6_ADDR*	ipv6Address,
+	_In_	ULONG			value
+);
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+BOOLEAN
+IPv6ToBleAddressTableLookup(
+	_In_opt_	const ADDRESS_TABLE*	addressTable,
+	_In_		const UINT8*			ipv6Address,
+	_Out_opt_	ULONG*					value
+);
+
+EXTERN_C_END
+
+#endif	// _HELPERS_ADDRESS_TABLE_H_
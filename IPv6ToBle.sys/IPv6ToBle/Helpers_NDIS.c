@@ -107,7 +107,7 @@ Environment:
 _Use_decl_annotations_
 NTSTATUS
 IPv6ToBleNDISPoolDataCreate(
-	_Out_    NDIS_POOL_DATA*	ndisPoolData,
+	_Outptr_result_maybenull_ NDIS_POOL_DATA**	ndisPoolData,
 	_In_opt_ UINT32				memoryTag
 )
 /*++
@@ -115,15 +115,16 @@ Routine Description:
 
 	Creates NDIS memory pool information required for allocating
 	NET_BUFFER_LIST structures, which are required to translate the user mode
-	data to kernel mode data.
+	data to kernel mode data, and the preallocated injection slabs.
 
 	This function is heavily based on the "KrnlHlprNDISPoolDataCreate" helper
 	function in the WFPSAMPLER sample driver from Microsoft.
 
 Arguments:
 
-	ndisPoolData - the ndisPoolData to create. This includes information for
-	the pools from which to allocate NET_BUFFER_LISTs and NET_BUFFERs.
+	ndisPoolData - receives the created ndisPoolData, or NULL on failure. This
+	includes information for the pools from which to allocate
+	NET_BUFFER_LISTs and NET_BUFFERs.
 
 Return Value:
 
@@ -133,10 +134,12 @@ Return Value:
 {
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_HELPERS_NDIS, "%!FUNC! Entry");
 
-
-	//NT_ASSERT(ndisPoolData);
+	NT_ASSERT(ndisPoolData);
 
 	NTSTATUS status = STATUS_SUCCESS;
+	NDIS_POOL_DATA* poolData = NULL;
+
+	*ndisPoolData = NULL;
 
 	//
 	// Step 1
@@ -144,26 +147,32 @@ Return Value:
 	// because this memory is for a network data packet that cannot be paged
 	// out (will be used in OS operations).
 	//
-	ndisPoolData = (NDIS_POOL_DATA*)ExAllocatePoolWithTag(NonPagedPoolNx,
-		                                                 sizeof(NDIS_POOL_DATA),
-		                                                 memoryTag
-	                                                     );
-	if (!ndisPoolData) {
+	poolData = (NDIS_POOL_DATA*)ExAllocatePoolWithTag(NonPagedPoolNx,
+		                                             sizeof(NDIS_POOL_DATA),
+		                                             memoryTag
+	                                                 );
+	if (!poolData) {
 		status = STATUS_INSUFFICIENT_RESOURCES;
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_NDIS, "NDIS_POOL_DATA memory allocation failed %!STATUS!", status);
 		goto Exit;
 	}
+	RtlZeroMemory(poolData, sizeof(NDIS_POOL_DATA));
 
 	//
 	// Step 2
-	// Populate the pools that the pool data structure contains
+	// Populate the pools that the pool data structure contains. On failure
+	// the pools are already purged, so only the structure is left to free.
 	//
-	status = IPv6ToBleNDISPoolDataPopulate(ndisPoolData, memoryTag);
-	if (!NT_SUCCESS(status) && ndisPoolData != NULL)
+	status = IPv6ToBleNDISPoolDataPopulate(poolData, memoryTag);
+	if (!NT_SUCCESS(status))
 	{
-		IPv6ToBleNDISPoolDataDestroy(ndisPoolData);
+		IPv6ToBleNDISPoolDataDestroy(poolData);
+		goto Exit;
 	}
 
+	// Only hand the structure back once it is fully populated
+	*ndisPoolData = poolData;
+
 Exit:
 
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_HELPERS_NDIS, "%!FUNC! Exit");
@@ -181,7 +190,8 @@ IPv6ToBleNDISPoolDataPopulate(
 Routine Description:
 
 	Populates an NDIS_POOL_DATA structure with the NET_BUFFER_LIST_POOL and
-	the NET_BUFFER_POOL.
+	the NET_BUFFER_POOL, then preallocates the injection slabs and their
+	NET_BUFFER_LISTs from the NET_BUFFER_LIST_POOL.
 
 	This function is heavily based on the "KrnlHlprNDISPoolDataPopulate" helper
 	function in the WFPSAMPLER sample driver from Microsoft.
@@ -272,6 +282,44 @@ Return Value:
 		goto Exit;
 	}
 
+	//
+	// Step 4
+	// Allocate the injection slabs, describe each one's buffer with an NBL,
+	// and put them all on the free list
+	//
+	ExInitializeSListHead(&ndisPoolData->injectSlabFreeList);
+
+	ndisPoolData->injectSlabs = (PINJECT_SLAB)ExAllocatePoolWithTag(NonPagedPoolNx,
+																	INJECT_SLAB_COUNT * sizeof(INJECT_SLAB),
+																	memoryTag
+																	);
+	if (!ndisPoolData->injectSlabs)
+	{
+		status = STATUS_INSUFFICIENT_RESOURCES;
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_NDIS, "Injection slab allocation failed %!STATUS!", status);
+		goto Exit;
+	}
+	RtlZeroMemory(ndisPoolData->injectSlabs, INJECT_SLAB_COUNT * sizeof(INJECT_SLAB));
+
+	for (ULONG i = 0; i < INJECT_SLAB_COUNT; i++)
+	{
+		PINJECT_SLAB slab = &ndisPoolData->injectSlabs[i];
+		size_t slabDataSize = sizeof(slab->data);
+
+		slab->NBL = IPv6ToBleNBLCreateFromBuffer(ndisPoolData->nblPoolHandle,
+												 slab->data,
+												 &slabDataSize
+												 );
+		if (!slab->NBL)
+		{
+			status = STATUS_INSUFFICIENT_RESOURCES;
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_NDIS, "Injection slab NBL allocation failed %!STATUS!", status);
+			goto Exit;
+		}
+
+		InterlockedPushEntrySList(&ndisPoolData->injectSlabFreeList, &slab->entry);
+	}
+
 Exit:
 
 	if (!NT_SUCCESS(status))
@@ -337,7 +385,8 @@ IPv6ToBleNDISPoolDataPurge(
 /*++
 Routine Description:
 
-	Cleans up memory pools inside an NDIS_POOL_DATA structure.
+	Cleans up the injection slabs and memory pools inside an NDIS_POOL_DATA
+	structure.
 
 	This function is heavily based on the "KrnlHlprNDISPoolDataPurge" helper
 	function in the WFPSAMPLER sample driver from Microsoft.
@@ -357,6 +406,24 @@ Return Value:
 
 	//NT_ASSERT(ndisPoolData);
 
+	// Free the injection slabs. Their NBLs came from the NBL pool, so this
+	// has to happen before the pools are freed.
+	if (ndisPoolData->injectSlabs)
+	{
+		for (ULONG i = 0; i < INJECT_SLAB_COUNT; i++)
+		{
+			NET_BUFFER_LIST* NBL = ndisPoolData->injectSlabs[i].NBL;
+			if (NBL)
+			{
+				IoFreeMdl(NET_BUFFER_FIRST_MDL(NET_BUFFER_LIST_FIRST_NB(NBL)));
+				FwpsFreeNetBufferList0(NBL);
+			}
+		}
+
+		ExFreePoolWithTag(ndisPoolData->injectSlabs, IPV6_TO_BLE_NDIS_TAG);
+		ndisPoolData->injectSlabs = NULL;
+	}
+
 	if (ndisPoolData->ndisHandle)
 	{
 		// Free the NB and NBL pools
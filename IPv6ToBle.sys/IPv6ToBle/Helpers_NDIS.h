@@ -42,7 +42,7 @@ _Check_return_
 _Success_(return == STATUS_SUCCESS)
 NTSTATUS
 IPv6ToBleNDISPoolDataCreate(
-	_Out_    NDIS_POOL_DATA*	ndisPoolData,
+	_Outptr_result_maybenull_ NDIS_POOL_DATA**	ndisPoolData,
 	_In_opt_ UINT32				memoryTag
 );
 
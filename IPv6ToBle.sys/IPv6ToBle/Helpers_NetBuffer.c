@@ -112,7 +112,7 @@ NTSTATUS
 IPv6ToBleNBLCopyToBuffer(
     _In_	NET_BUFFER_LIST*	NBL,
     _In_	UINT32				additionalSpace,
-    _Out_   BYTE*               outBuffer,
+    _Out_writes_bytes_to_(*outBufferSize, *outBufferSize)	BYTE*	outBuffer,
     _Inout_ UINT32*				outBufferSize
 )
 /*++
@@ -126,160 +126,420 @@ Routine Description:
 	
 	When the classify callout is registered at the IP_PACKET_V6 layer of the 
 	TCP/IP stack, the NBL that is passed to the classifyFn represents a 
-	complete IP packet. The IP header has been parsed and the NBL starts 
-	immediately after the IP header. Therefore, this function needs to
-	"retreat" the NBL to reclaim the IP header (re-advancing later before
-	returning).
+	complete IP packet. On the inbound path, the IP header has been parsed
+	and the NBL starts immediately after the IP header, so the copy has to
+	start additionalSpace bytes before the NBL's current data start.
 
-	This function is heavily based on the "KrnlHlprNBLCopyToBuffer" helper
-	function in the WFPSAMPLER sample driver from Microsoft.
+	The copy walks the NET_BUFFER's MDL chain and copies each piece straight
+	into the output buffer, so no pool memory is allocated per packet. The
+	IP header is normally still in the current MDL, in which case the NBL's
+	offsets are not touched at all; only if it starts in an earlier MDL do
+	we retreat (and later advance) the NET_BUFFER.
+
+	WFP indicates exactly one NET_BUFFER per NBL at the IP_PACKET layer, so
+	only the first NET_BUFFER is copied.
+
+	This function was originally based on the "KrnlHlprNBLCopyToBuffer"
+	helper function in the WFPSAMPLER sample driver from Microsoft.
 
 Arguments:
 
 	NBL - the NET_BUFFER_LIST to copy to the buffer.
 
-	size - the number of bytes copied to the array.
-
 	additionalSpace - any additional space needed in the buffer. In this case,
 	this is the IP header because the NBL passed in starts *after* the IP
 	header. This value is acquired during the classifyFn where the driver can
 	query the length of the IP header.
 
+	outBuffer - the buffer to copy the packet into.
+
+	outBufferSize - on input, the size of outBuffer in bytes. On output, the
+	number of bytes copied.
+
 Return Value:
 
-	Returns a pointer to the byte array if successful, NULL if not.
+	STATUS_SUCCESS if successful, STATUS_BUFFER_TOO_SMALL if the packet does
+	not fit in the output buffer, or another appropriate NTSTATUS error code.
 
 --*/
 {
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_HELPERS_NET_BUFFER, "%!FUNC! Entry");
+    TraceDataPath(TRACE_LEVEL_INFORMATION, TRACE_HELPERS_NET_BUFFER, "%!FUNC! Entry");
 
 	NTSTATUS status = STATUS_SUCCESS;
 
+	NET_BUFFER* netBuffer = NBL ? NET_BUFFER_LIST_FIRST_NB(NBL) : NULL;
+	BOOLEAN retreated = FALSE;
+	UINT32 bytesToCopy = 0;
+	UINT32 bytesCopied = 0;
+	UINT32 mdlsCopied = 0;
+
+	if (!netBuffer)
+	{
+		status = STATUS_INVALID_PARAMETER;
+		TraceDataPath(TRACE_LEVEL_ERROR, TRACE_HELPERS_NET_BUFFER, "NBL has no NET_BUFFER during %!FUNC! with %!STATUS!", status);
+		goto Exit;
+	}
+
 	//
 	// Step 1
-	// Prepare information for copying the bytes (num bytes to copy, num bytes
-	// copied, etc.)
+	// Work out how many bytes to copy and make sure they fit in the output
+	// buffer
 	//
-	UINT32 bytesToCopy = additionalSpace;
-	//*outBufferSize = 0;
+	status = RtlULongAdd(NET_BUFFER_DATA_LENGTH(netBuffer),
+						 additionalSpace,
+						 (ULONG*)&bytesToCopy
+						 );
+	if (!NT_SUCCESS(status))
+	{
+		TraceDataPath(TRACE_LEVEL_ERROR, TRACE_HELPERS_NET_BUFFER, "Packet size overflowed during %!FUNC! with %!STATUS!", status);
+		goto Exit;
+	}
 
-	//
-	// Step 2
-	// Retreat the NBL to "reclaim" the IP header (assuming sizeof(IP header)
-    // was passed in to the additional space parameter)
-	// 
-	NDIS_STATUS ndisStatus = NDIS_STATUS_SUCCESS;
-	ndisStatus = NdisRetreatNetBufferListDataStart(NBL,
-												   additionalSpace,
-												   0, 
-												   NULL,
-												   NULL
-											   	   );
-	if (ndisStatus != NDIS_STATUS_SUCCESS)
+	if (bytesToCopy > *outBufferSize)
 	{
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_NET_BUFFER, "Retreating NBL failed during %!FUNC! with %!STATUS!", status);
+		status = STATUS_BUFFER_TOO_SMALL;
+		TraceDataPath(TRACE_LEVEL_ERROR, TRACE_HELPERS_NET_BUFFER, "Packet of %u bytes does not fit in %u byte buffer during %!FUNC! with %!STATUS!", bytesToCopy, *outBufferSize, status);
 		goto Exit;
 	}
 
 	//
-	// Step 3
-	// Determine the number of bytes to copy by traversing the NET_BUFFER
-	// structures that are the children of the NET_BUFFER_LIST. Each NBL can
-	// have 1 or more NB children. 
-	// 
-	// Of note is that when the Windows Filtering Platform gives an NBL to the
-	// driver, representing a packet, the NBL has exactly one child NB.
+	// Step 2
+	// Find the MDL and offset where the IP header starts. If it is not in
+	// the current MDL, retreat the NET_BUFFER to reclaim it.
 	//
-	if (NBL) 
+	MDL* mdl = NET_BUFFER_CURRENT_MDL(netBuffer);
+	ULONG mdlOffset = NET_BUFFER_CURRENT_MDL_OFFSET(netBuffer);
+
+	if (mdlOffset >= additionalSpace)
 	{
-		for (NET_BUFFER* netBuffer = NET_BUFFER_LIST_FIRST_NB(NBL);
-			netBuffer;
-			netBuffer = NET_BUFFER_NEXT_NB(netBuffer))
+		mdlOffset -= additionalSpace;
+	}
+	else
+	{
+		NDIS_STATUS ndisStatus = NdisRetreatNetBufferDataStart(netBuffer,
+															   additionalSpace,
+															   0,
+															   NULL
+															   );
+		if (ndisStatus != NDIS_STATUS_SUCCESS)
 		{
-			bytesToCopy += NET_BUFFER_DATA_LENGTH(netBuffer);
+			status = STATUS_UNSUCCESSFUL;
+			TraceDataPath(TRACE_LEVEL_ERROR, TRACE_HELPERS_NET_BUFFER, "Retreating NET_BUFFER failed during %!FUNC! with %!STATUS!", status);
+			goto Exit;
 		}
+
+		retreated = TRUE;
+		mdl = NET_BUFFER_CURRENT_MDL(netBuffer);
+		mdlOffset = NET_BUFFER_CURRENT_MDL_OFFSET(netBuffer);
 	}
+
 	//
-	// Step 4
-	// Copy the data to the buffer for user mode
+	// Step 3
+	// Walk the MDL chain, copying each piece of the packet directly into the
+	// output buffer
 	//
-	if (NBL)
+	while (bytesCopied < bytesToCopy && mdl)
 	{
-		NET_BUFFER* netBuffer = NET_BUFFER_LIST_FIRST_NB(NBL);
+		ULONG mdlByteCount = MmGetMdlByteCount(mdl);
 
-		// Copy the data in each NET_BUFFER
-		for (UINT32 bytesCopied = 0;
-			bytesCopied < bytesToCopy && netBuffer;
-			netBuffer = NET_BUFFER_NEXT_NB(netBuffer))
+		if (mdlOffset < mdlByteCount)
 		{
-			BYTE* contiguousBuffer = 0;
-			BYTE* allocatedBuffer = 0;
-			UINT32 bytesNeeded = NET_BUFFER_DATA_LENGTH(netBuffer);
-
-			if (bytesNeeded)
-			{
-				// Allocate a buffer of zeroes to hold the data from the
-				// NET_BUFFER
-				allocatedBuffer = (BYTE*)ExAllocatePoolWithTag(NonPagedPoolNx,
-										(sizeof(BYTE) * bytesNeeded),
-										IPV6_TO_BLE_NBL_TAG
-									);
-				if (!allocatedBuffer)
-				{
-					status = (UINT32)STATUS_NO_MEMORY;
-                    TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_NET_BUFFER, "Memory allocation for NET_BUFFER data retrieval failed %!STATUS!", status);
-					goto Exit;
-				}
-
-				// Get the data from the NET_BUFFER
-				contiguousBuffer = (BYTE*)NdisGetDataBuffer(netBuffer,
-															bytesNeeded,
-															allocatedBuffer,
-															1, 
-															0
-															);
-				
-				// Copy the memory from this NET_BUFFER to the byte array to
-				// return (i.e. the packet to pass to usermode)
-				RtlCopyMemory(&outBuffer[bytesCopied],
-					contiguousBuffer ? contiguousBuffer : allocatedBuffer,
-					bytesNeeded
-				);
-
-				bytesCopied += bytesNeeded;
-
-				// Delete the allocated buffer
-				if (allocatedBuffer)
-				{
-					ExFreePoolWithTag((BYTE*)allocatedBuffer, 
-										IPV6_TO_BLE_NBL_TAG
+			BYTE* mdlAddress = (BYTE*)MmGetSystemAddressForMdlSafe(
+										mdl,
+										NormalPagePriority | MdlMappingNoExecute
 										);
-					allocatedBuffer = 0;
-				}
+			if (!mdlAddress)
+			{
+				status = STATUS_INSUFFICIENT_RESOURCES;
+				TraceDataPath(TRACE_LEVEL_ERROR, TRACE_HELPERS_NET_BUFFER, "Mapping MDL failed during %!FUNC! with %!STATUS!", status);
+				goto Exit;
 			}
+
+			UINT32 bytesInMdl = min(mdlByteCount - mdlOffset,
+									bytesToCopy - bytesCopied
+									);
+
+			RtlCopyMemory(&outBuffer[bytesCopied],
+						  &mdlAddress[mdlOffset],
+						  bytesInMdl
+						  );
+
+			bytesCopied += bytesInMdl;
+			mdlsCopied++;
 		}
+
+		mdlOffset = 0;
+		mdl = mdl->Next;
+	}
+
+	if (bytesCopied < bytesToCopy)
+	{
+		status = STATUS_DATA_ERROR;
+		TraceDataPath(TRACE_LEVEL_ERROR, TRACE_HELPERS_NET_BUFFER, "MDL chain ended after %u of %u bytes during %!FUNC! with %!STATUS!", bytesCopied, bytesToCopy, status);
+		goto Exit;
+	}
+
+	// Count whether the packet was contiguous (one MDL) or scattered
+	if (mdlsCopied <= 1)
+	{
+		IPV6_TO_BLE_STATISTICS_INCREMENT(copyContiguous);
+	}
+	else
+	{
+		IPV6_TO_BLE_STATISTICS_INCREMENT(copyScatter);
 	}
 
 Exit:
 	
-	// Advance the NBL to undo the retreat we did earlier, if the retreat was
-	// successful
-	if (ndisStatus == NDIS_STATUS_SUCCESS) 
+	// Advance the NET_BUFFER to undo the retreat we did earlier, if any
+	if (retreated)
 	{
-		NdisAdvanceNetBufferListDataStart(NBL,
-			                              additionalSpace,
-			                              FALSE,
-			                              NULL
-		                                  );
+		NdisAdvanceNetBufferDataStart(netBuffer,
+									  additionalSpace,
+									  FALSE,
+									  NULL
+									  );
 	}
 
-	// Free the packet if we failed, else report the size and return it
+	// Report the size on success
 	if (NT_SUCCESS(status))
 	{
-        *outBufferSize = bytesToCopy;
+        *outBufferSize = bytesCopied;
 	}
 
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_HELPERS_NET_BUFFER, "%!FUNC! Exit");
+    TraceDataPath(TRACE_LEVEL_INFORMATION, TRACE_HELPERS_NET_BUFFER, "%!FUNC! Exit");
 
 	return status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleNBLParseIpv6Header(
+	_In_	NET_BUFFER_LIST*	NBL,
+	_In_	UINT32				ipHeaderOffset,
+	_Out_	PIPV6_PACKET_INFO	packetInfo
+)
+/*++
+Routine Description:
+
+	Reads the fixed IPv6 header of a packet given to a classify callout and
+	extracts the fields the callouts make decisions on, in a single pass,
+	along with the UDP or TCP ports that follow it for the flow hash.
+
+	This is called for every classified packet, so it tries hard not to
+	touch the NBL's data offsets. On the outbound IP_PACKET layer the NBL is
+	positioned at the start of the IP header, so NdisGetDataBuffer can read
+	it directly (copying into a stack scratch area only if the header spans
+	more than one MDL).
+
+	On the inbound IP_PACKET layer the NBL has already been advanced past
+	the IP header. The header is still in the MDL chain, though, and almost
+	always in the current MDL, so we read it from there. Only if the header
+	starts in an earlier MDL do we fall back to a retreat/advance pair. The
+	ports are at the data start, so NdisGetDataBuffer reads them directly.
+
+	Both classify callouts call this once and use the result for every
+	later decision (destination lookup, protocol check, size check).
+
+Arguments:
+
+	NBL - the NET_BUFFER_LIST given to the classify callout. WFP indicates
+	exactly one NET_BUFFER per NBL at the IP_PACKET layer.
+
+	ipHeaderOffset - how far the NBL's data start is past the start of the
+	IP header: the ipHeaderSize metadata value on inbound, 0 on outbound.
+
+	packetInfo - receives the parsed header fields.
+
+Return Value:
+
+	STATUS_SUCCESS if the header was read and is an IPv6 header,
+	STATUS_INVALID_BUFFER_SIZE if the packet is too short to hold one,
+	or another appropriate NTSTATUS error code.
+
+--*/
+{
+	NTSTATUS status = STATUS_SUCCESS;
+
+	NET_BUFFER* netBuffer = NET_BUFFER_LIST_FIRST_NB(NBL);
+	UINT8 scratch[IPV6_HEADER_LENGTH + CLASSIFY_CORE_PORTS_LENGTH];
+	UINT8 portsScratch[CLASSIFY_CORE_PORTS_LENGTH];
+	UINT8* header = NULL;
+	UINT8* ports = NULL;
+
+	if (!netBuffer)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	//
+	// Step 1
+	// Get a pointer to the first 40 bytes of the IP header. On outbound,
+	// read the 4 bytes of ports after it too if the packet holds them.
+	//
+	if (ipHeaderOffset == 0)
+	{
+		ULONG readLength = IPV6_HEADER_LENGTH;
+		if (NET_BUFFER_DATA_LENGTH(netBuffer) >= IPV6_HEADER_LENGTH + CLASSIFY_CORE_PORTS_LENGTH)
+		{
+			readLength += CLASSIFY_CORE_PORTS_LENGTH;
+		}
+
+		header = (UINT8*)NdisGetDataBuffer(netBuffer,
+										   readLength,
+										   scratch,
+										   1,
+										   0
+										   );
+		if (header && readLength > IPV6_HEADER_LENGTH)
+		{
+			ports = header + IPV6_HEADER_LENGTH;
+		}
+	}
+	else if (ipHeaderOffset >= IPV6_HEADER_LENGTH &&
+			 NET_BUFFER_CURRENT_MDL_OFFSET(netBuffer) >= ipHeaderOffset)
+	{
+		// The whole IP header sits in front of the data start in the
+		// current MDL, so read it in place
+		UINT8* mdlAddress = (UINT8*)MmGetSystemAddressForMdlSafe(
+									NET_BUFFER_CURRENT_MDL(netBuffer),
+									NormalPagePriority | MdlMappingNoExecute
+									);
+		if (mdlAddress)
+		{
+			header = mdlAddress +
+					 NET_BUFFER_CURRENT_MDL_OFFSET(netBuffer) -
+					 ipHeaderOffset;
+		}
+	}
+	else if (ipHeaderOffset >= IPV6_HEADER_LENGTH)
+	{
+		// The header starts in an earlier MDL; retreat to it, copy it into
+		// the scratch area, and advance back
+		NDIS_STATUS ndisStatus = NdisRetreatNetBufferDataStart(netBuffer,
+															   ipHeaderOffset,
+															   0,
+															   NULL
+															   );
+		if (ndisStatus == NDIS_STATUS_SUCCESS)
+		{
+			header = (UINT8*)NdisGetDataBuffer(netBuffer,
+											   IPV6_HEADER_LENGTH,
+											   scratch,
+											   1,
+											   0
+											   );
+			if (header && header != scratch)
+			{
+				RtlCopyMemory(scratch, header, IPV6_HEADER_LENGTH);
+				header = scratch;
+			}
+
+			NdisAdvanceNetBufferDataStart(netBuffer,
+										  ipHeaderOffset,
+										  FALSE,
+										  NULL
+										  );
+		}
+	}
+
+	if (!header)
+	{
+		status = STATUS_INVALID_BUFFER_SIZE;
+		goto Exit;
+	}
+
+	//
+	// Step 2
+	// Pull the fields out of the header (see ClassifyCore.c)
+	//
+	if (!IPv6ToBleClassifyCoreParseHeader(header,
+										  NET_BUFFER_DATA_LENGTH(netBuffer) +
+										  ipHeaderOffset,
+										  packetInfo
+										  ))
+	{
+		status = STATUS_INVALID_PARAMETER;
+		goto Exit;
+	}
+
+	//
+	// Step 3
+	// Pull out the UDP or TCP ports. On inbound they are at the data start
+	// if the transport header directly follows the fixed header; if there
+	// are extension headers in between the packet is dropped anyway, so the
+	// ports are left 0.
+	//
+	if (ipHeaderOffset == IPV6_HEADER_LENGTH &&
+		NET_BUFFER_DATA_LENGTH(netBuffer) >= CLASSIFY_CORE_PORTS_LENGTH)
+	{
+		ports = (UINT8*)NdisGetDataBuffer(netBuffer,
+										  CLASSIFY_CORE_PORTS_LENGTH,
+										  portsScratch,
+										  1,
+										  0
+										  );
+	}
+
+	if (ports)
+	{
+		(VOID)IPv6ToBleClassifyCoreParsePorts(ports, packetInfo);
+	}
+
+Exit:
+
+	return status;
+}
+
+_Use_decl_annotations_
+UINT32
+IPv6ToBleNBLFlowHash(
+	const IPV6_PACKET_INFO*	packetInfo
+)
+/*++
+Routine Description:
+
+	Hashes the flow a classified packet belongs to, so user mode can spread
+	flows across workers without parsing the packet.
+
+	The flow is identified by the source address, destination address, and
+	flow label, as RFC 6437 describes, plus the UDP or TCP ports. Most
+	stacks leave the flow label 0, so without the ports every flow between
+	two devices would hash the same and land on the same listen channel.
+	The ports are 0 for packets that don't carry them directly after the
+	fixed header.
+
+	This uses 32-bit FNV-1a, which is cheap and spreads values that differ
+	only in their last bytes, as mesh addresses and ports do.
+
+Arguments:
+
+	packetInfo - the header fields parsed by IPv6ToBleNBLParseIpv6Header.
+
+Return Value:
+
+	The flow hash.
+
+--*/
+{
+	UINT32 hash = 2166136261;	// FNV offset basis
+
+	for (ULONG i = 0; i < IPV6_ADDRESS_LENGTH; i++)
+	{
+		hash = (hash ^ packetInfo->sourceAddress[i]) * 16777619;
+	}
+	for (ULONG i = 0; i < IPV6_ADDRESS_LENGTH; i++)
+	{
+		hash = (hash ^ packetInfo->destinationAddress[i]) * 16777619;
+	}
+	for (ULONG i = 0; i < 3; i++)
+	{
+		hash = (hash ^ ((packetInfo->flowLabel >> (i * 8)) & 0xFF)) * 16777619;
+	}
+	hash = (hash ^ (packetInfo->sourcePort >> 8)) * 16777619;
+	hash = (hash ^ (packetInfo->sourcePort & 0xFF)) * 16777619;
+	hash = (hash ^ (packetInfo->destinationPort >> 8)) * 16777619;
+	hash = (hash ^ (packetInfo->destinationPort & 0xFF)) * 16777619;
+
+	return hash;
 }
\ No newline at end of file
@@ -54,10 +54,35 @@ NTSTATUS
 IPv6ToBleNBLCopyToBuffer(
 	_In_	NET_BUFFER_LIST*	NBL,
     _In_	UINT32				additionalSpace,
-    _Out_   BYTE*               outBuffer,
+    _Out_writes_bytes_to_(*outBufferSize, *outBufferSize)	BYTE*	outBuffer,
 	_Inout_	UINT32*				outBufferSize	
 );
 
+//-----------------------------------------------------------------------------
+// Helper functions to read the IPv6 header of a classified packet and hash
+// its flow
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+_Check_return_
+_Success_(return == STATUS_SUCCESS)
+NTSTATUS
+IPv6ToBleNBLParseIpv6Header(
+	_In_	NET_BUFFER_LIST*	NBL,
+	_In_	UINT32				ipHeaderOffset,
+	_Out_	PIPV6_PACKET_INFO	packetInfo
+);
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+UINT32
+IPv6ToBleNBLFlowHash(
+	_In_	const IPV6_PACKET_INFO*	packetInfo
+);
+
 EXTERN_C_END
 
 #endif	// _HELPERS_NETBUFFER_H_
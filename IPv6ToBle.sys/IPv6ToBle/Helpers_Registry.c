@@ -243,6 +243,544 @@ Exit:
 	return status;
 }
 
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleRegistryRetrieveListenPendSettings(
+	_Inout_	ULONG*	depth,
+	_Inout_	ULONG*	dropPolicy,
+	_Inout_	ULONG*	channelCount
+)
+/*++
+Routine Description:
+
+	Reads the depth and drop policy of the listen pend queues, and the number
+	of listen channels (see Listen.c), from the driver's parameters key. The
+	INF file sets defaults for all three, but if any value is missing the
+	caller's default is left in place so that older installations keep
+	working.
+
+	A depth larger than LISTEN_PEND_QUEUE_MAX_DEPTH is clamped to it. An
+	unknown drop policy is treated as LISTEN_DROP_NEWEST. A channel count of
+	0 is treated as 1, and one larger than LISTEN_CHANNEL_MAX_COUNT is
+	clamped to it.
+
+Arguments:
+
+	depth - on input, the default depth; on output, the configured depth.
+
+	dropPolicy - on input, the default drop policy; on output, the configured
+	drop policy.
+
+	channelCount - on input, the default number of listen channels; on
+	output, the configured number.
+
+Return Value:
+
+	STATUS_SUCCESS if the operation was successful; appropriate NTSTATUS error
+	code otherwise.
+
+--*/
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_HELPERS_REGISTRY, "%!FUNC! Entry");
+
+	NTSTATUS status = STATUS_SUCCESS;
+	BOOLEAN parametersKeyOpened = FALSE;
+
+	// Open the parameters key
+	status = IPv6ToBleRegistryOpenParametersKey();
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_REGISTRY, "Could not open the parameters key, %!STATUS!", status);
+		goto Exit;
+	}
+	parametersKeyOpened = TRUE;
+
+	// Query the depth
+	DECLARE_CONST_UNICODE_STRING(depthValueName, L"Listen Pend Queue Depth");
+	ULONG depthValue = 0;
+	status = WdfRegistryQueryULong(gParametersKey,
+								   &depthValueName,
+								   &depthValue
+								   );
+	if (NT_SUCCESS(status))
+	{
+		if (depthValue > LISTEN_PEND_QUEUE_MAX_DEPTH)
+		{
+			TraceEvents(TRACE_LEVEL_WARNING, TRACE_HELPERS_REGISTRY, "Listen pend queue depth %u is too large, using %u", depthValue, LISTEN_PEND_QUEUE_MAX_DEPTH);
+			depthValue = LISTEN_PEND_QUEUE_MAX_DEPTH;
+		}
+		*depth = depthValue;
+	}
+	else
+	{
+		TraceEvents(TRACE_LEVEL_WARNING, TRACE_HELPERS_REGISTRY, "Could not load the listen pend queue depth, using default %u, %!STATUS!", *depth, status);
+	}
+
+	// Query the drop policy
+	DECLARE_CONST_UNICODE_STRING(dropPolicyValueName, L"Listen Pend Queue Drop Policy");
+	ULONG dropPolicyValue = 0;
+	status = WdfRegistryQueryULong(gParametersKey,
+								   &dropPolicyValueName,
+								   &dropPolicyValue
+								   );
+	if (NT_SUCCESS(status))
+	{
+		if (dropPolicyValue != LISTEN_DROP_NEWEST &&
+			dropPolicyValue != LISTEN_DROP_OLDEST)
+		{
+			TraceEvents(TRACE_LEVEL_WARNING, TRACE_HELPERS_REGISTRY, "Listen pend queue drop policy %u is invalid. It must be 0 to drop the newest packet or 1 to drop the oldest. Dropping newest.", dropPolicyValue);
+			dropPolicyValue = LISTEN_DROP_NEWEST;
+		}
+		*dropPolicy = dropPolicyValue;
+	}
+	else
+	{
+		TraceEvents(TRACE_LEVEL_WARNING, TRACE_HELPERS_REGISTRY, "Could not load the listen pend queue drop policy, using default %u, %!STATUS!", *dropPolicy, status);
+	}
+
+	// Query the channel count
+	DECLARE_CONST_UNICODE_STRING(channelCountValueName, L"Listen Channel Count");
+	ULONG channelCountValue = 0;
+	status = WdfRegistryQueryULong(gParametersKey,
+								   &channelCountValueName,
+								   &channelCountValue
+								   );
+	if (NT_SUCCESS(status))
+	{
+		if (channelCountValue == 0)
+		{
+			TraceEvents(TRACE_LEVEL_WARNING, TRACE_HELPERS_REGISTRY, "Listen channel count 0 is invalid, using 1");
+			channelCountValue = 1;
+		}
+		else if (channelCountValue > LISTEN_CHANNEL_MAX_COUNT)
+		{
+			TraceEvents(TRACE_LEVEL_WARNING, TRACE_HELPERS_REGISTRY, "Listen channel count %u is too large, using %u", channelCountValue, LISTEN_CHANNEL_MAX_COUNT);
+			channelCountValue = LISTEN_CHANNEL_MAX_COUNT;
+		}
+		*channelCount = channelCountValue;
+	}
+	else
+	{
+		TraceEvents(TRACE_LEVEL_WARNING, TRACE_HELPERS_REGISTRY, "Could not load the listen channel count, using default %u, %!STATUS!", *channelCount, status);
+	}
+
+	// Missing values are not an error
+	status = STATUS_SUCCESS;
+
+Exit:
+
+	if (parametersKeyOpened)
+	{
+		WdfRegistryClose(gParametersKey);
+	}
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_HELPERS_REGISTRY, "%!FUNC! Exit");
+
+	return status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleRegistryRetrievePacketTraceSettings(
+	_Inout_	ULONG*	dataPathTracing,
+	_Inout_	ULONG*	sampleRate
+)
+/*++
+Routine Description:
+
+	Reads whether the data path WPP trace points are on, and the packet trace
+	sample rate (see PacketTrace.c), from the driver's parameters key. As with
+	the listen pend settings, a missing value leaves the caller's default in
+	place.
+
+Arguments:
+
+	dataPathTracing - on input, the default; on output, nonzero if the data
+	path trace points are on.
+
+	sampleRate - on input, the default; on output, the configured sample
+	rate. 0 turns sampling off.
+
+Return Value:
+
+	STATUS_SUCCESS if the operation was successful; appropriate NTSTATUS error
+	code otherwise.
+
+--*/
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_HELPERS_REGISTRY, "%!FUNC! Entry");
+
+	NTSTATUS status = STATUS_SUCCESS;
+	BOOLEAN parametersKeyOpened = FALSE;
+
+	// Open the parameters key
+	status = IPv6ToBleRegistryOpenParametersKey();
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_REGISTRY, "Could not open the parameters key, %!STATUS!", status);
+		goto Exit;
+	}
+	parametersKeyOpened = TRUE;
+
+	// Query the data path tracing flag
+	DECLARE_CONST_UNICODE_STRING(dataPathTracingValueName, L"Data Path Tracing");
+	ULONG dataPathTracingValue = 0;
+	status = WdfRegistryQueryULong(gParametersKey,
+								   &dataPathTracingValueName,
+								   &dataPathTracingValue
+								   );
+	if (NT_SUCCESS(status))
+	{
+		*dataPathTracing = dataPathTracingValue;
+	}
+	else
+	{
+		TraceEvents(TRACE_LEVEL_WARNING, TRACE_HELPERS_REGISTRY, "Could not load the data path tracing flag, using default %u, %!STATUS!", *dataPathTracing, status);
+	}
+
+	// Query the sample rate
+	DECLARE_CONST_UNICODE_STRING(sampleRateValueName, L"Packet Trace Sample Rate");
+	ULONG sampleRateValue = 0;
+	status = WdfRegistryQueryULong(gParametersKey,
+								   &sampleRateValueName,
+								   &sampleRateValue
+								   );
+	if (NT_SUCCESS(status))
+	{
+		*sampleRate = sampleRateValue;
+	}
+	else
+	{
+		TraceEvents(TRACE_LEVEL_WARNING, TRACE_HELPERS_REGISTRY, "Could not load the packet trace sample rate, using default %u, %!STATUS!", *sampleRate, status);
+	}
+
+	// Missing values are not an error
+	status = STATUS_SUCCESS;
+
+Exit:
+
+	if (parametersKeyOpened)
+	{
+		WdfRegistryClose(gParametersKey);
+	}
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_HELPERS_REGISTRY, "%!FUNC! Exit");
+
+	return status;
+}
+
+//
+// Computes the CRC-32 (IEEE 802.3) of a buffer, used to validate the binary
+// list values. Lists are small and only read at driver entry and written
+// after changes, so a bitwise loop is fast enough and needs no table.
+//
+static
+ULONG
+IPv6ToBleRegistryCrc32(
+	_In_reads_bytes_(length)	const BYTE*	buffer,
+	_In_						SIZE_T		length
+)
+{
+	ULONG crc = 0xFFFFFFFF;
+
+	for (SIZE_T i = 0; i < length; i++)
+	{
+		crc ^= buffer[i];
+		for (ULONG bit = 0; bit < 8; bit++)
+		{
+			crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+		}
+	}
+
+	return ~crc;
+}
+
+//
+// Allocates a runtime list entry for an address loaded from the registry and
+// inserts it into the list. The caller holds gRuntimeListWriteLock.
+//
+static
+NTSTATUS
+IPv6ToBleRegistryInsertListEntry(
+	_In_	ULONG			TargetList,
+	_In_	const IN6_ADDR*	ipv6Address,
+	_In_	ULONG			scopeId
+)
+{
+	if (TargetList == WHITE_LIST)
+	{
+		PWHITE_LIST_ENTRY newWhiteListEntry = (PWHITE_LIST_ENTRY)ExAllocatePoolWithTag(
+												NonPagedPoolNx,
+												sizeof(WHITE_LIST_ENTRY),
+												IPV6_TO_BLE_WHITE_LIST_TAG
+											   );
+		if (!newWhiteListEntry)
+		{
+			TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_REGISTRY, "New white list entry allocation failed during %!FUNC! with this error code: %!STATUS!", STATUS_INSUFFICIENT_RESOURCES);
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+
+		// Add the entry to the list
+		InsertHeadList(gWhiteListHead, &newWhiteListEntry->listEntry);
+
+		// Insert the address into the entry
+		newWhiteListEntry->ipv6Address = *ipv6Address;
+		newWhiteListEntry->scopeId = scopeId;
+	}
+	else
+	{
+		PMESH_LIST_ENTRY newMeshListEntry = (PMESH_LIST_ENTRY)ExAllocatePoolWithTag(
+												NonPagedPoolNx,
+												sizeof(MESH_LIST_ENTRY),
+												IPV6_TO_BLE_MESH_LIST_TAG
+											 );
+		if (!newMeshListEntry)
+		{
+			TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_REGISTRY, "New mesh list entry allocation failed during %!FUNC! with this error code: %!STATUS!", STATUS_INSUFFICIENT_RESOURCES);
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+
+		// Add the entry to the list
+		InsertHeadList(gMeshListHead, &newMeshListEntry->listEntry);
+
+		// Insert the address into the entry
+		newMeshListEntry->ipv6Address = *ipv6Address;
+		newMeshListEntry->scopeId = scopeId;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+//
+// Loads a runtime list from its binary value (see REGISTRY_LIST_BLOB_HEADER
+// in Driver.h) and publishes its snapshot straight from the value's packed
+// entries. The whole value is validated before any entry is inserted, and
+// STATUS_FILE_CORRUPT_ERROR means the value is unusable and the legacy value
+// should be read instead. The caller has opened the list key and holds
+// gRuntimeListWriteLock.
+//
+static
+NTSTATUS
+IPv6ToBleRegistryLoadListBlob(
+	_In_	ULONG	TargetList
+)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+
+	WDFKEY listKey = (TargetList == WHITE_LIST ? gWhiteListKey : gMeshListKey);
+
+	DECLARE_CONST_UNICODE_STRING(whiteListBlobValueName, L"WhiteListBinary");
+	DECLARE_CONST_UNICODE_STRING(meshListBlobValueName, L"MeshListBinary");
+	const UNICODE_STRING listBlobValueName = (TargetList == WHITE_LIST ? whiteListBlobValueName : meshListBlobValueName);
+
+	PREGISTRY_LIST_BLOB_HEADER blob = NULL;
+	ULONG blobLength = 0;
+	ULONG valueType = REG_NONE;
+
+	// Query the size of the value first. Fails with
+	// STATUS_OBJECT_NAME_NOT_FOUND if the list was never stored in binary.
+	status = WdfRegistryQueryValue(listKey,
+								   &listBlobValueName,
+								   0,
+								   NULL,
+								   &blobLength,
+								   &valueType
+								   );
+	if (status != STATUS_BUFFER_OVERFLOW && !NT_SUCCESS(status))
+	{
+		return status;
+	}
+
+	if (valueType != REG_BINARY || blobLength < sizeof(REGISTRY_LIST_BLOB_HEADER))
+	{
+		TraceEvents(TRACE_LEVEL_WARNING, TRACE_HELPERS_REGISTRY, "Binary list value has type %u and length %u, ignoring it", valueType, blobLength);
+		return STATUS_FILE_CORRUPT_ERROR;
+	}
+
+	blob = (PREGISTRY_LIST_BLOB_HEADER)ExAllocatePoolWithTag(PagedPool,
+															  blobLength,
+															  IPV6_TO_BLE_REGISTRY_TAG
+															  );
+	if (!blob)
+	{
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_REGISTRY, "Allocating %u bytes for the binary list value failed %!STATUS!", blobLength, status);
+		return status;
+	}
+
+	status = WdfRegistryQueryValue(listKey,
+								   &listBlobValueName,
+								   blobLength,
+								   blob,
+								   &blobLength,
+								   &valueType
+								   );
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_REGISTRY, "Querying the binary list value failed %!STATUS!", status);
+		goto Exit;
+	}
+
+	// Validate the header and the checksum of the entries
+	PRUNTIME_LIST_SNAPSHOT_ENTRY entries = (PRUNTIME_LIST_SNAPSHOT_ENTRY)(blob + 1);
+	SIZE_T entriesLength = blobLength - sizeof(REGISTRY_LIST_BLOB_HEADER);
+
+	if (blob->version != REGISTRY_LIST_BLOB_VERSION ||
+		blob->entryCount == 0 ||
+		entriesLength != (SIZE_T)blob->entryCount * sizeof(RUNTIME_LIST_SNAPSHOT_ENTRY) ||
+		blob->crc32 != IPv6ToBleRegistryCrc32((const BYTE*)entries, entriesLength))
+	{
+		status = STATUS_FILE_CORRUPT_ERROR;
+		TraceEvents(TRACE_LEVEL_WARNING, TRACE_HELPERS_REGISTRY, "Binary list value version %u with %u entries failed validation %!STATUS!", blob->version, blob->entryCount, status);
+		goto Exit;
+	}
+
+	for (ULONG i = 0; i < blob->entryCount; i++)
+	{
+		status = IPv6ToBleRegistryInsertListEntry(TargetList,
+												  &entries[i].ipv6Address,
+												  entries[i].scopeId
+												  );
+		if (!NT_SUCCESS(status))
+		{
+			goto Exit;
+		}
+	}
+
+	// The entries are already in snapshot form, so index them as they are
+	status = IPv6ToBleRuntimeListPublishSnapshotFromEntries(TargetList,
+															entries,
+															blob->entryCount
+															);
+	if (!NT_SUCCESS(status))
+	{
+		goto Exit;
+	}
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_HELPERS_REGISTRY, "Loaded %u entries from the binary list value", blob->entryCount);
+
+Exit:
+
+	ExFreePoolWithTag(blob, IPV6_TO_BLE_REGISTRY_TAG);
+
+	return status;
+}
+
+//
+// Loads a runtime list from its legacy REG_MULTI_SZ value of address strings,
+// written by earlier versions of the driver. The caller has opened the list
+// key and holds gRuntimeListWriteLock.
+//
+static
+NTSTATUS
+IPv6ToBleRegistryLoadLegacyList(
+	_In_	ULONG	TargetList
+)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+
+	WDFCOLLECTION listAddresses = NULL;
+	WDF_OBJECT_ATTRIBUTES addressStringsAttributes;
+
+	ULONG i;
+	ULONG count;
+
+	IN6_ADDR ipv6AddressStorage;
+
+	// Declare the name of the value we're querying from the key
+	DECLARE_CONST_UNICODE_STRING(whiteListValueName, L"WhiteList");
+	DECLARE_CONST_UNICODE_STRING(meshListValueName, L"MeshList");
+	const UNICODE_STRING listValueName = (TargetList == WHITE_LIST ? whiteListValueName : meshListValueName);
+
+	// Create a collection to store the retrieved list addresses
+	status = WdfCollectionCreate(WDF_NO_OBJECT_ATTRIBUTES,
+		                         &listAddresses
+	                             );
+	if (!NT_SUCCESS(status))
+	{
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_REGISTRY, "WDFCOLLECTION creation failed during %!FUNC! with %!STATUS!", status);
+		goto Exit;
+	}
+
+	// Set the collection to be the parent of the retrieved string objects
+	WDF_OBJECT_ATTRIBUTES_INIT(&addressStringsAttributes);
+	addressStringsAttributes.ParentObject = listAddresses;
+
+	// Query the list key. Fails first time driver is installed or if the
+	// user purged the list and rebooted because the key exists but is empty.
+	status = WdfRegistryQueryMultiString(TargetList == WHITE_LIST ? gWhiteListKey : gMeshListKey,
+										 &listValueName,
+										 &addressStringsAttributes,
+										 listAddresses
+										 );
+	if (!NT_SUCCESS(status))
+	{
+		// If the key is empty, status will be STATUS_RESOURCE_DATA_NOT_FOUND.
+		TraceEvents(TRACE_LEVEL_WARNING, TRACE_HELPERS_REGISTRY, "Querying %s list failed because it was empty %!STATUS!", TargetList == WHITE_LIST ? "white" : "mesh", status);
+		goto Exit;
+	}
+
+	// Since the list is non-empty, we can walk the list, get the strings, and
+	// assign them to the context.
+	count = WdfCollectionGetCount(listAddresses);
+	for (i = 0; i < count; i++)
+	{
+
+		// Get the string from the collection retrieved from the registry. It
+        // should be null-terminated already if it was stored there correctly
+        // in the first place.
+		DECLARE_UNICODE_STRING_SIZE(currentIpv6Address, INET6_ADDRSTRLEN);
+		WDFSTRING currentWdfString = (WDFSTRING)WdfCollectionGetItem(
+			                              listAddresses,
+			                              i
+		                              );
+		WdfStringGetUnicodeString(currentWdfString, &currentIpv6Address);
+
+        // Defensively null-terminate the string
+        currentIpv6Address.Length = min(currentIpv6Address.Length,
+                                        currentIpv6Address.MaximumLength - sizeof(WCHAR)
+                                        );
+        currentIpv6Address.Buffer[currentIpv6Address.Length / sizeof(WCHAR)] = UNICODE_NULL;
+
+        // Convert the string to its 16-byte value and scope ID
+		ULONG scopeId = 0;
+		USHORT port = 0;
+        status = RtlIpv6StringToAddressExW(currentIpv6Address.Buffer,
+                                          &ipv6AddressStorage,
+										  &scopeId,
+										  &port
+                                          );
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_REGISTRY, "Converting IPv6 string to address failed during %!FUNC! with %!STATUS!", status);
+            goto Exit;
+        }
+
+        // Create the list entry and add it
+		status = IPv6ToBleRegistryInsertListEntry(TargetList,
+												  &ipv6AddressStorage,
+												  scopeId
+												  );
+		if (!NT_SUCCESS(status))
+		{
+			goto Exit;
+		}
+
+		// Zero out the storage structure for next time
+		RtlZeroMemory(&ipv6AddressStorage, sizeof(IN6_ADDR));
+	}
+
+Exit:
+
+    // Clean up the collection object and its children
+    if (listAddresses)
+    {
+        WdfObjectDelete(listAddresses);
+    }
+
+	return status;
+}
+
 _Use_decl_annotations_
 NTSTATUS
 IPv6ToBleRegistryRetrieveRuntimeList(
@@ -255,12 +793,19 @@ Routine Description:
 	values in it, assign them to the runtime context so we don't have to keep
 	accessing the registry.
 
-    This function is only called from DriverEntry so it should be called at
-    PASSIVE_LEVEL.
+	The list is read from its REG_BINARY value, whose packed entries become
+	the list's snapshot directly. If that value is missing or fails
+	validation, the REG_MULTI_SZ value written by earlier versions of the
+	driver is read instead, and a flush is scheduled so the list is
+	rewritten in the binary format.
+
+    This function is only called from the driver start work item (see
+    Driver.c), at PASSIVE_LEVEL.
 
 Arguments:
 
-	None. Accesses global variables defined in Driver.h.
+	TargetList - Determines which runtime list on which to operate. 0 for white
+		list, 1 for mesh list.
 
 Return Value:
 
@@ -281,16 +826,9 @@ Return Value:
 
 	NTSTATUS status = STATUS_SUCCESS;
 
-	WDFCOLLECTION listAddresses = NULL;
-	WDF_OBJECT_ATTRIBUTES addressStringsAttributes;
-
-	ULONG i;
-	ULONG count;
-
     BOOLEAN parametersKeyOpened = FALSE;
     BOOLEAN listKeyOpened = FALSE;
-
-	IN6_ADDR ipv6AddressStorage;
+    BOOLEAN writeLockAcquired = FALSE;
 
 	// Validate input
 	if (TargetList != WHITE_LIST && TargetList != MESH_LIST)
@@ -302,33 +840,13 @@ Return Value:
 
 	//
 	// Step 1
-	// Retrieve the list key. It is a REG_MULTI_SZ key, or multi strings
-	// key. Assign its string contents to the runtime context for the device.
+	// Open the list key.
 	// 
-	// NOTE: If this operation fails for the white list, DriverEntry skips to the
-	// mesh list since there may be something there even if the white list is 
+	// NOTE: If loading the white list fails, DriverEntry skips to the mesh
+	// list since there may be something there even if the white list is
 	// empty.
 	//
 
-	// Declare the name of the value we're querying from the key
-	DECLARE_CONST_UNICODE_STRING(whiteListValueName, L"WhiteList");
-	DECLARE_CONST_UNICODE_STRING(meshListValueName, L"MeshList");
-	const UNICODE_STRING listValueName = (TargetList == WHITE_LIST ? whiteListValueName : meshListValueName);
-
-	// Create a collection to store the retrieved white list addresses
-	status = WdfCollectionCreate(WDF_NO_OBJECT_ATTRIBUTES,
-		                         &listAddresses
-	                             );
-	if (!NT_SUCCESS(status))
-	{
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_REGISTRY, "WDFCOLLECTION creation failed during %!FUNC! with %!STATUS!", status);
-		goto Exit;
-	}
-
-	// Set the collection to be the parent of the retrieved string objects
-	WDF_OBJECT_ATTRIBUTES_INIT(&addressStringsAttributes);
-	addressStringsAttributes.ParentObject = listAddresses;
-
     // Open the parent key    
     status = IPv6ToBleRegistryOpenParametersKey();
     if (!NT_SUCCESS(status))
@@ -356,136 +874,42 @@ Return Value:
 	}	
 	listKeyOpened = TRUE;
 
-	// Query the list key. Fails first time driver is installed or if the
-	// user purged the list and rebooted because the key exists but is empty.
-	if (TargetList == WHITE_LIST)
-	{
-		status = WdfRegistryQueryMultiString(gWhiteListKey,
-											 &listValueName,
-											 &addressStringsAttributes,
-											 listAddresses
-											 );
-		if (!NT_SUCCESS(status))
-		{
-			// If the key is empty, status will be STATUS_RESOURCE_DATA_NOT_FOUND.
-			TraceEvents(TRACE_LEVEL_WARNING, TRACE_HELPERS_REGISTRY, "Querying white list failed because it was empty %!STATUS!", status);
-			goto Exit;
-		}
-	}
-	else
-	{
-		status = WdfRegistryQueryMultiString(gMeshListKey,
-											 &listValueName,
-											 &addressStringsAttributes,
-											 listAddresses
-											 );
-		if (!NT_SUCCESS(status))
-		{
-			// If the key is empty, status will be STATUS_RESOURCE_DATA_NOT_FOUND.
-			TraceEvents(TRACE_LEVEL_WARNING, TRACE_HELPERS_REGISTRY, "Querying mesh list failed because it was empty %!STATUS!", status);
-			goto Exit;
-		}
-	}
-	
-
 	//
 	// Step 2
-	// Set the list key's contents to the runtime list. We don't have 
-	// to worry about synchronizing access to the lists because this function 
-	// is either called from DriverEntry, or later from the context of the 
-	// EvtDeviceIoControl callback, and access to those is synchronized by the
-	// framework.
+	// Load the list key's contents into the runtime list, holding the runtime
+	// list write lock like any other change to the lists. Fall back to the
+	// legacy value if there is no usable binary value.
 	//
+	WdfWaitLockAcquire(gRuntimeListWriteLock, NULL);
+	writeLockAcquired = TRUE;
 
-	// Since the list is non-empty, we can walk the list, get the strings, and
-	// assign them to the context. No need for synchronization because this
-	// function is called from DriverEntry, which is synchronized.
-	count = WdfCollectionGetCount(listAddresses);
-	for (i = 0; i < count; i++)
+	status = IPv6ToBleRegistryLoadListBlob(TargetList);
+	if (status == STATUS_OBJECT_NAME_NOT_FOUND ||
+		status == STATUS_FILE_CORRUPT_ERROR)
 	{
-
-		// Get the string from the collection retrieved from the registry. It
-        // should be null-terminated already if it was stored there correctly
-        // in the first place.
-		DECLARE_UNICODE_STRING_SIZE(currentIpv6Address, INET6_ADDRSTRLEN);
-		WDFSTRING currentWdfString = (WDFSTRING)WdfCollectionGetItem(
-			                              listAddresses,
-			                              i
-		                              );
-		WdfStringGetUnicodeString(currentWdfString, &currentIpv6Address);
-
-        // Defensively null-terminate the string
-        currentIpv6Address.Length = min(currentIpv6Address.Length,
-                                        currentIpv6Address.MaximumLength - sizeof(WCHAR)
-                                        );
-        currentIpv6Address.Buffer[currentIpv6Address.Length / sizeof(WCHAR)] = UNICODE_NULL;
-
-        // Convert the string to its 16-byte value and scope ID
-		ULONG scopeId = 0;
-		USHORT port = 0;
-        status = RtlIpv6StringToAddressExW(currentIpv6Address.Buffer,
-                                          &ipv6AddressStorage,
-										  &scopeId,
-										  &port
-                                          );
-
-        // Create the list entry and add it
-        if (NT_SUCCESS(status))
+		status = IPv6ToBleRegistryLoadLegacyList(TargetList);
+		if (!NT_SUCCESS(status))
 		{
-			if (TargetList == WHITE_LIST)
-			{
-				PWHITE_LIST_ENTRY newWhiteListEntry = (PWHITE_LIST_ENTRY)ExAllocatePoolWithTag(
-														NonPagedPoolNx,
-														sizeof(WHITE_LIST_ENTRY),
-														IPV6_TO_BLE_WHITE_LIST_TAG
-													   );
-				if (!newWhiteListEntry)
-				{
-					status = STATUS_INSUFFICIENT_RESOURCES;
-					TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_REGISTRY, "New white list entry allocation failed during %!FUNC! with this error code: %!STATUS!", status);
-					goto Exit;
-				}
-
-				// Add the entry to the list
-				InsertHeadList(gWhiteListHead, &newWhiteListEntry->listEntry);
-
-				// Insert the address into the entry
-				newWhiteListEntry->ipv6Address = ipv6AddressStorage;
-				newWhiteListEntry->scopeId = scopeId;
-			}
-			else
-			{
-				PMESH_LIST_ENTRY newMeshListEntry = (PMESH_LIST_ENTRY)ExAllocatePoolWithTag(
-														NonPagedPoolNx,
-														sizeof(MESH_LIST_ENTRY),
-														IPV6_TO_BLE_MESH_LIST_TAG
-													 );
-				if (!newMeshListEntry)
-				{
-					status = STATUS_INSUFFICIENT_RESOURCES;
-					TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_REGISTRY, "New mesh list entry allocation failed during %!FUNC! with this error code: %!STATUS!", status);
-					goto Exit;
-				}
-
-				// Add the entry to the list
-				InsertHeadList(gMeshListHead, &newMeshListEntry->listEntry);
-
-				// Insert the address into the entry
-				newMeshListEntry->ipv6Address = ipv6AddressStorage;
-				newMeshListEntry->scopeId = scopeId;
-			}            
+			goto Exit;
 		}
-        else
-        {
-            TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_REGISTRY, "Converting IPv6 string to address failed during %!FUNC! with %!STATUS!", status);
-            goto Exit;
-        }
 
-		// Zero out the storage structure for next time
-		RtlZeroMemory(&ipv6AddressStorage, sizeof(IN6_ADDR));
+		// Rewrite the list in the binary format
+		IPv6ToBleRegistryScheduleListFlush(TargetList);
+
+		//
+		// Step 3
+		// Publish a snapshot of the loaded list for the classify callouts.
+		// The binary value publishes its own snapshot as it loads.
+		//
+		status = IPv6ToBleRuntimeListPublishSnapshot(TargetList);
 	}
 
 Exit:
+    if (writeLockAcquired)
+    {
+        WdfWaitLockRelease(gRuntimeListWriteLock);
+    }
+
     // Clean up any memory allocated if we failed at some point
     if (!NT_SUCCESS(status))
     {
@@ -509,12 +933,6 @@ Exit:
 		}        
     }
 
-    // Clean up the collection object and its children
-    if (listAddresses)
-    {
-        WdfObjectDelete(listAddresses);
-    }
-
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_HELPERS_REGISTRY, "%!FUNC! Exit");
 
     return status;
@@ -528,12 +946,17 @@ IPv6ToBleRegistryAssignRuntimeList(
 /*++
 Routine Description:
 
-    Assigns the runtime white list to the registry and overwrites what is
-    there. Converts the byte values used during runtime back to string forms
-    for storage.
+    Assigns the runtime list to the registry and overwrites what is there.
+    The addresses are packed into one REG_BINARY value with a checksum (see
+    REGISTRY_LIST_BLOB_HEADER in Driver.h), so the list is stored with a
+    single small write and no string conversions. Once the binary value is
+    written, the legacy REG_MULTI_SZ value is removed so it can't be read
+    in place of a newer list.
 
-    This function is called from the periodic timer callback function, which
-    is called at DISPATCH_LEVEL.
+    This function is called at PASSIVE_LEVEL from the registry flush work
+    item and from driver unload. It takes gRuntimeListWriteLock for the
+    whole flush, which is one small registry write, so list changes wait
+    for it.
 
 Arguments:
 
@@ -551,8 +974,8 @@ Return Value:
     NTSTATUS status = STATUS_SUCCESS;
     BOOLEAN parametersKeyOpened = FALSE;
     BOOLEAN listKeyOpened = FALSE;  
-    WDFCOLLECTION addressCollection = { 0 };
-    WDF_OBJECT_ATTRIBUTES attributes;
+    BOOLEAN writeLockAcquired = FALSE;
+    PREGISTRY_LIST_BLOB_HEADER blob = NULL;
 
 	// Validate input
 	if (TargetList != WHITE_LIST && TargetList != MESH_LIST)
@@ -562,30 +985,75 @@ Return Value:
 		goto Exit;
 	}
 
+    PLIST_ENTRY listHead = (TargetList == WHITE_LIST ? gWhiteListHead : gMeshListHead);
+
     //
     // Step 1
-    // Check for empty list (counts as success)
+    // Take the runtime list write lock and hold it until the value is
+    // written, then check for empty list (counts as success). Holding it
+    // across the write keeps a removal that empties the list, and deletes
+    // the list key, from landing between the copy and the write, which
+    // would re-create the key with entries that are gone.
     //
-	if (TargetList == WHITE_LIST)
-	{
-		if (IsListEmpty(gWhiteListHead))
-		{
-			TraceEvents(TRACE_LEVEL_WARNING, TRACE_HELPERS_REGISTRY, "White list is empty - nothing to write to registry %!STATUS!", status);
-			goto Exit;
-		}
-	} 
-	else
+    WdfWaitLockAcquire(gRuntimeListWriteLock, NULL);
+    writeLockAcquired = TRUE;
+
+	if (IsListEmpty(listHead))
 	{
-		if (IsListEmpty(gMeshListHead))
-		{
-			TraceEvents(TRACE_LEVEL_WARNING, TRACE_HELPERS_REGISTRY, "Mesh list is empty - nothing to write to registry %!STATUS!", status);
-			goto Exit;
-		}
+		TraceEvents(TRACE_LEVEL_WARNING, TRACE_HELPERS_REGISTRY, "%s list is empty - nothing to write to registry %!STATUS!", TargetList == WHITE_LIST ? "White" : "Mesh", status);
+		goto Exit;
 	}
-    
 
     //
     // Step 2
+    // Pack the list's addresses into the binary value
+    //
+    ULONG entryCount = 0;
+    for (PLIST_ENTRY entry = listHead->Flink; entry != listHead; entry = entry->Flink)
+    {
+        entryCount++;
+    }
+
+    ULONG blobLength = sizeof(REGISTRY_LIST_BLOB_HEADER) +
+                       entryCount * sizeof(RUNTIME_LIST_SNAPSHOT_ENTRY);
+
+    blob = (PREGISTRY_LIST_BLOB_HEADER)ExAllocatePoolWithTag(PagedPool,
+                                                              blobLength,
+                                                              IPV6_TO_BLE_REGISTRY_TAG
+                                                              );
+    if (!blob)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_REGISTRY, "Allocating %u bytes for the binary list value failed %!STATUS!", blobLength, status);
+        goto Exit;
+    }
+
+    PRUNTIME_LIST_SNAPSHOT_ENTRY entries = (PRUNTIME_LIST_SNAPSHOT_ENTRY)(blob + 1);
+    ULONG i = 0;
+    for (PLIST_ENTRY entry = listHead->Flink; entry != listHead; entry = entry->Flink, i++)
+    {
+        if (TargetList == WHITE_LIST)
+        {
+            PWHITE_LIST_ENTRY whiteListEntry = CONTAINING_RECORD(entry, WHITE_LIST_ENTRY, listEntry);
+            entries[i].ipv6Address = whiteListEntry->ipv6Address;
+            entries[i].scopeId = whiteListEntry->scopeId;
+        }
+        else
+        {
+            PMESH_LIST_ENTRY meshListEntry = CONTAINING_RECORD(entry, MESH_LIST_ENTRY, listEntry);
+            entries[i].ipv6Address = meshListEntry->ipv6Address;
+            entries[i].scopeId = meshListEntry->scopeId;
+        }
+    }
+
+    blob->version = REGISTRY_LIST_BLOB_VERSION;
+    blob->entryCount = entryCount;
+    blob->crc32 = IPv6ToBleRegistryCrc32((const BYTE*)entries,
+                                         entryCount * sizeof(RUNTIME_LIST_SNAPSHOT_ENTRY)
+                                         );
+
+    //
+    // Step 3
     // Open the key
     //
 
@@ -597,7 +1065,6 @@ Return Value:
     }
     parametersKeyOpened = TRUE;
 
-    // Open the list key
 	// Open the list key
 	if (TargetList == WHITE_LIST)
 	{
@@ -617,127 +1084,39 @@ Return Value:
 	}
     listKeyOpened = TRUE;
 
-    //
-    // Step 3
-    // Create the collection object that will be
-    // assigned to the key (it is a collection of strings; the key is a 
-    // REG_MULTI_SZ key)
-    //
-    status = WdfCollectionCreate(WDF_NO_OBJECT_ATTRIBUTES, &addressCollection);
-    if (!NT_SUCCESS(status))
-    {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_REGISTRY, "WDFCOLLECTION creation failed during %!FUNC! with %!STATUS!", status);
-        goto Exit;
-    }
-
     //
     // Step 4
-    // Traverse the list and add each entry's IPv6 address to the WDFCOLLECTION
-    //
-	PLIST_ENTRY entry = TargetList == WHITE_LIST ? gWhiteListHead->Flink : gMeshListHead->Flink;
-	if (!IsListEmpty(TargetList == WHITE_LIST ? gWhiteListHead : gMeshListHead))
-	{
-		while (entry != (TargetList == WHITE_LIST ? gWhiteListHead : gMeshListHead))
-		{
-			// Get the struct that contains this entry
-			
-			// This is the closest we can get to dynamic type declaration at
-			// runtime
-			union {
-				PWHITE_LIST_ENTRY whiteListEntry;
-				PMESH_LIST_ENTRY meshListEntry;
-			} runtimeListEntry;
-
-			if (TargetList == WHITE_LIST)
-			{
-				runtimeListEntry.whiteListEntry = CONTAINING_RECORD(entry,
-																	WHITE_LIST_ENTRY,
-																	listEntry
-																	);
-			}
-			else
-			{
-				runtimeListEntry.meshListEntry = CONTAINING_RECORD(entry,
-																   MESH_LIST_ENTRY,
-																   listEntry
-																   );
-			}
-
-			// Declare a unicode string to hold the to-be converted address
-			DECLARE_UNICODE_STRING_SIZE(currentIpv6AddressString,
-										INET6_ADDRSTRLEN
-										);
-
-			// Convert the address to a string (function null-terminates it)
-			ULONG currentIpv6AddressStringLength = INET6_ADDRSTRLEN;
-			status = RtlIpv6AddressToStringExW(TargetList == WHITE_LIST ? &runtimeListEntry.whiteListEntry->ipv6Address : &runtimeListEntry.meshListEntry->ipv6Address,
-											   TargetList == WHITE_LIST ? runtimeListEntry.whiteListEntry->scopeId : runtimeListEntry.meshListEntry->scopeId,
-											   0,
-											   (PWSTR)currentIpv6AddressString.Buffer,
-											   &currentIpv6AddressStringLength
-											   );
-			if (!NT_SUCCESS(status))
-			{
-				TraceEvents(TRACE_LEVEL_WARNING, TRACE_HELPERS_REGISTRY, "Converting IPv6 address to string failed during %!FUNC! with %!STATUS!", status);
-				goto Exit;
-			}
-
-			// Assign the actual number of bytes written to the UNICODE_STRING
-			// structure. Unicode characters are 2 bytes each and the
-			// conversion function reported the total number of CHARACTERS
-			// written to the buffer, so that is the length. Also, the max
-			// length must be a power of 2 accordingly, which is why
-			// INET6_ADDRSTRLEN is defined as 65 (64 + null terminator).
-			currentIpv6AddressString.Length = (sizeof(BYTE) * 2) * (USHORT)currentIpv6AddressStringLength;
-
-			// Initialize and create the WDF string object from the Unicode string
-			WDFSTRING currentIpv6AddressWdfString;
-			WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
-			attributes.ParentObject = addressCollection;
-
-			status = WdfStringCreate(&currentIpv6AddressString,
-									 &attributes,
-									 &currentIpv6AddressWdfString
-									 );
-			if (!NT_SUCCESS(status))
-			{
-				TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_REGISTRY, "WdfStringCreate failed during %!FUNC! with %!STATUS!", status);
-				goto Exit;
-			}
-
-			// Add the WDFSTRING to the WDFCOLLECTION
-			status = WdfCollectionAdd(addressCollection,
-									  currentIpv6AddressWdfString
-									  );
-			if (!NT_SUCCESS(status))
-			{
-				TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_REGISTRY, "WdfCollectionAdd failed during %!FUNC! with %!STATUS!", status);
-				goto Exit;
-			}
-
-			// Advance the list
-			entry = entry->Flink;
-		}
-    }
-    
-    //
-    // Step 5
-    // Assign the collection of string objects to the registry key
+    // Assign the binary value to the key, then remove the legacy value
     //
+	DECLARE_CONST_UNICODE_STRING(whiteListBlobValueName, L"WhiteListBinary");
+	DECLARE_CONST_UNICODE_STRING(meshListBlobValueName, L"MeshListBinary");
+	const UNICODE_STRING listBlobValueName = (TargetList == WHITE_LIST ? whiteListBlobValueName : meshListBlobValueName);
 
-    // Declare the name of the value we're assigning to the key
 	DECLARE_CONST_UNICODE_STRING(whiteListValueName, L"WhiteList");
 	DECLARE_CONST_UNICODE_STRING(meshListValueName, L"MeshList");
 	const UNICODE_STRING listValueName = (TargetList == WHITE_LIST ? whiteListValueName : meshListValueName);
 
-    // Assign the collection of strings to the registry key's value
-    status = WdfRegistryAssignMultiString(TargetList == WHITE_LIST ? gWhiteListKey : gMeshListKey, 
-                                          &listValueName, 
-                                          addressCollection
-                                          );
+    status = WdfRegistryAssignValue(TargetList == WHITE_LIST ? gWhiteListKey : gMeshListKey,
+                                    &listBlobValueName,
+                                    REG_BINARY,
+                                    blobLength,
+                                    blob
+                                    );
     if (!NT_SUCCESS(status))
     {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_REGISTRY, "WdfRegistryAssignMultiString failed during %!FUNC! with %!STATUS!", status);
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_HELPERS_REGISTRY, "WdfRegistryAssignValue failed during %!FUNC! with %!STATUS!", status);
+        goto Exit;
+    }
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_HELPERS_REGISTRY, "Wrote %u entries in %u bytes", entryCount, blobLength);
+
+    // Not there after the first flush, which is fine
+    NTSTATUS removeStatus = WdfRegistryRemoveValue(TargetList == WHITE_LIST ? gWhiteListKey : gMeshListKey,
+                                                   &listValueName
+                                                   );
+    if (!NT_SUCCESS(removeStatus) && removeStatus != STATUS_OBJECT_NAME_NOT_FOUND)
+    {
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_HELPERS_REGISTRY, "Removing the legacy list value failed %!STATUS!", removeStatus);
     }
 
 Exit:
@@ -752,10 +1131,14 @@ Exit:
         WdfRegistryClose(TargetList == WHITE_LIST ? gWhiteListKey : gMeshListKey);
     }
 
-    // Clean up collection object
-    if (addressCollection)
+    if (blob)
     {
-        WdfObjectDelete(addressCollection);
+        ExFreePoolWithTag(blob, IPV6_TO_BLE_REGISTRY_TAG);
+    }
+
+    if (writeLockAcquired)
+    {
+        WdfWaitLockRelease(gRuntimeListWriteLock);
     }
 
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_HELPERS_REGISTRY, "%!FUNC! Exit");
@@ -765,22 +1148,55 @@ Exit:
 
 _Use_decl_annotations_
 VOID
-IPv6ToBleRegistryFlushWhiteListWorkItemEx(
-    _In_     PVOID        IoObject,
-    _In_opt_ PVOID        Context,
-    _In_     PIO_WORKITEM IoWorkItem
+IPv6ToBleRegistryArmFlushTimer()
+/*++
+Routine Description:
+
+    Starts the one-shot registry flush timer unless it is already waiting to
+    fire, so every change made before it fires is flushed together.
+
+    Called at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+
+    None. Accesses global variables defined in Driver.h.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (!gRegistryTimer)
+    {
+        return;
+    }
+
+    if (InterlockedCompareExchange(&gRegistryTimerArmed, TRUE, FALSE) == FALSE)
+    {
+        WdfTimerStart(gRegistryTimer,
+                      WDF_REL_TIMEOUT_IN_MS(REGISTRY_FLUSH_COALESCE_MS)
+                      );
+    }
+}
+
+_Use_decl_annotations_
+VOID
+IPv6ToBleRegistryScheduleListFlush(
+    _In_ ULONG TargetList
 )
 /*++
 Routine Description:
 
-    A callback routine associated with a work item for a system worker thread.
-    Does the actual calling of AssignWhiteList() at IRQL == PASSIVE_LEVEL, then
-    frees the work item. The system worker thread is scheduled in the device
-    timer callback.
+    Marks a runtime list as modified and arms the registry flush timer. Called
+    after every successful change to a list.
+
+    Called at IRQL <= DISPATCH_LEVEL.
 
 Arguments:
 
-    Parameter - the work item object previously allocated in the timer func.
+    TargetList - Determines which runtime list was modified. 0 for white
+		list, 1 for mesh list.
 
 Return Value:
 
@@ -788,49 +1204,80 @@ Return Value:
 
 --*/
 {
-    UNREFERENCED_PARAMETER(IoObject);   // The WDM device object, unused
-    UNREFERENCED_PARAMETER(Context);    
+	if (TargetList == WHITE_LIST)
+	{
+		WdfSpinLockAcquire(gWhiteListModifiedLock);
+		gWhiteListModified = TRUE;
+		WdfSpinLockRelease(gWhiteListModifiedLock);
+	}
+	else
+	{
+		WdfSpinLockAcquire(gMeshListModifiedLock);
+		gMeshListModified = TRUE;
+		WdfSpinLockRelease(gMeshListModifiedLock);
+	}
 
-    NTSTATUS status = STATUS_SUCCESS;
-    
+    IPv6ToBleRegistryArmFlushTimer();
+}
 
-#if DBG
-    KIRQL irql = KeGetCurrentIrql();
-#endif // DBG
+_Use_decl_annotations_
+VOID
+IPv6ToBleRegistryFlushModifiedLists(
+    _In_ BOOLEAN retryOnFailure
+)
+/*++
+Routine Description:
 
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_HELPERS_REGISTRY, "%!FUNC! Entry");
+    Assigns each runtime list that was modified since its last flush to the
+    registry. A list's modified flag is cleared before it is written, so a
+    change made during the write marks it again and is flushed next time.
 
-    //
-    // Step 1
-    // Assign the runtime white list to the registry
-    //
+Arguments:
+
+    retryOnFailure - if a list can't be written, mark it modified again and,
+    if this is TRUE, arm the flush timer to retry. Driver unload passes FALSE
+    since the timer has been stopped.
+
+Return Value:
 
-    // No need to check this for failure, as if it fails we'll try again 
-    // later; plus, the function itself will log a trace error if it fails
-    status = IPv6ToBleRegistryAssignRuntimeList(WHITE_LIST);
+    None. Failures are logged by IPv6ToBleRegistryAssignRuntimeList.
 
-    // Reset the flag for next check if we succeeded
-    if (NT_SUCCESS(status))
+--*/
+{
+    for (ULONG TargetList = WHITE_LIST; TargetList <= MESH_LIST; TargetList++)
     {
-        WdfSpinLockAcquire(gWhiteListModifiedLock);
-        gWhiteListModified = FALSE;
-        WdfSpinLockRelease(gWhiteListModifiedLock);
-    }
+        WDFSPINLOCK modifiedLock = (TargetList == WHITE_LIST ? gWhiteListModifiedLock : gMeshListModifiedLock);
+        BOOLEAN* modified = (TargetList == WHITE_LIST ? &gWhiteListModified : &gMeshListModified);
+        BOOLEAN wasModified;
 
-    NT_ASSERT(irql == KeGetCurrentIrql());
+        WdfSpinLockAcquire(modifiedLock);
+        wasModified = *modified;
+        *modified = FALSE;
+        WdfSpinLockRelease(modifiedLock);
 
-    //
-    // Step 2
-    // Free the work item
-    //
-    IoFreeWorkItem(IoWorkItem);
+        if (!wasModified)
+        {
+            continue;
+        }
 
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_HELPERS_REGISTRY, "%!FUNC! Exit");
+        NTSTATUS status = IPv6ToBleRegistryAssignRuntimeList(TargetList);
+        if (!NT_SUCCESS(status))
+        {
+            WdfSpinLockAcquire(modifiedLock);
+            *modified = TRUE;
+            WdfSpinLockRelease(modifiedLock);
+
+            if (retryOnFailure)
+            {
+                IPv6ToBleRegistryArmFlushTimer();
+            }
+        }
+    }
 }
 
 _Use_decl_annotations_
 VOID
-IPv6ToBleRegistryFlushMeshListWorkItemEx(
+IPv6ToBleRegistryFlushListsWorkItemEx(
     _In_     PVOID        IoObject,
     _In_opt_ PVOID        Context,
     _In_     PIO_WORKITEM IoWorkItem
@@ -839,13 +1286,13 @@ IPv6ToBleRegistryFlushMeshListWorkItemEx(
 Routine Description:
 
     A callback routine associated with a work item for a system worker thread.
-    Does the actual calling of AssignMeshList() at IRQL == PASSIVE_LEVEL, then
-    frees the work item. The system worker thread is scheduled in the device
-    timer callback.
+    Flushes the modified runtime lists to the registry at IRQL ==
+    PASSIVE_LEVEL, then frees the work item. The system worker thread is
+    scheduled by the registry flush timer callback.
 
 Arguments:
 
-    Parameter - the work item object previously allocated in the timer func.
+    IoWorkItem - the work item object previously allocated in the timer func.
 
 Return Value:
 
@@ -853,11 +1300,8 @@ Return Value:
 
 --*/
 {
-    UNREFERENCED_PARAMETER(IoObject);   // the WDM device object, unused
-    UNREFERENCED_PARAMETER(Context);
-
-    NTSTATUS status = STATUS_SUCCESS;
-    
+    UNREFERENCED_PARAMETER(IoObject);   // The WDM device object, unused
+    UNREFERENCED_PARAMETER(Context);    
 
 #if DBG
     KIRQL irql = KeGetCurrentIrql();
@@ -867,20 +1311,10 @@ Return Value:
 
     //
     // Step 1
-    // Assign the runtime mesh list to the registry
+    // Assign the modified runtime lists to the registry. If this fails, the
+    // lists stay marked and the timer is armed to try again later.
     //
-
-    // No need to check this for failure, as if it fails we'll try again 
-    // later; plus, the function itself will log a trace error if it fails
-    status = IPv6ToBleRegistryAssignRuntimeList(MESH_LIST);
-
-    // Reset the flag for next check if we succeeded
-    if (NT_SUCCESS(status))
-    {
-        WdfSpinLockAcquire(gMeshListModifiedLock);
-        gMeshListModified = FALSE;
-        WdfSpinLockRelease(gMeshListModifiedLock);
-    }
+    IPv6ToBleRegistryFlushModifiedLists(TRUE);
 
     NT_ASSERT(irql == KeGetCurrentIrql());
 
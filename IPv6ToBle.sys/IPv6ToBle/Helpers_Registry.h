@@ -54,6 +54,33 @@ _IRQL_requires_same_
 NTSTATUS
 IPv6ToBleRegistryCheckBorderRouterFlag();
 
+//-------------------------------------------------------------------------------
+// Function to load the listen pend queue and channel settings from the
+// registry
+//-------------------------------------------------------------------------------
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+NTSTATUS
+IPv6ToBleRegistryRetrieveListenPendSettings(
+	_Inout_	ULONG*	depth,
+	_Inout_	ULONG*	dropPolicy,
+	_Inout_	ULONG*	channelCount
+);
+
+//-------------------------------------------------------------------------------
+// Function to load the data path tracing and packet trace settings from the
+// registry
+//-------------------------------------------------------------------------------
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+NTSTATUS
+IPv6ToBleRegistryRetrievePacketTraceSettings(
+	_Inout_	ULONG*	dataPathTracing,
+	_Inout_	ULONG*	sampleRate
+);
+
 //-----------------------------------------------------------------------------
 // Functions to load white list and mesh list information from the registry and
 // populate the runtime lists
@@ -71,14 +98,13 @@ IPv6ToBleRegistryRetrieveRuntimeList(
 //-----------------------------------------------------------------------------
 // Functions to store the white list and mesh lists in the registry
 //
-// These functions are called periodically by the device timer callback, which
-// checks if the lists have changed and overwrites the registry key values if
-// they have. The device timer is a periodic timer and is thus called at
-// IRQL == DISPATCH_LEVEL.
+// Every change to a list marks it modified and arms a one-shot timer, so a
+// burst of changes is written once, shortly after the first, and nothing
+// runs while the lists are idle. The timer callback runs at IRQL ==
+// DISPATCH_LEVEL.
 //
 // Because working with the registry requires many PASSIVE_LEVEL functions,
-// the timer callback schedules a worker thread to perform the task if it
-// detects that the runtime list has changed.
+// the timer callback schedules a worker thread to write the modified lists.
 //-----------------------------------------------------------------------------
 
 _IRQL_requires_(PASSIVE_LEVEL)
@@ -88,12 +114,27 @@ IPv6ToBleRegistryAssignRuntimeList(
 	_In_ ULONG TargetList
 );
 
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+VOID
+IPv6ToBleRegistryArmFlushTimer();
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+VOID
+IPv6ToBleRegistryScheduleListFlush(
+	_In_ ULONG TargetList
+);
+
 _IRQL_requires_(PASSIVE_LEVEL)
 _IRQL_requires_same_
-IO_WORKITEM_ROUTINE_EX IPv6ToBleRegistryFlushWhiteListWorkItemEx;
+VOID
+IPv6ToBleRegistryFlushModifiedLists(
+	_In_ BOOLEAN retryOnFailure
+);
 
 _IRQL_requires_(PASSIVE_LEVEL)
 _IRQL_requires_same_
-IO_WORKITEM_ROUTINE_EX IPv6ToBleRegistryFlushMeshListWorkItemEx;
+IO_WORKITEM_ROUTINE_EX IPv6ToBleRegistryFlushListsWorkItemEx;
 
 #endif	// _HELPERS_REGISTRY_H_
\ No newline at end of file
@@ -0,0 +1,201 @@
+/*++
+
+Module Name:
+
+	Helpers_Tcp.c
+
+Abstract:
+
+	This file contains implementations for helper functions that adjust TCP
+	segments handed to the usermode packet processing app so they fit the BLE
+	path MTU.
+
+	TCP hosts on either side of the border router pick their segment size
+	from their own link MTU, typically 1500 bytes, so without help their
+	segments are too large for the mesh and are dropped, leaving TCP to
+	retransmit until it gives up. Each side announces the largest segment it
+	will accept in the maximum segment size (MSS) option of its SYN or
+	SYN-ACK, so lowering that option to TCP_MSS_CLAMP as the segment passes
+	through keeps every later segment of the connection within 1280 bytes.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#include "Includes.h"
+#include "Helpers_Tcp.tmh"	// auto-generated tracing file
+
+//
+// TCP header offsets and values used below
+//
+#define TCP_CHECKSUM_OFFSET     16
+#define TCP_DATA_OFFSET_OFFSET  12
+#define TCP_FLAGS_OFFSET        13
+#define TCP_FLAG_SYN            0x02
+
+#define TCP_OPTION_END          0
+#define TCP_OPTION_NOP          1
+#define TCP_OPTION_MSS          2
+#define TCP_OPTION_MSS_LENGTH   4
+
+//
+// Updates a ones' complement checksum for a 16-bit value that changed, as in
+// RFC 1624: HC' = ~(~HC + ~m + m'). Values are read most significant byte
+// first, as they are on the wire. A value that starts at an odd offset from
+// the start of the TCP header straddles two checksum words, which is the
+// same as adding it byte swapped, so the caller passes it swapped.
+//
+static
+UINT16
+IPv6ToBleTcpChecksumUpdate(
+	_In_	UINT16	checksum,
+	_In_	UINT16	oldValue,
+	_In_	UINT16	newValue
+)
+{
+	UINT32 sum = (UINT16)~checksum;
+
+	sum += (UINT16)~oldValue;
+	sum += newValue;
+
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+
+	return (UINT16)~sum;
+}
+
+_Use_decl_annotations_
+VOID
+IPv6ToBleTcpClampMss(
+	BYTE*	packet,
+	UINT32	packetLength
+)
+/*++
+Routine Description:
+
+	If the packet is a TCP segment with the SYN flag set, directly after the
+	fixed IPv6 header, and its MSS option is larger than TCP_MSS_CLAMP,
+	lowers the option to TCP_MSS_CLAMP and fixes up the TCP checksum to
+	match, and counts the segment in the statistics. Any other packet is left
+	alone.
+
+	Called on the copy of an intercepted packet that is handed to the app,
+	never on the NET_BUFFER_LIST itself, which belongs to the stack.
+
+Arguments:
+
+	packet - the packet, starting at the IPv6 header.
+
+	packetLength - the number of valid bytes in packet.
+
+Return Value:
+
+	None.
+
+--*/
+{
+	//
+	// Step 1
+	// Make sure this is a SYN segment with room for options
+	//
+	if (packetLength < IPV6_HEADER_LENGTH + TCP_HEADER_LENGTH ||
+		packet[6] != IPPROTO_TCP)
+	{
+		return;
+	}
+
+	BYTE* tcpHeader = packet + IPV6_HEADER_LENGTH;
+
+	if (!(tcpHeader[TCP_FLAGS_OFFSET] & TCP_FLAG_SYN))
+	{
+		return;
+	}
+
+	UINT32 tcpHeaderLength = (tcpHeader[TCP_DATA_OFFSET_OFFSET] >> 4) * 4;
+	if (tcpHeaderLength <= TCP_HEADER_LENGTH ||
+		IPV6_HEADER_LENGTH + tcpHeaderLength > packetLength)
+	{
+		return;
+	}
+
+	//
+	// Step 2
+	// Walk the options looking for the MSS
+	//
+	UINT32 offset = TCP_HEADER_LENGTH;
+
+	while (offset < tcpHeaderLength)
+	{
+		BYTE kind = tcpHeader[offset];
+
+		if (kind == TCP_OPTION_END)
+		{
+			break;
+		}
+		if (kind == TCP_OPTION_NOP)
+		{
+			offset++;
+			continue;
+		}
+
+		if (offset + 1 >= tcpHeaderLength)
+		{
+			break;
+		}
+
+		BYTE optionLength = tcpHeader[offset + 1];
+		if (optionLength < 2 || offset + optionLength > tcpHeaderLength)
+		{
+			break;
+		}
+
+		if (kind == TCP_OPTION_MSS && optionLength == TCP_OPTION_MSS_LENGTH)
+		{
+			//
+			// Step 3
+			// Lower the MSS if it is too large and fix up the checksum
+			//
+			UINT32 mssOffset = offset + 2;
+			UINT16 oldMss = (UINT16)((tcpHeader[mssOffset] << 8) | tcpHeader[mssOffset + 1]);
+
+			if (oldMss <= TCP_MSS_CLAMP)
+			{
+				return;
+			}
+
+			UINT16 newMss = TCP_MSS_CLAMP;
+
+			tcpHeader[mssOffset] = (BYTE)(newMss >> 8);
+			tcpHeader[mssOffset + 1] = (BYTE)newMss;
+
+			UINT16 checksum = (UINT16)((tcpHeader[TCP_CHECKSUM_OFFSET] << 8) | tcpHeader[TCP_CHECKSUM_OFFSET + 1]);
+
+			if (mssOffset & 1)
+			{
+				checksum = IPv6ToBleTcpChecksumUpdate(checksum,
+													  RtlUshortByteSwap(oldMss),
+													  RtlUshortByteSwap(newMss)
+													  );
+			}
+			else
+			{
+				checksum = IPv6ToBleTcpChecksumUpdate(checksum,
+													  oldMss,
+													  newMss
+													  );
+			}
+
+			tcpHeader[TCP_CHECKSUM_OFFSET] = (BYTE)(checksum >> 8);
+			tcpHeader[TCP_CHECKSUM_OFFSET + 1] = (BYTE)checksum;
+
+			IPV6_TO_BLE_STATISTICS_INCREMENT(tcpMssClamped);
+			TraceDataPath(TRACE_LEVEL_VERBOSE, TRACE_HELPERS_TCP, "Clamped TCP MSS from %u to %u", oldMss, newMss);
+
+			return;
+		}
+
+		offset += optionLength;
+	}
+}
@@ -0,0 +1,39 @@
+/*++
+
+Module Name:
+
+	Helpers_Tcp.h
+
+Abstract:
+
+	This file contains definitions for helper functions that adjust TCP
+	segments handed to the usermode packet processing app so they fit the BLE
+	path MTU.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#ifndef _HELPERS_TCP_H_
+#define _HELPERS_TCP_H_
+
+EXTERN_C_START
+
+//-----------------------------------------------------------------------------
+// Function to clamp the maximum segment size option of a TCP SYN segment
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+VOID
+IPv6ToBleTcpClampMss(
+	_Inout_updates_bytes_(packetLength)	BYTE*	packet,
+	_In_								UINT32	packetLength
+);
+
+EXTERN_C_END
+
+#endif	// _HELPERS_TCP_H_
@@ -47,15 +47,25 @@ EXTERN_C_START
 #include "trace.h"
 
 // Other headers in this project
+#include "Public.h"             // IOCTLs and structures shared with usermode
+#include "ClassifyCore.h"		// Platform-neutral classify decisions
+#include "Helpers_AddressTable.h"	// Hash index over runtime list addresses
 #include "Driver.h"             // The driver object definitions, entry, unload
 #include "Device.h"				// The device object definitions
 #include "Queue.h"				// I/O queue definitions
 #include "callout.h"			// Our custom callout driver callbacks
 #include "RuntimeList.h"        // Working with runtime white and mesh lists
+#include "Listen.h"				// Handing packets to the usermode app
+#include "SharedRing.h"			// Packet rings shared with the usermode app
+#include "Statistics.h"			// Per-processor data path statistics
+#include "PacketTrace.h"		// Sampled packet traces
+#include "Shaping.h"			// Per-destination outbound shaping
+#include "ListChange.h"			// Notifying the apps of list changes
 
 #include "Helpers_NDIS.h"		// Helpers for kernel mode networking
 #include "Helpers_NetBuffer.h"	// Helpers for user <-> kernel translation
 #include "Helpers_Registry.h"	// Helpers for working with the registry
+#include "Helpers_Tcp.h"		// Helpers for clamping the TCP MSS
 
 EXTERN_C_END
 
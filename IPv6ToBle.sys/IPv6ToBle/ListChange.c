@@ -0,0 +1,480 @@
+/*++
+
+Module Name:
+
+	ListChange.c
+
+Abstract:
+
+	This file contains the implementations for logging changes to the
+	runtime lists and for the list change IOCTL, an inverted call that the
+	packet processing app or GUI app keeps pending so it hears about every
+	change to the white list or mesh list as soon as it is made.
+
+	Every address added to or removed from a list is logged as a record in a
+	fixed ring of the most recent LIST_CHANGE_LOG_LENGTH changes, and moves
+	the list generation on by one. A request names the generation its copy of
+	the lists is at and receives the records since then; if there are none
+	yet, it waits in gListChangeQueue until the next change is committed. A
+	request from further back than the log reaches gets the full contents of
+	both lists from their published snapshots instead.
+
+	The log and the generation are only touched with gRuntimeListWriteLock
+	held, the same lock that serializes changes to the lists, so a request
+	always sees the lists and the log at the same generation.
+
+	This file and its header are only used on the border router device.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#include "Includes.h"
+#include "ListChange.tmh"	// auto-generated tracing file
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, IPv6ToBleListChangeInitialize)
+#pragma alloc_text (PAGE, IPv6ToBleListChangeCleanup)
+#endif
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleListChangeInitialize()
+/*++
+Routine Description:
+
+	Allocates the list change log and starts the list generation at 1, so a
+	caller without a copy of the lists, which sends generation 0, is always
+	given both lists in full.
+
+	This function is called from DriverEntry at PASSIVE_LEVEL, on the border
+	router only.
+
+Arguments:
+
+	None. Accesses global variables defined in Driver.h.
+
+Return Value:
+
+	STATUS_SUCCESS if successful, appropriate NTSTATUS error codes otherwise.
+
+--*/
+{
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_LIST_CHANGE, "%!FUNC! Entry");
+
+	PAGED_CODE();
+
+	NTSTATUS status = STATUS_SUCCESS;
+
+	gListGeneration = 1;
+	gListChangeOldest = 1;
+	gListChangeNext = 1;
+
+	gListChangeLog = (PIPV6_TO_BLE_LIST_CHANGE_RECORD)ExAllocatePoolWithTag(
+										NonPagedPoolNx,
+										LIST_CHANGE_LOG_LENGTH * sizeof(IPV6_TO_BLE_LIST_CHANGE_RECORD),
+										IPV6_TO_BLE_LIST_CHANGE_TAG
+									);
+	if (!gListChangeLog)
+	{
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_LIST_CHANGE, "List change log allocation failed during %!FUNC! with %!STATUS!", status);
+		goto Exit;
+	}
+
+Exit:
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_LIST_CHANGE, "%!FUNC! Exit");
+
+	return status;
+}
+
+_Use_decl_annotations_
+VOID
+IPv6ToBleListChangeCleanup()
+/*++
+Routine Description:
+
+	Frees the list change log. Called during driver unload, after the lists
+	have been purged. No request can still be waiting, since the driver only
+	unloads once every handle to the device is closed.
+
+Arguments:
+
+	None. Accesses global variables defined in Driver.h.
+
+Return Value:
+
+	None.
+
+--*/
+{
+	PAGED_CODE();
+
+	if (gListChangeLog)
+	{
+		ExFreePoolWithTag(gListChangeLog, IPV6_TO_BLE_LIST_CHANGE_TAG);
+		gListChangeLog = NULL;
+	}
+}
+
+_Use_decl_annotations_
+VOID
+IPv6ToBleListChangeRecord(
+	ULONG			TargetList,
+	UINT8			Change,
+	const IN6_ADDR*	Ipv6Address,
+	ULONG			ScopeId
+)
+/*++
+Routine Description:
+
+	Logs a change to a runtime list. The change isn't visible to requests
+	until IPv6ToBleListChangeCommit is called. If the log is full, the oldest
+	record is overwritten, and callers that hadn't seen it yet will be given
+	both lists in full.
+
+	The caller must hold gRuntimeListWriteLock.
+
+Arguments:
+
+	TargetList - WHITE_LIST or MESH_LIST.
+
+	Change - IPV6_TO_BLE_LIST_CHANGE_ADDED or IPV6_TO_BLE_LIST_CHANGE_REMOVED.
+
+	Ipv6Address - the address that was added or removed.
+
+	ScopeId - the scope ID of the address.
+
+Return Value:
+
+	None.
+
+--*/
+{
+	if (!gListChangeLog)
+	{
+		return;
+	}
+
+	PIPV6_TO_BLE_LIST_CHANGE_RECORD record = &gListChangeLog[gListChangeNext & (LIST_CHANGE_LOG_LENGTH - 1)];
+
+	RtlCopyMemory(record->ipv6Address, Ipv6Address, sizeof(IN6_ADDR));
+	record->scopeId = ScopeId;
+	record->targetList = (UINT8)TargetList;
+	record->change = Change;
+	record->reserved = 0;
+
+	gListChangeNext++;
+	if (gListChangeNext - gListChangeOldest > LIST_CHANGE_LOG_LENGTH)
+	{
+		gListChangeOldest = gListChangeNext - LIST_CHANGE_LOG_LENGTH;
+	}
+}
+
+//
+// Appends the entries of a list's published snapshot to a reset response.
+// The caller holds gRuntimeListWriteLock, so the snapshot can't be retired
+// while it is being read.
+//
+static
+ULONG
+IPv6ToBleListChangeCopySnapshot(
+	_In_	ULONG							TargetList,
+	_Out_	PIPV6_TO_BLE_LIST_CHANGE_RECORD	records
+)
+{
+	PRUNTIME_LIST_SNAPSHOT snapshot = (TargetList == WHITE_LIST) ? gWhiteListSnapshot : gMeshListSnapshot;
+	if (!snapshot)
+	{
+		return 0;
+	}
+
+	for (ULONG i = 0; i < snapshot->entryCount; i++)
+	{
+		RtlCopyMemory(records[i].ipv6Address,
+					  &snapshot->entries[i].ipv6Address,
+					  sizeof(IN6_ADDR)
+					  );
+		records[i].scopeId = snapshot->entries[i].scopeId;
+		records[i].targetList = (UINT8)TargetList;
+		records[i].change = IPV6_TO_BLE_LIST_CHANGE_ADDED;
+		records[i].reserved = 0;
+	}
+
+	return snapshot->entryCount;
+}
+
+//
+// Fills a list change request's output buffer with the changes since
+// generation, or with both lists in full if the log no longer reaches back
+// that far. The caller holds gRuntimeListWriteLock and has made sure there
+// is something to return.
+//
+static
+NTSTATUS
+IPv6ToBleListChangeFill(
+	_In_	WDFREQUEST	request,
+	_In_	UINT64		generation,
+	_Out_	ULONG_PTR*	bytesTransferred
+)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+
+	PIPV6_TO_BLE_LIST_CHANGE_HEADER header = NULL;
+	size_t outputLength = 0;
+
+	*bytesTransferred = 0;
+
+	status = WdfRequestRetrieveOutputBuffer(request,
+											sizeof(IPV6_TO_BLE_LIST_CHANGE_HEADER) + sizeof(IPV6_TO_BLE_LIST_CHANGE_RECORD),
+											(PVOID*)&header,
+											&outputLength
+											);
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_LIST_CHANGE, "Retrieving output buffer from WDFREQUEST failed during %!FUNC! with %!STATUS!", status);
+		return status;
+	}
+
+	PIPV6_TO_BLE_LIST_CHANGE_RECORD records = (PIPV6_TO_BLE_LIST_CHANGE_RECORD)(header + 1);
+	SIZE_T capacity = (outputLength - sizeof(IPV6_TO_BLE_LIST_CHANGE_HEADER)) / sizeof(IPV6_TO_BLE_LIST_CHANGE_RECORD);
+
+	RtlZeroMemory(header, sizeof(IPV6_TO_BLE_LIST_CHANGE_HEADER));
+
+	if (generation >= gListChangeOldest && generation <= gListGeneration)
+	{
+		//
+		// Return the logged changes since the caller's generation, as many
+		// as fit
+		//
+		ULONG recordCount = (ULONG)min(gListGeneration - generation, (UINT64)capacity);
+
+		for (ULONG i = 0; i < recordCount; i++)
+		{
+			records[i] = gListChangeLog[(generation + i) & (LIST_CHANGE_LOG_LENGTH - 1)];
+		}
+
+		header->generation = generation + recordCount;
+		header->recordCount = recordCount;
+		if (header->generation < gListGeneration)
+		{
+			header->flags = IPV6_TO_BLE_LIST_CHANGE_FLAG_MORE;
+		}
+
+		*bytesTransferred = sizeof(IPV6_TO_BLE_LIST_CHANGE_HEADER) + recordCount * sizeof(IPV6_TO_BLE_LIST_CHANGE_RECORD);
+	}
+	else
+	{
+		//
+		// Return both lists in full, or just the length they need if they
+		// don't fit
+		//
+		ULONG whiteListEntries = gWhiteListSnapshot ? gWhiteListSnapshot->entryCount : 0;
+		ULONG meshListEntries = gMeshListSnapshot ? gMeshListSnapshot->entryCount : 0;
+		SIZE_T entryCount = (SIZE_T)whiteListEntries + meshListEntries;
+
+		header->generation = gListGeneration;
+		header->flags = IPV6_TO_BLE_LIST_CHANGE_FLAG_RESET;
+		header->requiredLength = (UINT32)(sizeof(IPV6_TO_BLE_LIST_CHANGE_HEADER) + entryCount * sizeof(IPV6_TO_BLE_LIST_CHANGE_RECORD));
+
+		if (entryCount > capacity)
+		{
+			status = STATUS_BUFFER_OVERFLOW;
+			TraceEvents(TRACE_LEVEL_WARNING, TRACE_LIST_CHANGE, "Output buffer of %Iu bytes too small for %Iu list entries, %!STATUS!", outputLength, entryCount, status);
+			*bytesTransferred = sizeof(IPV6_TO_BLE_LIST_CHANGE_HEADER);
+			return status;
+		}
+
+		ULONG recordCount = IPv6ToBleListChangeCopySnapshot(WHITE_LIST, records);
+		recordCount += IPv6ToBleListChangeCopySnapshot(MESH_LIST, records + recordCount);
+
+		header->recordCount = recordCount;
+
+		*bytesTransferred = header->requiredLength;
+
+		TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_LIST_CHANGE, "Generation %I64u is not in the log, returned %u list entries at generation %I64u", generation, recordCount, gListGeneration);
+	}
+
+	return status;
+}
+
+_Use_decl_annotations_
+VOID
+IPv6ToBleListChangeCommit()
+/*++
+Routine Description:
+
+	Makes the changes logged since the last commit visible, moving the list
+	generation past them, and completes every waiting list change request
+	with them. A bulk change commits once, after all of its changes are
+	logged, so a waiting request sees the whole change at once if it fits.
+
+	The caller must hold gRuntimeListWriteLock.
+
+Arguments:
+
+	None. Accesses global variables defined in Driver.h.
+
+Return Value:
+
+	None.
+
+--*/
+{
+	if (gListChangeNext == gListGeneration)
+	{
+		return;
+	}
+
+	gListGeneration = gListChangeNext;
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_LIST_CHANGE, "Lists are now at generation %I64u", gListGeneration);
+
+	if (!gListChangeQueue)
+	{
+		return;
+	}
+
+	//
+	// Complete the waiting requests. Each one was queued at the generation
+	// before this commit, so each has something to return.
+	//
+	WDFREQUEST request = NULL;
+	while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(gListChangeQueue, &request)))
+	{
+		ULONG_PTR bytesTransferred = 0;
+		PIPV6_TO_BLE_LIST_CHANGE_REQUEST input = NULL;
+
+		NTSTATUS status = WdfRequestRetrieveInputBuffer(request,
+														sizeof(IPV6_TO_BLE_LIST_CHANGE_REQUEST),
+														(PVOID*)&input,
+														NULL
+														);
+		if (NT_SUCCESS(status))
+		{
+			status = IPv6ToBleListChangeFill(request,
+											 input->generation,
+											 &bytesTransferred
+											 );
+		}
+
+		WdfRequestCompleteWithInformation(request, status, bytesTransferred);
+	}
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleListChangeHandleRequest(
+	WDFREQUEST	Request,
+	ULONG_PTR*	BytesTransferred
+)
+/*++
+Routine Description:
+
+	Handles a list change request: completes it right away if the lists have
+	changed since the generation it names, or queues it in gListChangeQueue
+	until they next change.
+
+	The generation is checked and the request queued with
+	gRuntimeListWriteLock held, so a change can't be committed in between and
+	leave the request waiting for a change that already happened.
+
+Arguments:
+
+	Request - the WDFREQUEST from user mode. Its input buffer is an
+	IPV6_TO_BLE_LIST_CHANGE_REQUEST; its output buffer must hold an
+	IPV6_TO_BLE_LIST_CHANGE_HEADER and at least one record.
+
+	BytesTransferred - receives the number of bytes written to the output
+	buffer if the request is to be completed now.
+
+Return Value:
+
+	STATUS_PENDING if the request was queued; otherwise the status to
+	complete it with: STATUS_SUCCESS, STATUS_BUFFER_OVERFLOW if both lists
+	had to be returned and didn't fit, or an appropriate NTSTATUS error code.
+
+--*/
+{
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_LIST_CHANGE, "%!FUNC! Entry");
+
+	NTSTATUS status = STATUS_SUCCESS;
+
+	PIPV6_TO_BLE_LIST_CHANGE_REQUEST input = NULL;
+	PVOID outputBuffer = NULL;
+
+	*BytesTransferred = 0;
+
+	//
+	// Step 1
+	// Validate the request. Its buffers are checked now so that it can't
+	// fail when it is completed later.
+	//
+	if (!gBorderRouterFlag)
+	{
+		status = STATUS_INVALID_DEVICE_REQUEST;
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_LIST_CHANGE, "Runtime lists only exist on the border router %!STATUS!", status);
+		goto Exit;
+	}
+
+	status = WdfRequestRetrieveInputBuffer(Request,
+										   sizeof(IPV6_TO_BLE_LIST_CHANGE_REQUEST),
+										   (PVOID*)&input,
+										   NULL
+										   );
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_LIST_CHANGE, "Retrieving input buffer from WDFREQUEST failed during %!FUNC! with %!STATUS!", status);
+		goto Exit;
+	}
+
+	// The input and output buffers of a buffered IOCTL are the same memory,
+	// so read the generation before anything is written
+	UINT64 generation = input->generation;
+
+	status = WdfRequestRetrieveOutputBuffer(Request,
+											sizeof(IPV6_TO_BLE_LIST_CHANGE_HEADER) + sizeof(IPV6_TO_BLE_LIST_CHANGE_RECORD),
+											&outputBuffer,
+											NULL
+											);
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_LIST_CHANGE, "Retrieving output buffer from WDFREQUEST failed during %!FUNC! with %!STATUS!", status);
+		goto Exit;
+	}
+
+	//
+	// Step 2
+	// Queue the request if the caller is up to date, otherwise return what
+	// it is missing
+	//
+	WdfWaitLockAcquire(gRuntimeListWriteLock, NULL);
+
+	if (generation == gListGeneration)
+	{
+		status = WdfRequestForwardToIoQueue(Request, gListChangeQueue);
+		if (NT_SUCCESS(status))
+		{
+			status = STATUS_PENDING;
+		}
+		else
+		{
+			TraceEvents(TRACE_LEVEL_ERROR, TRACE_LIST_CHANGE, "Forwarding list change request failed with %!STATUS!", status);
+		}
+	}
+	else
+	{
+		status = IPv6ToBleListChangeFill(Request, generation, BytesTransferred);
+	}
+
+	WdfWaitLockRelease(gRuntimeListWriteLock);
+
+Exit:
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_LIST_CHANGE, "%!FUNC! Exit");
+
+	return status;
+}
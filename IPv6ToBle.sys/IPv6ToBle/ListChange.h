@@ -0,0 +1,78 @@
+/*++
+
+Module Name:
+
+	ListChange.h
+
+Abstract:
+
+	This file contains definitions for the functions that log changes to the
+	runtime lists and complete the list change IOCTL with them. The log is
+	defined in Driver.h; the input and output formats in Public.h.
+
+	This file and its source are only used on the border router device.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#ifndef _LISTCHANGE_H_
+#define _LISTCHANGE_H_
+
+EXTERN_C_START
+
+//-----------------------------------------------------------------------------
+// Functions to create and destroy the list change log
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+_Check_return_
+_Success_(return == STATUS_SUCCESS)
+NTSTATUS
+IPv6ToBleListChangeInitialize();
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+VOID
+IPv6ToBleListChangeCleanup();
+
+//-----------------------------------------------------------------------------
+// Functions called by the runtime list functions, with gRuntimeListWriteLock
+// held, once a change to a list has been published. Each change is logged
+// with IPv6ToBleListChangeRecord, then IPv6ToBleListChangeCommit makes all
+// of them visible at once and completes the waiting requests.
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+VOID
+IPv6ToBleListChangeRecord(
+	_In_	ULONG			TargetList,
+	_In_	UINT8			Change,
+	_In_	const IN6_ADDR*	Ipv6Address,
+	_In_	ULONG			ScopeId
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+VOID
+IPv6ToBleListChangeCommit();
+
+//-----------------------------------------------------------------------------
+// Function called by the I/O control callback for the list change IOCTL
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+NTSTATUS
+IPv6ToBleListChangeHandleRequest(
+	_In_	WDFREQUEST	Request,
+	_Out_	ULONG_PTR*	BytesTransferred
+);
+
+EXTERN_C_END
+
+#endif	// _LISTCHANGE_H_
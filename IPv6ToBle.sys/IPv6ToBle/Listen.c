@@ -0,0 +1,1083 @@
+/*++
+
+Module Name:
+
+	Listen.c
+
+Abstract:
+
+	This file contains the implementations for handing intercepted packets to
+	the usermode packet processing app.
+
+	The app keeps a listen request outstanding with the driver, but between
+	completing one request and sending the next there is a window in which no
+	request is available. Packets intercepted in that window are copied into a
+	bounded, per-direction ring of preallocated slots (the pend queue) and are
+	returned by the next listen requests instead of being dropped.
+
+	Each direction has one pend queue per priority class, picked by the DSCP
+	in the packet's traffic class (see Public.h). Listen requests take the
+	oldest packet of the highest class that has any, so small control
+	messages aren't stuck behind a bulk transfer that has filled the normal
+	or low class queues.
+
+	The app can also send batched listen requests with a larger output buffer.
+	Those never take a packet directly; packets are always pended first, and
+	a short one-shot timer then fills the oldest batched request with as many
+	pended packets as fit, so one completion carries several packets.
+
+	All of this is split into listen channels. Each channel has its own pend
+	queues, listen request queues, sequence counter and batch timer, and each
+	intercepted packet goes to the channel picked by its flow hash, so the app
+	can have one worker thread per channel draining them in parallel while
+	the packets of any one flow are still returned in order.
+
+	Each channel's state is guarded by the channel's own lock, so a packet can
+	never be pended while a listen request is sitting in the same channel's
+	listen request queue and vice versa, and packets on different channels
+	never contend. gListenRequestQueueLock only guards the switch to and from
+	the shared listen ring.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#include "Includes.h"
+#include "Listen.tmh"	// auto-generated tracing file
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, IPv6ToBleListenInitialize)
+#pragma alloc_text (PAGE, IPv6ToBleListenCleanup)
+#pragma alloc_text (PAGE, IPv6ToBleListenCreateBatchTimers)
+#endif
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleListenInitialize()
+/*++
+Routine Description:
+
+	Reads the pend queue depth, drop policy and number of listen channels
+	from the registry, creates each channel's lock, then allocates the ring of
+	packet slots for each priority class of each direction that intercepts
+	packets in each channel.
+	On the border router both directions are used; on the Pi/IoT devices only
+	outbound traffic is intercepted, so only the outbound rings are allocated.
+
+	A depth of 0 disables pending, restoring the old behavior of dropping any
+	packet that arrives while no listen request is outstanding.
+
+	Called from IPv6ToBleDriverInitGlobalObjects, after the border router flag
+	has been read. The channels' queues and timers are created later, with the
+	device's other queues, by IPv6ToBleQueuesInitialize.
+
+Arguments:
+
+	None. Accesses global variables defined in Driver.h.
+
+Return Value:
+
+	STATUS_SUCCESS if successful, appropriate NTSTATUS error codes otherwise.
+
+--*/
+{
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_LISTEN, "%!FUNC! Entry");
+
+	PAGED_CODE();
+
+	NTSTATUS status = STATUS_SUCCESS;
+
+	ULONG depth = LISTEN_PEND_QUEUE_DEFAULT_DEPTH;
+	ULONG dropPolicy = LISTEN_DROP_NEWEST;
+	ULONG channelCount = LISTEN_CHANNEL_DEFAULT_COUNT;
+
+	RtlZeroMemory(gListenChannels, sizeof(gListenChannels));
+	gListenChannelCount = 0;
+
+	//
+	// Step 1
+	// Read the configuration. Missing values leave the defaults in place.
+	//
+	status = IPv6ToBleRegistryRetrieveListenPendSettings(&depth,
+														 &dropPolicy,
+														 &channelCount
+														 );
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_LISTEN, "Reading pend queue settings failed during %!FUNC! with %!STATUS!", status);
+		goto Exit;
+	}
+
+	//
+	// Step 2
+	// Create each channel's lock
+	//
+	for (ULONG channel = 0; channel < channelCount; channel++)
+	{
+		WDF_OBJECT_ATTRIBUTES lockAttributes;
+		WDF_OBJECT_ATTRIBUTES_INIT(&lockAttributes);
+		lockAttributes.ParentObject = gWdfDeviceObject;
+
+		status = WdfSpinLockCreate(&lockAttributes,
+								   &gListenChannels[channel].lock
+								   );
+		if (!NT_SUCCESS(status))
+		{
+			TraceEvents(TRACE_LEVEL_ERROR, TRACE_LISTEN, "Creating listen channel %u spin lock failed %!STATUS!", channel, status);
+			goto Exit;
+		}
+	}
+	gListenChannelCount = channelCount;
+
+	if (depth == 0)
+	{
+		TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_LISTEN, "Pend queue depth is 0; packets will not be pended");
+		goto Exit;
+	}
+
+	//
+	// Step 3
+	// Allocate the slots for each direction we intercept, in each channel.
+	// The slots are allocated up front so that pending a packet in the
+	// classify callouts is only ever a copy.
+	//
+	SIZE_T ringSize = 0;
+	status = RtlSizeTMult(depth, sizeof(PENDED_PACKET), &ringSize);
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_LISTEN, "Pend queue size overflowed during %!FUNC! with %!STATUS!", status);
+		goto Exit;
+	}
+
+	for (ULONG channel = 0; channel < gListenChannelCount; channel++)
+	{
+		for (ULONG priority = 0; priority < IPV6_TO_BLE_PRIORITY_COUNT; priority++)
+		{
+			for (ULONG direction = INBOUND; direction <= OUTBOUND; direction++)
+			{
+				if (direction == INBOUND && !gBorderRouterFlag)
+				{
+					continue;
+				}
+
+				PLISTEN_PEND_QUEUE pendQueue = &gListenChannels[channel].pendQueues[priority][direction];
+
+				pendQueue->packets = (PPENDED_PACKET)ExAllocatePoolWithTag(
+												NonPagedPoolNx,
+												ringSize,
+												IPV6_TO_BLE_PEND_QUEUE_TAG
+											);
+				if (!pendQueue->packets)
+				{
+					status = STATUS_INSUFFICIENT_RESOURCES;
+					TraceEvents(TRACE_LEVEL_ERROR, TRACE_LISTEN, "Pend queue allocation failed during %!FUNC! with %!STATUS!", status);
+					goto Exit;
+				}
+
+				pendQueue->depth = depth;
+				pendQueue->dropPolicy = dropPolicy;
+			}
+		}
+	}
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_LISTEN, "%u listen channels created with pend queue depth %u and drop policy %u", gListenChannelCount, depth, dropPolicy);
+
+Exit:
+
+	if (!NT_SUCCESS(status))
+	{
+		IPv6ToBleListenCleanup();
+	}
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_LISTEN, "%!FUNC! Exit");
+
+	return status;
+}
+
+_Use_decl_annotations_
+VOID
+IPv6ToBleListenCleanup()
+/*++
+Routine Description:
+
+	Frees every channel's pend queue slots. Any packets still pended are
+	discarded.
+
+	Called from the driver unload callback after the callouts have been
+	unregistered, so no classify callout can still be pending a packet. Each
+	channel's batch timer is stopped first so it can't drain a freed queue.
+
+Arguments:
+
+	None. Accesses global variables defined in Driver.h.
+
+Return Value:
+
+	None.
+
+--*/
+{
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_LISTEN, "%!FUNC! Entry");
+
+	PAGED_CODE();
+
+	for (ULONG channel = 0; channel < LISTEN_CHANNEL_MAX_COUNT; channel++)
+	{
+		PLISTEN_CHANNEL listenChannel = &gListenChannels[channel];
+
+		// Make sure the batch timer callback isn't running or about to run
+		if (listenChannel->batchTimer)
+		{
+			WdfTimerStop(listenChannel->batchTimer, TRUE);
+		}
+		listenChannel->batchTimerArmed = FALSE;
+
+		for (ULONG priority = 0; priority < IPV6_TO_BLE_PRIORITY_COUNT; priority++)
+		{
+			for (ULONG direction = INBOUND; direction <= OUTBOUND; direction++)
+			{
+				PLISTEN_PEND_QUEUE pendQueue = &listenChannel->pendQueues[priority][direction];
+
+				if (pendQueue->packets)
+				{
+					TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_LISTEN, "Channel %u priority %u pend queue %u: pended %I64d, delivered %I64d, dropped %I64d, discarded %u", channel, priority, direction, pendQueue->pendedCount, pendQueue->deliveredCount, pendQueue->droppedCount, pendQueue->count);
+
+					ExFreePoolWithTag(pendQueue->packets, IPV6_TO_BLE_PEND_QUEUE_TAG);
+					pendQueue->packets = NULL;
+				}
+
+				pendQueue->depth = 0;
+				pendQueue->head = 0;
+				pendQueue->count = 0;
+			}
+		}
+	}
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_LISTEN, "%!FUNC! Exit");
+}
+
+_Use_decl_annotations_
+BOOLEAN
+IPv6ToBleListenRequestWantsMetadata(
+	WDFREQUEST	Request
+)
+/*++
+Routine Description:
+
+	Checks whether a listen or batched listen request asked for each packet
+	to be preceded by an IPV6_TO_BLE_PACKET_METADATA block.
+
+	The input buffer is optional; requests sent without one get packets only,
+	as before. Inputs that end after the flags, from apps that predate listen
+	channels, are accepted. Listen requests are buffered, so the input and
+	output buffers are the same memory, and callers must ask before writing
+	any output.
+
+Arguments:
+
+	Request - the listen or batched listen request.
+
+Return Value:
+
+	TRUE if the request's input flags include IPV6_TO_BLE_LISTEN_FLAG_METADATA,
+	FALSE otherwise.
+
+--*/
+{
+	PIPV6_TO_BLE_LISTEN_INPUT listenInput = NULL;
+
+	NTSTATUS status = WdfRequestRetrieveInputBuffer(Request,
+													RTL_SIZEOF_THROUGH_FIELD(IPV6_TO_BLE_LISTEN_INPUT, flags),
+													(PVOID*)&listenInput,
+													NULL
+													);
+	if (!NT_SUCCESS(status))
+	{
+		return FALSE;
+	}
+
+	return (listenInput->flags & IPV6_TO_BLE_LISTEN_FLAG_METADATA) ? TRUE : FALSE;
+}
+
+//
+// Returns the listen channel a listen or batched listen request asked to
+// wait on, or NULL if it named one that doesn't exist. Requests with no
+// input, or with only the flags, wait on channel 0. Like the flags, this
+// must be read before any output is written.
+//
+static
+PLISTEN_CHANNEL
+IPv6ToBleListenRequestChannel(
+	_In_	WDFREQUEST	Request
+)
+{
+	PIPV6_TO_BLE_LISTEN_INPUT listenInput = NULL;
+	ULONG channel = 0;
+
+	NTSTATUS status = WdfRequestRetrieveInputBuffer(Request,
+													sizeof(IPV6_TO_BLE_LISTEN_INPUT),
+													(PVOID*)&listenInput,
+													NULL
+													);
+	if (NT_SUCCESS(status))
+	{
+		channel = listenInput->channel;
+	}
+
+	if (channel >= gListenChannelCount)
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_LISTEN, "Listen request asked for channel %u, but there are only %u", channel, gListenChannelCount);
+		return NULL;
+	}
+
+	return &gListenChannels[channel];
+}
+
+//
+// Returns the listen channel that a packet's flow is steered to, so all
+// packets of a flow are pended and returned by the same channel
+//
+static
+PLISTEN_CHANNEL
+IPv6ToBleListenChannelForFlow(
+	_In_	const IPV6_TO_BLE_PACKET_METADATA*	metadata
+)
+{
+	return &gListenChannels[metadata->flowHash % gListenChannelCount];
+}
+
+//
+// Returns the channel's pend queue holding the next packet to return, or NULL
+// if no packets are pended: of the highest priority class that has pended
+// packets, the queue whose oldest packet arrived first. Sequence numbers are
+// assigned across both directions of a channel, so comparing the heads keeps
+// arrival order within a class. The caller holds the channel's lock.
+//
+static
+PLISTEN_PEND_QUEUE
+IPv6ToBleListenNextPendQueue(
+	_In_	PLISTEN_CHANNEL	channel
+)
+{
+	PLISTEN_PEND_QUEUE oldestQueue = NULL;
+
+	for (ULONG priority = 0; priority < IPV6_TO_BLE_PRIORITY_COUNT && !oldestQueue; priority++)
+	{
+		for (ULONG direction = INBOUND; direction <= OUTBOUND; direction++)
+		{
+			PLISTEN_PEND_QUEUE pendQueue = &channel->pendQueues[priority][direction];
+
+			if (pendQueue->count == 0)
+			{
+				continue;
+			}
+
+			if (!oldestQueue ||
+				pendQueue->packets[pendQueue->head].sequence <
+				oldestQueue->packets[oldestQueue->head].sequence)
+			{
+				oldestQueue = pendQueue;
+			}
+		}
+	}
+
+	return oldestQueue;
+}
+
+//
+// Fills a batched listen request's output buffer with as many of the
+// channel's pended packets as fit, highest priority class first and oldest
+// first within a class, in the record format
+// described in Public.h. Returns the number of bytes written. The caller
+// holds the channel's lock.
+//
+static
+ULONG_PTR
+IPv6ToBleListenDrainPendQueues(
+	_In_									PLISTEN_CHANNEL	channel,
+	_Out_writes_bytes_(outputBufferLength)	BYTE*			outputBuffer,
+	_In_									size_t			outputBufferLength,
+	_In_									BOOLEAN			includeMetadata
+)
+{
+	ULONG_PTR offset = 0;
+	ULONG_PTR bytesWritten = 0;
+
+	UINT16 metadataLength = includeMetadata ? sizeof(IPV6_TO_BLE_PACKET_METADATA) : 0;
+
+	PLISTEN_PEND_QUEUE pendQueue = IPv6ToBleListenNextPendQueue(channel);
+
+	while (pendQueue)
+	{
+		PPENDED_PACKET slot = &pendQueue->packets[pendQueue->head];
+
+		ULONG_PTR recordLength = sizeof(IPV6_TO_BLE_LISTEN_RECORD) + metadataLength + slot->length;
+
+		if (offset + recordLength > outputBufferLength)
+		{
+			break;
+		}
+
+		PIPV6_TO_BLE_LISTEN_RECORD record = (PIPV6_TO_BLE_LISTEN_RECORD)(outputBuffer + offset);
+		record->packetLength = (UINT16)slot->length;
+		record->metadataLength = metadataLength;
+
+		RtlCopyMemory(record + 1, &slot->metadata, metadataLength);
+		RtlCopyMemory((BYTE*)(record + 1) + metadataLength, slot->data, slot->length);
+
+		IPv6ToBleStatisticsRecordLatency(IPV6_TO_BLE_PACKET_METADATA_CAPTURE_TIME(&slot->metadata));
+
+		bytesWritten = offset + recordLength;
+		offset = ALIGN_UP_BY(bytesWritten, IPV6_TO_BLE_LISTEN_RECORD_ALIGNMENT);
+
+		pendQueue->head = (pendQueue->head + 1) % pendQueue->depth;
+		pendQueue->count--;
+		pendQueue->deliveredCount++;
+
+		pendQueue = IPv6ToBleListenNextPendQueue(channel);
+	}
+
+	return bytesWritten;
+}
+
+//
+// Arms the channel's one-shot batch timer if a batched listen request is
+// waiting on the channel and the timer isn't already armed. The caller holds
+// the channel's lock.
+//
+static
+VOID
+IPv6ToBleListenArmBatchTimer(
+	_Inout_	PLISTEN_CHANNEL	channel
+)
+{
+	ULONG queuedRequests = 0;
+
+	if (channel->batchTimerArmed || !channel->batchTimer)
+	{
+		return;
+	}
+
+	WdfIoQueueGetState(channel->batchRequestQueue, &queuedRequests, NULL);
+	if (queuedRequests == 0)
+	{
+		return;
+	}
+
+	channel->batchTimerArmed = TRUE;
+	WdfTimerStart(channel->batchTimer,
+				  WDF_REL_TIMEOUT_IN_US(LISTEN_BATCH_COALESCE_US)
+				  );
+}
+
+//
+// Copies a packet into the next free slot of the channel's pend queue for
+// the packet's priority class and direction, applying the queue's drop
+// policy if it is full. The caller holds the channel's lock.
+//
+static
+NTSTATUS
+IPv6ToBleListenPendPacket(
+	_Inout_	PLISTEN_CHANNEL						channel,
+	_In_	NET_BUFFER_LIST*					NBL,
+	_In_	UINT32								ipHeaderOffset,
+	_In_	const IPV6_TO_BLE_PACKET_METADATA*	metadata
+)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+
+	NT_ASSERT(metadata->priority < IPV6_TO_BLE_PRIORITY_COUNT);
+
+	PLISTEN_PEND_QUEUE pendQueue = &channel->pendQueues[metadata->priority][metadata->direction];
+
+	if (pendQueue->depth == 0)
+	{
+		return STATUS_DEVICE_NOT_READY;
+	}
+
+	if (pendQueue->count == pendQueue->depth)
+	{
+		pendQueue->droppedCount++;
+
+		if (pendQueue->dropPolicy == LISTEN_DROP_NEWEST)
+		{
+			return STATUS_DEVICE_BUSY;
+		}
+
+		// Drop the oldest packet to make room
+		pendQueue->head = (pendQueue->head + 1) % pendQueue->depth;
+		pendQueue->count--;
+	}
+
+	PPENDED_PACKET slot = &pendQueue->packets[(pendQueue->head + pendQueue->count) % pendQueue->depth];
+
+	UINT32 packetSize = LISTEN_PACKET_MAX_LENGTH;
+	status = IPv6ToBleNBLCopyToBuffer(NBL,
+									  ipHeaderOffset,
+									  slot->data,
+									  &packetSize
+									  );
+	if (!NT_SUCCESS(status))
+	{
+		pendQueue->droppedCount++;
+		return status;
+	}
+
+	IPv6ToBleTcpClampMss(slot->data, packetSize);
+
+	slot->sequence = channel->pendSequence++;
+	slot->metadata = *metadata;
+	slot->length = packetSize;
+	pendQueue->count++;
+	pendQueue->pendedCount++;
+
+	return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleListenDeliverPacket(
+	NET_BUFFER_LIST*					NBL,
+	UINT32								ipHeaderOffset,
+	const IPV6_TO_BLE_PACKET_METADATA*	metadata
+)
+/*++
+Routine Description:
+
+	Hands an intercepted packet to the usermode packet processing app. If the
+	app has mapped the shared rings, the packet goes into the listen ring.
+	Otherwise the packet goes to the listen channel picked by its flow hash:
+	if a listen request is outstanding on that channel, the packet is copied
+	into its output buffer and the request is completed. Otherwise, the
+	packet is copied into the next free slot of the channel's pend queue for
+	its priority class and direction, and the channel's batch timer is armed
+	if a batched listen request is waiting for it.
+
+	If the pend queue is full, the queue's drop policy decides whether the new
+	packet or the oldest pended packet is dropped. Either way the queue's drop
+	counter is incremented.
+
+	The packet's metadata travels with it, and is returned in front of it to
+	listen requests that ask for it. The time from the metadata's capture
+	timestamp until a listen request returns the packet is recorded in the
+	latency histogram (see Statistics.c).
+
+	The caller has already verified that the packet is no larger than
+	LISTEN_PACKET_MAX_LENGTH, and blocks/absorbs the original packet whatever
+	this function returns.
+
+Arguments:
+
+	NBL - the intercepted packet.
+
+	ipHeaderOffset - how far before the NBL's current position the IP header
+	starts. See IPv6ToBleNBLCopyToBuffer.
+
+	metadata - the packet's metadata, filled in by the classify callout. Its
+	flow hash selects the listen channel, and its priority class and direction
+	the pend queue.
+
+Return Value:
+
+	STATUS_SUCCESS if the packet was delivered or pended, appropriate NTSTATUS
+	error codes if it was dropped.
+
+--*/
+{
+	NTSTATUS status = STATUS_SUCCESS;
+
+	WDFREQUEST outRequest = NULL;
+	BOOLEAN requestRetrieved = FALSE;
+	ULONG_PTR bytesTransferred = 0;
+
+	BYTE* outputBuffer = NULL;
+	size_t outputBufferLength = 0;
+
+	ULONG direction = metadata->direction;
+
+	PLISTEN_CHANNEL channel = IPv6ToBleListenChannelForFlow(metadata);
+
+	//
+	// Step 1
+	// If the app has mapped the shared rings, the listen ring replaces the
+	// listen channels. The flag is read without the lock first so that the
+	// usual case doesn't take a lock shared by all channels; a packet that
+	// races with the rings being mapped is pended on its channel as if it had
+	// arrived just before. The flag is checked again under the lock, which
+	// unmapping takes, before the ring is touched.
+	//
+	if (*(volatile BOOLEAN*)&gSharedRings.active)
+	{
+		WdfSpinLockAcquire(gListenRequestQueueLock);
+
+		if (gSharedRings.active)
+		{
+			status = IPv6ToBleSharedRingsProducePacket(NBL,
+													   ipHeaderOffset,
+													   direction
+													   );
+			WdfSpinLockRelease(gListenRequestQueueLock);
+			return status;
+		}
+
+		WdfSpinLockRelease(gListenRequestQueueLock);
+	}
+
+	//
+	// Step 2
+	// Try to retrieve a listen request outstanding on the flow's channel. If
+	// there isn't one, pend the packet on the channel. The channel's lock is
+	// held across both so that a listen request arriving in between can't
+	// miss this packet.
+	//
+	WdfSpinLockAcquire(channel->lock);
+
+	status = WdfIoQueueRetrieveNextRequest(channel->requestQueue, &outRequest);
+	if (NT_SUCCESS(status))
+	{
+		requestRetrieved = TRUE;
+	}
+	else
+	{
+		status = IPv6ToBleListenPendPacket(channel,
+										   NBL,
+										   ipHeaderOffset,
+										   metadata
+										   );
+		if (NT_SUCCESS(status))
+		{
+			IPv6ToBleListenArmBatchTimer(channel);
+		}
+	}
+
+	WdfSpinLockRelease(channel->lock);
+
+	if (!requestRetrieved)
+	{
+		if (!NT_SUCCESS(status))
+		{
+			TraceDataPath(TRACE_LEVEL_WARNING, TRACE_LISTEN, "No listen request outstanding on channel %u and pend queue %u could not take the packet, %!STATUS!", (ULONG)(channel - gListenChannels), direction, status);
+		}
+		goto Exit;
+	}
+
+	//
+	// Step 3
+	// Copy the metadata, if the request asked for it, and the packet,
+	// including the IP header, to the request's output buffer. The
+	// EvtIoDeviceControl callback verified the buffer can hold both before
+	// queueing the request. The flags are read first, since the input and
+	// output buffers are the same memory.
+	//
+	UINT32 metadataLength = IPv6ToBleListenRequestWantsMetadata(outRequest) ?
+							sizeof(IPV6_TO_BLE_PACKET_METADATA) : 0;
+
+	status = WdfRequestRetrieveOutputBuffer(outRequest,
+											sizeof(BYTE) * 48,	// Min 48 bytes
+											(PVOID*)&outputBuffer,
+											&outputBufferLength
+											);
+	if (!NT_SUCCESS(status))
+	{
+		TraceDataPath(TRACE_LEVEL_ERROR, TRACE_LISTEN, "Retrieving output buffer from WDFREQUEST failed during %!FUNC! with %!STATUS!", status);
+		goto Exit;
+	}
+
+	if (outputBufferLength < metadataLength)
+	{
+		status = STATUS_BUFFER_TOO_SMALL;
+		goto Exit;
+	}
+	RtlCopyMemory(outputBuffer, metadata, metadataLength);
+
+	UINT32 packetSize = (UINT32)(outputBufferLength - metadataLength);
+	status = IPv6ToBleNBLCopyToBuffer(NBL,
+									  ipHeaderOffset,
+									  outputBuffer + metadataLength,
+									  &packetSize
+									  );
+	if (!NT_SUCCESS(status))
+	{
+		goto Exit;
+	}
+
+	IPv6ToBleTcpClampMss(outputBuffer + metadataLength, packetSize);
+
+	bytesTransferred = metadataLength + packetSize;
+
+	IPv6ToBleStatisticsRecordLatency(IPV6_TO_BLE_PACKET_METADATA_CAPTURE_TIME(metadata));
+
+Exit:
+
+	if (requestRetrieved)
+	{
+		WdfRequestCompleteWithInformation(outRequest, status, bytesTransferred);
+	}
+
+	return status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleListenHandleRequest(
+	WDFREQUEST	Request,
+	ULONG_PTR*	info
+)
+/*++
+Routine Description:
+
+	Handles a new listen request. If any packets are pended on the listen
+	channel the request asked for, the oldest one of the highest priority
+	class that has any, from either direction, is copied into the request's
+	output buffer and the caller completes the request. Otherwise the
+	request is forwarded to the channel's listen request queue to wait for
+	the next packet steered to the channel.
+
+Arguments:
+
+	Request - the listen request. Its output buffer has already been verified
+	to be LISTEN_PACKET_MAX_LENGTH bytes.
+
+	info - receives the number of bytes copied into the output buffer.
+
+Return Value:
+
+	STATUS_SUCCESS if a pended packet was returned; the caller completes the
+	request. STATUS_PENDING if the request was forwarded to the listen request
+	queue; the caller must not touch it again. STATUS_INVALID_PARAMETER if the
+	request asked for a channel that doesn't exist. Other NTSTATUS error codes
+	otherwise; the caller completes the request.
+
+--*/
+{
+	NTSTATUS status = STATUS_SUCCESS;
+
+	BYTE* outputBuffer = NULL;
+	size_t outputBufferLength = 0;
+
+	*info = 0;
+
+	// Read the input before anything is written to the shared buffer
+	UINT32 metadataLength = IPv6ToBleListenRequestWantsMetadata(Request) ?
+							sizeof(IPV6_TO_BLE_PACKET_METADATA) : 0;
+
+	PLISTEN_CHANNEL channel = IPv6ToBleListenRequestChannel(Request);
+	if (!channel)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	status = WdfRequestRetrieveOutputBuffer(Request,
+											metadataLength + LISTEN_PACKET_MAX_LENGTH,
+											(PVOID*)&outputBuffer,
+											&outputBufferLength
+											);
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_LISTEN, "Retrieving output buffer from WDFREQUEST failed during %!FUNC! with %!STATUS!", status);
+		return status;
+	}
+
+	WdfSpinLockAcquire(channel->lock);
+
+	//
+	// Step 1
+	// Find the channel's next pended packet: the oldest of the highest
+	// priority class that has any
+	//
+	PLISTEN_PEND_QUEUE nextQueue = IPv6ToBleListenNextPendQueue(channel);
+
+	//
+	// Step 2
+	// Return that packet if there is one...
+	//
+	if (nextQueue)
+	{
+		PPENDED_PACKET slot = &nextQueue->packets[nextQueue->head];
+
+		RtlCopyMemory(outputBuffer, &slot->metadata, metadataLength);
+		RtlCopyMemory(outputBuffer + metadataLength, slot->data, slot->length);
+		*info = metadataLength + slot->length;
+
+		IPv6ToBleStatisticsRecordLatency(IPV6_TO_BLE_PACKET_METADATA_CAPTURE_TIME(&slot->metadata));
+
+		nextQueue->head = (nextQueue->head + 1) % nextQueue->depth;
+		nextQueue->count--;
+		nextQueue->deliveredCount++;
+
+		WdfSpinLockRelease(channel->lock);
+
+		return STATUS_SUCCESS;
+	}
+
+	//
+	// Step 3
+	// ...otherwise wait in the channel's listen request queue for the next
+	// packet
+	//
+	status = WdfRequestForwardToIoQueue(Request, channel->requestQueue);
+
+	WdfSpinLockRelease(channel->lock);
+
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_LISTEN, "Forwarding I/O request to listening queue failed %!STATUS!", status);
+		return status;
+	}
+
+	return STATUS_PENDING;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleListenHandleBatchRequest(
+	WDFREQUEST	Request,
+	ULONG_PTR*	info
+)
+/*++
+Routine Description:
+
+	Handles a new batched listen request. If any packets are pended on the
+	listen channel the request asked for, as many as fit are copied into the
+	request's output buffer right away and the caller completes the request.
+	Otherwise the request is forwarded to the channel's batched listen request
+	queue, and the channel's batch timer fills it shortly after the next
+	packet is pended on the channel.
+
+	Batched requests are served from the pend queues, so they are refused if
+	pending is disabled.
+
+Arguments:
+
+	Request - the batched listen request. Its output buffer has already been
+	verified to be at least IPV6_TO_BLE_LISTEN_BATCH_MIN_LENGTH bytes.
+
+	info - receives the number of bytes written to the output buffer.
+
+Return Value:
+
+	STATUS_SUCCESS if pended packets were returned; the caller completes the
+	request. STATUS_PENDING if the request was forwarded to the batched listen
+	request queue; the caller must not touch it again. STATUS_INVALID_PARAMETER
+	if the request asked for a channel that doesn't exist. Other NTSTATUS
+	error codes otherwise; the caller completes the request.
+
+--*/
+{
+	NTSTATUS status = STATUS_SUCCESS;
+
+	BYTE* outputBuffer = NULL;
+	size_t outputBufferLength = 0;
+
+	*info = 0;
+
+	// Read the input before anything is written to the shared buffer
+	BOOLEAN includeMetadata = IPv6ToBleListenRequestWantsMetadata(Request);
+
+	PLISTEN_CHANNEL channel = IPv6ToBleListenRequestChannel(Request);
+	if (!channel)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (!channel->pendQueues[IPV6_TO_BLE_PRIORITY_NORMAL][INBOUND].packets &&
+		!channel->pendQueues[IPV6_TO_BLE_PRIORITY_NORMAL][OUTBOUND].packets)
+	{
+		status = STATUS_INVALID_DEVICE_STATE;
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_LISTEN, "Batched listen requests need the pend queues, which are disabled, %!STATUS!", status);
+		return status;
+	}
+
+	status = WdfRequestRetrieveOutputBuffer(Request,
+											IPV6_TO_BLE_LISTEN_BATCH_MIN_LENGTH,
+											(PVOID*)&outputBuffer,
+											&outputBufferLength
+											);
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_LISTEN, "Retrieving output buffer from WDFREQUEST failed during %!FUNC! with %!STATUS!", status);
+		return status;
+	}
+
+	WdfSpinLockAcquire(channel->lock);
+
+	//
+	// Step 1
+	// Return whatever is already pended on the channel...
+	//
+	*info = IPv6ToBleListenDrainPendQueues(channel,
+										   outputBuffer,
+										   outputBufferLength,
+										   includeMetadata
+										   );
+	if (*info > 0)
+	{
+		WdfSpinLockRelease(channel->lock);
+
+		return STATUS_SUCCESS;
+	}
+
+	//
+	// Step 2
+	// ...otherwise wait in the channel's batched listen request queue for
+	// packets
+	//
+	status = WdfRequestForwardToIoQueue(Request, channel->batchRequestQueue);
+
+	WdfSpinLockRelease(channel->lock);
+
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_LISTEN, "Forwarding I/O request to batched listening queue failed %!STATUS!", status);
+		return status;
+	}
+
+	return STATUS_PENDING;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleListenCreateBatchTimers()
+/*++
+Routine Description:
+
+	Creates each listen channel's one-shot timer that fills the channel's
+	batched listen requests. A timer is armed when a packet is pended on its
+	channel while a batched request is waiting there, so packets that arrive
+	within LISTEN_BATCH_COALESCE_US of each other are returned in one
+	completion. Each timer's context points back at its channel.
+
+	A high resolution timer is requested because the coalescing delay is far
+	shorter than the default system timer resolution.
+
+	Called from IPv6ToBleQueuesInitialize, after the device object exists.
+
+Arguments:
+
+	None. Accesses global variables defined in Driver.h.
+
+Return Value:
+
+	STATUS_SUCCESS if successful, appropriate NTSTATUS error codes otherwise.
+
+--*/
+{
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_LISTEN, "%!FUNC! Entry");
+
+	PAGED_CODE();
+
+	NTSTATUS status = STATUS_SUCCESS;
+
+	WDF_TIMER_CONFIG timerConfig;
+	WDF_OBJECT_ATTRIBUTES timerAttributes;
+
+	for (ULONG channel = 0; channel < gListenChannelCount; channel++)
+	{
+		WDFTIMER batchTimer = NULL;
+
+		// One-shot timer. The timer state is guarded by the channel's spin
+		// lock, so no framework serialization is needed.
+		WDF_TIMER_CONFIG_INIT(&timerConfig, IPv6ToBleListenBatchTimerExpired);
+		timerConfig.AutomaticSerialization = FALSE;
+		timerConfig.UseHighResolutionTimer = WdfTrue;
+
+		WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&timerAttributes, LISTEN_BATCH_TIMER_CONTEXT);
+		timerAttributes.ParentObject = gWdfDeviceObject;
+
+		status = WdfTimerCreate(&timerConfig,
+								&timerAttributes,
+								&batchTimer
+								);
+		if (!NT_SUCCESS(status))
+		{
+			TraceEvents(TRACE_LEVEL_ERROR, TRACE_LISTEN, "Batch timer creation for channel %u failed %!STATUS!", channel, status);
+			break;
+		}
+
+		IPv6ToBleListenGetBatchTimerContext(batchTimer)->channel = &gListenChannels[channel];
+		gListenChannels[channel].batchTimer = batchTimer;
+	}
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_LISTEN, "%!FUNC! Exit");
+
+	return status;
+}
+
+_Use_decl_annotations_
+VOID
+IPv6ToBleListenBatchTimerExpired(
+	WDFTIMER	Timer
+)
+/*++
+Routine Description:
+
+	Fills the batched listen requests waiting on the timer's channel with the
+	packets pended on the channel since the timer was armed, oldest request
+	first, and completes them. Stops when either the channel's pend queues or
+	its batched listen request queue are empty.
+
+	Runs as a DPC at DISPATCH_LEVEL.
+
+Arguments:
+
+	Timer - a channel's batch timer. Its context points at the channel.
+
+Return Value:
+
+	None.
+
+--*/
+{
+	NTSTATUS status = STATUS_SUCCESS;
+
+	PLISTEN_CHANNEL channel = IPv6ToBleListenGetBatchTimerContext(Timer)->channel;
+
+	WdfSpinLockAcquire(channel->lock);
+
+	channel->batchTimerArmed = FALSE;
+
+	while (IPv6ToBleListenNextPendQueue(channel))
+	{
+		WDFREQUEST batchRequest = NULL;
+		BYTE* outputBuffer = NULL;
+		size_t outputBufferLength = 0;
+		ULONG_PTR bytesWritten = 0;
+		BOOLEAN includeMetadata = FALSE;
+
+		status = WdfIoQueueRetrieveNextRequest(channel->batchRequestQueue,
+											   &batchRequest
+											   );
+		if (!NT_SUCCESS(status))
+		{
+			// No batched request is waiting anymore; the packets stay pended
+			break;
+		}
+
+		includeMetadata = IPv6ToBleListenRequestWantsMetadata(batchRequest);
+
+		status = WdfRequestRetrieveOutputBuffer(batchRequest,
+												IPV6_TO_BLE_LISTEN_BATCH_MIN_LENGTH,
+												(PVOID*)&outputBuffer,
+												&outputBufferLength
+												);
+		if (NT_SUCCESS(status))
+		{
+			bytesWritten = IPv6ToBleListenDrainPendQueues(channel,
+														  outputBuffer,
+														  outputBufferLength,
+														  includeMetadata
+														  );
+		}
+
+		// Don't hold the lock while completing the request
+		WdfSpinLockRelease(channel->lock);
+
+		WdfRequestCompleteWithInformation(batchRequest, status, bytesWritten);
+
+		WdfSpinLockAcquire(channel->lock);
+	}
+
+	WdfSpinLockRelease(channel->lock);
+}
@@ -0,0 +1,104 @@
+/*++
+
+Module Name:
+
+	Listen.h
+
+Abstract:
+
+	This file contains definitions for the functions that hand intercepted
+	packets to the usermode packet processing app, either by completing an
+	outstanding listen request or by holding the packet in a bounded
+	pend queue for its direction and priority class until the next listen
+	request arrives. Packets are spread across one or more listen channels by
+	flow. The channel and
+	pend queue structures themselves are defined in Driver.h.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#ifndef _LISTEN_H_
+#define _LISTEN_H_
+
+EXTERN_C_START
+
+//-----------------------------------------------------------------------------
+// Functions to create and destroy the listen channels' pend queues
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+_Check_return_
+_Success_(return == STATUS_SUCCESS)
+NTSTATUS
+IPv6ToBleListenInitialize();
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+VOID
+IPv6ToBleListenCleanup();
+
+//-----------------------------------------------------------------------------
+// Function called by the classify callouts to deliver an intercepted packet
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+NTSTATUS
+IPv6ToBleListenDeliverPacket(
+	_In_	NET_BUFFER_LIST*					NBL,
+	_In_	UINT32								ipHeaderOffset,
+	_In_	const IPV6_TO_BLE_PACKET_METADATA*	metadata
+);
+
+//-----------------------------------------------------------------------------
+// Functions called by the I/O control callback for each new listen request
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+BOOLEAN
+IPv6ToBleListenRequestWantsMetadata(
+	_In_	WDFREQUEST	Request
+);
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+NTSTATUS
+IPv6ToBleListenHandleRequest(
+	_In_	WDFREQUEST	Request,
+	_Out_	ULONG_PTR*	info
+);
+
+//-----------------------------------------------------------------------------
+// Functions for batched listen requests, which return many packets per
+// completion
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+NTSTATUS
+IPv6ToBleListenHandleBatchRequest(
+	_In_	WDFREQUEST	Request,
+	_Out_	ULONG_PTR*	info
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+NTSTATUS
+IPv6ToBleListenCreateBatchTimers();
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+EVT_WDF_TIMER IPv6ToBleListenBatchTimerExpired;
+
+EXTERN_C_END
+
+#endif	// _LISTEN_H_
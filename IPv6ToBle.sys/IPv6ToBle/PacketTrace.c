@@ -0,0 +1,449 @@
+/*++
+
+Module Name:
+
+	PacketTrace.c
+
+Abstract:
+
+	This file contains the implementations for sampling the classify callouts'
+	decisions into an in-memory ring, and for the IOCTLs that change the data
+	path tracing settings and read the ring.
+
+	Tracing every packet with WPP slows the data path down and floods any
+	trace session, so the per-packet trace points are off by default (see
+	Trace.h). To see what the driver is doing with production traffic, the
+	classify callouts instead offer each decision to IPv6ToBlePacketTraceSample,
+	which keeps 1 in every gPacketTraceSampleRate of them as a compact record.
+
+	Each processor counts down to its next sample on its own cache line, so a
+	packet that isn't sampled only reads the sample rate and writes its own
+	processor's countdown. Sampled records are written to the ring under
+	gPacketTraceLock, which only sampled packets and the query IOCTL take.
+	The ring keeps the newest PACKET_TRACE_RING_SIZE records; the query IOCTL
+	returns the oldest unread ones and counts any that were overwritten first.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#include "Includes.h"
+#include "PacketTrace.tmh"	// auto-generated tracing file
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, IPv6ToBlePacketTraceInitialize)
+#pragma alloc_text (PAGE, IPv6ToBlePacketTraceCleanup)
+#endif
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBlePacketTraceInitialize()
+/*++
+Routine Description:
+
+	Reads the data path tracing settings from the registry, then creates the
+	lock, the ring of records, and a zeroed, cache-aligned countdown for every
+	possible processor. Called from IPv6ToBleDriverInitGlobalObjects before
+	the callouts are registered, so the ring exists before any packet can be
+	sampled.
+
+Arguments:
+
+	None. Accesses global variables defined in Driver.h.
+
+Return Value:
+
+	STATUS_SUCCESS if successful, appropriate NTSTATUS error codes otherwise.
+
+--*/
+{
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_PACKET_TRACE, "%!FUNC! Entry");
+
+	PAGED_CODE();
+
+	NTSTATUS status = STATUS_SUCCESS;
+
+	ULONG dataPathTracing = 0;
+	ULONG sampleRate = 0;
+
+	gDataPathTracing = 0;
+	gPacketTraceSampleRate = 0;
+	gPacketTraceProduced = 0;
+	gPacketTraceConsumed = 0;
+
+	//
+	// Step 1
+	// Read the settings. Missing values leave tracing and sampling off.
+	//
+	status = IPv6ToBleRegistryRetrievePacketTraceSettings(&dataPathTracing,
+														  &sampleRate
+														  );
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_PACKET_TRACE, "Reading packet trace settings failed during %!FUNC! with %!STATUS!", status);
+		goto Exit;
+	}
+
+	//
+	// Step 2
+	// Create the lock that guards the ring
+	//
+	WDF_OBJECT_ATTRIBUTES lockAttributes;
+	WDF_OBJECT_ATTRIBUTES_INIT(&lockAttributes);
+	lockAttributes.ParentObject = gWdfDeviceObject;
+
+	status = WdfSpinLockCreate(&lockAttributes, &gPacketTraceLock);
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_PACKET_TRACE, "Creating packet trace spin lock failed %!STATUS!", status);
+		goto Exit;
+	}
+
+	//
+	// Step 3
+	// Allocate the ring and the per-processor countdowns
+	//
+	gPacketTraceRing = (PIPV6_TO_BLE_PACKET_TRACE_RECORD)ExAllocatePoolWithTag(
+										NonPagedPoolNx,
+										PACKET_TRACE_RING_SIZE * sizeof(IPV6_TO_BLE_PACKET_TRACE_RECORD),
+										IPV6_TO_BLE_PACKET_TRACE_TAG
+									);
+	if (!gPacketTraceRing)
+	{
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_PACKET_TRACE, "Packet trace ring allocation failed during %!FUNC! with %!STATUS!", status);
+		goto Exit;
+	}
+
+	ULONG processorCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+	SIZE_T countdownsSize = 0;
+	status = RtlSizeTMult(processorCount,
+						  sizeof(PER_PROCESSOR_PACKET_TRACE),
+						  &countdownsSize
+						  );
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_PACKET_TRACE, "Packet trace countdown array size overflowed during %!FUNC! with %!STATUS!", status);
+		goto Exit;
+	}
+
+	gPacketTraceCountdowns = (PPER_PROCESSOR_PACKET_TRACE)ExAllocatePoolWithTag(
+										NonPagedPoolNxCacheAligned,
+										countdownsSize,
+										IPV6_TO_BLE_PACKET_TRACE_TAG
+									);
+	if (!gPacketTraceCountdowns)
+	{
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_PACKET_TRACE, "Packet trace countdown allocation failed during %!FUNC! with %!STATUS!", status);
+		goto Exit;
+	}
+	RtlZeroMemory(gPacketTraceCountdowns, countdownsSize);
+
+	//
+	// Step 4
+	// Apply the settings now that sampling has somewhere to go
+	//
+	gDataPathTracing = dataPathTracing ? 1 : 0;
+	gPacketTraceSampleRate = (LONG)min(sampleRate, MAXLONG);
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_PACKET_TRACE, "Data path tracing %u, packet trace sample rate %u", dataPathTracing, sampleRate);
+
+Exit:
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_PACKET_TRACE, "%!FUNC! Exit");
+
+	return status;
+}
+
+_Use_decl_annotations_
+VOID
+IPv6ToBlePacketTraceCleanup()
+/*++
+Routine Description:
+
+	Turns sampling off and frees the ring and the per-processor countdowns.
+	Called during driver unload after the callouts have been unregistered, so
+	no classify callout can still be sampling a packet.
+
+Arguments:
+
+	None. Accesses global variables defined in Driver.h.
+
+Return Value:
+
+	None.
+
+--*/
+{
+	PAGED_CODE();
+
+	gPacketTraceSampleRate = 0;
+	gDataPathTracing = 0;
+
+	if (gPacketTraceCountdowns)
+	{
+		ExFreePoolWithTag(gPacketTraceCountdowns, IPV6_TO_BLE_PACKET_TRACE_TAG);
+		gPacketTraceCountdowns = NULL;
+	}
+
+	if (gPacketTraceRing)
+	{
+		ExFreePoolWithTag(gPacketTraceRing, IPV6_TO_BLE_PACKET_TRACE_TAG);
+		gPacketTraceRing = NULL;
+	}
+}
+
+_Use_decl_annotations_
+VOID
+IPv6ToBlePacketTraceSample(
+	ULONG					direction,
+	UINT8					decision,
+	const IPV6_PACKET_INFO*	packetInfo,
+	NTSTATUS				status
+)
+/*++
+Routine Description:
+
+	Counts a classified packet against the current processor's countdown and,
+	if it is the packet to sample, writes a record of the callout's decision
+	to the ring, overwriting the oldest record if the ring is full.
+
+	Called through IPV6_TO_BLE_PACKET_TRACE, which skips the call entirely
+	while sampling is off.
+
+Arguments:
+
+	direction - INBOUND or OUTBOUND.
+
+	decision - the IPV6_TO_BLE_DECISION_* value for the packet.
+
+	packetInfo - the parsed IPv6 header, or NULL if it wasn't parsed.
+
+	status - the result of parsing the header or delivering the packet.
+
+Return Value:
+
+	None.
+
+--*/
+{
+	LONG sampleRate = ReadNoFence(&gPacketTraceSampleRate);
+	if (sampleRate <= 0)
+	{
+		return;
+	}
+
+	//
+	// Step 1
+	// Count down to the next sample. This isn't interlocked: if the thread
+	// moves to another processor in between, a sample is only shifted by a
+	// packet.
+	//
+	PPER_PROCESSOR_PACKET_TRACE countdown = &gPacketTraceCountdowns[KeGetCurrentProcessorIndex()];
+
+	if (--countdown->countdown > 0)
+	{
+		return;
+	}
+	countdown->countdown = sampleRate;
+
+	//
+	// Step 2
+	// Build the record outside the lock
+	//
+	IPV6_TO_BLE_PACKET_TRACE_RECORD record;
+	RtlZeroMemory(&record, sizeof(record));
+
+	record.classifyTime = KeQueryPerformanceCounter(NULL).QuadPart;
+	record.status = status;
+	record.direction = (UINT8)direction;
+	record.decision = decision;
+
+	if (packetInfo)
+	{
+		RtlCopyMemory(record.sourceAddress,
+					  packetInfo->sourceAddress,
+					  sizeof(IN6_ADDR)
+					  );
+		RtlCopyMemory(record.destinationAddress,
+					  packetInfo->destinationAddress,
+					  sizeof(IN6_ADDR)
+					  );
+		record.flowHash = IPv6ToBleNBLFlowHash(packetInfo);
+		record.packetLength = (UINT16)min(packetInfo->packetLength, MAXUINT16);
+		record.nextHeader = packetInfo->nextHeader;
+	}
+
+	//
+	// Step 3
+	// Write it to the next slot
+	//
+	WdfSpinLockAcquire(gPacketTraceLock);
+
+	record.sequence = gPacketTraceProduced;
+	gPacketTraceRing[gPacketTraceProduced % PACKET_TRACE_RING_SIZE] = record;
+	gPacketTraceProduced++;
+
+	WdfSpinLockRelease(gPacketTraceLock);
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBlePacketTraceSetSettings(
+	WDFREQUEST	Request
+)
+/*++
+Routine Description:
+
+	Turns the data path WPP trace points on or off and sets the packet trace
+	sample rate. The per-processor countdowns aren't reset, so a lower rate
+	takes full effect once each processor's current countdown runs out.
+
+Arguments:
+
+	Request - the WDFREQUEST from user mode. Its input buffer is an
+	IPV6_TO_BLE_PACKET_TRACE_SETTINGS.
+
+Return Value:
+
+	STATUS_SUCCESS if successful, appropriate NTSTATUS error codes otherwise.
+
+--*/
+{
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_PACKET_TRACE, "%!FUNC! Entry");
+
+	NTSTATUS status = STATUS_SUCCESS;
+
+	PIPV6_TO_BLE_PACKET_TRACE_SETTINGS settings = NULL;
+
+	status = WdfRequestRetrieveInputBuffer(Request,
+										   sizeof(IPV6_TO_BLE_PACKET_TRACE_SETTINGS),
+										   (PVOID*)&settings,
+										   NULL
+										   );
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_PACKET_TRACE, "Retrieving input buffer from WDFREQUEST failed during %!FUNC! with %!STATUS!", status);
+		goto Exit;
+	}
+
+	InterlockedExchange(&gDataPathTracing,
+						(settings->flags & IPV6_TO_BLE_PACKET_TRACE_FLAG_DATA_PATH_WPP) ? 1 : 0
+						);
+	InterlockedExchange(&gPacketTraceSampleRate,
+						(LONG)min(settings->sampleRate, MAXLONG)
+						);
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_PACKET_TRACE, "Packet trace flags set to 0x%x, sample rate set to %u", settings->flags, settings->sampleRate);
+
+Exit:
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_PACKET_TRACE, "%!FUNC! Exit");
+
+	return status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBlePacketTraceQuery(
+	WDFREQUEST	Request,
+	ULONG_PTR*	info
+)
+/*++
+Routine Description:
+
+	Copies as many of the oldest unread records as fit into the request's
+	output buffer, after a header with the current settings, and removes them
+	from the ring. Records that were overwritten before this query are
+	skipped and counted in the header.
+
+Arguments:
+
+	Request - the WDFREQUEST from user mode. Its output buffer receives an
+	IPV6_TO_BLE_PACKET_TRACE_HEADER followed by the records.
+
+	info - receives the number of bytes written to the output buffer.
+
+Return Value:
+
+	STATUS_SUCCESS if successful, appropriate NTSTATUS error codes otherwise.
+
+--*/
+{
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_PACKET_TRACE, "%!FUNC! Entry");
+
+	NTSTATUS status = STATUS_SUCCESS;
+
+	PIPV6_TO_BLE_PACKET_TRACE_HEADER header = NULL;
+	size_t outputBufferLength = 0;
+
+	*info = 0;
+
+	//
+	// Step 1
+	// Retrieve the output buffer and work out how many records fit
+	//
+	status = WdfRequestRetrieveOutputBuffer(Request,
+											sizeof(IPV6_TO_BLE_PACKET_TRACE_HEADER),
+											(PVOID*)&header,
+											&outputBufferLength
+											);
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_PACKET_TRACE, "Retrieving output buffer from WDFREQUEST failed during %!FUNC! with %!STATUS!", status);
+		goto Exit;
+	}
+
+	PIPV6_TO_BLE_PACKET_TRACE_RECORD records = (PIPV6_TO_BLE_PACKET_TRACE_RECORD)(header + 1);
+
+	UINT64 capacity = (outputBufferLength - sizeof(IPV6_TO_BLE_PACKET_TRACE_HEADER)) /
+					  sizeof(IPV6_TO_BLE_PACKET_TRACE_RECORD);
+
+	RtlZeroMemory(header, sizeof(IPV6_TO_BLE_PACKET_TRACE_HEADER));
+
+	//
+	// Step 2
+	// Skip what was overwritten, then copy out the oldest unread records
+	//
+	WdfSpinLockAcquire(gPacketTraceLock);
+
+	UINT64 unread = gPacketTraceProduced - gPacketTraceConsumed;
+	if (unread > PACKET_TRACE_RING_SIZE)
+	{
+		header->recordsLost = unread - PACKET_TRACE_RING_SIZE;
+		gPacketTraceConsumed += header->recordsLost;
+		unread = PACKET_TRACE_RING_SIZE;
+	}
+
+	UINT32 recordCount = (UINT32)min(unread, capacity);
+
+	for (UINT32 i = 0; i < recordCount; i++)
+	{
+		records[i] = gPacketTraceRing[(gPacketTraceConsumed + i) % PACKET_TRACE_RING_SIZE];
+	}
+	gPacketTraceConsumed += recordCount;
+
+	WdfSpinLockRelease(gPacketTraceLock);
+
+	//
+	// Step 3
+	// Fill in the rest of the header
+	//
+	header->settings.flags = ReadNoFence(&gDataPathTracing) ?
+							 IPV6_TO_BLE_PACKET_TRACE_FLAG_DATA_PATH_WPP : 0;
+	header->settings.sampleRate = (UINT32)ReadNoFence(&gPacketTraceSampleRate);
+	header->recordCount = recordCount;
+
+	*info = sizeof(IPV6_TO_BLE_PACKET_TRACE_HEADER) +
+			recordCount * sizeof(IPV6_TO_BLE_PACKET_TRACE_RECORD);
+
+Exit:
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_PACKET_TRACE, "%!FUNC! Exit");
+
+	return status;
+}
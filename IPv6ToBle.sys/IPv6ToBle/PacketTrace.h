@@ -0,0 +1,94 @@
+/*++
+
+Module Name:
+
+	PacketTrace.h
+
+Abstract:
+
+	This file contains definitions for the functions that sample the classify
+	callouts' decisions into the in-memory packet trace ring, and for the
+	IOCTLs that change the data path tracing settings and read the ring. The
+	record format is defined in Public.h; the per-processor structure is
+	defined in Driver.h.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#ifndef _PACKET_TRACE_H_
+#define _PACKET_TRACE_H_
+
+EXTERN_C_START
+
+//-----------------------------------------------------------------------------
+// Macro to offer a classify decision to the packet trace ring. Decision is an
+// IPV6_TO_BLE_DECISION_* value, and PacketInfo is NULL if the IPv6 header
+// hasn't been parsed.
+//
+// While sampling is off this is one read of a global that is almost never
+// written, so it costs next to nothing on the data path.
+//-----------------------------------------------------------------------------
+
+#define IPV6_TO_BLE_PACKET_TRACE(Direction, Decision, PacketInfo, Status)      \
+    ((ReadNoFence(&gPacketTraceSampleRate) != 0) ?                              \
+        IPv6ToBlePacketTraceSample((Direction), (Decision), (PacketInfo), (Status)) : \
+        (VOID)0)
+
+//-----------------------------------------------------------------------------
+// Functions to create and destroy the packet trace ring
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+_Check_return_
+_Success_(return == STATUS_SUCCESS)
+NTSTATUS
+IPv6ToBlePacketTraceInitialize();
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+VOID
+IPv6ToBlePacketTraceCleanup();
+
+//-----------------------------------------------------------------------------
+// Function called by the classify callouts, through the macro above
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+VOID
+IPv6ToBlePacketTraceSample(
+	_In_		ULONG					direction,
+	_In_		UINT8					decision,
+	_In_opt_	const IPV6_PACKET_INFO*	packetInfo,
+	_In_		NTSTATUS				status
+);
+
+//-----------------------------------------------------------------------------
+// Functions called by the I/O control callback for the packet trace IOCTLs
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+NTSTATUS
+IPv6ToBlePacketTraceSetSettings(
+	_In_	WDFREQUEST	Request
+);
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+NTSTATUS
+IPv6ToBlePacketTraceQuery(
+	_In_	WDFREQUEST	Request,
+	_Out_	ULONG_PTR*	info
+);
+
+EXTERN_C_END
+
+#endif	// _PACKET_TRACE_H_
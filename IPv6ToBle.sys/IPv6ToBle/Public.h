@@ -15,6 +15,9 @@ Environment:
 
 --*/
 
+#ifndef _PUBLIC_H_
+#define _PUBLIC_H_
+
 //-----------------------------------------------------------------------------
 // Arbitrary code for device type to use with custom IOCTL definitions
 //-----------------------------------------------------------------------------
@@ -30,6 +33,10 @@ Environment:
 // First IOCTL: Listen for incoming or outgoing IPv6 packets to send up to the
 // usermode app and redirect OUT over Bluetooth Low Energy.
 //
+// The output buffer must be exactly 1280 bytes, or 1280 bytes plus
+// sizeof(IPV6_TO_BLE_PACKET_METADATA) if metadata is requested through the
+// optional IPV6_TO_BLE_LISTEN_INPUT (see below).
+//
 // Used on the border router device and the IoT core devices.
 //
 // Sent by the packet processing background app.
@@ -117,3 +124,661 @@ Environment:
 // Sent by the packet processing app.
 //
 #define IOCTL_IPV6_TO_BLE_QUERY_MESH_ROLE CTL_CODE(FILE_DEVICE_IPV6_TO_BLE, 0x8090, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Eleventh IOCTL: Listen for incoming or outgoing IPv6 packets in batches.
+//
+// Like the first IOCTL, but returns as many packets as are waiting in one
+// completion. The output buffer may be any size that holds at least one
+// record with a full 1280 byte packet (IPV6_TO_BLE_LISTEN_BATCH_MIN_LENGTH,
+// plus sizeof(IPV6_TO_BLE_PACKET_METADATA) if metadata is requested). See
+// the record format below.
+//
+// Used on the border router device and the IoT core devices.
+//
+// Sent by the packet processing background app.
+//
+#define IOCTL_IPV6_TO_BLE_LISTEN_NETWORK_V6_BATCH CTL_CODE(FILE_DEVICE_IPV6_TO_BLE, 0x8091, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//-----------------------------------------------------------------------------
+// Optional input for both listen IOCTLs.
+//
+// If the input buffer is an IPV6_TO_BLE_LISTEN_INPUT with
+// IPV6_TO_BLE_LISTEN_FLAG_METADATA set, each packet returned by the request
+// is preceded by an IPV6_TO_BLE_PACKET_METADATA describing where and when it
+// was captured, so the app doesn't have to parse the headers to route it.
+// Without an input buffer, only the packets are returned, as before.
+//
+// The driver can be configured with several listen channels (the "Listen
+// Channel Count" registry value), each with its own listen requests and pend
+// queues. Every intercepted packet goes to one channel, picked by its flow
+// hash, so the packets of one flow are always returned in order by the same
+// channel while different flows are returned in parallel. The channel field
+// picks the channel a request waits on; requests without it, or with only
+// the flags, wait on channel 0. The app must keep requests outstanding on
+// every channel, and can read the number of channels with the readiness
+// IOCTL.
+//
+// The metadata is versioned: its length field gives its size, and fields
+// are only ever added at the end with a new version, so an app built against
+// an older version can skip what it doesn't know. Version 2 added the
+// traffic class and the priority class the packet was pended in.
+//
+// Packets waiting in a channel's pend queues are returned by priority class:
+// every pended packet of a higher class is returned before any packet of a
+// lower class, and packets of the same class are returned oldest first. The
+// class comes from the DSCP in the packet's traffic class:
+//
+// - High: DSCP 40 (CS5) and above, i.e. expedited forwarding, voice admit
+//   and network control, for small control messages that must not wait
+//   behind bulk transfers.
+// - Low: DSCP 1 (lower effort) and 8 (CS1), for bulk transfers such as
+//   firmware updates.
+// - Normal: everything else, including unmarked traffic.
+//
+// Packets of one flow normally share a DSCP, so they stay in order.
+//-----------------------------------------------------------------------------
+
+#define IPV6_TO_BLE_LISTEN_FLAG_METADATA    0x1
+
+typedef struct _IPV6_TO_BLE_LISTEN_INPUT
+{
+    UINT32  flags;          // IPV6_TO_BLE_LISTEN_FLAG_* flags
+    UINT32  channel;        // Listen channel, 0 to the channel count - 1
+} IPV6_TO_BLE_LISTEN_INPUT, *PIPV6_TO_BLE_LISTEN_INPUT;
+
+#define IPV6_TO_BLE_PACKET_METADATA_VERSION 2
+
+#define IPV6_TO_BLE_PRIORITY_HIGH       0
+#define IPV6_TO_BLE_PRIORITY_NORMAL     1
+#define IPV6_TO_BLE_PRIORITY_LOW        2
+#define IPV6_TO_BLE_PRIORITY_COUNT      3
+
+typedef struct _IPV6_TO_BLE_PACKET_METADATA
+{
+    UINT16  version;            // IPV6_TO_BLE_PACKET_METADATA_VERSION
+    UINT16  length;             // Size of the metadata; the packet follows
+    UINT8   direction;          // Callout: 0 inbound, 1 outbound
+    UINT8   transportProtocol;  // Next header value of the IPv6 header
+    UINT16  ipHeaderLength;     // Bytes of IP header before the payload
+    UINT32  interfaceIndex;     // Interface the packet was captured on
+    UINT32  subInterfaceIndex;  // Sub-interface the packet was captured on
+    UINT32  flowHash;           // Hash of the addresses, flow label and ports
+    UINT32  captureTimeLow;     // Performance counter when captured, split
+    UINT32  captureTimeHigh;    // like a FILETIME to keep 4 byte alignment
+    UINT8   trafficClass;       // Traffic class (DSCP + ECN) of the packet
+    UINT8   priority;           // IPV6_TO_BLE_PRIORITY_* class
+    UINT16  reserved;
+} IPV6_TO_BLE_PACKET_METADATA, *PIPV6_TO_BLE_PACKET_METADATA;
+
+#define IPV6_TO_BLE_PACKET_METADATA_CAPTURE_TIME(Metadata) \
+    ((INT64)(((UINT64)(Metadata)->captureTimeHigh << 32) | (Metadata)->captureTimeLow))
+
+//-----------------------------------------------------------------------------
+// Record format for the batched listen IOCTL.
+//
+// The output buffer is filled with records back to back. Each record is this
+// header, then the metadata if it was requested, then the packet, including
+// its IPv6 header. The next record starts at the next
+// IPV6_TO_BLE_LISTEN_RECORD_ALIGNMENT byte boundary from the start of the
+// buffer. The number of bytes returned ends at the last packet byte, so the
+// last record is not padded.
+//-----------------------------------------------------------------------------
+
+typedef struct _IPV6_TO_BLE_LISTEN_RECORD
+{
+    UINT16  packetLength;   // Length of the packet, in bytes
+    UINT16  metadataLength; // Length of the metadata before the packet; 0
+                            // if metadata wasn't requested
+} IPV6_TO_BLE_LISTEN_RECORD, *PIPV6_TO_BLE_LISTEN_RECORD;
+
+#define IPV6_TO_BLE_LISTEN_RECORD_ALIGNMENT 4
+
+#define IPV6_TO_BLE_LISTEN_BATCH_MIN_LENGTH (sizeof(IPV6_TO_BLE_LISTEN_RECORD) + 1280)
+
+//
+// Twelfth IOCTL: Map the shared packet rings into the calling process.
+//
+// The input buffer is an IPV6_TO_BLE_SHARED_RINGS_MAP_INPUT and the output
+// buffer receives an IPV6_TO_BLE_SHARED_RINGS_MAP_OUTPUT. Only one process
+// can have the rings mapped at a time. While they are mapped, intercepted
+// packets go to the listen ring instead of to listen requests.
+//
+// Used on the border router device and the IoT core devices.
+//
+// Sent by the packet processing background app.
+//
+#define IOCTL_IPV6_TO_BLE_MAP_SHARED_RINGS CTL_CODE(FILE_DEVICE_IPV6_TO_BLE, 0x8092, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Thirteenth IOCTL: Unmap the shared packet rings. Closing the handle that
+// mapped them does the same.
+//
+// Used on the border router device and the IoT core devices.
+//
+// Sent by the packet processing background app.
+//
+#define IOCTL_IPV6_TO_BLE_UNMAP_SHARED_RINGS CTL_CODE(FILE_DEVICE_IPV6_TO_BLE, 0x8093, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Fourteenth IOCTL: Wake the driver to inject the packets in the inject ring.
+// See the ring protocol below for when this needs to be sent.
+//
+// Used on the border router device and the IoT core devices.
+//
+// Sent by the packet processing background app.
+//
+#define IOCTL_IPV6_TO_BLE_KICK_INJECT_RING CTL_CODE(FILE_DEVICE_IPV6_TO_BLE, 0x8094, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//-----------------------------------------------------------------------------
+// Layout of the shared packet rings.
+//
+// The mapped region holds two single-producer, single-consumer rings: the
+// listen ring, which the driver fills with intercepted packets, and the
+// inject ring, which the app fills with packets for the driver to inject.
+// Each ring is a header followed by slotCount slots of slotSize bytes.
+//
+// Indices are free-running counts, so a ring is empty when producerIndex ==
+// consumerIndex and full when producerIndex - consumerIndex == slotCount. The
+// producer writes the slot before advancing producerIndex; the consumer reads
+// the slot before advancing consumerIndex.
+//
+// Before the consumer sleeps, it sets consumerWaiting and then checks the
+// ring once more. After the producer advances producerIndex, it exchanges
+// consumerWaiting with 0 and, only if it was set, wakes the consumer: the
+// driver by signalling the event given at map time, the app by sending
+// IOCTL_IPV6_TO_BLE_KICK_INJECT_RING. While both sides keep up, neither
+// side makes a system call.
+//-----------------------------------------------------------------------------
+
+typedef struct _IPV6_TO_BLE_SHARED_RING_HEADER
+{
+    volatile LONG   producerIndex;      // Written only by the producer
+    LONG            reserved0[15];      // Keeps the indices on separate
+                                        // cache lines
+    volatile LONG   consumerIndex;      // Written only by the consumer
+    volatile LONG   consumerWaiting;    // Set by the consumer before sleeping
+    LONG            reserved1[14];
+    UINT32          slotCount;          // Number of slots, a power of 2
+    UINT32          slotSize;           // Bytes per slot
+    LONG            reserved2[14];
+} IPV6_TO_BLE_SHARED_RING_HEADER, *PIPV6_TO_BLE_SHARED_RING_HEADER;
+
+typedef struct _IPV6_TO_BLE_SHARED_RING_SLOT
+{
+    UINT16  packetLength;   // Length of the packet, in bytes
+    UINT16  direction;      // Inject ring: 0 inbound, 1 outbound
+    UINT8   packet[1280];   // The packet, including its IPv6 header
+} IPV6_TO_BLE_SHARED_RING_SLOT, *PIPV6_TO_BLE_SHARED_RING_SLOT;
+
+typedef struct _IPV6_TO_BLE_SHARED_RINGS_MAP_INPUT
+{
+    UINT64  listenEvent;    // Handle to an event the driver signals when a
+                            // packet is added to the listen ring while the
+                            // app waits
+} IPV6_TO_BLE_SHARED_RINGS_MAP_INPUT, *PIPV6_TO_BLE_SHARED_RINGS_MAP_INPUT;
+
+typedef struct _IPV6_TO_BLE_SHARED_RINGS_MAP_OUTPUT
+{
+    UINT64  baseAddress;        // Start of the region in the app's process
+    UINT32  regionLength;       // Length of the region, in bytes
+    UINT32  listenRingOffset;   // Offset of the listen ring header
+    UINT32  injectRingOffset;   // Offset of the inject ring header
+    UINT32  reserved;
+} IPV6_TO_BLE_SHARED_RINGS_MAP_OUTPUT, *PIPV6_TO_BLE_SHARED_RINGS_MAP_OUTPUT;
+
+//
+// Fifteenth IOCTL: Inject a batch of IPv6 packets inbound.
+//
+// Like the second IOCTL, but the input buffer holds many packets, each as an
+// IPV6_TO_BLE_INJECT_RECORD. The output buffer receives one NTSTATUS per
+// packet, in order, so it must hold at least as many NTSTATUS values as
+// there are records. The request only fails as a whole if the input buffer
+// is malformed or the output buffer is too small, in which case nothing is
+// injected.
+//
+// Used on the border router device and the IoT core devices.
+//
+// Sent by the packet processing background app.
+//
+#define IOCTL_IPV6_TO_BLE_INJECT_INBOUND_NETWORK_V6_BATCH CTL_CODE(FILE_DEVICE_IPV6_TO_BLE, 0x8095, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Sixteenth IOCTL: Inject a batch of IPv6 packets outbound.
+//
+// Like the third IOCTL, with the same batch format as the fifteenth.
+//
+// Used ONLY on the border router device.
+//
+// Sent by the packet processing background app.
+//
+#define IOCTL_IPV6_TO_BLE_INJECT_OUTBOUND_NETWORK_V6_BATCH CTL_CODE(FILE_DEVICE_IPV6_TO_BLE, 0x8096, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//-----------------------------------------------------------------------------
+// Record format for the batched inject IOCTLs.
+//
+// The input buffer holds records back to back, laid out the same way as the
+// batched listen records: this header followed by the packet, including its
+// IPv6 header, with the next record starting at the next
+// IPV6_TO_BLE_INJECT_RECORD_ALIGNMENT byte boundary from the start of the
+// buffer. Each packet must be between 40 and 1280 bytes long.
+//-----------------------------------------------------------------------------
+
+typedef struct _IPV6_TO_BLE_INJECT_RECORD
+{
+    UINT16  packetLength;   // Length of the packet that follows, in bytes
+    UINT16  reserved;       // Must be 0
+} IPV6_TO_BLE_INJECT_RECORD, *PIPV6_TO_BLE_INJECT_RECORD;
+
+#define IPV6_TO_BLE_INJECT_RECORD_ALIGNMENT 4
+
+//
+// Seventeenth IOCTL: Add many addresses to the white list or mesh list.
+//
+// The input buffer is an IPV6_TO_BLE_BULK_LIST_HEADER followed by
+// entryCount IPV6_TO_BLE_BULK_LIST_ENTRY structures. The change is applied
+// all or nothing: if any address is already in the list, or appears twice
+// in the request, the list is left unchanged.
+//
+// This IOCTL is used ONLY on the border router device.
+//
+// Sent by the usermode GUI app or provisioning tools.
+//
+#define IOCTL_IPV6_TO_BLE_BULK_ADD_TO_LIST CTL_CODE(FILE_DEVICE_IPV6_TO_BLE, 0x8097, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Eighteenth IOCTL: Remove many addresses from the white list or mesh list.
+//
+// Same input format as the seventeenth IOCTL. If any address is not in the
+// list, the list is left unchanged.
+//
+// This IOCTL is used ONLY on the border router device.
+//
+// Sent by the usermode GUI app or provisioning tools.
+//
+#define IOCTL_IPV6_TO_BLE_BULK_REMOVE_FROM_LIST CTL_CODE(FILE_DEVICE_IPV6_TO_BLE, 0x8098, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Nineteenth IOCTL: Replace the contents of the white list or mesh list.
+//
+// Same input format as the seventeenth IOCTL. The list ends up holding
+// exactly the given addresses; an entryCount of 0 empties it.
+//
+// This IOCTL is used ONLY on the border router device.
+//
+// Sent by the usermode GUI app or provisioning tools.
+//
+#define IOCTL_IPV6_TO_BLE_BULK_REPLACE_LIST CTL_CODE(FILE_DEVICE_IPV6_TO_BLE, 0x8099, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//-----------------------------------------------------------------------------
+// Input format for the bulk list IOCTLs. Addresses are binary, in network
+// byte order, so the driver doesn't have to parse strings.
+//-----------------------------------------------------------------------------
+
+#define IPV6_TO_BLE_BULK_TARGET_WHITE_LIST  0
+#define IPV6_TO_BLE_BULK_TARGET_MESH_LIST   1
+
+#define IPV6_TO_BLE_BULK_LIST_MAX_ENTRIES   65536
+
+typedef struct _IPV6_TO_BLE_BULK_LIST_HEADER
+{
+    UINT32  targetList;     // IPV6_TO_BLE_BULK_TARGET_WHITE/MESH_LIST
+    UINT32  entryCount;     // Number of entries that follow
+} IPV6_TO_BLE_BULK_LIST_HEADER, *PIPV6_TO_BLE_BULK_LIST_HEADER;
+
+typedef struct _IPV6_TO_BLE_BULK_LIST_ENTRY
+{
+    UINT8   ipv6Address[16];    // The IPv6 address, network byte order
+    UINT32  scopeId;            // The scope ID of the address
+} IPV6_TO_BLE_BULK_LIST_ENTRY, *PIPV6_TO_BLE_BULK_LIST_ENTRY;
+
+//
+// Twentieth IOCTL: Query the data path statistics.
+//
+// The output buffer receives an IPV6_TO_BLE_STATISTICS structure. Counters
+// start at 0 when the driver loads and are never reset.
+//
+// Used on the border router device and the IoT core devices.
+//
+// Sent by the packet processing app or diagnostic tools.
+//
+#define IOCTL_IPV6_TO_BLE_QUERY_STATISTICS CTL_CODE(FILE_DEVICE_IPV6_TO_BLE, 0x809A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//-----------------------------------------------------------------------------
+// Output format for the statistics IOCTL.
+//
+// Counters that come in pairs are indexed by direction: 0 for inbound, 1 for
+// outbound. Every packet seen by a classify callout is counted exactly once,
+// in classifyNoRights, classifyPermitted, classifyDelivered, or one of the
+// classifyDropped counters. classifyDroppedOverRate is outbound only, so it
+// isn't a pair. Every packet the app asks to inject is counted
+// once in injectSubmitted, injectFailed, or injectDroppedNoSlab; a submitted
+// packet that then fails to inject is also counted in injectCompleteFailed.
+//-----------------------------------------------------------------------------
+
+typedef struct _IPV6_TO_BLE_STATISTICS
+{
+    // Classify callouts
+    UINT64  classifyNoRights[2];            // Couldn't alter the classify
+    UINT64  classifyPermitted[2];           // Let through: not for the mesh,
+                                            // loopback, or injected by us
+    UINT64  classifyDelivered[2];           // Absorbed and handed to the app
+    UINT64  classifyDroppedNotUdp[2];       // Absorbed and dropped, not UDP or TCP
+    UINT64  classifyDroppedTooLarge[2];     // Absorbed and dropped, > 1280
+    UINT64  classifyDroppedNoListener[2];   // Absorbed and dropped, no listen
+                                            // request, pend slot, or ring slot
+
+    // Injection
+    UINT64  injectSubmitted[2];             // Handed to WFP to inject
+    UINT64  injectFailed[2];                // Rejected by WFP
+    UINT64  injectDroppedNoSlab[2];         // Every injection slab in use
+    UINT64  injectCompleteFailed[2];        // Submitted, but failed to inject
+
+    // Copies to the app
+    UINT64  copyContiguous;                 // Copied from a single MDL
+    UINT64  copyScatter;                    // Copied from more than one MDL
+
+    // Listen pend queues and the shared listen ring
+    UINT64  pendQueuePended[2];             // Packets pended
+    UINT64  pendQueueDelivered[2];          // Pended packets returned to app
+    UINT64  pendQueueDropped[2];            // Dropped from or by a full queue
+    UINT64  sharedRingListenDropped;        // Dropped, listen ring full,
+                                            // since the rings were mapped
+
+    // Outbound shaping
+    UINT64  classifyDroppedOverRate;        // Absorbed and dropped, outbound
+                                            // destination over its rate
+
+    // TCP
+    UINT64  tcpMssClamped;                  // SYN segments copied to the app
+                                            // whose MSS option was lowered
+
+    // IPv6 extension headers
+    UINT64  classifyDroppedExtensionHeader[2];  // Absorbed and dropped, for
+                                                // the mesh but an extension
+                                                // header follows the fixed
+                                                // header, so UDP or TCP
+                                                // isn't directly after it
+} IPV6_TO_BLE_STATISTICS, *PIPV6_TO_BLE_STATISTICS;
+
+//
+// Twenty-first IOCTL: Query the classify to delivery latency histogram.
+//
+// The output buffer receives an IPV6_TO_BLE_LATENCY_HISTOGRAM. The input
+// buffer is optional; if it is an IPV6_TO_BLE_LATENCY_QUERY_INPUT with
+// IPV6_TO_BLE_LATENCY_QUERY_RESET set, the histogram is reset as it is read,
+// so consecutive queries return consecutive intervals. Every packet is in
+// the buckets and packet count of exactly one interval, but a packet timed
+// during a reset can have its latency added to the total of the next
+// interval, so an interval's mean can be slightly off.
+//
+// Used on the border router device and the IoT core devices.
+//
+// Sent by the packet processing app or diagnostic tools.
+//
+#define IOCTL_IPV6_TO_BLE_QUERY_LATENCY_HISTOGRAM CTL_CODE(FILE_DEVICE_IPV6_TO_BLE, 0x809B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//-----------------------------------------------------------------------------
+// Input and output formats for the latency histogram IOCTL.
+//
+// Latency is measured from the moment a classify callout hands a packet over
+// until a listen request or batched listen request returns it to the app,
+// whether directly or after it was pended. Packets delivered through the
+// shared listen ring aren't timed, since the driver doesn't see the app
+// take them.
+//
+// Bucket 0 counts packets delivered in under 1 microsecond, and bucket i
+// counts packets delivered in [2^(i-1), 2^i) microseconds. The last bucket
+// also counts everything slower.
+//-----------------------------------------------------------------------------
+
+#define IPV6_TO_BLE_LATENCY_QUERY_RESET     0x1
+
+typedef struct _IPV6_TO_BLE_LATENCY_QUERY_INPUT
+{
+    UINT32  flags;          // IPV6_TO_BLE_LATENCY_QUERY_* flags
+} IPV6_TO_BLE_LATENCY_QUERY_INPUT, *PIPV6_TO_BLE_LATENCY_QUERY_INPUT;
+
+#define IPV6_TO_BLE_LATENCY_BUCKET_COUNT    32
+
+typedef struct _IPV6_TO_BLE_LATENCY_HISTOGRAM
+{
+    UINT64  packetCount;        // Packets timed, the sum of the buckets
+    UINT64  totalMicroseconds;  // Sum of their latencies, for the mean
+    UINT64  buckets[IPV6_TO_BLE_LATENCY_BUCKET_COUNT];
+} IPV6_TO_BLE_LATENCY_HISTOGRAM, *PIPV6_TO_BLE_LATENCY_HISTOGRAM;
+
+//
+// Twenty-second IOCTL: Query whether the driver is ready.
+//
+// DriverEntry returns before the runtime lists are loaded and the callouts
+// are registered; a work item does both right after. The output buffer
+// receives an IPV6_TO_BLE_READINESS saying how far that has got, so the apps
+// can wait for the driver instead of assuming it is intercepting traffic as
+// soon as the device opens. Changes to the lists are refused with
+// STATUS_DEVICE_NOT_READY until the lists are loaded.
+//
+// Used on the border router device and the IoT core devices.
+//
+// Sent by the packet processing app, the GUI app, or diagnostic tools.
+//
+#define IOCTL_IPV6_TO_BLE_QUERY_READINESS CTL_CODE(FILE_DEVICE_IPV6_TO_BLE, 0x809C, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//-----------------------------------------------------------------------------
+// Output format for the readiness IOCTL.
+//-----------------------------------------------------------------------------
+
+#define IPV6_TO_BLE_READINESS_STARTING          0   // Loading the lists and
+                                                    // registering callouts
+#define IPV6_TO_BLE_READINESS_READY             1   // Callouts registered
+#define IPV6_TO_BLE_READINESS_WAITING_FOR_LISTS 2   // Border router: the white
+                                                    // list or mesh list is
+                                                    // empty, so no callouts
+#define IPV6_TO_BLE_READINESS_FAILED            3   // Registering the
+                                                    // callouts failed
+
+typedef struct _IPV6_TO_BLE_READINESS
+{
+    UINT32  state;              // IPV6_TO_BLE_READINESS_* value
+    INT32   startStatus;        // NTSTATUS of the start work item
+    UINT32  whiteListEntries;   // Entries in each list now; 0 on the IoT
+    UINT32  meshListEntries;    // core devices
+    UINT64  startMicroseconds;  // From DriverEntry until the start work item
+                                // finished; 0 while starting
+    UINT32  listenChannels;     // Listen channels to send listen requests on
+    UINT32  reserved;
+} IPV6_TO_BLE_READINESS, *PIPV6_TO_BLE_READINESS;
+
+//
+// Twenty-third IOCTL: Change the data path tracing settings.
+//
+// The input buffer is an IPV6_TO_BLE_PACKET_TRACE_SETTINGS. The settings
+// take effect right away and last until the driver unloads; the registry
+// values "Data Path Tracing" and "Packet Trace Sample Rate" give the settings
+// the driver starts with.
+//
+// Used on the border router device and the IoT core devices.
+//
+// Sent by diagnostic tools.
+//
+#define IOCTL_IPV6_TO_BLE_SET_PACKET_TRACE CTL_CODE(FILE_DEVICE_IPV6_TO_BLE, 0x809D, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Twenty-fourth IOCTL: Read the sampled packet trace records.
+//
+// The output buffer receives an IPV6_TO_BLE_PACKET_TRACE_HEADER followed by
+// as many of the oldest unread records as fit. Records that are returned are
+// removed from the ring, so consecutive queries return consecutive records.
+//
+// Used on the border router device and the IoT core devices.
+//
+// Sent by diagnostic tools.
+//
+#define IOCTL_IPV6_TO_BLE_QUERY_PACKET_TRACE CTL_CODE(FILE_DEVICE_IPV6_TO_BLE, 0x809E, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//-----------------------------------------------------------------------------
+// Input and output formats for the packet trace IOCTLs.
+//
+// The per-packet WPP trace points in the classify callouts, the listen
+// functions and the injection functions are off unless
+// IPV6_TO_BLE_PACKET_TRACE_FLAG_DATA_PATH_WPP is set (and the driver was
+// built with them; see Trace.h), since they slow every packet down and flood
+// any trace session.
+//
+// Instead, the classify callouts can record 1 in every sampleRate packets
+// into an in-memory ring of IPV6_TO_BLE_PACKET_TRACE_RECORDs, each saying
+// what the callout decided for the packet and why. A sample rate of 0 turns
+// sampling off. When the ring is full the oldest unread records are
+// overwritten and counted in recordsLost.
+//-----------------------------------------------------------------------------
+
+#define IPV6_TO_BLE_PACKET_TRACE_FLAG_DATA_PATH_WPP 0x1
+
+typedef struct _IPV6_TO_BLE_PACKET_TRACE_SETTINGS
+{
+    UINT32  flags;          // IPV6_TO_BLE_PACKET_TRACE_FLAG_* flags
+    UINT32  sampleRate;     // Record 1 in this many packets; 0 for none
+} IPV6_TO_BLE_PACKET_TRACE_SETTINGS, *PIPV6_TO_BLE_PACKET_TRACE_SETTINGS;
+
+#define IPV6_TO_BLE_DECISION_NO_RIGHTS              0   // Couldn't alter the
+                                                        // classify
+#define IPV6_TO_BLE_DECISION_PERMIT_INJECTED        1   // Injected by us
+#define IPV6_TO_BLE_DECISION_PERMIT_LOOPBACK        2   // Loopback
+#define IPV6_TO_BLE_DECISION_PERMIT_UNPARSED        3   // Header not parsed
+#define IPV6_TO_BLE_DECISION_PERMIT_NOT_WHITE_LISTED 4  // Source not in the
+                                                        // white list
+#define IPV6_TO_BLE_DECISION_PERMIT_NOT_FOR_MESH    5   // Destination not in
+                                                        // the mesh list
+#define IPV6_TO_BLE_DECISION_DROP_NOT_UDP           6   // Absorbed, not UDP or TCP
+#define IPV6_TO_BLE_DECISION_DROP_TOO_LARGE         7   // Absorbed, > 1280
+#define IPV6_TO_BLE_DECISION_DELIVERED              8   // Handed to the app
+#define IPV6_TO_BLE_DECISION_DROP_NO_LISTENER       9   // Absorbed, couldn't
+                                                        // be handed to the app
+#define IPV6_TO_BLE_DECISION_DROP_OVER_RATE         10  // Absorbed, outbound
+                                                        // destination over its
+                                                        // shaping rate
+#define IPV6_TO_BLE_DECISION_DROP_EXTENSION_HEADER  11  // Absorbed, for the
+                                                        // mesh but with an
+                                                        // extension header
+
+typedef struct _IPV6_TO_BLE_PACKET_TRACE_RECORD
+{
+    UINT64  sequence;               // Records sampled before this one
+    INT64   classifyTime;           // Performance counter when classified
+    UINT8   sourceAddress[16];      // Network byte order; the addresses,
+    UINT8   destinationAddress[16]; // flow hash, length and next header are
+    UINT32  flowHash;               // 0 if the header wasn't parsed
+    INT32   status;                 // NTSTATUS of parsing or delivery
+    UINT16  packetLength;           // Including the IPv6 header
+    UINT8   direction;              // Callout: 0 inbound, 1 outbound
+    UINT8   decision;               // IPV6_TO_BLE_DECISION_* value
+    UINT8   nextHeader;             // Next header value of the IPv6 header
+    UINT8   reserved[3];
+} IPV6_TO_BLE_PACKET_TRACE_RECORD, *PIPV6_TO_BLE_PACKET_TRACE_RECORD;
+
+typedef struct _IPV6_TO_BLE_PACKET_TRACE_HEADER
+{
+    IPV6_TO_BLE_PACKET_TRACE_SETTINGS settings; // Settings in effect
+    UINT32  recordCount;            // Records following this header
+    UINT32  reserved;
+    UINT64  recordsLost;            // Overwritten unread since the last query
+} IPV6_TO_BLE_PACKET_TRACE_HEADER, *PIPV6_TO_BLE_PACKET_TRACE_HEADER;
+
+//
+// Twenty-fifth IOCTL: Set the outbound shaping rate.
+//
+// The input buffer is an IPV6_TO_BLE_SHAPING_SETTINGS. Each destination the
+// outbound classify callout would hand to the app gets its own token bucket,
+// which fills at rateBytesPerSecond up to burstBytes. A packet whose
+// destination's bucket holds fewer tokens than the packet's length is
+// dropped before it reaches the app, and counted in the statistics'
+// classifyDroppedOverRate. A rate of 0, the default, turns shaping off.
+//
+// Changing the settings refills every destination's bucket.
+//
+// Used on the border router device and the IoT core devices.
+//
+// Sent by the packet processing app.
+//
+#define IOCTL_IPV6_TO_BLE_SET_SHAPING CTL_CODE(FILE_DEVICE_IPV6_TO_BLE, 0x809F, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//-----------------------------------------------------------------------------
+// Input format for the shaping IOCTL. The burst must hold at least one
+// packet of the largest size the callouts deliver (1280 bytes) while shaping
+// is on, or no packet could ever be sent.
+//-----------------------------------------------------------------------------
+
+#define IPV6_TO_BLE_SHAPING_MIN_BURST   1280
+
+typedef struct _IPV6_TO_BLE_SHAPING_SETTINGS
+{
+    UINT32  rateBytesPerSecond;     // Per destination; 0 turns shaping off
+    UINT32  burstBytes;             // Bucket size per destination
+} IPV6_TO_BLE_SHAPING_SETTINGS, *PIPV6_TO_BLE_SHAPING_SETTINGS;
+
+//
+// Twenty-sixth IOCTL: Wait for changes to the white list or mesh list.
+//
+// The input buffer is an IPV6_TO_BLE_LIST_CHANGE_REQUEST holding the list
+// generation the caller's copy of the lists is at. If the lists have changed
+// since then, the request completes right away; otherwise it stays pending
+// until they next change. Either way the output buffer receives an
+// IPV6_TO_BLE_LIST_CHANGE_HEADER followed by the changes, oldest first, and
+// the generation to send with the next request. Keeping one of these
+// outstanding keeps a copy of the lists in sync without polling.
+//
+// A caller without a copy yet sends generation 0. It, and any caller that
+// has fallen too far behind for the driver to still have every change it
+// missed, gets IPV6_TO_BLE_LIST_CHANGE_FLAG_RESET and the full contents of
+// both lists instead. If the lists don't fit in the output buffer, the
+// request fails with STATUS_BUFFER_OVERFLOW and only the header, whose
+// requiredLength says how big the buffer must be.
+//
+// This IOCTL is used ONLY on the border router device.
+//
+// Sent by the packet processing app or the GUI app.
+//
+#define IOCTL_IPV6_TO_BLE_WAIT_FOR_LIST_CHANGE CTL_CODE(FILE_DEVICE_IPV6_TO_BLE, 0x80A0, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//-----------------------------------------------------------------------------
+// Input and output formats for the list change IOCTL.
+//
+// The list generation counts the changes made to the lists since the driver
+// started, one per address added to or removed from either list, starting at
+// 1. Applying the records of a response in order to a copy of the lists at
+// the requested generation brings it to the generation in the header.
+//-----------------------------------------------------------------------------
+
+#define IPV6_TO_BLE_LIST_CHANGE_FLAG_RESET  0x1 // Discard the copy first; the
+                                                // records are both lists
+#define IPV6_TO_BLE_LIST_CHANGE_FLAG_MORE   0x2 // More changes are waiting;
+                                                // the next request completes
+                                                // right away
+
+#define IPV6_TO_BLE_LIST_CHANGE_ADDED       0
+#define IPV6_TO_BLE_LIST_CHANGE_REMOVED     1
+
+typedef struct _IPV6_TO_BLE_LIST_CHANGE_REQUEST
+{
+    UINT64  generation;     // Generation of the caller's copy; 0 for none
+} IPV6_TO_BLE_LIST_CHANGE_REQUEST, *PIPV6_TO_BLE_LIST_CHANGE_REQUEST;
+
+typedef struct _IPV6_TO_BLE_LIST_CHANGE_HEADER
+{
+    UINT64  generation;     // Generation after applying the records
+    UINT32  flags;          // IPV6_TO_BLE_LIST_CHANGE_FLAG_* flags
+    UINT32  recordCount;    // Records following this header
+    UINT32  requiredLength; // Output buffer length a reset needs, in bytes
+    UINT32  reserved;
+} IPV6_TO_BLE_LIST_CHANGE_HEADER, *PIPV6_TO_BLE_LIST_CHANGE_HEADER;
+
+typedef struct _IPV6_TO_BLE_LIST_CHANGE_RECORD
+{
+    UINT8   ipv6Address[16];    // The IPv6 address, network byte order
+    UINT32  scopeId;            // The scope ID of the address
+    UINT8   targetList;         // IPV6_TO_BLE_BULK_TARGET_WHITE/MESH_LIST
+    UINT8   change;             // IPV6_TO_BLE_LIST_CHANGE_ADDED/REMOVED
+    UINT16  reserved;
+} IPV6_TO_BLE_LIST_CHANGE_RECORD, *PIPV6_TO_BLE_LIST_CHANGE_RECORD;
+
+#endif  // _PUBLIC_H_
@@ -90,28 +90,85 @@ Return Value:
 		goto Exit;
     }
 
-	//
-	// Step 2
-	// Configure secondary, manual-dispatch queue for our IOCTL notifications
-	// we'll receive from the usermode app. 
-	//
+	for (ULONG channel = 0; channel < gListenChannelCount; channel++)
+	{
+		//
+		// Step 2
+		// Configure secondary, manual-dispatch queue for our IOCTL
+		// notifications we'll receive from the usermode app, one for each
+		// listen channel
+		//
 
-	// Configure the queue to manual dispatch and non-power managed
-	WDF_IO_QUEUE_CONFIG_INIT(&queueConfig,
-							 WdfIoQueueDispatchManual
-							 );
-	queueConfig.PowerManaged = WdfFalse;
+		// Configure the queue to manual dispatch and non-power managed
+		WDF_IO_QUEUE_CONFIG_INIT(&queueConfig,
+								 WdfIoQueueDispatchManual
+								 );
+		queueConfig.PowerManaged = WdfFalse;
+
+		// Create the manual queue
+		status = WdfIoQueueCreate(gWdfDeviceObject,
+								  &queueConfig,
+								  WDF_NO_OBJECT_ATTRIBUTES,
+								  &gListenChannels[channel].requestQueue
+								  );
+		if (!NT_SUCCESS(status))
+		{
+			TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "WdfIoQueueCreate for listen request queue %u failed %!STATUS!", channel, status);
+			goto Exit;
+		}
 
-	// Create the manual queue
-	status = WdfIoQueueCreate(gWdfDeviceObject,
-							  &queueConfig,
-							  WDF_NO_OBJECT_ATTRIBUTES,
-							  &gListenRequestQueue
-							  );
-    if (!NT_SUCCESS(status))
-    {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "WdfIoQueueCreate for listen request queue failed %!STATUS!", status);
-    }
+		//
+		// Step 3
+		// Configure another manual-dispatch queue for batched listen
+		// requests, which are filled from the pend queues rather than one
+		// packet at a time
+		//
+		WDF_IO_QUEUE_CONFIG_INIT(&queueConfig,
+								 WdfIoQueueDispatchManual
+								 );
+		queueConfig.PowerManaged = WdfFalse;
+
+		status = WdfIoQueueCreate(gWdfDeviceObject,
+								  &queueConfig,
+								  WDF_NO_OBJECT_ATTRIBUTES,
+								  &gListenChannels[channel].batchRequestQueue
+								  );
+		if (!NT_SUCCESS(status))
+		{
+			TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "WdfIoQueueCreate for batched listen request queue %u failed %!STATUS!", channel, status);
+			goto Exit;
+		}
+	}
+
+	if (gBorderRouterFlag)
+	{
+		//
+		// Step 4
+		// Configure a manual-dispatch queue for list change requests, which
+		// wait there until the white list or mesh list next changes
+		//
+		WDF_IO_QUEUE_CONFIG_INIT(&queueConfig,
+								 WdfIoQueueDispatchManual
+								 );
+		queueConfig.PowerManaged = WdfFalse;
+
+		status = WdfIoQueueCreate(gWdfDeviceObject,
+								  &queueConfig,
+								  WDF_NO_OBJECT_ATTRIBUTES,
+								  &gListChangeQueue
+								  );
+		if (!NT_SUCCESS(status))
+		{
+			TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "WdfIoQueueCreate for list change request queue failed %!STATUS!", status);
+			goto Exit;
+		}
+	}
+
+	//
+	// Step 5
+	// Create the timers that fill batched listen requests
+	//
+	status = IPv6ToBleListenCreateBatchTimers();
 
 Exit:
 	
@@ -120,6 +177,35 @@ Exit:
     return status;
 }
 
+//
+// Returns TRUE for the IOCTLs that change the white list or mesh list, or
+// wait for changes to them. They are refused until the start work item has
+// loaded the lists.
+//
+static
+BOOLEAN
+IPv6ToBleQueueIsListChange(
+    _In_    ULONG   IoControlCode
+)
+{
+    switch (IoControlCode)
+    {
+        case IOCTL_IPV6_TO_BLE_ADD_TO_WHITE_LIST:
+        case IOCTL_IPV6_TO_BLE_REMOVE_FROM_WHITE_LIST:
+        case IOCTL_IPV6_TO_BLE_ADD_TO_MESH_LIST:
+        case IOCTL_IPV6_TO_BLE_REMOVE_FROM_MESH_LIST:
+        case IOCTL_IPV6_TO_BLE_PURGE_WHITE_LIST:
+        case IOCTL_IPV6_TO_BLE_PURGE_MESH_LIST:
+        case IOCTL_IPV6_TO_BLE_BULK_ADD_TO_LIST:
+        case IOCTL_IPV6_TO_BLE_BULK_REMOVE_FROM_LIST:
+        case IOCTL_IPV6_TO_BLE_BULK_REPLACE_LIST:
+        case IOCTL_IPV6_TO_BLE_WAIT_FOR_LIST_CHANGE:
+            return TRUE;
+        default:
+            return FALSE;
+    }
+}
+
 _Use_decl_annotations_
 VOID
 IPv6ToBleEvtIoDeviceControl(
@@ -146,22 +232,21 @@ Routine Description:
     invoked by this callback). Reading and modification is triggered either by 
     assigning values from the registry or by registering callouts.
 
-	Because those lists are read and modified ONLY from within THIS callback or
-	DriverEntry, we don't have to synchronize access to them at all. 
+	Changes to those lists are serialized with gRuntimeListWriteLock, since
+	requests on the parallel default queue can arrive concurrently. The
+	classify callouts never read the lists directly; they read immutable
+	snapshots that are published after every change (see RuntimeList.c).
 
     This all holds true at IRQL = PASSIVE_LEVEL.
 
-    The only other function in this driver that will need to access the lists
-    is the periodic timer callback, which executes at DISPATCH_LEVEL as it is
-    a Deferred Procedure Call (DPC). The only overlap between that callback and
-    this one is checking if the lists have been modified, so the functions to
-    modify the runtime lists that are called from this callback do acquire the
-    spinlock just to update that boolean. There is no race condition because
-    the timer callback will keep checking every 5 seconds and will catch up
-    in short order if it missed an update (e.g. the timer callback had the
-    spinlock, which stopped this function from setting the "modified" boolean
-    to TRUE during an update, then this function updates the boolean after the
-    timer callback returns, then the timer checks again and sees the update).
+    The only other code in this driver that will need to access the lists
+    is the registry flush, which is armed by a one-shot timer whose callback
+    executes at DISPATCH_LEVEL as it is a Deferred Procedure Call (DPC). The
+    functions to modify the runtime lists that are called from this callback
+    mark the list modified under a spinlock and arm that timer. There is no
+    race condition because the flush clears the "modified" boolean before it
+    reads a list, so a change made during a flush marks the list again and
+    arms the timer for another flush.
 
 Arguments:
 
@@ -193,6 +278,19 @@ Return Value:
     KIRQL irql = KeGetCurrentIrql();
 #endif // DBG
 
+    // The lists are loaded by the start work item after DriverEntry returns
+    // (see Driver.c). Until it is done, changes to them would be mixed with
+    // the entries being loaded, so refuse them; the apps can wait with
+    // IOCTL_IPV6_TO_BLE_QUERY_READINESS.
+    if (IPv6ToBleQueueIsListChange(IoControlCode) &&
+        !KeReadStateEvent(&gStartCompleteEvent))
+    {
+        status = STATUS_DEVICE_NOT_READY;
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_QUEUE, "List change refused while the driver is starting %!STATUS!", status);
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
 	// Switch based on the IOCTL sent to us by the usermode app(s)
 	switch (IoControlCode)
 	{
@@ -223,8 +321,12 @@ Return Value:
             //
             // The length must be exactly 1280 bytes, so it is big enough to
             // hold any reasonably-sized packet but not larger than the
-            // Bluetooth MTU.
-			if (OutputBufferLength != (sizeof(BYTE) * 1280))
+            // Bluetooth MTU. Requests that asked for packet metadata get
+            // room for it in front of the packet.
+            size_t metadataLength = IPv6ToBleListenRequestWantsMetadata(Request) ?
+                                    sizeof(IPV6_TO_BLE_PACKET_METADATA) : 0;
+
+			if (OutputBufferLength != (sizeof(BYTE) * 1280) + metadataLength)
 			{
 
 				// If not provided enough space, return invalid parameter, set 
@@ -232,35 +334,25 @@ Return Value:
 				break;
 			}
 
-			// Attempt to forward the request to the listening queue. If not
-			// successful, complete the request with whatever status we get
-			// back from WdfRequestForwardToIoQueue.
-            //
-            // Use a spin lock to guard adding the request to the listen queue.
-            // The spin lock automatically raises this thread to DISPATCH_LEVEL
-            // when acquired, blocking other thread interrupts, and lowers it
-            // when released.
-            WdfSpinLockAcquire(gListenRequestQueueLock);
-			status = WdfRequestForwardToIoQueue(Request,
-				                                gListenRequestQueue
-			                                    );
-            WdfSpinLockRelease(gListenRequestQueueLock);
+			// If packets were pended on the request's listen channel while no
+			// listen request was outstanding, return the oldest one right
+			// away. Otherwise, forward the request to the channel's listening
+			// queue. See Listen.c.
+			status = IPv6ToBleListenHandleRequest(Request, &bytesTransferred);
 
             NT_ASSERT(irql == KeGetCurrentIrql());
 
-			if (!NT_SUCCESS(status))
-			{
-                TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "Forwarding I/O request to listening queue failed %!STATUS!", status);
-				break;
-			}
-
 			// If successful in forwarding the request to the listening
 			// queue, return here with the request pending and **do not break
 			// or fall through**
+			if (status == STATUS_PENDING)
+			{
+				TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "Successfully pended the listening request.\n");
 
-            TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "Successfully pended the listening request.\n");
+				return;
+			}
 
-			return;
+			break;
 		}
 
         //
@@ -302,6 +394,34 @@ Return Value:
 			break;
 		}
 
+        //
+        // IOCTLs 15 and 16: Inject a batch inbound or outbound.
+        //
+        // Same as IOCTLs 2 and 3, but the input buffer holds many
+        // length-prefixed packets (see Public.h) and the output buffer
+        // receives a status for each one. This saves a round trip to the
+        // driver per packet when packets from the mesh arrive in bursts.
+        //
+        // The outbound version is ONLY used on the border router device.
+        //
+        case IOCTL_IPV6_TO_BLE_INJECT_INBOUND_NETWORK_V6_BATCH:
+        {
+            status = IPv6ToBleQueueInjectNetworkBatchV6(Request,
+                                                        INBOUND,
+                                                        &bytesTransferred
+                                                        );
+            break;
+        }
+
+        case IOCTL_IPV6_TO_BLE_INJECT_OUTBOUND_NETWORK_V6_BATCH:
+        {
+            status = IPv6ToBleQueueInjectNetworkBatchV6(Request,
+                                                        OUTBOUND,
+                                                        &bytesTransferred
+                                                        );
+            break;
+        }
+
 		//
 		// IOCTL 4: Add to white list
 		//
@@ -384,59 +504,21 @@ Return Value:
 		// start it over, or they are somehow out of sync. This assumes that
 		// the GUI provisioning app is the authority on keeping a correct list.
 		//
-		// This is a bit of a misnomer, since the actual PurgeList() function
-		// doesn't clear the registry key; it only frees the runtime list
-		// memory. Tthis is because PurgeList() is always called to free memory
-		// upon driver unload, but we want the registry key to be non-volatile.
-		// But, this IOCTL specifically clears the registry key to start over 
-		// on the assumption that new white list addresses will follow to 
-		// re-build both the runtime list and the permanently stored list.
+		// IPv6ToBleRuntimeListPurgeRuntimeList() doesn't clear the registry
+		// key; it only frees the runtime list memory, because it is also
+		// called to free memory upon driver unload and we want the registry
+		// key to be non-volatile. This IOCTL uses
+		// IPv6ToBleRuntimeListPurgeListAndRegistryKey() instead, which also
+		// unregisters the callouts and clears the registry key, all under
+		// the runtime list write lock, to start over on the assumption that
+		// new white list addresses will follow to re-build both the runtime
+		// list and the permanently stored list.
 		//
 		// This IOCTL is ONLY used on the border router device.
 		//
 		case IOCTL_IPV6_TO_BLE_PURGE_WHITE_LIST:
 		{
-			// Purge the runtime list
-			IPv6ToBleRuntimeListPurgeRuntimeList(WHITE_LIST);
-
-			// Open the parent key
-			BOOLEAN parametersKeyOpened = FALSE;
-			status = IPv6ToBleRegistryOpenParametersKey();
-			if (!NT_SUCCESS(status))
-			{
-				goto PurgeWhiteListError;
-			}
-			parametersKeyOpened = TRUE;
-
-			// Remove the list's registry key
-			status = IPv6ToBleRegistryOpenWhiteListKey();
-			if (!NT_SUCCESS(status))
-			{
-				goto PurgeWhiteListError;
-			}
-			status = WdfRegistryRemoveKey(gWhiteListKey);
-			if (!NT_SUCCESS(status))
-			{
-				TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "Removing white list key failed during %!FUNC!, status: %!STATUS!", status);
-			}
-
-			// Since the white list is *now* empty, unregister the callouts
-			// if they were registered
-			if (IsListEmpty(gWhiteListHead))
-			{
-				// Unregister the callouts
-				if (gCalloutsRegistered)
-				{
-					IPv6ToBleCalloutsUnregister();
-				}
-			}
-
-		PurgeWhiteListError:
-
-			if (parametersKeyOpened)
-			{
-				WdfRegistryClose(gParametersKey);
-			}
+			status = IPv6ToBleRuntimeListPurgeListAndRegistryKey(WHITE_LIST);
 			break;
 		}
 
@@ -452,61 +534,22 @@ Return Value:
 		// start it over, or they are somehow out of sync. This assumes that
 		// the GUI provisioning app is the authority on keeping a correct list.
 		//
-		// This is a bit of a misnomer, since the actual PurgeList() function
-		// doesn't clear the registry key; it only frees the runtime list
-		// memory. This is because PurgeList() is always called to free memory
-		// upon driver unload, but we want the registry key to be non-volatile.
-		// But, this IOCTL specifically clears the registry key to start over 
-		// on the assumption that new mesh list addresses will follow to 
-		// re-build both the runtime list and the permanently stored list.
+		// IPv6ToBleRuntimeListPurgeRuntimeList() doesn't clear the registry
+		// key; it only frees the runtime list memory, because it is also
+		// called to free memory upon driver unload and we want the registry
+		// key to be non-volatile. This IOCTL uses
+		// IPv6ToBleRuntimeListPurgeListAndRegistryKey() instead, which also
+		// unregisters the callouts and clears the registry key, all under
+		// the runtime list write lock, to start over on the assumption that
+		// new mesh list addresses will follow to re-build both the runtime
+		// list and the permanently stored list.
 		//
 		// This IOCTL is ONLY used on the border router device.
 		//
 		case IOCTL_IPV6_TO_BLE_PURGE_MESH_LIST:
 		{
-			// Purge the runtime list
-			IPv6ToBleRuntimeListPurgeRuntimeList(MESH_LIST);
-
-			// Open the parent key
-			BOOLEAN parametersKeyOpened = FALSE;
-			status = IPv6ToBleRegistryOpenParametersKey();
-			if (!NT_SUCCESS(status))
-			{
-				goto PurgeMeshListError;
-			}
-			parametersKeyOpened = TRUE;
-
-			// Remove the list's registry key
-			status = IPv6ToBleRegistryOpenMeshListKey();
-			if (!NT_SUCCESS(status))
-			{
-				goto PurgeMeshListError;
-			}
-			status = WdfRegistryRemoveKey(gMeshListKey);
-			if (!NT_SUCCESS(status))
-			{
-				TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "Removing mesh list key failed during %!FUNC!, status: %!STATUS!", status);
-			}
-
-			// Since the mesh list is *now* empty, unregister the callouts
-			// if they were registered
-			if (IsListEmpty(gMeshListHead))
-			{
-				// Unregister the callouts
-				if (gCalloutsRegistered)
-				{
-					IPv6ToBleCalloutsUnregister();
-				}
-			}
-
-		PurgeMeshListError:
-
-			if (parametersKeyOpened)
-			{
-				WdfRegistryClose(gParametersKey);
-			}
+			status = IPv6ToBleRuntimeListPurgeListAndRegistryKey(MESH_LIST);
 			break;
-
 		}
 
         //
@@ -524,6 +567,198 @@ Return Value:
             break;
         }
 
+        //
+        // IOCTL 11: Listen inbound or outbound, batched.
+        //
+        // Same as IOCTL 1, but the output buffer can hold many packets and
+        // the request is completed with as many as are waiting, each as a
+        // length-prefixed record (see Public.h). This amortizes the cost of
+        // the round trip to the driver over several packets.
+        //
+        case IOCTL_IPV6_TO_BLE_LISTEN_NETWORK_V6_BATCH:
+        {
+            // The buffer must be able to hold at least one full-sized packet,
+            // and its metadata if the request asked for it
+            size_t metadataLength = IPv6ToBleListenRequestWantsMetadata(Request) ?
+                                    sizeof(IPV6_TO_BLE_PACKET_METADATA) : 0;
+
+            if (OutputBufferLength < IPV6_TO_BLE_LISTEN_BATCH_MIN_LENGTH + metadataLength)
+            {
+                break;
+            }
+
+            status = IPv6ToBleListenHandleBatchRequest(Request, &bytesTransferred);
+
+            NT_ASSERT(irql == KeGetCurrentIrql());
+
+            // If the request is waiting in the batched listen queue, return
+            // here with the request pending and **do not break or fall
+            // through**
+            if (status == STATUS_PENDING)
+            {
+                TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "Successfully pended the batched listening request.\n");
+
+                return;
+            }
+
+            break;
+        }
+
+        //
+        // IOCTLs 12 and 13: Map and unmap the shared packet rings.
+        //
+        // These have to run in the app's process, so they are handled and
+        // completed by IPv6ToBleSharedRingsEvtIoInCallerContext before they
+        // would reach this queue.
+        //
+
+        //
+        // IOCTL 14: Kick the inject ring.
+        //
+        // This IOCTL is sent by the usermode packet processing app after it
+        // adds packets to the shared inject ring while the driver is marked
+        // as waiting. The driver injects everything in the ring before
+        // completing it.
+        //
+        case IOCTL_IPV6_TO_BLE_KICK_INJECT_RING:
+        {
+            status = IPv6ToBleSharedRingsKickInject(WdfRequestGetFileObject(Request));
+            break;
+        }
+
+        //
+        // IOCTLs 17, 18, and 19: Bulk add to, remove from, or replace a list.
+        //
+        // These IOCTLs are sent by the usermode GUI app to provision or
+        // deprovision many devices at once. The input buffer holds a header
+        // naming the white list or mesh list, followed by binary addresses
+        // and scope IDs. The change is applied to the list as a whole or not
+        // at all.
+        //
+        // These IOCTLs are ONLY used on the border router device.
+        //
+        case IOCTL_IPV6_TO_BLE_BULK_ADD_TO_LIST:
+        {
+            status = IPv6ToBleRuntimeListApplyBulkChange(Request, BULK_LIST_ADD);
+            break;
+        }
+
+        case IOCTL_IPV6_TO_BLE_BULK_REMOVE_FROM_LIST:
+        {
+            status = IPv6ToBleRuntimeListApplyBulkChange(Request, BULK_LIST_REMOVE);
+            break;
+        }
+
+        case IOCTL_IPV6_TO_BLE_BULK_REPLACE_LIST:
+        {
+            status = IPv6ToBleRuntimeListApplyBulkChange(Request, BULK_LIST_REPLACE);
+            break;
+        }
+
+        //
+        // IOCTL 20: Query statistics
+        //
+        // This IOCTL is sent by the packet processing app or a diagnostic
+        // tool to read the data path counters: how many packets the classify
+        // callouts permitted, delivered, or dropped and why, and how many
+        // injections succeeded or failed.
+        //
+        case IOCTL_IPV6_TO_BLE_QUERY_STATISTICS:
+        {
+            status = IPv6ToBleStatisticsQuery(Request, &bytesTransferred);
+            break;
+        }
+
+        //
+        // IOCTL 21: Query latency histogram
+        //
+        // This IOCTL is sent by the packet processing app or a diagnostic
+        // tool to read, and optionally reset, the histogram of how long
+        // packets wait between classify and delivery to the app.
+        //
+        case IOCTL_IPV6_TO_BLE_QUERY_LATENCY_HISTOGRAM:
+        {
+            status = IPv6ToBleStatisticsQueryLatency(Request, &bytesTransferred);
+            break;
+        }
+
+        //
+        // IOCTL 22: Query readiness
+        //
+        // This IOCTL is sent by the packet processing app, the GUI app, or
+        // a diagnostic tool to find out whether the driver has finished
+        // loading the lists and registering its callouts after it started.
+        //
+        case IOCTL_IPV6_TO_BLE_QUERY_READINESS:
+        {
+            status = IPv6ToBleQueueReportReadiness(Request, &bytesTransferred);
+            break;
+        }
+
+        //
+        // IOCTL 23: Set packet trace settings
+        //
+        // This IOCTL is sent by a diagnostic tool to turn the per-packet WPP
+        // trace points on or off and to set how often the classify callouts'
+        // decisions are sampled into the packet trace ring.
+        //
+        case IOCTL_IPV6_TO_BLE_SET_PACKET_TRACE:
+        {
+            status = IPv6ToBlePacketTraceSetSettings(Request);
+            break;
+        }
+
+        //
+        // IOCTL 24: Query packet trace
+        //
+        // This IOCTL is sent by a diagnostic tool to read, and remove, the
+        // oldest sampled packet trace records.
+        //
+        case IOCTL_IPV6_TO_BLE_QUERY_PACKET_TRACE:
+        {
+            status = IPv6ToBlePacketTraceQuery(Request, &bytesTransferred);
+            break;
+        }
+
+        //
+        // IOCTL 25: Set the outbound shaping rate
+        //
+        // This IOCTL is sent by the packet processing app to limit how fast
+        // each destination in the mesh is sent packets, or to turn the limit
+        // off.
+        //
+        case IOCTL_IPV6_TO_BLE_SET_SHAPING:
+        {
+            status = IPv6ToBleShapingSetSettings(Request);
+            break;
+        }
+
+        //
+        // IOCTL 26: Wait for list changes
+        //
+        // This IOCTL is sent by the packet processing app or the GUI app,
+        // and kept pending, to keep its copy of the white list and mesh list
+        // in sync with the driver's. It completes right away if the lists
+        // have changed since the generation it names. See ListChange.c.
+        //
+        case IOCTL_IPV6_TO_BLE_WAIT_FOR_LIST_CHANGE:
+        {
+            status = IPv6ToBleListChangeHandleRequest(Request, &bytesTransferred);
+
+            NT_ASSERT(irql == KeGetCurrentIrql());
+
+            // If the request was queued, return here with it pending and
+            // **do not break or fall through**
+            if (status == STATUS_PENDING)
+            {
+                TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "Successfully pended the list change request.\n");
+
+                return;
+            }
+
+            break;
+        }
+
         default:
         {
             TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "Invalid IOCTL received.\n");
@@ -575,14 +810,12 @@ Return Value:
 
 --*/
 {
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_INJECT_NETWORK_INBOUND, "%!FUNC! Entry");
+    TraceDataPath(TRACE_LEVEL_INFORMATION, TRACE_INJECT_NETWORK_INBOUND, "%!FUNC! Entry");
 
     NTSTATUS status = STATUS_SUCCESS;
     PVOID inputBuffer;
     size_t receivedSize;
 
-    NET_BUFFER_LIST* NBL = 0;
-
 #if DBG
     KIRQL irql = KeGetCurrentIrql();
 #endif // DBG
@@ -603,67 +836,39 @@ Return Value:
                                           );
     if (!NT_SUCCESS(status))
     {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_INJECT_NETWORK_INBOUND, "Retrieving input buffer from WDFREQUEST failed during %!FUNC! with %!STATUS!", status);
+        TraceDataPath(TRACE_LEVEL_ERROR, TRACE_INJECT_NETWORK_INBOUND, "Retrieving input buffer from WDFREQUEST failed during %!FUNC! with %!STATUS!", status);
         goto Exit;
     }
     packetFromUsermode = (BYTE*)inputBuffer;
 
     //
     // Step 2
-    // Create the NET_BUFFER_LIST from the buffer
+    // Copy the packet into an injection slab and inject it into the receive
+    // path. NDIS only references the slab, so the request can be completed
+    // as soon as this returns.
     //
-    HANDLE nblPoolHandle = gNdisPoolData->nblPoolHandle;
-
-    // Create the NBL from the usermode packet (buffer)
-    NBL = IPv6ToBleNBLCreateFromBuffer(nblPoolHandle,
-                                       packetFromUsermode,
-                                       &receivedSize
-                                       );
-    if (!NBL)
+    if (receivedSize > INJECT_PACKET_MAX_LENGTH)
     {
-        status = STATUS_INSUFFICIENT_RESOURCES;
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_INJECT_NETWORK_INBOUND, "Creating NBL from usermode packet failed during %!FUNC! with %!STATUS!", status);
+        status = STATUS_INVALID_BUFFER_SIZE;
+        TraceDataPath(TRACE_LEVEL_ERROR, TRACE_INJECT_NETWORK_INBOUND, "Packet from usermode is larger than the Bluetooth MTU %!STATUS!", status);
         goto Exit;
     }
 
-    //
-    // Step 3
-    // Inject the packet into the receive path
-    //
-    status = FwpsInjectNetworkReceiveAsync0(gInjectionHandleNetwork,
-                                            0,
-                                            0,
-                                            DEFAULT_COMPARTMENT_ID,
-                                            0,   // New packet, so no original
-                                                 // iFace index?
-                                            0,   // Or sub-iFace index?
-                                            NBL,
-                                            IPv6ToBleQueueInjectNetworkComplete,
-                                            NULL
+    status = IPv6ToBleQueueInjectPacketCopy(packetFromUsermode,
+                                            (UINT32)receivedSize,
+                                            INBOUND
                                             );
 
     NT_ASSERT(irql == KeGetCurrentIrql());
 
     if (!NT_SUCCESS(status))
     {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_INJECT_NETWORK_INBOUND, "Inbound injection at network layer failed %!STATUS!", status);
+        TraceDataPath(TRACE_LEVEL_ERROR, TRACE_INJECT_NETWORK_INBOUND, "Inbound injection at network layer failed %!STATUS!", status);
     }
 
-
 Exit:
 
-    // Free memory if injection failed but the NBL was successfully allocated,
-    // as if injection fails then the completion function is not called
-    if (!NT_SUCCESS(status))
-    {
-        if (NBL)
-        {
-            FwpsFreeNetBufferList0(NBL);
-            NBL = 0;
-        }
-    }
-
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_INJECT_NETWORK_INBOUND, "%!FUNC! Exit");
+    TraceDataPath(TRACE_LEVEL_INFORMATION, TRACE_INJECT_NETWORK_INBOUND, "%!FUNC! Exit");
 
     return status;
 }
@@ -692,14 +897,12 @@ Return Value:
 
 --*/
 {
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_INJECT_NETWORK_OUTBOUND, "%!FUNC! Entry");
+    TraceDataPath(TRACE_LEVEL_INFORMATION, TRACE_INJECT_NETWORK_OUTBOUND, "%!FUNC! Entry");
 
 	NTSTATUS status = STATUS_SUCCESS;
 	PVOID inputBuffer;
 	size_t receivedSize;
 
-    NET_BUFFER_LIST* NBL = 0;
-
 #if DBG
     KIRQL irql = KeGetCurrentIrql();
 #endif // DBG
@@ -719,66 +922,215 @@ Return Value:
 										  );
 	if (!NT_SUCCESS(status)) 
 	{
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_INJECT_NETWORK_OUTBOUND, "Retrieving input buffer from WDFREQUEST failed during %!FUNC! with %!STATUS!", status);
+        TraceDataPath(TRACE_LEVEL_ERROR, TRACE_INJECT_NETWORK_OUTBOUND, "Retrieving input buffer from WDFREQUEST failed during %!FUNC! with %!STATUS!", status);
 		goto Exit;
 	}
 	packetFromUsermode = (BYTE*)inputBuffer;
 
 	//
 	// Step 2
-	// Create the NET_BUFFER_LIST from the buffer
-	//
-    HANDLE nblPoolHandle = gNdisPoolData->nblPoolHandle;
-
-    // Create the NBL from the usermode packet (buffer)
-	NBL = IPv6ToBleNBLCreateFromBuffer(nblPoolHandle, 
-		                               packetFromUsermode, 
-		                               &receivedSize
-		                               );
-	if (!NBL)
-	{
-		status = STATUS_INSUFFICIENT_RESOURCES;
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_INJECT_NETWORK_OUTBOUND, "Creating NBL from usermode packet failed during %!FUNC! with %!STATUS!", status);
-		goto Exit;
-	}
-	
+	// Copy the packet into an injection slab and inject it into the send
+	// path. NDIS only references the slab, so the request can be completed
+	// as soon as this returns.
 	//
-	// Step 3
-	// Inject the packet into the send path
-    //
-    status = FwpsInjectNetworkSendAsync0(gInjectionHandleNetwork,
-                                         0,
-                                         0,
-                                         DEFAULT_COMPARTMENT_ID,
-                                         NBL,
-                                         IPv6ToBleQueueInjectNetworkComplete,
-                                         NULL
-                                         );
+    if (receivedSize > INJECT_PACKET_MAX_LENGTH)
+    {
+        status = STATUS_INVALID_BUFFER_SIZE;
+        TraceDataPath(TRACE_LEVEL_ERROR, TRACE_INJECT_NETWORK_OUTBOUND, "Packet from usermode is larger than the Bluetooth MTU %!STATUS!", status);
+        goto Exit;
+    }
+
+    status = IPv6ToBleQueueInjectPacketCopy(packetFromUsermode,
+                                            (UINT32)receivedSize,
+                                            OUTBOUND
+                                            );
 
     NT_ASSERT(irql == KeGetCurrentIrql());
 
     if (!NT_SUCCESS(status))
     {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_INJECT_NETWORK_OUTBOUND, "Outbound injection at network layer failed %!STATUS!", status);
+        TraceDataPath(TRACE_LEVEL_ERROR, TRACE_INJECT_NETWORK_OUTBOUND, "Outbound injection at network layer failed %!STATUS!", status);
     }
 
 Exit:
 
-    // Free memory if injection failed but the NBL was successfully allocated,
-    // because if injection fails then the completion function is not called
+    TraceDataPath(TRACE_LEVEL_INFORMATION, TRACE_INJECT_NETWORK_OUTBOUND, "%!FUNC! Exit");
+
+    return status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleQueueInjectNetworkBatchV6(
+    WDFREQUEST  Request,
+    ULONG       direction,
+    ULONG_PTR*  info
+)
+/*++
+Routine Description:
+
+    Injects every packet in a batched inject request into the inbound or
+    outbound Network Layer data path, and reports a status for each one.
+
+    The whole input buffer is validated before anything is injected, so a
+    malformed batch is rejected without side effects. Each packet is then
+    copied and injected on its own with IPv6ToBleQueueInjectPacketCopy, as
+    the request's buffers go away when it is completed, which is usually
+    before the injections complete.
+
+    The batch IOCTLs are METHOD_BUFFERED, so the input records and the
+    output statuses share one system buffer, and writing a status
+    overwrites the start of the records. The statuses are collected in a
+    separate buffer while injecting and copied out once every record has
+    been read.
+
+Arguments:
+
+    Request - the WDFREQUEST object that contains the packets from usermode.
+
+    direction - INBOUND or OUTBOUND.
+
+    info - receives the number of bytes of per-packet status written.
+
+Return Value:
+
+    STATUS_SUCCESS if the batch was well formed, even if some packets failed
+    to inject; their failures are in the per-packet status. Other appropriate
+    NTSTATUS error codes if the batch was rejected.
+
+--*/
+{
+    TraceDataPath(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! Entry");
+
+    NTSTATUS status = STATUS_SUCCESS;
+
+    BYTE* inputBuffer = NULL;
+    size_t inputBufferLength = 0;
+    NTSTATUS* packetStatus = NULL;
+    size_t outputBufferLength = 0;
+    NTSTATUS* batchStatus = NULL;
+
+    size_t offset = 0;
+    size_t packetCount = 0;
+
+    *info = 0;
+
+    //
+    // Step 1
+    // Retrieve the buffers. The input must hold at least one record header
+    // and minimal packet, and the output at least one status.
+    //
+    status = WdfRequestRetrieveInputBuffer(Request,
+                                           sizeof(IPV6_TO_BLE_INJECT_RECORD) + IPV6_HEADER_LENGTH,
+                                           (PVOID*)&inputBuffer,
+                                           &inputBufferLength
+                                           );
+    if (!NT_SUCCESS(status))
+    {
+        TraceDataPath(TRACE_LEVEL_ERROR, TRACE_QUEUE, "Retrieving input buffer from WDFREQUEST failed during %!FUNC! with %!STATUS!", status);
+        goto Exit;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            sizeof(NTSTATUS),
+                                            (PVOID*)&packetStatus,
+                                            &outputBufferLength
+                                            );
     if (!NT_SUCCESS(status))
     {
-        if (NBL)
+        TraceDataPath(TRACE_LEVEL_ERROR, TRACE_QUEUE, "Retrieving output buffer from WDFREQUEST failed during %!FUNC! with %!STATUS!", status);
+        goto Exit;
+    }
+
+    //
+    // Step 2
+    // Walk the records once to validate them and count the packets
+    //
+    while (offset < inputBufferLength)
+    {
+        if (inputBufferLength - offset < sizeof(IPV6_TO_BLE_INJECT_RECORD))
         {
-            FwpsFreeNetBufferList0(NBL);
-            NBL = 0;
+            status = STATUS_INVALID_PARAMETER;
+            break;
         }
+
+        PIPV6_TO_BLE_INJECT_RECORD record = (PIPV6_TO_BLE_INJECT_RECORD)(inputBuffer + offset);
+        size_t recordLength = sizeof(IPV6_TO_BLE_INJECT_RECORD) + record->packetLength;
+
+        if (record->packetLength < IPV6_HEADER_LENGTH ||
+            record->packetLength > INJECT_PACKET_MAX_LENGTH ||
+            inputBufferLength - offset < recordLength)
+        {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        packetCount++;
+        offset += ALIGN_UP_BY(recordLength, IPV6_TO_BLE_INJECT_RECORD_ALIGNMENT);
+    }
+    if (!NT_SUCCESS(status))
+    {
+        TraceDataPath(TRACE_LEVEL_ERROR, TRACE_QUEUE, "Malformed inject record at offset %Iu %!STATUS!", offset, status);
+        goto Exit;
     }
 
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_INJECT_NETWORK_OUTBOUND, "%!FUNC! Exit");
+    if (outputBufferLength / sizeof(NTSTATUS) < packetCount)
+    {
+        status = STATUS_BUFFER_TOO_SMALL;
+        TraceDataPath(TRACE_LEVEL_ERROR, TRACE_QUEUE, "Output buffer too small for %Iu packet statuses %!STATUS!", packetCount, status);
+        goto Exit;
+    }
+
+    batchStatus = (NTSTATUS*)ExAllocatePoolWithTag(NonPagedPoolNx,
+                                                   packetCount * sizeof(NTSTATUS),
+                                                   IPV6_TO_BLE_INJECT_TAG
+                                                   );
+    if (!batchStatus)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        TraceDataPath(TRACE_LEVEL_ERROR, TRACE_QUEUE, "Allocating %Iu packet statuses failed %!STATUS!", packetCount, status);
+        goto Exit;
+    }
 
-	return status;
+    //
+    // Step 3
+    // Inject each packet and keep its status aside, so the records aren't
+    // overwritten while they are still being read
+    //
+    offset = 0;
+    for (size_t i = 0; i < packetCount; i++)
+    {
+        PIPV6_TO_BLE_INJECT_RECORD record = (PIPV6_TO_BLE_INJECT_RECORD)(inputBuffer + offset);
+
+        batchStatus[i] = IPv6ToBleQueueInjectPacketCopy((BYTE*)(record + 1),
+                                                        record->packetLength,
+                                                        direction
+                                                        );
 
+        offset += ALIGN_UP_BY(sizeof(IPV6_TO_BLE_INJECT_RECORD) + record->packetLength,
+                              IPV6_TO_BLE_INJECT_RECORD_ALIGNMENT
+                              );
+    }
+
+    //
+    // Step 4
+    // Every record has been read, so the statuses can now go into the
+    // shared buffer
+    //
+    RtlCopyMemory(packetStatus, batchStatus, packetCount * sizeof(NTSTATUS));
+
+    *info = packetCount * sizeof(NTSTATUS);
+
+Exit:
+
+    if (batchStatus)
+    {
+        ExFreePoolWithTag(batchStatus, IPV6_TO_BLE_INJECT_TAG);
+    }
+
+    TraceDataPath(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! Exit");
+
+    return status;
 }
 
 _Use_decl_annotations_
@@ -791,13 +1143,14 @@ IPv6ToBleQueueInjectNetworkComplete(
 /*++
 Routine Description:
 
-    Called by the filter engine when a packet has been successfully injected
-    into the outbound stack. Performs memory cleanup, etc.
+    Called by the filter engine when a packet has been injected into the
+    inbound or outbound stack. Returns the packet's injection slab to the
+    free list.
 
 Arguments:
 
-    context - A pointer to the completionContext parameter of the packet
-    injection function.
+    context - the injection slab holding the packet, passed as the
+    completionContext parameter of the packet injection function.
 
     netBufferList - the NET_BUFFER_LIST parameter from the injection function.
 
@@ -811,11 +1164,7 @@ Return Value:
 
 --*/
 {
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_INJECT_NETWORK_COMPLETE, "%!FUNC! Entry");
-
-    // This was not passed in as we don't need any kind of completion data
-    // such as statistics, tracking number of completed packet injections, etc.
-    UNREFERENCED_PARAMETER(context);
+    TraceDataPath(TRACE_LEVEL_INFORMATION, TRACE_INJECT_NETWORK_COMPLETE, "%!FUNC! Entry");
 
     // Doesn't matter if this is called at or below DISPATCH_LEVEL
     UNREFERENCED_PARAMETER(dispatchLevel);
@@ -829,23 +1178,145 @@ Return Value:
 
     NTSTATUS status = netBufferList->Status;
 
+    PINJECT_SLAB slab = (PINJECT_SLAB)context;
+    NT_ASSERT(slab->NBL == netBufferList);
+
     if (!NT_SUCCESS(status))
     {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_INJECT_NETWORK_COMPLETE, "Injection complete: NBL status did not succeed %!STATUS!", status);
+        IPV6_TO_BLE_STATISTICS_INCREMENT(injectCompleteFailed[slab->direction]);
+        TraceDataPath(TRACE_LEVEL_ERROR, TRACE_INJECT_NETWORK_COMPLETE, "Injection complete: NBL status did not succeed %!STATUS!", status);
     }
 
     //
     // Step 2
-    // Free the NBL
+    // Return the slab to the free list. Its NBL and MDL are reused as is.
     //
-    FwpsFreeNetBufferList0(netBufferList);
-    netBufferList = 0;
 
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_INJECT_NETWORK_COMPLETE, "%!FUNC! Exit");
+    InterlockedPushEntrySList(&gNdisPoolData->injectSlabFreeList, &slab->entry);
+
+    TraceDataPath(TRACE_LEVEL_INFORMATION, TRACE_INJECT_NETWORK_COMPLETE, "%!FUNC! Exit");
 
     return;
 }
 
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleQueueInjectPacketCopy(
+    const BYTE* packet,
+    UINT32      packetLength,
+    ULONG       direction
+)
+/*++
+Routine Description:
+
+    Copies a packet into a preallocated injection slab and injects it into
+    the inbound or outbound Network Layer data path.
+
+    The slab's NBL and MDL were set up when the slab was created, so all
+    that changes per packet is the data length. The slab is returned to the
+    free list by IPv6ToBleQueueInjectNetworkComplete, which means the caller's
+    buffer can be reused as soon as this returns. If every slab is in use,
+    the packet is dropped rather than allocating more memory.
+
+Arguments:
+
+    packet - the IPv6 packet, starting with the IPv6 header.
+
+    packetLength - the length of the packet, no more than
+    INJECT_PACKET_MAX_LENGTH.
+
+    direction - INBOUND to inject into the receive path, OUTBOUND to inject
+    into the send path.
+
+Return Value:
+
+    STATUS_SUCCESS if the packet was successfully injected. Other appropriate
+    NTSTATUS error codes otherwise, depending on where the failure occurred.
+
+--*/
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    PINJECT_SLAB slab = NULL;
+
+    NT_ASSERT(packetLength <= INJECT_PACKET_MAX_LENGTH);
+
+    //
+    // Step 1
+    // Take a free slab and copy the packet into it
+    //
+    PSLIST_ENTRY entry = InterlockedPopEntrySList(&gNdisPoolData->injectSlabFreeList);
+    if (!entry)
+    {
+        IPV6_TO_BLE_STATISTICS_INCREMENT(injectDroppedNoSlab[direction]);
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        TraceDataPath(TRACE_LEVEL_ERROR, TRACE_QUEUE, "No free injection slab; dropping packet %!STATUS!", status);
+        goto Exit;
+    }
+    slab = CONTAINING_RECORD(entry, INJECT_SLAB, entry);
+
+    RtlCopyMemory(slab->data, packet, packetLength);
+    slab->direction = direction;
+
+    //
+    // Step 2
+    // Reset the slab's NBL to describe just this packet
+    //
+    NET_BUFFER_LIST_STATUS(slab->NBL) = STATUS_SUCCESS;
+    NET_BUFFER_DATA_LENGTH(NET_BUFFER_LIST_FIRST_NB(slab->NBL)) = packetLength;
+
+    //
+    // Step 3
+    // Inject the packet into the receive or send path
+    //
+    if (direction == INBOUND)
+    {
+        status = FwpsInjectNetworkReceiveAsync0(gInjectionHandleNetwork,
+                                                0,
+                                                0,
+                                                DEFAULT_COMPARTMENT_ID,
+                                                0,   // New packet, so no original
+                                                     // iFace index?
+                                                0,   // Or sub-iFace index?
+                                                slab->NBL,
+                                                IPv6ToBleQueueInjectNetworkComplete,
+                                                slab
+                                                );
+    }
+    else
+    {
+        status = FwpsInjectNetworkSendAsync0(gInjectionHandleNetwork,
+                                             0,
+                                             0,
+                                             DEFAULT_COMPARTMENT_ID,
+                                             slab->NBL,
+                                             IPv6ToBleQueueInjectNetworkComplete,
+                                             slab
+                                             );
+    }
+    if (NT_SUCCESS(status))
+    {
+        IPV6_TO_BLE_STATISTICS_INCREMENT(injectSubmitted[direction]);
+    }
+    else
+    {
+        IPV6_TO_BLE_STATISTICS_INCREMENT(injectFailed[direction]);
+        TraceDataPath(TRACE_LEVEL_ERROR, TRACE_QUEUE, "Injecting packet at network layer failed %!STATUS!", status);
+    }
+
+Exit:
+
+    // The completion callback is not called if injection failed, so return
+    // the slab here
+    if (!NT_SUCCESS(status) && slab)
+    {
+        InterlockedPushEntrySList(&gNdisPoolData->injectSlabFreeList, &slab->entry);
+    }
+
+    return status;
+}
+
+
 _Use_decl_annotations_
 NTSTATUS
 IPv6ToBleQueueReportMeshRole(
@@ -908,6 +1379,119 @@ Return Value:
 
     *bytesTransferred = sizeof(UINT32);
 
+Exit:
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! Exit");
+
+    return status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleQueueReportReadiness(
+    _In_    WDFREQUEST  Request,
+    _Out_   ULONG_PTR*  bytesTransferred
+)
+/*++
+Routine Description:
+
+    Reports how far the driver has got with starting: whether the start work
+    item is still running, and if not, whether the callouts are registered,
+    are waiting for both lists to have entries, or failed to register. Also
+    reports the current size of each list, how long starting took, and how
+    many listen channels the app should send listen requests on.
+
+    The state is worked out when asked rather than tracked, since the
+    callouts are also registered and unregistered as the lists change.
+
+Arguments:
+
+    Request - the WDFREQUEST sent by a user mode app, the output buffer of
+    which will receive an IPV6_TO_BLE_READINESS.
+
+    bytesTransferred - receives the number of bytes written.
+
+Return Value:
+
+    Returns STATUS_SUCCESS if the output buffer was filled in. Otherwise,
+    returns an appropriate NTSTATUS error code.
+
+--*/
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! Entry");
+
+    NTSTATUS status = STATUS_SUCCESS;
+
+    PIPV6_TO_BLE_READINESS readiness = NULL;
+
+    *bytesTransferred = 0;
+
+    //
+    // Step 1
+    // Retrieve the output buffer
+    //
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            sizeof(IPV6_TO_BLE_READINESS),
+                                            (PVOID*)&readiness,
+                                            NULL
+                                            );
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "Retrieving output buffer from WDFREQUEST failed during %!FUNC! with %!STATUS!", status);
+        goto Exit;
+    }
+
+    RtlZeroMemory(readiness, sizeof(IPV6_TO_BLE_READINESS));
+
+    //
+    // Step 2
+    // Work out the state. The start results are written before the event is
+    // signaled, so they are valid once it is.
+    //
+    if (!KeReadStateEvent(&gStartCompleteEvent))
+    {
+        readiness->state = IPV6_TO_BLE_READINESS_STARTING;
+        readiness->startStatus = STATUS_PENDING;
+    }
+    else
+    {
+        readiness->startStatus = gStartStatus;
+        readiness->startMicroseconds = gStartMicroseconds;
+
+        if (gCalloutsRegistered)
+        {
+            readiness->state = IPV6_TO_BLE_READINESS_READY;
+        }
+        else if (!NT_SUCCESS(gStartStatus))
+        {
+            readiness->state = IPV6_TO_BLE_READINESS_FAILED;
+        }
+        else
+        {
+            readiness->state = IPV6_TO_BLE_READINESS_WAITING_FOR_LISTS;
+        }
+    }
+
+    //
+    // Step 3
+    // Report the size of each list from its published snapshot
+    //
+    if (gBorderRouterFlag)
+    {
+        KIRQL oldIrql;
+        PRUNTIME_LIST_SNAPSHOT snapshot = IPv6ToBleRuntimeListSnapshotAcquire(WHITE_LIST, &oldIrql);
+        readiness->whiteListEntries = snapshot ? snapshot->entryCount : 0;
+        IPv6ToBleRuntimeListSnapshotRelease(oldIrql);
+
+        snapshot = IPv6ToBleRuntimeListSnapshotAcquire(MESH_LIST, &oldIrql);
+        readiness->meshListEntries = snapshot ? snapshot->entryCount : 0;
+        IPv6ToBleRuntimeListSnapshotRelease(oldIrql);
+    }
+
+    readiness->listenChannels = gListenChannelCount;
+
+    *bytesTransferred = sizeof(IPV6_TO_BLE_READINESS);
+
 Exit:
 
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! Exit");
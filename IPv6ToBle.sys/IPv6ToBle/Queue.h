@@ -60,6 +60,16 @@ IPv6ToBleQueueInjectNetworkOutboundV6(
 	_In_ WDFREQUEST	Request
 );
 
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+NTSTATUS
+IPv6ToBleQueueInjectNetworkBatchV6(
+    _In_    WDFREQUEST  Request,
+    _In_    ULONG       direction,
+    _Out_   ULONG_PTR*  info
+);
+
 _IRQL_requires_min_(PASSIVE_LEVEL)
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _IRQL_requires_same_
@@ -70,6 +80,21 @@ IPv6ToBleQueueInjectNetworkComplete(
     _In_    BOOLEAN             dispatchLevel
 );
 
+//-----------------------------------------------------------------------------
+// Function to copy a packet into a preallocated injection slab and inject it.
+// IPv6ToBleQueueInjectNetworkComplete returns the slab to the free list.
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+NTSTATUS
+IPv6ToBleQueueInjectPacketCopy(
+    _In_reads_(packetLength)    const BYTE* packet,
+    _In_                        UINT32      packetLength,
+    _In_                        ULONG       direction
+);
+
 //-----------------------------------------------------------------------------
 // Function to retrieve the mesh role (i.e. border router or not) and report it
 //-----------------------------------------------------------------------------
@@ -83,4 +108,17 @@ IPv6ToBleQueueReportMeshRole(
     _Out_   ULONG_PTR*  info
 );
 
+//-----------------------------------------------------------------------------
+// Function to report whether the driver has finished starting
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+NTSTATUS
+IPv6ToBleQueueReportReadiness(
+    _In_    WDFREQUEST  Request,
+    _Out_   ULONG_PTR*  info
+);
+
 EXTERN_C_END
\ No newline at end of file
@@ -30,8 +30,9 @@ Routine Description:
 
     Adds an entry to a runtime list.
 
-    This function is called from EvtIoDeviceControl, which can run either at
-    IRQL = PASSIVE_LEVEL or DISPATCH_LEVEL.
+    This function is called from EvtIoDeviceControl at IRQL = PASSIVE_LEVEL.
+    It must not be called at DISPATCH_LEVEL, as it takes the
+    gRuntimeListWriteLock wait lock and registers callouts and filters.
 
 Arguments:
 
@@ -48,7 +49,10 @@ Return Value:
 {
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_RUNTIME_LIST, "%!FUNC! Entry");
 
+    PAGED_CODE();
+
     NTSTATUS status = STATUS_SUCCESS;
+    BOOLEAN writeLockAcquired = FALSE;
 
 #if DBG
     KIRQL irql = KeGetCurrentIrql();
@@ -136,8 +140,11 @@ Return Value:
 
     //
     // Step 5
-    // Verify the entry isn't already in the list
+    // Take the write lock, then verify the entry isn't already in the list
     // 
+    WdfWaitLockAcquire(gRuntimeListWriteLock, NULL);
+    writeLockAcquired = TRUE;
+
     PLIST_ENTRY entry = targetListHead->Flink;
 
     NT_ASSERT(entry);
@@ -191,6 +198,7 @@ Return Value:
     // Step 6
     // Assuming it is not a duplicate, add the entry to the list
     //
+    PLIST_ENTRY newListEntry = NULL;
 	if (TargetList == WHITE_LIST)
 	{
 		PWHITE_LIST_ENTRY newWhiteListEntry = (PWHITE_LIST_ENTRY)ExAllocatePoolWithTag(
@@ -211,6 +219,8 @@ Return Value:
 		// Insert the address into the entry
 		newWhiteListEntry->ipv6Address = ipv6AddressStorage;
 		newWhiteListEntry->scopeId = scopeId;
+
+		newListEntry = &newWhiteListEntry->listEntry;
 	}
 	else
 	{
@@ -232,59 +242,92 @@ Return Value:
 		// Insert the address into the entry
 		newMeshListEntry->ipv6Address = ipv6AddressStorage;
 		newMeshListEntry->scopeId = scopeId;
+
+		newListEntry = &newMeshListEntry->listEntry;
+	}
+
+	// Publish a new snapshot of the list for the classify callouts. If that
+	// fails, back out the new entry so the list and the snapshot stay in sync.
+	status = IPv6ToBleRuntimeListPublishSnapshot(TargetList);
+	if (!NT_SUCCESS(status))
+	{
+		RemoveEntryList(newListEntry);
+		if (TargetList == WHITE_LIST)
+		{
+			ExFreePoolWithTag(CONTAINING_RECORD(newListEntry,
+												WHITE_LIST_ENTRY,
+												listEntry
+												),
+							  IPV6_TO_BLE_WHITE_LIST_TAG
+							  );
+		}
+		else
+		{
+			ExFreePoolWithTag(CONTAINING_RECORD(newListEntry,
+												MESH_LIST_ENTRY,
+												listEntry
+												),
+							  IPV6_TO_BLE_MESH_LIST_TAG
+							  );
+		}
+		goto Exit;
 	}
 
     //
     // Step 7
-    // Update the boolean that the list has been modified
+    // Mark the list modified so it is flushed to the registry, and tell
+    // anyone waiting for list changes
     //
-	if (TargetList == WHITE_LIST)
-	{
-		WdfSpinLockAcquire(gWhiteListModifiedLock);
-		gWhiteListModified = TRUE;
-		WdfSpinLockRelease(gWhiteListModifiedLock);
-	}
-	else
-	{
-		WdfSpinLockAcquire(gMeshListModifiedLock);
-		gMeshListModified = TRUE;
-		WdfSpinLockRelease(gMeshListModifiedLock);
-	}    
+	IPv6ToBleRegistryScheduleListFlush(TargetList);
+
+    IPv6ToBleListChangeRecord(TargetList,
+                              IPV6_TO_BLE_LIST_CHANGE_ADDED,
+                              &ipv6AddressStorage,
+                              scopeId
+                              );
+    IPv6ToBleListChangeCommit();
 
     NT_ASSERT(irql == KeGetCurrentIrql());
 
     //
-    // Step 6
-    // Because the white list has had an entry successfully added, and the
-    // callout filters are based on the white list, tear down and rebuild the
-    // callouts IF the mesh list is also not empty. If we just added an entry
-    // to the white list but there is nothing in the mesh list, we can't
-    // perform listening callout operations.
+    // Step 8
+    // Because the list has had an entry successfully added, and the callout
+    // filters are based on the lists, add a filter for the new entry IF the
+    // other list is also not empty. If we just added an entry to the white
+    // list but there is nothing in the mesh list, we can't perform listening
+    // callout operations.
     //
     // Also, we have to check if the callouts were registered. If they were
     // not and we now have at least one entry in both the white list and the
-    // mesh list, then we have to register the callouts but not try to
-    // unregister them first. If the callouts were already registered, i.e. 
-    // there was already at least one entry in each list and we just added 
-    // another one, then tear down and rebuild.
-    //
-    // Note: we shouldn't have to worry about synchronizing access to the list
-    // heads because this and other list modification functions are called from
-    // EvtIoDeviceControl, which is guaranteed to be synchronized by the
-    // framework. Nothing else in this driver should ever come along at
-    // IRQL > PASSIVE_LEVEL that nees to check whether the callouts are
-    // registered.
+    // mesh list, then we have to register the callouts (which adds the
+    // filters for every entry). If the callouts were already registered,
+    // i.e. there was already at least one entry in each list and we just
+    // added another one, then only the new entry's filter needs updating. If
+    // that fails, fall back to tearing down and rebuilding the callouts.
+    //
+    // Note: the write lock is still held here, so registering the callouts
+    // sees the same lists that were just published. Nothing else in this
+    // driver should ever come along at IRQL > PASSIVE_LEVEL that needs to
+    // check whether the callouts are registered.
     //
     if ((TargetList == WHITE_LIST && !IsListEmpty(gMeshListHead)) ||
 		(TargetList == MESH_LIST && !IsListEmpty(gWhiteListHead)))
     {
         if (gCalloutsRegistered)
         {
-            IPv6ToBleCalloutsUnregister();
-            status = IPv6ToBleCalloutsRegister();
+            status = IPv6ToBleCalloutFilterAddForListEntry(TargetList,
+                                                           &ipv6AddressStorage
+                                                           );
             if (!NT_SUCCESS(status))
             {
-                TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Registering callouts during %!FUNC! failed with %!STATUS!", status);
+                TraceEvents(TRACE_LEVEL_WARNING, TRACE_RUNTIME_LIST, "Adding filter for new entry failed during %!FUNC! with %!STATUS!, rebuilding callouts", status);
+
+                IPv6ToBleCalloutsUnregister();
+                status = IPv6ToBleCalloutsRegister();
+                if (!NT_SUCCESS(status))
+                {
+                    TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Registering callouts during %!FUNC! failed with %!STATUS!", status);
+                }
             }
         }
         else
@@ -299,10 +342,77 @@ Return Value:
 
 Exit:
 
+    if (writeLockAcquired)
+    {
+        WdfWaitLockRelease(gRuntimeListWriteLock);
+    }
+
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_RUNTIME_LIST, "%!FUNC! Exit");
     return status;
 }
 
+//
+// Removes a runtime list's registry key, with both its binary and legacy
+// values, for when the list has been emptied. A flush of the list still
+// waiting for the registry timer is dropped too, so it can't write the list
+// back. The caller holds gRuntimeListWriteLock.
+//
+static
+NTSTATUS
+IPv6ToBleRuntimeListRemoveRegistryKey(
+    _In_ ULONG TargetList
+)
+{
+	if (TargetList == WHITE_LIST)
+	{
+		WdfSpinLockAcquire(gWhiteListModifiedLock);
+		gWhiteListModified = FALSE;
+		WdfSpinLockRelease(gWhiteListModifiedLock);
+	}
+	else
+	{
+		WdfSpinLockAcquire(gMeshListModifiedLock);
+		gMeshListModified = FALSE;
+		WdfSpinLockRelease(gMeshListModifiedLock);
+	}
+
+    NTSTATUS status = IPv6ToBleRegistryOpenParametersKey();
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+	if (TargetList == WHITE_LIST)
+	{
+		status = IPv6ToBleRegistryOpenWhiteListKey();
+		if (NT_SUCCESS(status))
+		{
+			status = WdfRegistryRemoveKey(gWhiteListKey);
+			if (!NT_SUCCESS(status))
+			{
+				TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Removing white list key failed during %!FUNC!, status: %!STATUS!", status);
+			}
+		}
+	}
+	else
+	{
+		status = IPv6ToBleRegistryOpenMeshListKey();
+		if (NT_SUCCESS(status))
+		{
+			status = WdfRegistryRemoveKey(gMeshListKey);
+			if (!NT_SUCCESS(status))
+			{
+				TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Removing mesh list key failed during %!FUNC!, status: %!STATUS!", status);
+			}
+		}
+	}
+
+    // Close the parent key we opened to remove the child list key
+    WdfRegistryClose(gParametersKey);
+
+    return status;
+}
+
 _Use_decl_annotations_
 NTSTATUS
 IPv6ToBleRuntimeListRemoveListEntry(
@@ -314,8 +424,9 @@ Routine Description:
 
     Removes an entry from a runtime list.
 
-    This function is called from EvtIoDeviceControl, which can run either at
-    IRQL = PASSIVE_LEVEL or DISPATCH_LEVEL.
+    This function is called from EvtIoDeviceControl at IRQL = PASSIVE_LEVEL.
+    It must not be called at DISPATCH_LEVEL, as it takes the
+    gRuntimeListWriteLock wait lock and deletes filters.
 
 Arguments:
 
@@ -329,14 +440,18 @@ Arguments:
 Return Value:
 
     STATUS_SUCCESS if successful; appropriate NTSTATUS error codes otherwise.
+    If the new list snapshot can't be published, the entry is left in the
+    list and nothing is changed.
 
 --*/
 {
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_RUNTIME_LIST, "%!FUNC! Entry");
 
+    PAGED_CODE();
+
     NTSTATUS status = STATUS_SUCCESS;
     BOOLEAN isInList = FALSE;
-    BOOLEAN parametersKeyOpened = FALSE;
+    BOOLEAN writeLockAcquired = FALSE;
 
     PVOID inputBuffer;
     size_t receivedSize = 0;
@@ -355,8 +470,11 @@ Return Value:
 
     //
     // Step 2
-    // Check for empty list
+    // Take the write lock and check for empty list
     //
+    WdfWaitLockAcquire(gRuntimeListWriteLock, NULL);
+    writeLockAcquired = TRUE;
+
     if (IsListEmpty(targetListHead))
     {
         status = STATUS_INVALID_PARAMETER;
@@ -431,9 +549,11 @@ Return Value:
 
     //
     // Step 6
-    // Traverse the list and remove the entry if we find it
+    // Traverse the list and take the entry out of it if we find it. The
+    // entry isn't freed yet, so it can be put back if publishing fails.
     //
     PLIST_ENTRY entry = targetListHead->Flink;
+    PLIST_ENTRY previousEntry = NULL;
 
     NT_ASSERT(entry);
 
@@ -470,30 +590,14 @@ Return Value:
                            &scopeId,
                            sizeof(ULONG)))
         {
-            // Found it, now remove it
+            // Found it, now take it out of the list, remembering where it
+            // was. No need to check the bool result of this function, as it
+            // only reports TRUE if the list is now empty and we don't care
+            // about that right now
             isInList = TRUE;
-
-            // No need to check the bool result of this function, as it only
-            // reports TRUE if the list is now empty and we don't care about
-            // that right now
+            previousEntry = entry->Blink;
             RemoveEntryList(entry);
 
-            // Free the memory (should be valid if we got to this point)
-			if (TargetList == WHITE_LIST)
-			{
-				ExFreePoolWithTag(runtimeListEntry.whiteListEntry,
-								  IPV6_TO_BLE_WHITE_LIST_TAG
-								  );
-				runtimeListEntry.whiteListEntry = 0;
-			}
-			else
-			{
-				ExFreePoolWithTag(runtimeListEntry.meshListEntry,
-								  IPV6_TO_BLE_MESH_LIST_TAG
-								  );
-				runtimeListEntry.meshListEntry = 0;
-			}
-
             break;
         }
 
@@ -502,8 +606,9 @@ Return Value:
 
     //
     // Step 7
-    // Exit if we didn't find the entry, otherwise mark that we modified the
-    // list by acquiring the appropriate spinlock
+    // Exit if we didn't find the entry. Otherwise publish a snapshot without
+    // it; if that fails, put the entry back where it was so the list and the
+    // snapshot stay in sync, and nothing has changed.
     //
     if (!isInList)
     {
@@ -511,24 +616,53 @@ Return Value:
         TraceEvents(TRACE_LEVEL_WARNING, TRACE_RUNTIME_LIST, "Could not find requested entry in the list %!STATUS!", status);
         goto Exit;
     }
-    else
+
+    status = IPv6ToBleRuntimeListPublishSnapshot(TargetList);
+    if (!NT_SUCCESS(status))
     {
-		if (TargetList == WHITE_LIST)
-		{
-			WdfSpinLockAcquire(gWhiteListModifiedLock);
-			gWhiteListModified = TRUE;
-			WdfSpinLockRelease(gWhiteListModifiedLock);
-		}
-		else
-		{
-			WdfSpinLockAcquire(gMeshListModifiedLock);
-			gMeshListModified = TRUE;
-			WdfSpinLockRelease(gMeshListModifiedLock);
-		}
+        InsertHeadList(previousEntry, entry);
+        goto Exit;
     }
 
     //
     // Step 8
+    // The entry is gone from the list and the snapshot, so finish removing
+    // it: update the filters, free it, mark the list modified so it is
+    // flushed to the registry, and tell anyone waiting for list changes.
+    //
+    // If deleting the filter fails it stays behind until the callouts are
+    // next rebuilt; the classify callouts verify addresses against the
+    // snapshots regardless.
+    //
+    (VOID)IPv6ToBleCalloutFilterDeleteForListEntry(TargetList,
+                                                   &ipv6AddressStorage
+                                                   );
+
+    if (TargetList == WHITE_LIST)
+    {
+        ExFreePoolWithTag(CONTAINING_RECORD(entry, WHITE_LIST_ENTRY, listEntry),
+                          IPV6_TO_BLE_WHITE_LIST_TAG
+                          );
+    }
+    else
+    {
+        ExFreePoolWithTag(CONTAINING_RECORD(entry, MESH_LIST_ENTRY, listEntry),
+                          IPV6_TO_BLE_MESH_LIST_TAG
+                          );
+    }
+    entry = NULL;
+
+    IPv6ToBleRegistryScheduleListFlush(TargetList);
+
+    IPv6ToBleListChangeRecord(TargetList,
+                              IPV6_TO_BLE_LIST_CHANGE_REMOVED,
+                              &ipv6AddressStorage,
+                              scopeId
+                              );
+    IPv6ToBleListChangeCommit();
+
+    //
+    // Step 9
     // If the list is *now* empty and the callouts were registered,
     // unregister the callouts. Doesn't matter about the other list.
     //
@@ -542,123 +676,1292 @@ Return Value:
         }
 
         // Remove the list registry key since the list is now empty
-        status = IPv6ToBleRegistryOpenParametersKey();
-        if (!NT_SUCCESS(status))
-        {
-            goto Exit;
-        }
-        parametersKeyOpened = TRUE;
-
-		if (TargetList == WHITE_LIST)
-		{
-			status = IPv6ToBleRegistryOpenWhiteListKey();
-			if (!NT_SUCCESS(status))
-			{
-				goto Exit;
-			}
-			status = WdfRegistryRemoveKey(gWhiteListKey);
-			if (!NT_SUCCESS(status))
-			{
-				TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Removing white list key failed during %!FUNC!, status: %!STATUS!", status);
-			}
-		}
-		else
-		{
-			status = IPv6ToBleRegistryOpenMeshListKey();
-			if (!NT_SUCCESS(status))
-			{
-				goto Exit;
-			}
-			status = WdfRegistryRemoveKey(gMeshListKey);
-			if (!NT_SUCCESS(status))
-			{
-				TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Removing mesh list key failed during %!FUNC!, status: %!STATUS!", status);
-			}
-		}
-        
+        status = IPv6ToBleRuntimeListRemoveRegistryKey(TargetList);
     }
 
 Exit:
 
-    // Close the parent key if we opened it to remove the child list key
-    if (parametersKeyOpened)
+    if (writeLockAcquired)
     {
-        WdfRegistryClose(gParametersKey);
+        WdfWaitLockRelease(gRuntimeListWriteLock);
     }
 
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_RUNTIME_LIST, "%!FUNC! Exit");
     return status;
 }
 
-_Use_decl_annotations_
+//
+// Returns the address and scope ID of a white list or mesh list entry
+//
+static
 VOID
-IPv6ToBleRuntimeListPurgeRuntimeList(
-	_In_ ULONG TargetList
+IPv6ToBleRuntimeListEntryGetAddress(
+    _In_    ULONG               TargetList,
+    _In_    PLIST_ENTRY         entry,
+    _Out_   const IN6_ADDR**    ipv6Address,
+    _Out_   ULONG*              scopeId
+)
+{
+    if (TargetList == WHITE_LIST)
+    {
+        PWHITE_LIST_ENTRY whiteListEntry = CONTAINING_RECORD(entry,
+                                                             WHITE_LIST_ENTRY,
+                                                             listEntry
+                                                             );
+        *ipv6Address = &whiteListEntry->ipv6Address;
+        *scopeId = whiteListEntry->scopeId;
+    }
+    else
+    {
+        PMESH_LIST_ENTRY meshListEntry = CONTAINING_RECORD(entry,
+                                                           MESH_LIST_ENTRY,
+                                                           listEntry
+                                                           );
+        *ipv6Address = &meshListEntry->ipv6Address;
+        *scopeId = meshListEntry->scopeId;
+    }
+}
+
+//
+// Returns TRUE if a runtime list entry matches an entry of a bulk request,
+// by address and scope ID. batchIndex maps each address in the request to
+// its position in batchEntries.
+//
+static
+BOOLEAN
+IPv6ToBleRuntimeListBatchContains(
+    _In_    ULONG                               TargetList,
+    _In_    PLIST_ENTRY                         entry,
+    _In_    const ADDRESS_TABLE*                batchIndex,
+    _In_    const IPV6_TO_BLE_BULK_LIST_ENTRY*  batchEntries
+)
+{
+    const IN6_ADDR* ipv6Address = NULL;
+    ULONG scopeId = 0;
+    ULONG batchPosition = 0;
+
+    IPv6ToBleRuntimeListEntryGetAddress(TargetList, entry, &ipv6Address, &scopeId);
+
+    return IPv6ToBleAddressTableLookup(batchIndex,
+                                       ipv6Address->u.Byte,
+                                       &batchPosition) &&
+           batchEntries[batchPosition].scopeId == scopeId;
+}
+
+//
+// Moves entries from one list to the tail of another. If batchIndex is not
+// NULL, only entries that match the bulk request are moved.
+//
+static
+VOID
+IPv6ToBleRuntimeListMoveEntries(
+    _In_        ULONG                               TargetList,
+    _Inout_     PLIST_ENTRY                         from,
+    _Inout_     PLIST_ENTRY                         to,
+    _In_opt_    const ADDRESS_TABLE*                batchIndex,
+    _In_opt_    const IPV6_TO_BLE_BULK_LIST_ENTRY*  batchEntries
+)
+{
+    PLIST_ENTRY entry = from->Flink;
+    while (entry != from)
+    {
+        PLIST_ENTRY next = entry->Flink;
+
+        if (!batchIndex ||
+            IPv6ToBleRuntimeListBatchContains(TargetList, entry, batchIndex, batchEntries))
+        {
+            RemoveEntryList(entry);
+            InsertTailList(to, entry);
+        }
+
+        entry = next;
+    }
+}
+
+//
+// Frees every entry on a list of runtime list entries
+//
+static
+VOID
+IPv6ToBleRuntimeListFreeEntries(
+    _In_    ULONG       TargetList,
+    _Inout_ PLIST_ENTRY listHead
+)
+{
+    while (!IsListEmpty(listHead))
+    {
+        PLIST_ENTRY entry = RemoveHeadList(listHead);
+        if (TargetList == WHITE_LIST)
+        {
+            ExFreePoolWithTag(CONTAINING_RECORD(entry,
+                                                WHITE_LIST_ENTRY,
+                                                listEntry
+                                                ),
+                              IPV6_TO_BLE_WHITE_LIST_TAG
+                              );
+        }
+        else
+        {
+            ExFreePoolWithTag(CONTAINING_RECORD(entry,
+                                                MESH_LIST_ENTRY,
+                                                listEntry
+                                                ),
+                              IPV6_TO_BLE_MESH_LIST_TAG
+                              );
+        }
+    }
+}
+
+//
+// Logs the change a bulk request made to a list for the list change IOCTL:
+// entries taken out of the list are logged as removed, then the request's
+// entries as added or removed. The changes are committed as one.
+//
+static
+VOID
+IPv6ToBleRuntimeListRecordBulkChange(
+    _In_    ULONG                               TargetList,
+    _In_    ULONG                               Operation,
+    _In_    PLIST_ENTRY                         oldEntries,
+    _In_    const IPV6_TO_BLE_BULK_LIST_ENTRY*  batchEntries,
+    _In_    ULONG                               entryCount
+)
+{
+    if (Operation == BULK_LIST_REPLACE)
+    {
+        for (PLIST_ENTRY entry = oldEntries->Flink;
+             entry != oldEntries;
+             entry = entry->Flink)
+        {
+            const IN6_ADDR* ipv6Address = NULL;
+            ULONG scopeId = 0;
+
+            IPv6ToBleRuntimeListEntryGetAddress(TargetList, entry, &ipv6Address, &scopeId);
+            IPv6ToBleListChangeRecord(TargetList,
+                                      IPV6_TO_BLE_LIST_CHANGE_REMOVED,
+                                      ipv6Address,
+                                      scopeId
+                                      );
+        }
+    }
+
+    for (ULONG i = 0; i < entryCount; i++)
+    {
+        IPv6ToBleListChangeRecord(TargetList,
+                                  Operation == BULK_LIST_REMOVE ? IPV6_TO_BLE_LIST_CHANGE_REMOVED : IPV6_TO_BLE_LIST_CHANGE_ADDED,
+                                  (const IN6_ADDR*)batchEntries[i].ipv6Address,
+                                  batchEntries[i].scopeId
+                                  );
+    }
+
+    IPv6ToBleListChangeCommit();
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleRuntimeListApplyBulkChange(
+    WDFREQUEST  Request,
+    ULONG       Operation
 )
 /*++
 Routine Description:
 
-    Cleans up the runtime linked list of white list entries, if possible.
+    Adds, removes, or replaces many entries of a runtime list at once, from
+    binary addresses, so provisioning a large mesh doesn't take one request,
+    one string conversion, and one filter update per device.
+
+    The change is all or nothing. The request is checked in full and every
+    new entry is allocated before the list is touched. The list is changed
+    and a single snapshot is published. If publishing fails, the list is put
+    back the way it was. Then the filters are updated once for the whole
+    change: the /64 prefixes that were added or removed get their filters
+    added or deleted in a single transaction with the filter engine, so
+    traffic for the rest of the list stays matched throughout.
 
-    This function is called from the device cleanup callback, which is called
-    at IRQL = PASSIVE_LEVEL.
+    Once the snapshot is published the change has taken effect, and the
+    request succeeds even if the callouts can't be brought in line with it.
+    In that case the failure is traced and the callouts are left
+    unregistered, to be registered again on the next list change.
+
+    Entries are identified by address and scope ID, as in the single-entry
+    functions. Each address may appear only once per request.
 
 Arguments:
 
-    None.
+    Request - the WDFREQUEST object sent from user mode. Its input buffer
+    holds an IPV6_TO_BLE_BULK_LIST_HEADER followed by the entries (see
+    Public.h).
+
+    Operation - BULK_LIST_ADD, BULK_LIST_REMOVE, or BULK_LIST_REPLACE.
 
 Return Value:
 
-    None.
+    STATUS_SUCCESS if successful; appropriate NTSTATUS error codes otherwise.
+    If the list could not be changed, it is left as it was.
 
 --*/
 {
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_RUNTIME_LIST, "%!FUNC! Entry");
 
-	// Validate input
-	if (TargetList != WHITE_LIST && TargetList != MESH_LIST)
-	{
-		TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Invalid list option during %!FUNC!");
-		return;
-	}
+    PAGED_CODE();
 
-    // Check for empty list
-    if ((TargetList == WHITE_LIST && IsListEmpty(gWhiteListHead)) ||
-		(TargetList == MESH_LIST && IsListEmpty(gMeshListHead)))
+    NTSTATUS status = STATUS_SUCCESS;
+    BOOLEAN writeLockAcquired = FALSE;
+
+    PIPV6_TO_BLE_BULK_LIST_HEADER header = NULL;
+    size_t receivedSize = 0;
+
+    ULONG TargetList = WHITE_LIST;
+    PADDRESS_TABLE batchIndex = NULL;
+
+    // New entries waiting to go into the list, and entries taken out of it
+    // waiting to be freed
+    LIST_ENTRY newEntries;
+    LIST_ENTRY oldEntries;
+    InitializeListHead(&newEntries);
+    InitializeListHead(&oldEntries);
+
+    //
+    // Step 1
+    // Retrieve and validate the request
+    //
+    if (!gBorderRouterFlag)
     {
-        TraceEvents(TRACE_LEVEL_WARNING, TRACE_RUNTIME_LIST, "%s List is empty; nothing to purge.", TargetList == WHITE_LIST ? "White" : "Mesh");
-        return;
+        status = STATUS_INVALID_DEVICE_REQUEST;
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Runtime lists only exist on the border router %!STATUS!", status);
+        goto Exit;
     }
 
-    // Clean up the linked list
-	if (TargetList == WHITE_LIST)
-	{
-		while (!IsListEmpty(gWhiteListHead))
-		{
-			PLIST_ENTRY entry = RemoveHeadList(gWhiteListHead);   // remove from list
-			PWHITE_LIST_ENTRY whiteListEntry = CONTAINING_RECORD(entry,
-																 WHITE_LIST_ENTRY,
-																 listEntry
-																 );
-			entry = 0;
-			ExFreePoolWithTag(whiteListEntry, IPV6_TO_BLE_WHITE_LIST_TAG); // free white list entry memory
-			whiteListEntry = 0;
-		}
-	}
-	else
-	{
-		while (!IsListEmpty(gMeshListHead))
-		{
-			PLIST_ENTRY entry = RemoveHeadList(gMeshListHead);   // remove from list
-			PMESH_LIST_ENTRY meshListEntry = CONTAINING_RECORD(entry,
-															   MESH_LIST_ENTRY,
-															   listEntry
-															   );
-			entry = 0;
-			ExFreePoolWithTag(meshListEntry, IPV6_TO_BLE_MESH_LIST_TAG); // free mesh list entry memory
-			meshListEntry = 0;
-		}
-	}    
-
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_RUNTIME_LIST, "%!FUNC! Exit");
-}
\ No newline at end of file
+    status = WdfRequestRetrieveInputBuffer(Request,
+                                           sizeof(IPV6_TO_BLE_BULK_LIST_HEADER),
+                                           (PVOID*)&header,
+                                           &receivedSize
+                                           );
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Retrieving input buffer from WDFREQUEST failed during %!FUNC! with %!STATUS!", status);
+        goto Exit;
+    }
+
+    TargetList = header->targetList;
+    ULONG entryCount = header->entryCount;
+
+    if ((TargetList != WHITE_LIST && TargetList != MESH_LIST) ||
+        entryCount > IPV6_TO_BLE_BULK_LIST_MAX_ENTRIES ||
+        (entryCount == 0 && Operation != BULK_LIST_REPLACE))
+    {
+        status = STATUS_INVALID_PARAMETER;
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Invalid list %u or entry count %u during %!FUNC! with %!STATUS!", TargetList, entryCount, status);
+        goto Exit;
+    }
+
+    if ((receivedSize - sizeof(IPV6_TO_BLE_BULK_LIST_HEADER)) / sizeof(IPV6_TO_BLE_BULK_LIST_ENTRY) < entryCount)
+    {
+        status = STATUS_BUFFER_TOO_SMALL;
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Input buffer too small for %u entries during %!FUNC! with %!STATUS!", entryCount, status);
+        goto Exit;
+    }
+
+    const IPV6_TO_BLE_BULK_LIST_ENTRY* batchEntries = (const IPV6_TO_BLE_BULK_LIST_ENTRY*)(header + 1);
+    PLIST_ENTRY targetListHead = (TargetList == WHITE_LIST) ? gWhiteListHead : gMeshListHead;
+
+    //
+    // Step 2
+    // Index the request's addresses, rejecting duplicates, so the list can be
+    // matched against the request in a single pass
+    //
+    if (entryCount > 0)
+    {
+        status = IPv6ToBleAddressTableCreate(entryCount, &batchIndex);
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Creating bulk request index failed during %!FUNC! with %!STATUS!", status);
+            goto Exit;
+        }
+
+        for (ULONG i = 0; i < entryCount; i++)
+        {
+            if (IPv6ToBleAddressTableLookup(batchIndex, batchEntries[i].ipv6Address, NULL))
+            {
+                status = STATUS_INVALID_PARAMETER;
+                TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Entry %u repeats an address earlier in the request %!STATUS!", i, status);
+                goto Exit;
+            }
+
+            status = IPv6ToBleAddressTableInsert(batchIndex,
+                                                 (const IN6_ADDR*)batchEntries[i].ipv6Address,
+                                                 i
+                                                 );
+            if (!NT_SUCCESS(status))
+            {
+                TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Inserting into bulk request index failed during %!FUNC! with %!STATUS!", status);
+                goto Exit;
+            }
+        }
+    }
+
+    //
+    // Step 3
+    // Allocate the new entries up front, so nothing can fail to allocate
+    // once the list is being changed
+    //
+    if (Operation != BULK_LIST_REMOVE)
+    {
+        for (ULONG i = 0; i < entryCount; i++)
+        {
+            PLIST_ENTRY newListEntry = NULL;
+
+            if (TargetList == WHITE_LIST)
+            {
+                PWHITE_LIST_ENTRY newWhiteListEntry = (PWHITE_LIST_ENTRY)ExAllocatePoolWithTag(
+                                                        NonPagedPoolNx,
+                                                        sizeof(WHITE_LIST_ENTRY),
+                                                        IPV6_TO_BLE_WHITE_LIST_TAG
+                                                       );
+                if (newWhiteListEntry)
+                {
+                    RtlCopyMemory(&newWhiteListEntry->ipv6Address,
+                                  batchEntries[i].ipv6Address,
+                                  sizeof(IN6_ADDR)
+                                  );
+                    newWhiteListEntry->scopeId = batchEntries[i].scopeId;
+                    newListEntry = &newWhiteListEntry->listEntry;
+                }
+            }
+            else
+            {
+                PMESH_LIST_ENTRY newMeshListEntry = (PMESH_LIST_ENTRY)ExAllocatePoolWithTag(
+                                                        NonPagedPoolNx,
+                                                        sizeof(MESH_LIST_ENTRY),
+                                                        IPV6_TO_BLE_MESH_LIST_TAG
+                                                    );
+                if (newMeshListEntry)
+                {
+                    RtlCopyMemory(&newMeshListEntry->ipv6Address,
+                                  batchEntries[i].ipv6Address,
+                                  sizeof(IN6_ADDR)
+                                  );
+                    newMeshListEntry->scopeId = batchEntries[i].scopeId;
+                    newListEntry = &newMeshListEntry->listEntry;
+                }
+            }
+
+            if (!newListEntry)
+            {
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "New list entry allocation failed during %!FUNC! with %!STATUS!", status);
+                goto Exit;
+            }
+
+            InsertTailList(&newEntries, newListEntry);
+        }
+    }
+
+    //
+    // Step 4
+    // Take the write lock and match the list against the request. Adding
+    // requires that no entry is already in the list; removing requires that
+    // every entry is.
+    //
+    WdfWaitLockAcquire(gRuntimeListWriteLock, NULL);
+    writeLockAcquired = TRUE;
+
+    if (Operation != BULK_LIST_REPLACE)
+    {
+        ULONG matchCount = 0;
+        for (PLIST_ENTRY entry = targetListHead->Flink;
+             entry != targetListHead;
+             entry = entry->Flink)
+        {
+            if (IPv6ToBleRuntimeListBatchContains(TargetList, entry, batchIndex, batchEntries))
+            {
+                matchCount++;
+            }
+        }
+
+        if ((Operation == BULK_LIST_ADD && matchCount != 0) ||
+            (Operation == BULK_LIST_REMOVE && matchCount != entryCount))
+        {
+            status = STATUS_INVALID_PARAMETER;
+            TraceEvents(TRACE_LEVEL_WARNING, TRACE_RUNTIME_LIST, "%u of %u entries matched the list during %!FUNC! with %!STATUS!", matchCount, entryCount, status);
+            goto Exit;
+        }
+    }
+
+    //
+    // Step 5
+    // Change the list and publish one snapshot of the result. If publishing
+    // fails, undo the change so the list and the snapshot stay in sync.
+    //
+    switch (Operation)
+    {
+        case BULK_LIST_ADD:
+            IPv6ToBleRuntimeListMoveEntries(TargetList, &newEntries, targetListHead, NULL, NULL);
+            break;
+        case BULK_LIST_REMOVE:
+            IPv6ToBleRuntimeListMoveEntries(TargetList, targetListHead, &oldEntries, batchIndex, batchEntries);
+            break;
+        default:
+            IPv6ToBleRuntimeListMoveEntries(TargetList, targetListHead, &oldEntries, NULL, NULL);
+            IPv6ToBleRuntimeListMoveEntries(TargetList, &newEntries, targetListHead, NULL, NULL);
+            break;
+    }
+
+    status = IPv6ToBleRuntimeListPublishSnapshot(TargetList);
+    if (!NT_SUCCESS(status))
+    {
+        switch (Operation)
+        {
+            case BULK_LIST_ADD:
+                IPv6ToBleRuntimeListMoveEntries(TargetList, targetListHead, &newEntries, batchIndex, batchEntries);
+                break;
+            case BULK_LIST_REMOVE:
+                IPv6ToBleRuntimeListMoveEntries(TargetList, &oldEntries, targetListHead, NULL, NULL);
+                break;
+            default:
+                IPv6ToBleRuntimeListMoveEntries(TargetList, targetListHead, &newEntries, NULL, NULL);
+                IPv6ToBleRuntimeListMoveEntries(TargetList, &oldEntries, targetListHead, NULL, NULL);
+                break;
+        }
+        goto Exit;
+    }
+
+    //
+    // Step 6
+    // Mark the list modified so it is flushed to the registry, and tell
+    // anyone waiting for list changes
+    //
+	IPv6ToBleRegistryScheduleListFlush(TargetList);
+
+    IPv6ToBleRuntimeListRecordBulkChange(TargetList,
+                                         Operation,
+                                         &oldEntries,
+                                         batchEntries,
+                                         entryCount
+                                         );
+
+    //
+    // Step 7
+    // Bring the callouts in line with the lists: unregistered if either list
+    // is now empty, registered if they weren't, and otherwise updated with
+    // only the filters for the prefixes that changed. A full re-registration
+    // is the fallback if the update fails.
+    //
+    if (IsListEmpty(gWhiteListHead) || IsListEmpty(gMeshListHead))
+    {
+        if (gCalloutsRegistered)
+        {
+            IPv6ToBleCalloutsUnregister();
+        }
+    }
+    else
+    {
+        NTSTATUS calloutStatus = STATUS_SUCCESS;
+
+        if (gCalloutsRegistered)
+        {
+            calloutStatus = IPv6ToBleCalloutFilterGroupsUpdate(TargetList);
+            if (!NT_SUCCESS(calloutStatus))
+            {
+                TraceEvents(TRACE_LEVEL_WARNING, TRACE_RUNTIME_LIST, "Updating filters failed with %!STATUS!; re-registering callouts", calloutStatus);
+                IPv6ToBleCalloutsUnregister();
+            }
+        }
+
+        if (!gCalloutsRegistered)
+        {
+            calloutStatus = IPv6ToBleCalloutsRegister();
+            if (!NT_SUCCESS(calloutStatus))
+            {
+                TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Registering callouts during %!FUNC! failed with %!STATUS!; the list change stands but the callouts are unregistered", calloutStatus);
+            }
+        }
+    }
+
+    //
+    // Step 8
+    // Remove the list registry key if the list is now empty
+    //
+    if (IsListEmpty(targetListHead))
+    {
+        status = IPv6ToBleRuntimeListRemoveRegistryKey(TargetList);
+    }
+
+Exit:
+
+    if (writeLockAcquired)
+    {
+        WdfWaitLockRelease(gRuntimeListWriteLock);
+    }
+
+    // Free entries that didn't make it into the list, or that were taken out
+    // of it
+    IPv6ToBleRuntimeListFreeEntries(TargetList, &newEntries);
+    IPv6ToBleRuntimeListFreeEntries(TargetList, &oldEntries);
+
+    IPv6ToBleAddressTableDestroy(batchIndex);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_RUNTIME_LIST, "%!FUNC! Exit");
+    return status;
+}
+
+//
+// Frees every entry of a runtime list, logs each as removed, and publishes
+// the empty list. The caller holds gRuntimeListWriteLock. Returns FALSE if
+// the list was already empty.
+//
+static
+BOOLEAN
+IPv6ToBleRuntimeListPurgeEntries(
+	_In_ ULONG TargetList
+)
+{
+    // Check for empty list
+    if ((TargetList == WHITE_LIST && IsListEmpty(gWhiteListHead)) ||
+		(TargetList == MESH_LIST && IsListEmpty(gMeshListHead)))
+    {
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_RUNTIME_LIST, "%s List is empty; nothing to purge.", TargetList == WHITE_LIST ? "White" : "Mesh");
+        return FALSE;
+    }
+
+    // Clean up the linked list
+	if (TargetList == WHITE_LIST)
+	{
+		while (!IsListEmpty(gWhiteListHead))
+		{
+			PLIST_ENTRY entry = RemoveHeadList(gWhiteListHead);   // remove from list
+			PWHITE_LIST_ENTRY whiteListEntry = CONTAINING_RECORD(entry,
+																 WHITE_LIST_ENTRY,
+																 listEntry
+																 );
+			entry = 0;
+			IPv6ToBleListChangeRecord(WHITE_LIST,
+									  IPV6_TO_BLE_LIST_CHANGE_REMOVED,
+									  &whiteListEntry->ipv6Address,
+									  whiteListEntry->scopeId
+									  );
+			ExFreePoolWithTag(whiteListEntry, IPV6_TO_BLE_WHITE_LIST_TAG); // free white list entry memory
+			whiteListEntry = 0;
+		}
+	}
+	else
+	{
+		while (!IsListEmpty(gMeshListHead))
+		{
+			PLIST_ENTRY entry = RemoveHeadList(gMeshListHead);   // remove from list
+			PMESH_LIST_ENTRY meshListEntry = CONTAINING_RECORD(entry,
+															   MESH_LIST_ENTRY,
+															   listEntry
+															   );
+			entry = 0;
+			IPv6ToBleListChangeRecord(MESH_LIST,
+									  IPV6_TO_BLE_LIST_CHANGE_REMOVED,
+									  &meshListEntry->ipv6Address,
+									  meshListEntry->scopeId
+									  );
+			ExFreePoolWithTag(meshListEntry, IPV6_TO_BLE_MESH_LIST_TAG); // free mesh list entry memory
+			meshListEntry = 0;
+		}
+	}    
+
+    // Retire the published snapshot. Publishing an empty list cannot fail.
+    (VOID)IPv6ToBleRuntimeListPublishSnapshot(TargetList);
+
+    // Tell anyone waiting for list changes
+    IPv6ToBleListChangeCommit();
+
+    return TRUE;
+}
+
+_Use_decl_annotations_
+VOID
+IPv6ToBleRuntimeListPurgeRuntimeList(
+	_In_ ULONG TargetList
+)
+/*++
+Routine Description:
+
+    Cleans up a runtime linked list, if possible. The list's registry key is
+    left alone; see IPv6ToBleRuntimeListPurgeListAndRegistryKey for that.
+
+    This function is called from the device cleanup callback, and when
+    loading a list from the registry fails, at IRQL = PASSIVE_LEVEL.
+
+Arguments:
+
+    TargetList - WHITE_LIST or MESH_LIST.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_RUNTIME_LIST, "%!FUNC! Entry");
+
+	// Validate input
+	if (TargetList != WHITE_LIST && TargetList != MESH_LIST)
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Invalid list option during %!FUNC!");
+		return;
+	}
+
+    WdfWaitLockAcquire(gRuntimeListWriteLock, NULL);
+
+    (VOID)IPv6ToBleRuntimeListPurgeEntries(TargetList);
+
+    WdfWaitLockRelease(gRuntimeListWriteLock);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_RUNTIME_LIST, "%!FUNC! Exit");
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleRuntimeListPurgeListAndRegistryKey(
+	_In_ ULONG TargetList
+)
+/*++
+Routine Description:
+
+    Empties a runtime list for the purge IOCTLs, so the GUI app can start
+    the list over: frees its entries, unregisters the callouts, and removes
+    the list's registry key along with any flush of it still pending.
+
+    All of it is done under gRuntimeListWriteLock, as in
+    IPv6ToBleRuntimeListRemoveListEntry, so an add, remove, or bulk request
+    on another thread can't put an entry in the list between the purge and
+    the callouts being unregistered or the key being removed.
+
+    This function is called from EvtIoDeviceControl at IRQL = PASSIVE_LEVEL.
+
+Arguments:
+
+    TargetList - WHITE_LIST or MESH_LIST.
+
+Return Value:
+
+    STATUS_SUCCESS if successful; appropriate NTSTATUS error codes from
+    removing the registry key otherwise. The runtime list is emptied either
+    way.
+
+--*/
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_RUNTIME_LIST, "%!FUNC! Entry");
+
+    PAGED_CODE();
+
+    NTSTATUS status = STATUS_SUCCESS;
+
+	// Validate input
+	if (TargetList != WHITE_LIST && TargetList != MESH_LIST)
+	{
+		status = STATUS_INVALID_PARAMETER;
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Invalid list option during %!FUNC! with %!STATUS!", status);
+		return status;
+	}
+
+    WdfWaitLockAcquire(gRuntimeListWriteLock, NULL);
+
+    //
+    // Step 1
+    // Empty the runtime list
+    //
+    (VOID)IPv6ToBleRuntimeListPurgeEntries(TargetList);
+
+    //
+    // Step 2
+    // The list is now empty, so the callouts have nothing to do
+    //
+    if (gCalloutsRegistered)
+    {
+        IPv6ToBleCalloutsUnregister();
+    }
+
+    //
+    // Step 3
+    // Remove the list's registry key, even if the runtime list was already
+    // empty, in case the stored list is what the GUI app is starting over
+    //
+    status = IPv6ToBleRuntimeListRemoveRegistryKey(TargetList);
+
+    WdfWaitLockRelease(gRuntimeListWriteLock);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_RUNTIME_LIST, "%!FUNC! Exit");
+
+    return status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleRuntimeListSnapshotsInitialize()
+/*++
+Routine Description:
+
+    Creates the objects used to publish runtime list snapshots: the write
+    lock that serializes changes to the lists, and one reader sequence per
+    processor.
+
+    This function is called from DriverEntry at PASSIVE_LEVEL, on the border
+    router only.
+
+Arguments:
+
+    None. Accesses global variables defined in Driver.h.
+
+Return Value:
+
+    STATUS_SUCCESS if successful; appropriate NTSTATUS error codes otherwise.
+
+--*/
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_RUNTIME_LIST, "%!FUNC! Entry");
+
+    NTSTATUS status = STATUS_SUCCESS;
+
+    gWhiteListSnapshot = NULL;
+    gMeshListSnapshot = NULL;
+
+    //
+    // Step 1
+    // Create the write lock. Its parent is the driver object so it is still
+    // valid when the lists are purged during driver unload.
+    //
+    status = WdfWaitLockCreate(WDF_NO_OBJECT_ATTRIBUTES,
+                               &gRuntimeListWriteLock
+                               );
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Creating runtime list write lock failed %!STATUS!", status);
+        goto Exit;
+    }
+
+    //
+    // Step 2
+    // Allocate a cache-aligned reader sequence for every possible processor,
+    // so readers on different processors never share a cache line
+    //
+    gSnapshotReaderCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    SIZE_T readersSize = 0;
+    status = RtlSizeTMult(gSnapshotReaderCount,
+                          sizeof(SNAPSHOT_READER_SEQUENCE),
+                          &readersSize
+                          );
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Reader sequence array size overflowed %!STATUS!", status);
+        goto Exit;
+    }
+
+    gSnapshotReaders = (PSNAPSHOT_READER_SEQUENCE)ExAllocatePoolWithTag(
+                            NonPagedPoolNxCacheAligned,
+                            readersSize,
+                            IPV6_TO_BLE_SNAPSHOT_TAG
+                       );
+    if (!gSnapshotReaders)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Allocating reader sequences failed %!STATUS!", status);
+        goto Exit;
+    }
+    RtlZeroMemory(gSnapshotReaders, readersSize);
+
+Exit:
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_RUNTIME_LIST, "%!FUNC! Exit");
+    return status;
+}
+
+_Use_decl_annotations_
+VOID
+IPv6ToBleRuntimeListSnapshotsCleanup()
+/*++
+Routine Description:
+
+    Frees the reader sequences. Called during driver unload after the lists
+    have been purged, which has already retired both snapshots.
+
+Arguments:
+
+    None. Accesses global variables defined in Driver.h.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    NT_ASSERT(!gWhiteListSnapshot && !gMeshListSnapshot);
+
+    if (gSnapshotReaders)
+    {
+        ExFreePoolWithTag(gSnapshotReaders, IPV6_TO_BLE_SNAPSHOT_TAG);
+        gSnapshotReaders = NULL;
+    }
+}
+
+_Use_decl_annotations_
+VOID
+IPv6ToBleRuntimeListSnapshotDestroy(
+    _In_opt_ PRUNTIME_LIST_SNAPSHOT Snapshot
+)
+/*++
+Routine Description:
+
+    Frees a snapshot and its address index. The snapshot must no longer be
+    published or visible to any reader.
+
+Arguments:
+
+    Snapshot - the snapshot to free. May be NULL.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (Snapshot)
+    {
+        IPv6ToBleAddressTableDestroy(Snapshot->index);
+        ExFreePoolWithTag(Snapshot, IPV6_TO_BLE_SNAPSHOT_TAG);
+    }
+}
+
+//
+// Allocates a snapshot with room for entryCount entries and an empty index
+// sized for them. The caller fills in the entries and indexes them.
+//
+static
+NTSTATUS
+IPv6ToBleRuntimeListSnapshotCreate(
+    _In_    ULONG                   entryCount,
+    _Out_   PRUNTIME_LIST_SNAPSHOT* snapshot
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    PRUNTIME_LIST_SNAPSHOT newSnapshot = NULL;
+
+    *snapshot = NULL;
+
+    SIZE_T snapshotSize = 0;
+    status = RtlSizeTMult(entryCount - 1,
+                          sizeof(RUNTIME_LIST_SNAPSHOT_ENTRY),
+                          &snapshotSize
+                          );
+    if (NT_SUCCESS(status))
+    {
+        status = RtlSizeTAdd(snapshotSize,
+                             sizeof(RUNTIME_LIST_SNAPSHOT),
+                             &snapshotSize
+                             );
+    }
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Snapshot size overflowed during %!FUNC! with %!STATUS!", status);
+        return status;
+    }
+
+    newSnapshot = (PRUNTIME_LIST_SNAPSHOT)ExAllocatePoolWithTag(
+                        NonPagedPoolNx,
+                        snapshotSize,
+                        IPV6_TO_BLE_SNAPSHOT_TAG
+                  );
+    if (!newSnapshot)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Snapshot allocation failed during %!FUNC! with %!STATUS!", status);
+        return status;
+    }
+    newSnapshot->entryCount = entryCount;
+    newSnapshot->index = NULL;
+
+    status = IPv6ToBleAddressTableCreate(entryCount, &newSnapshot->index);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Creating snapshot index failed during %!FUNC! with %!STATUS!", status);
+        IPv6ToBleRuntimeListSnapshotDestroy(newSnapshot);
+        return status;
+    }
+
+    *snapshot = newSnapshot;
+
+    return status;
+}
+
+//
+// Publishes a fully built snapshot (or NULL for an empty list), waits until
+// no reader can still be using the one it replaces, and frees that one. See
+// IPv6ToBleRuntimeListPublishSnapshot for why the wait is enough.
+//
+static
+VOID
+IPv6ToBleRuntimeListSnapshotSwap(
+    _In_        ULONG                   TargetList,
+    _In_opt_    PRUNTIME_LIST_SNAPSHOT  newSnapshot
+)
+{
+    PRUNTIME_LIST_SNAPSHOT oldSnapshot = (PRUNTIME_LIST_SNAPSHOT)InterlockedExchangePointer(
+                        (PVOID volatile*)(TargetList == WHITE_LIST ? &gWhiteListSnapshot : &gMeshListSnapshot),
+                        newSnapshot
+                  );
+
+    if (oldSnapshot)
+    {
+        for (ULONG processor = 0; processor < gSnapshotReaderCount; processor++)
+        {
+            LONG sequence = ReadAcquire(&gSnapshotReaders[processor].sequence);
+            if (sequence & 1)
+            {
+                while (ReadAcquire(&gSnapshotReaders[processor].sequence) == sequence)
+                {
+                    YieldProcessor();
+                }
+            }
+        }
+
+        IPv6ToBleRuntimeListSnapshotDestroy(oldSnapshot);
+    }
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleRuntimeListPublishSnapshot(
+    _In_ ULONG TargetList
+)
+/*++
+Routine Description:
+
+    Builds a new, contiguous snapshot of a runtime list and publishes it for
+    the classify callouts. Once no reader can still be using the previous
+    snapshot, frees it.
+
+    The new snapshot is fully built before it is published with a single
+    pointer exchange, so a reader sees either the old snapshot or the new one,
+    never a partially built one. An empty list publishes NULL.
+
+    After the exchange, the writer visits every processor's reader sequence.
+    A reader increments its sequence (making it odd) before it loads the
+    snapshot pointer and increments it again when it is done. So if a
+    sequence is even, no reader on that processor can hold the old snapshot;
+    if it is odd, waiting until it changes is enough, because the next reader
+    on that processor will load the new pointer. Readers run at
+    DISPATCH_LEVEL and hold a snapshot only long enough for a lookup, so the
+    wait is short.
+
+    The caller must hold gRuntimeListWriteLock.
+
+Arguments:
+
+    TargetList - the list to publish a snapshot of.
+
+Return Value:
+
+    STATUS_SUCCESS if successful; appropriate NTSTATUS error codes otherwise.
+    On failure the previous snapshot stays published.
+
+--*/
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_RUNTIME_LIST, "%!FUNC! Entry");
+
+    NTSTATUS status = STATUS_SUCCESS;
+
+    PRUNTIME_LIST_SNAPSHOT newSnapshot = NULL;
+
+    if (TargetList != WHITE_LIST && TargetList != MESH_LIST)
+    {
+        status = STATUS_INVALID_PARAMETER;
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Invalid list option during %!FUNC! with %!STATUS!", status);
+        goto Exit;
+    }
+    PLIST_ENTRY targetListHead = (TargetList == WHITE_LIST) ? gWhiteListHead : gMeshListHead;
+
+    //
+    // Step 1
+    // Count the entries so the snapshot can be allocated once
+    //
+    ULONG entryCount = 0;
+    PLIST_ENTRY entry = targetListHead->Flink;
+    while (entry != targetListHead)
+    {
+        entryCount++;
+        entry = entry->Flink;
+    }
+
+    //
+    // Step 2
+    // Build the snapshot: copy the entries into a contiguous array and index
+    // each address by its position in that array
+    //
+    if (entryCount > 0)
+    {
+        status = IPv6ToBleRuntimeListSnapshotCreate(entryCount, &newSnapshot);
+        if (!NT_SUCCESS(status))
+        {
+            goto Exit;
+        }
+
+        ULONG i = 0;
+        entry = targetListHead->Flink;
+        while (entry != targetListHead)
+        {
+            PRUNTIME_LIST_SNAPSHOT_ENTRY snapshotEntry = &newSnapshot->entries[i];
+
+            if (TargetList == WHITE_LIST)
+            {
+                PWHITE_LIST_ENTRY whiteListEntry = CONTAINING_RECORD(entry,
+                                                                     WHITE_LIST_ENTRY,
+                                                                     listEntry
+                                                                     );
+                snapshotEntry->ipv6Address = whiteListEntry->ipv6Address;
+                snapshotEntry->scopeId = whiteListEntry->scopeId;
+            }
+            else
+            {
+                PMESH_LIST_ENTRY meshListEntry = CONTAINING_RECORD(entry,
+                                                                   MESH_LIST_ENTRY,
+                                                                   listEntry
+                                                                   );
+                snapshotEntry->ipv6Address = meshListEntry->ipv6Address;
+                snapshotEntry->scopeId = meshListEntry->scopeId;
+            }
+
+            status = IPv6ToBleAddressTableInsert(newSnapshot->index,
+                                                 &snapshotEntry->ipv6Address,
+                                                 i
+                                                 );
+            if (!NT_SUCCESS(status))
+            {
+                TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Inserting into snapshot index failed during %!FUNC! with %!STATUS!", status);
+                goto Exit;
+            }
+
+            i++;
+            entry = entry->Flink;
+        }
+    }
+
+    //
+    // Step 3
+    // Publish the new snapshot, then wait for readers that may still see the
+    // old snapshot and free it
+    //
+    IPv6ToBleRuntimeListSnapshotSwap(TargetList, newSnapshot);
+    newSnapshot = NULL;
+
+Exit:
+
+    // Free a partially built snapshot if we failed
+    IPv6ToBleRuntimeListSnapshotDestroy(newSnapshot);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_RUNTIME_LIST, "%!FUNC! Exit");
+    return status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleRuntimeListPublishSnapshotFromEntries(
+    _In_                        ULONG                               TargetList,
+    _In_reads_(entryCount)      const RUNTIME_LIST_SNAPSHOT_ENTRY*  entries,
+    _In_                        ULONG                               entryCount
+)
+/*++
+Routine Description:
+
+    Builds a snapshot of a runtime list straight from an array of packed
+    entries, such as a list loaded from its binary registry value, and
+    publishes it like IPv6ToBleRuntimeListPublishSnapshot. The entries are
+    copied with one move instead of being gathered from the linked list.
+
+    The array must hold the same addresses as the list, which the caller
+    has just loaded from it. The caller must hold gRuntimeListWriteLock.
+
+Arguments:
+
+    TargetList - the list to publish a snapshot of.
+
+    entries - the list's entries.
+
+    entryCount - the number of entries. 0 publishes NULL.
+
+Return Value:
+
+    STATUS_SUCCESS if successful; appropriate NTSTATUS error codes otherwise.
+    On failure the previous snapshot stays published.
+
+--*/
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_RUNTIME_LIST, "%!FUNC! Entry");
+
+    NTSTATUS status = STATUS_SUCCESS;
+
+    PRUNTIME_LIST_SNAPSHOT newSnapshot = NULL;
+
+    if (TargetList != WHITE_LIST && TargetList != MESH_LIST)
+    {
+        status = STATUS_INVALID_PARAMETER;
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Invalid list option during %!FUNC! with %!STATUS!", status);
+        goto Exit;
+    }
+
+    //
+    // Step 1
+    // Build the snapshot: copy the entries and index each address by its
+    // position
+    //
+    if (entryCount > 0)
+    {
+        status = IPv6ToBleRuntimeListSnapshotCreate(entryCount, &newSnapshot);
+        if (!NT_SUCCESS(status))
+        {
+            goto Exit;
+        }
+
+        RtlCopyMemory(newSnapshot->entries,
+                      entries,
+                      entryCount * sizeof(RUNTIME_LIST_SNAPSHOT_ENTRY)
+                      );
+
+        for (ULONG i = 0; i < entryCount; i++)
+        {
+            status = IPv6ToBleAddressTableInsert(newSnapshot->index,
+                                                 &newSnapshot->entries[i].ipv6Address,
+                                                 i
+                                                 );
+            if (!NT_SUCCESS(status))
+            {
+                TraceEvents(TRACE_LEVEL_ERROR, TRACE_RUNTIME_LIST, "Inserting into snapshot index failed during %!FUNC! with %!STATUS!", status);
+                goto Exit;
+            }
+        }
+    }
+
+    //
+    // Step 2
+    // Publish the new snapshot and free the old one
+    //
+    IPv6ToBleRuntimeListSnapshotSwap(TargetList, newSnapshot);
+    newSnapshot = NULL;
+
+Exit:
+
+    // Free a partially built snapshot if we failed
+    IPv6ToBleRuntimeListSnapshotDestroy(newSnapshot);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_RUNTIME_LIST, "%!FUNC! Exit");
+    return status;
+}
+
+_Use_decl_annotations_
+PRUNTIME_LIST_SNAPSHOT
+IPv6ToBleRuntimeListSnapshotAcquire(
+    _In_    ULONG   TargetList,
+    _Out_   KIRQL*  OldIrql
+)
+/*++
+Routine Description:
+
+    Enters a snapshot read section and returns the currently published
+    snapshot of a runtime list. Must be paired with
+    IPv6ToBleRuntimeListSnapshotRelease.
+
+    The section runs at DISPATCH_LEVEL so the reader stays on one processor
+    and is not preempted while the writer waits on it. Keep it short: look
+    up what you need and release.
+
+Arguments:
+
+    TargetList - the list to read.
+
+    OldIrql - receives the IRQL to restore on release.
+
+Return Value:
+
+    The published snapshot, or NULL if the list is empty.
+
+--*/
+{
+    KeRaiseIrql(DISPATCH_LEVEL, OldIrql);
+
+    InterlockedIncrement(&gSnapshotReaders[KeGetCurrentProcessorIndex()].sequence);
+
+    return (PRUNTIME_LIST_SNAPSHOT)ReadPointerAcquire(
+                (PVOID volatile*)(TargetList == WHITE_LIST ? &gWhiteListSnapshot : &gMeshListSnapshot)
+           );
+}
+
+_Use_decl_annotations_
+VOID
+IPv6ToBleRuntimeListSnapshotRelease(
+    _In_ KIRQL OldIrql
+)
+/*++
+Routine Description:
+
+    Leaves a snapshot read section entered with
+    IPv6ToBleRuntimeListSnapshotAcquire. The snapshot must not be used after
+    this call.
+
+Arguments:
+
+    OldIrql - the IRQL returned by IPv6ToBleRuntimeListSnapshotAcquire.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    InterlockedIncrement(&gSnapshotReaders[KeGetCurrentProcessorIndex()].sequence);
+
+    KeLowerIrql(OldIrql);
+}
+
+_Use_decl_annotations_
+BOOLEAN
+IPv6ToBleRuntimeListSnapshotContains(
+    _In_        ULONG           TargetList,
+    _In_        const UINT8*    Ipv6Address,
+    _Out_opt_   ULONG*          EntryIndex
+)
+/*++
+Routine Description:
+
+    Checks whether an address is in the published snapshot of a runtime list.
+    This is the membership check the classify callouts use; it does not lock
+    or allocate.
+
+Arguments:
+
+    TargetList - the list to check.
+
+    Ipv6Address - the 16 byte address, in network byte order. It does not need
+    to be aligned.
+
+    EntryIndex - receives the address's position in the snapshot, if found.
+
+Return Value:
+
+    TRUE if the address is in the list, FALSE otherwise.
+
+--*/
+{
+    KIRQL oldIrql;
+    BOOLEAN isInList = FALSE;
+
+    PRUNTIME_LIST_SNAPSHOT snapshot = IPv6ToBleRuntimeListSnapshotAcquire(TargetList,
+                                                                          &oldIrql
+                                                                          );
+    if (snapshot)
+    {
+        isInList = IPv6ToBleAddressTableLookup(snapshot->index,
+                                               Ipv6Address,
+                                               EntryIndex
+                                               );
+    }
+
+    IPv6ToBleRuntimeListSnapshotRelease(oldIrql);
+
+    return isInList;
+}
@@ -22,8 +22,7 @@ Environment:
 // Functions to add entries to the lists
 //-----------------------------------------------------------------------------
 
-_IRQL_requires_min_(PASSIVE_LEVEL)
-_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_(PASSIVE_LEVEL)
 _IRQL_requires_same_
 NTSTATUS
 IPv6ToBleRuntimeListAssignNewListEntry(
@@ -35,8 +34,7 @@ IPv6ToBleRuntimeListAssignNewListEntry(
 // Functions to remove entries from the lists
 //-----------------------------------------------------------------------------
 
-_IRQL_requires_min_(PASSIVE_LEVEL)
-_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_(PASSIVE_LEVEL)
 _IRQL_requires_same_
 NTSTATUS
 IPv6ToBleRuntimeListRemoveListEntry(
@@ -44,6 +42,18 @@ IPv6ToBleRuntimeListRemoveListEntry(
 	_In_	ULONG		TargetList
 );
 
+//-----------------------------------------------------------------------------
+// Function to add, remove, or replace many entries at once
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+NTSTATUS
+IPv6ToBleRuntimeListApplyBulkChange(
+    _In_    WDFREQUEST  Request,
+    _In_    ULONG       Operation
+);
+
 //-----------------------------------------------------------------------------
 // Functions to clean up the runtime lists in the device context
 //-----------------------------------------------------------------------------
@@ -56,4 +66,76 @@ IPv6ToBleRuntimeListPurgeRuntimeList(
 	_In_ ULONG TargetList
 );
 
-#endif  // _RUNTIMELIST_H_
\ No newline at end of file
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+NTSTATUS
+IPv6ToBleRuntimeListPurgeListAndRegistryKey(
+	_In_ ULONG TargetList
+);
+
+//-----------------------------------------------------------------------------
+// Functions to publish and read snapshots of the lists
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+NTSTATUS
+IPv6ToBleRuntimeListSnapshotsInitialize();
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+VOID
+IPv6ToBleRuntimeListSnapshotsCleanup();
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+VOID
+IPv6ToBleRuntimeListSnapshotDestroy(
+    _In_opt_ PRUNTIME_LIST_SNAPSHOT Snapshot
+);
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+NTSTATUS
+IPv6ToBleRuntimeListPublishSnapshot(
+    _In_ ULONG TargetList
+);
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+NTSTATUS
+IPv6ToBleRuntimeListPublishSnapshotFromEntries(
+    _In_                    ULONG                               TargetList,
+    _In_reads_(entryCount)  const RUNTIME_LIST_SNAPSHOT_ENTRY*  entries,
+    _In_                    ULONG                               entryCount
+);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_raises_(DISPATCH_LEVEL)
+_IRQL_saves_
+PRUNTIME_LIST_SNAPSHOT
+IPv6ToBleRuntimeListSnapshotAcquire(
+    _In_    ULONG   TargetList,
+    _Out_   KIRQL*  OldIrql
+);
+
+_IRQL_requires_(DISPATCH_LEVEL)
+VOID
+IPv6ToBleRuntimeListSnapshotRelease(
+    _In_ _IRQL_restores_ KIRQL OldIrql
+);
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+BOOLEAN
+IPv6ToBleRuntimeListSnapshotContains(
+    _In_        ULONG           TargetList,
+    _In_        const UINT8*    Ipv6Address,
+    _Out_opt_   ULONG*          EntryIndex
+);
+
+#endif  // _RUNTIMELIST_H_
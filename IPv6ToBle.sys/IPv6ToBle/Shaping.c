@@ -0,0 +1,362 @@
+/*++
+
+Module Name:
+
+	Shaping.c
+
+Abstract:
+
+	This file contains the implementations for shaping outbound traffic to
+	the mesh with a token bucket per destination, and for the IOCTL that sets
+	the shaping rate.
+
+	The BLE mesh drains far more slowly than the border router's network
+	interfaces can fill it, so one busy host could otherwise use all of the
+	mesh's airtime and build up queues in the packet processing app. With
+	shaping on, each destination may send at most gShapingRate bytes per
+	second, in bursts of up to gShapingBurst bytes. Packets over that rate are
+	dropped in the outbound classify callout, before they take a listen
+	request, pend queue slot, or shared ring slot.
+
+	Token buckets live in a fixed table of cache-aligned buckets hashed by
+	destination, so there is no allocation on the data path and packets to
+	different destinations rarely contend for a lock.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#include "Includes.h"
+#include "Shaping.tmh"	// auto-generated tracing file
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, IPv6ToBleShapingInitialize)
+#pragma alloc_text (PAGE, IPv6ToBleShapingCleanup)
+#endif
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleShapingInitialize()
+/*++
+Routine Description:
+
+	Allocates the shaping table and initializes each bucket's lock. Shaping
+	starts off; the packet processing app turns it on with the shaping IOCTL.
+
+Arguments:
+
+	None. Accesses global variables defined in Driver.h.
+
+Return Value:
+
+	STATUS_SUCCESS if successful, appropriate NTSTATUS error codes otherwise.
+
+--*/
+{
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_SHAPING, "%!FUNC! Entry");
+
+	PAGED_CODE();
+
+	NTSTATUS status = STATUS_SUCCESS;
+
+	gShapingRate = 0;
+	gShapingBurst = 0;
+
+	gShapingTable = (PSHAPING_TABLE_BUCKET)ExAllocatePoolWithTag(
+										NonPagedPoolNxCacheAligned,
+										SHAPING_TABLE_BUCKET_COUNT * sizeof(SHAPING_TABLE_BUCKET),
+										IPV6_TO_BLE_SHAPING_TAG
+									);
+	if (!gShapingTable)
+	{
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_SHAPING, "Shaping table allocation failed during %!FUNC! with %!STATUS!", status);
+		goto Exit;
+	}
+	RtlZeroMemory(gShapingTable,
+				  SHAPING_TABLE_BUCKET_COUNT * sizeof(SHAPING_TABLE_BUCKET)
+				  );
+
+	for (ULONG i = 0; i < SHAPING_TABLE_BUCKET_COUNT; i++)
+	{
+		KeInitializeSpinLock(&gShapingTable[i].lock);
+	}
+
+Exit:
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_SHAPING, "%!FUNC! Exit");
+
+	return status;
+}
+
+_Use_decl_annotations_
+VOID
+IPv6ToBleShapingCleanup()
+/*++
+Routine Description:
+
+	Turns shaping off and frees the shaping table. Called during driver
+	unload after the callouts have been unregistered, so no classify callout
+	can still be using the table.
+
+Arguments:
+
+	None. Accesses global variables defined in Driver.h.
+
+Return Value:
+
+	None.
+
+--*/
+{
+	PAGED_CODE();
+
+	gShapingRate = 0;
+
+	if (gShapingTable)
+	{
+		ExFreePoolWithTag(gShapingTable, IPV6_TO_BLE_SHAPING_TAG);
+		gShapingTable = NULL;
+	}
+}
+
+//
+// Adds the tokens a slot has earned since its last refill, up to the burst
+// size. The last refill time only moves when at least one token was added,
+// so a destination that sends often at a low rate still earns its tokens.
+//
+static
+VOID
+IPv6ToBleShapingRefill(
+	_Inout_	PSHAPING_SLOT	slot,
+	_In_	LONGLONG		now,
+	_In_	LONG			rate,
+	_In_	LONG			burst
+)
+{
+	LONGLONG elapsed = now - slot->lastRefill;
+	if (elapsed <= 0)
+	{
+		return;
+	}
+
+	// If enough whole seconds have passed to fill the bucket from empty,
+	// just fill it. Otherwise fewer than burst / rate + 1 seconds have
+	// passed, so the multiplication below can't overflow.
+	LONGLONG seconds = elapsed / gPerformanceFrequency;
+	if (seconds >= (LONGLONG)burst / rate + 1)
+	{
+		slot->tokens = burst;
+		slot->lastRefill = now;
+		return;
+	}
+
+	LONGLONG earned = seconds * rate +
+					  ((elapsed % gPerformanceFrequency) * rate) / gPerformanceFrequency;
+	if (earned > 0)
+	{
+		slot->tokens = (LONG)min((LONGLONG)slot->tokens + earned, (LONGLONG)burst);
+		slot->lastRefill = now;
+	}
+}
+
+_Use_decl_annotations_
+BOOLEAN
+IPv6ToBleShapingAdmit(
+	const IPV6_PACKET_INFO*	packetInfo
+)
+/*++
+Routine Description:
+
+	Finds or creates the token bucket for the packet's destination, refills
+	it for the time since it was last refilled, and takes the packet's length
+	from it if it holds enough tokens.
+
+	Called through IPV6_TO_BLE_SHAPING_ADMIT, which skips the call entirely
+	while shaping is off.
+
+Arguments:
+
+	packetInfo - the parsed IPv6 header of the outbound packet.
+
+Return Value:
+
+	TRUE if the packet may be sent; FALSE if its destination is over its
+	rate and the packet should be dropped.
+
+--*/
+{
+	BOOLEAN admit = TRUE;
+
+	LONG rate = ReadNoFence(&gShapingRate);
+	LONG burst = ReadNoFence(&gShapingBurst);
+	if (rate <= 0)
+	{
+		return TRUE;
+	}
+
+	PSHAPING_TABLE_BUCKET bucket = &gShapingTable[
+		IPv6ToBleAddressTableHash(packetInfo->destinationAddress) &
+		(SHAPING_TABLE_BUCKET_COUNT - 1)
+		];
+
+	KIRQL oldIrql;
+	KeAcquireSpinLock(&bucket->lock, &oldIrql);
+
+	LONGLONG now = KeQueryPerformanceCounter(NULL).QuadPart;
+
+	//
+	// Step 1
+	// Find the destination's slot. If it has none, take a free slot or the
+	// one refilled longest ago, and start it with a full bucket.
+	//
+	PSHAPING_SLOT slot = NULL;
+	PSHAPING_SLOT victim = &bucket->slots[0];
+
+	for (ULONG i = 0; i < SHAPING_SLOTS_PER_BUCKET; i++)
+	{
+		PSHAPING_SLOT candidate = &bucket->slots[i];
+
+		if (!candidate->inUse)
+		{
+			if (victim->inUse)
+			{
+				victim = candidate;
+			}
+			continue;
+		}
+
+		if (RtlEqualMemory(&candidate->destination,
+						   packetInfo->destinationAddress,
+						   sizeof(IN6_ADDR)
+						   ))
+		{
+			slot = candidate;
+			break;
+		}
+
+		if (victim->inUse && candidate->lastRefill < victim->lastRefill)
+		{
+			victim = candidate;
+		}
+	}
+
+	if (slot)
+	{
+		IPv6ToBleShapingRefill(slot, now, rate, burst);
+	}
+	else
+	{
+		slot = victim;
+		RtlCopyMemory(&slot->destination,
+					  packetInfo->destinationAddress,
+					  sizeof(IN6_ADDR)
+					  );
+		slot->tokens = burst;
+		slot->lastRefill = now;
+		slot->inUse = TRUE;
+	}
+
+	//
+	// Step 2
+	// Take the packet's length from the bucket if it fits
+	//
+	if ((ULONG)slot->tokens >= packetInfo->packetLength)
+	{
+		slot->tokens -= (LONG)packetInfo->packetLength;
+	}
+	else
+	{
+		admit = FALSE;
+	}
+
+	KeReleaseSpinLock(&bucket->lock, oldIrql);
+
+	return admit;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleShapingSetSettings(
+	WDFREQUEST	Request
+)
+/*++
+Routine Description:
+
+	Sets the per-destination shaping rate and burst size, then empties the
+	shaping table so every destination starts again with a full bucket of
+	the new size.
+
+Arguments:
+
+	Request - the WDFREQUEST from user mode. Its input buffer is an
+	IPV6_TO_BLE_SHAPING_SETTINGS.
+
+Return Value:
+
+	STATUS_SUCCESS if successful, STATUS_INVALID_PARAMETER if shaping is
+	being turned on with a burst too small for the largest packet,
+	appropriate NTSTATUS error codes otherwise.
+
+--*/
+{
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_SHAPING, "%!FUNC! Entry");
+
+	NTSTATUS status = STATUS_SUCCESS;
+
+	PIPV6_TO_BLE_SHAPING_SETTINGS settings = NULL;
+
+	//
+	// Step 1
+	// Retrieve and validate the settings
+	//
+	status = WdfRequestRetrieveInputBuffer(Request,
+										   sizeof(IPV6_TO_BLE_SHAPING_SETTINGS),
+										   (PVOID*)&settings,
+										   NULL
+										   );
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_SHAPING, "Retrieving input buffer from WDFREQUEST failed during %!FUNC! with %!STATUS!", status);
+		goto Exit;
+	}
+
+	if (settings->rateBytesPerSecond != 0 &&
+		(settings->rateBytesPerSecond > MAXLONG ||
+		 settings->burstBytes > MAXLONG ||
+		 settings->burstBytes < IPV6_TO_BLE_SHAPING_MIN_BURST))
+	{
+		status = STATUS_INVALID_PARAMETER;
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_SHAPING, "Shaping rate %u with burst %u is invalid; the burst must be %u to %u bytes, %!STATUS!", settings->rateBytesPerSecond, settings->burstBytes, IPV6_TO_BLE_SHAPING_MIN_BURST, MAXLONG, status);
+		goto Exit;
+	}
+
+	//
+	// Step 2
+	// Turn shaping off while the table is emptied, then apply the settings.
+	// A classify callout that read the old rate may still refill a slot with
+	// the old burst; that slot is only briefly allowed the old size.
+	//
+	InterlockedExchange(&gShapingRate, 0);
+
+	for (ULONG i = 0; i < SHAPING_TABLE_BUCKET_COUNT; i++)
+	{
+		KIRQL oldIrql;
+		KeAcquireSpinLock(&gShapingTable[i].lock, &oldIrql);
+		RtlZeroMemory(gShapingTable[i].slots, sizeof(gShapingTable[i].slots));
+		KeReleaseSpinLock(&gShapingTable[i].lock, oldIrql);
+	}
+
+	InterlockedExchange(&gShapingBurst, (LONG)settings->burstBytes);
+	InterlockedExchange(&gShapingRate, (LONG)settings->rateBytesPerSecond);
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_SHAPING, "Shaping rate set to %u bytes/second, burst %u bytes", settings->rateBytesPerSecond, settings->burstBytes);
+
+Exit:
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_SHAPING, "%!FUNC! Exit");
+
+	return status;
+}
@@ -0,0 +1,80 @@
+/*++
+
+Module Name:
+
+	Shaping.h
+
+Abstract:
+
+	This file contains definitions for the functions that shape outbound
+	traffic to the mesh with a token bucket per destination, and for the
+	IOCTL that sets the shaping rate. The table structures are defined in
+	Driver.h.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#ifndef _SHAPING_H_
+#define _SHAPING_H_
+
+EXTERN_C_START
+
+//-----------------------------------------------------------------------------
+// Macro to check whether an outbound packet fits in its destination's token
+// bucket, taking the packet's length from the bucket if it does. Evaluates
+// to TRUE if the packet may be sent.
+//
+// While shaping is off this is one read of a global that is almost never
+// written, so it costs next to nothing on the data path.
+//-----------------------------------------------------------------------------
+
+#define IPV6_TO_BLE_SHAPING_ADMIT(PacketInfo)                               \
+    ((ReadNoFence(&gShapingRate) == 0) ||                                   \
+        IPv6ToBleShapingAdmit((PacketInfo)))
+
+//-----------------------------------------------------------------------------
+// Functions to create and destroy the shaping table
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+_Check_return_
+_Success_(return == STATUS_SUCCESS)
+NTSTATUS
+IPv6ToBleShapingInitialize();
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+VOID
+IPv6ToBleShapingCleanup();
+
+//-----------------------------------------------------------------------------
+// Function called by the outbound classify callout, through the macro above
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+BOOLEAN
+IPv6ToBleShapingAdmit(
+	_In_	const IPV6_PACKET_INFO*	packetInfo
+);
+
+//-----------------------------------------------------------------------------
+// Function called by the I/O control callback for the shaping IOCTL
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+NTSTATUS
+IPv6ToBleShapingSetSettings(
+	_In_	WDFREQUEST	Request
+);
+
+EXTERN_C_END
+
+#endif	// _SHAPING_H_
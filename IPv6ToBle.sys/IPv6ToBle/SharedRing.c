@@ -0,0 +1,630 @@
+/*++
+
+Module Name:
+
+	SharedRing.c
+
+Abstract:
+
+	This file contains the implementations for the packet rings shared with
+	the usermode packet processing app.
+
+	Listen and inject requests copy every packet through a METHOD_BUFFERED
+	system buffer. When the app maps the shared rings instead, the classify
+	callouts copy intercepted packets straight into the listen ring, and the
+	app writes packets to inject straight into the inject ring. As long as
+	both sides keep up, no system calls are made; the event and the kick IOCTL
+	are only used to wake a side that went to sleep on an empty ring.
+
+	The mapped region is writable by the app at all times, so everything read
+	back from it (indices, lengths, directions) is checked before use, and
+	packets are copied out of the inject ring before they are injected.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#include "Includes.h"
+#include "SharedRing.tmh"	// auto-generated tracing file
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, IPv6ToBleSharedRingsEvtIoInCallerContext)
+#pragma alloc_text (PAGE, IPv6ToBleSharedRingsEvtFileCleanup)
+#pragma alloc_text (PAGE, IPv6ToBleSharedRingsMap)
+#pragma alloc_text (PAGE, IPv6ToBleSharedRingsUnmap)
+#pragma alloc_text (PAGE, IPv6ToBleSharedRingsKickInject)
+#endif
+
+//
+// Returns a pointer to the first slot of a ring, which follows its header
+//
+FORCEINLINE
+PIPV6_TO_BLE_SHARED_RING_SLOT
+IPv6ToBleSharedRingSlots(
+	_In_ PIPV6_TO_BLE_SHARED_RING_HEADER ring
+)
+{
+	return (PIPV6_TO_BLE_SHARED_RING_SLOT)(ring + 1);
+}
+
+_Use_decl_annotations_
+VOID
+IPv6ToBleSharedRingsEvtIoInCallerContext(
+	WDFDEVICE	Device,
+	WDFREQUEST	Request
+)
+/*++
+Routine Description:
+
+	Called by the framework for every request, in the context of the thread
+	that sent it, before the request is queued.
+
+	Mapping and unmapping the shared rings has to happen in the app's process,
+	which the default queue does not guarantee, so those two IOCTLs are
+	handled and completed here. Everything else is queued as usual.
+
+Arguments:
+
+	Device - the control device.
+
+	Request - the request.
+
+Return Value:
+
+	None.
+
+--*/
+{
+	PAGED_CODE();
+
+	NTSTATUS status = STATUS_SUCCESS;
+	ULONG_PTR bytesTransferred = 0;
+
+	WDF_REQUEST_PARAMETERS parameters;
+	WDF_REQUEST_PARAMETERS_INIT(&parameters);
+	WdfRequestGetParameters(Request, &parameters);
+
+	if (parameters.Type == WdfRequestTypeDeviceControl)
+	{
+		switch (parameters.Parameters.DeviceIoControl.IoControlCode)
+		{
+			case IOCTL_IPV6_TO_BLE_MAP_SHARED_RINGS:
+			{
+				status = IPv6ToBleSharedRingsMap(Request, &bytesTransferred);
+				WdfRequestCompleteWithInformation(Request, status, bytesTransferred);
+				return;
+			}
+
+			case IOCTL_IPV6_TO_BLE_UNMAP_SHARED_RINGS:
+			{
+				status = IPv6ToBleSharedRingsUnmap(WdfRequestGetFileObject(Request));
+				WdfRequestComplete(Request, status);
+				return;
+			}
+
+			default:
+			{
+				break;
+			}
+		}
+	}
+
+	status = WdfDeviceEnqueueRequest(Device, Request);
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_SHARED_RING, "Enqueueing request failed %!STATUS!", status);
+		WdfRequestComplete(Request, status);
+	}
+}
+
+_Use_decl_annotations_
+VOID
+IPv6ToBleSharedRingsEvtFileCleanup(
+	WDFFILEOBJECT	FileObject
+)
+/*++
+Routine Description:
+
+	Called by the framework when the last handle to a file object is closed,
+	in the context of the process that closed it. If that file object mapped
+	the shared rings, they are unmapped here so they are never left mapped
+	in a process that is going away.
+
+Arguments:
+
+	FileObject - the file object being cleaned up.
+
+Return Value:
+
+	None.
+
+--*/
+{
+	PAGED_CODE();
+
+	if (gSharedRings.owner == FileObject)
+	{
+		IPv6ToBleSharedRingsUnmap(FileObject);
+	}
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleSharedRingsMap(
+	WDFREQUEST	Request,
+	ULONG_PTR*	info
+)
+/*++
+Routine Description:
+
+	Allocates the shared rings, maps them into the calling process, and
+	switches the listen path over to the listen ring.
+
+	The region is a whole number of pages allocated on its own, so mapping it
+	exposes nothing else from non-paged pool to the app. It is mapped
+	no-execute.
+
+Arguments:
+
+	Request - the map request. Its input buffer holds the event to signal
+	and its output buffer receives where the rings were mapped.
+
+	info - receives the number of bytes written to the output buffer.
+
+Return Value:
+
+	STATUS_SUCCESS if successful, appropriate NTSTATUS error codes otherwise.
+
+--*/
+{
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_SHARED_RING, "%!FUNC! Entry");
+
+	PAGED_CODE();
+
+	NTSTATUS status = STATUS_SUCCESS;
+
+	PIPV6_TO_BLE_SHARED_RINGS_MAP_INPUT mapInput = NULL;
+	PIPV6_TO_BLE_SHARED_RINGS_MAP_OUTPUT mapOutput = NULL;
+
+	PKEVENT listenEvent = NULL;
+	PVOID kernelBase = NULL;
+	PMDL mdl = NULL;
+	PVOID userBase = NULL;
+
+	*info = 0;
+
+	if (WdfRequestGetRequestorMode(Request) != UserMode)
+	{
+		return STATUS_INVALID_DEVICE_REQUEST;
+	}
+
+	status = WdfRequestRetrieveInputBuffer(Request,
+										   sizeof(IPV6_TO_BLE_SHARED_RINGS_MAP_INPUT),
+										   (PVOID*)&mapInput,
+										   NULL
+										   );
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_SHARED_RING, "Retrieving input buffer from WDFREQUEST failed during %!FUNC! with %!STATUS!", status);
+		return status;
+	}
+
+	status = WdfRequestRetrieveOutputBuffer(Request,
+											sizeof(IPV6_TO_BLE_SHARED_RINGS_MAP_OUTPUT),
+											(PVOID*)&mapOutput,
+											NULL
+											);
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_SHARED_RING, "Retrieving output buffer from WDFREQUEST failed during %!FUNC! with %!STATUS!", status);
+		return status;
+	}
+
+	WdfWaitLockAcquire(gSharedRingsLock, NULL);
+
+	if (gSharedRings.kernelBase)
+	{
+		status = STATUS_DEVICE_BUSY;
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_SHARED_RING, "Shared rings are already mapped %!STATUS!", status);
+		goto Exit;
+	}
+
+	//
+	// Step 1
+	// Reference the app's event. The handle is only valid in this process.
+	//
+	status = ObReferenceObjectByHandle((HANDLE)(ULONG_PTR)mapInput->listenEvent,
+									   EVENT_MODIFY_STATE,
+									   *ExEventObjectType,
+									   UserMode,
+									   (PVOID*)&listenEvent,
+									   NULL
+									   );
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_SHARED_RING, "Referencing listen event failed %!STATUS!", status);
+		goto Exit;
+	}
+
+	//
+	// Step 2
+	// Allocate and lay out the region: the listen ring, then the inject ring
+	//
+	SIZE_T ringLength = ALIGN_UP_BY(sizeof(IPV6_TO_BLE_SHARED_RING_HEADER) +
+									SHARED_RING_SLOT_COUNT * sizeof(IPV6_TO_BLE_SHARED_RING_SLOT),
+									SYSTEM_CACHE_ALIGNMENT_SIZE
+									);
+	SIZE_T regionLength = ROUND_TO_PAGES(ringLength * 2);
+
+	kernelBase = ExAllocatePoolWithTag(NonPagedPoolNx,
+									   regionLength,
+									   IPV6_TO_BLE_SHARED_RING_TAG
+									   );
+	if (!kernelBase)
+	{
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_SHARED_RING, "Shared ring allocation failed %!STATUS!", status);
+		goto Exit;
+	}
+	RtlZeroMemory(kernelBase, regionLength);
+
+	PIPV6_TO_BLE_SHARED_RING_HEADER listenRing = (PIPV6_TO_BLE_SHARED_RING_HEADER)kernelBase;
+	PIPV6_TO_BLE_SHARED_RING_HEADER injectRing = (PIPV6_TO_BLE_SHARED_RING_HEADER)((BYTE*)kernelBase + ringLength);
+
+	listenRing->slotCount = SHARED_RING_SLOT_COUNT;
+	listenRing->slotSize = sizeof(IPV6_TO_BLE_SHARED_RING_SLOT);
+	injectRing->slotCount = SHARED_RING_SLOT_COUNT;
+	injectRing->slotSize = sizeof(IPV6_TO_BLE_SHARED_RING_SLOT);
+
+	//
+	// Step 3
+	// Describe the region with an MDL and map it into the app's process.
+	// Mapping into user mode raises an exception rather than returning NULL.
+	//
+	mdl = IoAllocateMdl(kernelBase, (ULONG)regionLength, FALSE, FALSE, NULL);
+	if (!mdl)
+	{
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_SHARED_RING, "Allocating MDL for shared rings failed %!STATUS!", status);
+		goto Exit;
+	}
+	MmBuildMdlForNonPagedPool(mdl);
+
+	__try
+	{
+		userBase = MmMapLockedPagesSpecifyCache(mdl,
+												UserMode,
+												MmCached,
+												NULL,
+												FALSE,
+												NormalPagePriority | MdlMappingNoExecute
+												);
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER)
+	{
+		status = GetExceptionCode();
+		userBase = NULL;
+	}
+	if (!userBase)
+	{
+		if (NT_SUCCESS(status))
+		{
+			status = STATUS_INSUFFICIENT_RESOURCES;
+		}
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_SHARED_RING, "Mapping shared rings into the app failed %!STATUS!", status);
+		goto Exit;
+	}
+
+	//
+	// Step 4
+	// Publish the rings. From here on the classify callouts use the listen
+	// ring instead of listen requests.
+	//
+	gSharedRings.kernelBase = kernelBase;
+	gSharedRings.regionLength = regionLength;
+	gSharedRings.mdl = mdl;
+	gSharedRings.userBase = userBase;
+	gSharedRings.owner = WdfRequestGetFileObject(Request);
+	gSharedRings.ownerProcess = PsGetCurrentProcess();
+	gSharedRings.listenEvent = listenEvent;
+	gSharedRings.listenRing = listenRing;
+	gSharedRings.injectRing = injectRing;
+	gSharedRings.injectConsumer = 0;
+	gSharedRings.listenDroppedCount = 0;
+
+	WdfSpinLockAcquire(gListenRequestQueueLock);
+	gSharedRings.listenProducer = 0;
+	gSharedRings.active = TRUE;
+	WdfSpinLockRelease(gListenRequestQueueLock);
+
+	mapOutput->baseAddress = (UINT64)(ULONG_PTR)userBase;
+	mapOutput->regionLength = (UINT32)regionLength;
+	mapOutput->listenRingOffset = 0;
+	mapOutput->injectRingOffset = (UINT32)ringLength;
+	mapOutput->reserved = 0;
+	*info = sizeof(IPV6_TO_BLE_SHARED_RINGS_MAP_OUTPUT);
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_SHARED_RING, "Mapped %Iu bytes of shared rings at %p", regionLength, userBase);
+
+Exit:
+
+	WdfWaitLockRelease(gSharedRingsLock);
+
+	if (!NT_SUCCESS(status))
+	{
+		if (mdl)
+		{
+			IoFreeMdl(mdl);
+		}
+		if (kernelBase)
+		{
+			ExFreePoolWithTag(kernelBase, IPV6_TO_BLE_SHARED_RING_TAG);
+		}
+		if (listenEvent)
+		{
+			ObDereferenceObject(listenEvent);
+		}
+	}
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_SHARED_RING, "%!FUNC! Exit");
+
+	return status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleSharedRingsUnmap(
+	WDFFILEOBJECT	FileObject
+)
+/*++
+Routine Description:
+
+	Switches the listen path back to listen requests, then unmaps and frees
+	the shared rings. Packets still in the listen ring are discarded.
+
+	Must be called in the context of the process that mapped the rings.
+
+Arguments:
+
+	FileObject - the file object asking to unmap. It must be the one that
+	mapped the rings.
+
+Return Value:
+
+	STATUS_SUCCESS if successful, appropriate NTSTATUS error codes otherwise.
+
+--*/
+{
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_SHARED_RING, "%!FUNC! Entry");
+
+	PAGED_CODE();
+
+	NTSTATUS status = STATUS_SUCCESS;
+
+	WdfWaitLockAcquire(gSharedRingsLock, NULL);
+
+	if (!gSharedRings.kernelBase)
+	{
+		status = STATUS_INVALID_DEVICE_STATE;
+		goto Exit;
+	}
+
+	if (gSharedRings.owner != FileObject ||
+		gSharedRings.ownerProcess != PsGetCurrentProcess())
+	{
+		status = STATUS_ACCESS_DENIED;
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_SHARED_RING, "Only the process and handle that mapped the shared rings can unmap them %!STATUS!", status);
+		goto Exit;
+	}
+
+	// Stop the classify callouts from producing first. Once the lock is
+	// released nothing touches the listen ring anymore.
+	WdfSpinLockAcquire(gListenRequestQueueLock);
+	gSharedRings.active = FALSE;
+	WdfSpinLockRelease(gListenRequestQueueLock);
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_SHARED_RING, "Unmapping shared rings; %I64d packets were dropped because the listen ring was full", gSharedRings.listenDroppedCount);
+
+	MmUnmapLockedPages(gSharedRings.userBase, gSharedRings.mdl);
+	IoFreeMdl(gSharedRings.mdl);
+	ExFreePoolWithTag(gSharedRings.kernelBase, IPV6_TO_BLE_SHARED_RING_TAG);
+	ObDereferenceObject(gSharedRings.listenEvent);
+
+	RtlZeroMemory(&gSharedRings, sizeof(gSharedRings));
+
+Exit:
+
+	WdfWaitLockRelease(gSharedRingsLock);
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_SHARED_RING, "%!FUNC! Exit");
+
+	return status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleSharedRingsProducePacket(
+	NET_BUFFER_LIST*	NBL,
+	UINT32				ipHeaderOffset,
+	ULONG				direction
+)
+/*++
+Routine Description:
+
+	Copies an intercepted packet into the next slot of the listen ring and
+	wakes the app if it is waiting for one.
+
+	Called from IPv6ToBleListenDeliverPacket with gListenRequestQueueLock
+	held and gSharedRings.active set, which makes the driver the listen ring's
+	single producer and keeps the ring mapped for the duration.
+
+Arguments:
+
+	NBL - the intercepted packet.
+
+	ipHeaderOffset - how far before the NBL's current position the IP header
+	starts. See IPv6ToBleNBLCopyToBuffer.
+
+	direction - INBOUND or OUTBOUND, recorded in the slot.
+
+Return Value:
+
+	STATUS_SUCCESS if the packet was added to the ring, appropriate NTSTATUS
+	error codes if it was dropped.
+
+--*/
+{
+	NTSTATUS status = STATUS_SUCCESS;
+
+	PIPV6_TO_BLE_SHARED_RING_HEADER ring = gSharedRings.listenRing;
+
+	// The consumer index comes from the app. If it is not within one ring's
+	// length behind our producer index, the unsigned difference is huge and
+	// the ring is treated as full.
+	ULONG consumerIndex = (ULONG)ReadNoFence(&ring->consumerIndex);
+	if ((ULONG)(gSharedRings.listenProducer - consumerIndex) >= SHARED_RING_SLOT_COUNT)
+	{
+		gSharedRings.listenDroppedCount++;
+		return STATUS_DEVICE_BUSY;
+	}
+
+	PIPV6_TO_BLE_SHARED_RING_SLOT slot =
+		&IPv6ToBleSharedRingSlots(ring)[gSharedRings.listenProducer & (SHARED_RING_SLOT_COUNT - 1)];
+
+	UINT32 packetSize = sizeof(slot->packet);
+	status = IPv6ToBleNBLCopyToBuffer(NBL,
+									  ipHeaderOffset,
+									  slot->packet,
+									  &packetSize
+									  );
+	if (!NT_SUCCESS(status))
+	{
+		gSharedRings.listenDroppedCount++;
+		return status;
+	}
+
+	IPv6ToBleTcpClampMss(slot->packet, packetSize);
+
+	slot->packetLength = (UINT16)packetSize;
+	slot->direction = (UINT16)direction;
+
+	// Publish the slot. The interlocked exchange is a full barrier, so the
+	// app can't see the new index before the slot contents.
+	gSharedRings.listenProducer++;
+	InterlockedExchange(&ring->producerIndex, (LONG)gSharedRings.listenProducer);
+
+	if (InterlockedExchange(&ring->consumerWaiting, 0))
+	{
+		KeSetEvent(gSharedRings.listenEvent, IO_NO_INCREMENT, FALSE);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleSharedRingsKickInject(
+	WDFFILEOBJECT	FileObject
+)
+/*++
+Routine Description:
+
+	Injects every packet in the inject ring, then marks the driver as waiting
+	so the app knows to kick again after adding the next packet.
+
+	Each slot's length and direction are read once and checked, and the
+	packet is copied out of the ring before it is injected, so the app
+	changing a slot underneath us can at worst corrupt its own packet.
+
+Arguments:
+
+	FileObject - the file object that sent the kick. It must be the one that
+	mapped the rings.
+
+Return Value:
+
+	STATUS_SUCCESS if successful, appropriate NTSTATUS error codes otherwise.
+	Packets that fail to inject are dropped and do not fail the kick.
+
+--*/
+{
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_SHARED_RING, "%!FUNC! Entry");
+
+	PAGED_CODE();
+
+	NTSTATUS status = STATUS_SUCCESS;
+
+	WdfWaitLockAcquire(gSharedRingsLock, NULL);
+
+	if (!gSharedRings.kernelBase || gSharedRings.owner != FileObject)
+	{
+		status = STATUS_INVALID_DEVICE_STATE;
+		goto Exit;
+	}
+
+	PIPV6_TO_BLE_SHARED_RING_HEADER ring = gSharedRings.injectRing;
+
+	InterlockedExchange(&ring->consumerWaiting, 0);
+
+	for (;;)
+	{
+		ULONG producerIndex = (ULONG)ReadNoFence(&ring->producerIndex);
+		ULONG available = producerIndex - gSharedRings.injectConsumer;
+
+		if (available == 0)
+		{
+			// Announce that we're going to sleep, then look once more in case
+			// the app added a packet without seeing the flag
+			InterlockedExchange(&ring->consumerWaiting, 1);
+
+			if ((ULONG)ReadNoFence(&ring->producerIndex) == gSharedRings.injectConsumer)
+			{
+				break;
+			}
+
+			InterlockedExchange(&ring->consumerWaiting, 0);
+			continue;
+		}
+
+		if (available > SHARED_RING_SLOT_COUNT)
+		{
+			status = STATUS_INVALID_PARAMETER;
+			TraceEvents(TRACE_LEVEL_ERROR, TRACE_SHARED_RING, "Inject ring producer index %u is inconsistent with consumer index %u %!STATUS!", producerIndex, gSharedRings.injectConsumer, status);
+			break;
+		}
+
+		PIPV6_TO_BLE_SHARED_RING_SLOT slot =
+			&IPv6ToBleSharedRingSlots(ring)[gSharedRings.injectConsumer & (SHARED_RING_SLOT_COUNT - 1)];
+
+		UINT16 packetLength = ReadUShortNoFence(&slot->packetLength);
+		UINT16 direction = ReadUShortNoFence(&slot->direction);
+
+		if (packetLength < IPV6_HEADER_LENGTH ||
+			packetLength > sizeof(slot->packet) ||
+			(direction != INBOUND && direction != OUTBOUND))
+		{
+			TraceEvents(TRACE_LEVEL_ERROR, TRACE_SHARED_RING, "Dropping inject ring slot with length %u and direction %u", packetLength, direction);
+		}
+		else
+		{
+			// Failures are traced by the injection function
+			(VOID)IPv6ToBleQueueInjectPacketCopy(slot->packet,
+												 packetLength,
+												 direction
+												 );
+		}
+
+		gSharedRings.injectConsumer++;
+		InterlockedExchange(&ring->consumerIndex, (LONG)gSharedRings.injectConsumer);
+	}
+
+Exit:
+
+	WdfWaitLockRelease(gSharedRingsLock);
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_SHARED_RING, "%!FUNC! Exit");
+
+	return status;
+}
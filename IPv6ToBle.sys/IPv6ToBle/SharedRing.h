@@ -0,0 +1,83 @@
+/*++
+
+Module Name:
+
+	SharedRing.h
+
+Abstract:
+
+	This file contains definitions for the functions that map the packet rings
+	shared with the usermode packet processing app, fill the listen ring with
+	intercepted packets, and inject the packets the app puts in the inject
+	ring. The ring layout and protocol are defined in Public.h; the driver's
+	bookkeeping structure is defined in Driver.h.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#ifndef _SHARED_RING_H_
+#define _SHARED_RING_H_
+
+EXTERN_C_START
+
+//-----------------------------------------------------------------------------
+// Callbacks that must run in the context of the app's process, because they
+// map or unmap the rings in its address space
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+EVT_WDF_IO_IN_CALLER_CONTEXT IPv6ToBleSharedRingsEvtIoInCallerContext;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+EVT_WDF_FILE_CLEANUP IPv6ToBleSharedRingsEvtFileCleanup;
+
+//-----------------------------------------------------------------------------
+// Functions to map and unmap the rings
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+_Check_return_
+_Success_(return == STATUS_SUCCESS)
+NTSTATUS
+IPv6ToBleSharedRingsMap(
+	_In_	WDFREQUEST	Request,
+	_Out_	ULONG_PTR*	info
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+NTSTATUS
+IPv6ToBleSharedRingsUnmap(
+	_In_	WDFFILEOBJECT	FileObject
+);
+
+//-----------------------------------------------------------------------------
+// Functions to move packets through the rings
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+NTSTATUS
+IPv6ToBleSharedRingsProducePacket(
+	_In_	NET_BUFFER_LIST*	NBL,
+	_In_	UINT32				ipHeaderOffset,
+	_In_	ULONG				direction
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+NTSTATUS
+IPv6ToBleSharedRingsKickInject(
+	_In_	WDFFILEOBJECT	FileObject
+);
+
+EXTERN_C_END
+
+#endif	// _SHARED_RING_H_
@@ -0,0 +1,406 @@
+/*++
+
+Module Name:
+
+	Statistics.c
+
+Abstract:
+
+	This file contains the implementations for the data path statistics.
+
+	Each processor has its own cache-aligned copy of the counters, so
+	counting a packet in the classify callouts or the injection functions
+	never bounces a cache line between processors. Reading the statistics
+	adds up every processor's copy. The sum isn't an atomic snapshot, since
+	packets keep being counted while it's taken, but every counter only ever
+	goes up.
+
+	The listen pend queue counters are already guarded by each listen
+	channel's lock, and the shared listen ring counter by
+	gListenRequestQueueLock, so they are read under those locks rather than
+	duplicated here.
+
+	The latency histogram is kept the same way. Each packet handed to the
+	listen functions is stamped with the performance counter, and when a
+	listen request returns it to the app the elapsed time goes into a log2
+	bucket on the current processor, and its latency is added to a running
+	total. Reading the histogram with the reset flag exchanges each counter
+	with 0 as it is added up. A packet's bucket is a single counter, so it
+	lands in exactly one interval, and the packet count is the sum of the
+	buckets rather than a counter of its own. The total is updated
+	separately, so a packet timed during a reset can have its bucket in one
+	interval and its latency in the total of the next; the mean of an
+	interval can be off by that much.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#include "Includes.h"
+#include "Statistics.tmh"	// auto-generated tracing file
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, IPv6ToBleStatisticsInitialize)
+#pragma alloc_text (PAGE, IPv6ToBleStatisticsCleanup)
+#endif
+
+// The per-processor counters are added up as arrays of UINT64
+C_ASSERT(sizeof(IPV6_TO_BLE_STATISTICS) % sizeof(UINT64) == 0);
+C_ASSERT(sizeof(IPV6_TO_BLE_LATENCY_HISTOGRAM) % sizeof(UINT64) == 0);
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleStatisticsInitialize()
+/*++
+Routine Description:
+
+	Allocates a zeroed, cache-aligned set of counters for every possible
+	processor. Called from IPv6ToBleDriverInitGlobalObjects before the
+	callouts are registered, so the counters exist before any packet is
+	counted.
+
+Arguments:
+
+	None. Accesses global variables defined in Driver.h.
+
+Return Value:
+
+	STATUS_SUCCESS if successful, appropriate NTSTATUS error codes otherwise.
+
+--*/
+{
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_STATISTICS, "%!FUNC! Entry");
+
+	PAGED_CODE();
+
+	NTSTATUS status = STATUS_SUCCESS;
+
+	LARGE_INTEGER frequency;
+	(VOID)KeQueryPerformanceCounter(&frequency);
+	gPerformanceFrequency = frequency.QuadPart;
+
+	gStatisticsCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+	SIZE_T statisticsSize = 0;
+	status = RtlSizeTMult(gStatisticsCount,
+						  sizeof(PER_PROCESSOR_STATISTICS),
+						  &statisticsSize
+						  );
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_STATISTICS, "Statistics array size overflowed during %!FUNC! with %!STATUS!", status);
+		goto Exit;
+	}
+
+	gStatistics = (PPER_PROCESSOR_STATISTICS)ExAllocatePoolWithTag(
+										NonPagedPoolNxCacheAligned,
+										statisticsSize,
+										IPV6_TO_BLE_STATISTICS_TAG
+									);
+	if (!gStatistics)
+	{
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_STATISTICS, "Statistics allocation failed during %!FUNC! with %!STATUS!", status);
+		goto Exit;
+	}
+	RtlZeroMemory(gStatistics, statisticsSize);
+
+Exit:
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_STATISTICS, "%!FUNC! Exit");
+
+	return status;
+}
+
+_Use_decl_annotations_
+VOID
+IPv6ToBleStatisticsCleanup()
+/*++
+Routine Description:
+
+	Frees the per-processor counters. Called during driver unload after the
+	callouts have been unregistered and every injection has completed, so
+	nothing can count a packet anymore.
+
+Arguments:
+
+	None. Accesses global variables defined in Driver.h.
+
+Return Value:
+
+	None.
+
+--*/
+{
+	PAGED_CODE();
+
+	if (gStatistics)
+	{
+		ExFreePoolWithTag(gStatistics, IPV6_TO_BLE_STATISTICS_TAG);
+		gStatistics = NULL;
+	}
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleStatisticsQuery(
+	WDFREQUEST	Request,
+	ULONG_PTR*	info
+)
+/*++
+Routine Description:
+
+	Adds up every processor's counters into the request's output buffer,
+	then fills in the listen pend queue and shared ring counters.
+
+Arguments:
+
+	Request - the WDFREQUEST from user mode. Its output buffer receives an
+	IPV6_TO_BLE_STATISTICS structure.
+
+	info - receives the number of bytes written to the output buffer.
+
+Return Value:
+
+	STATUS_SUCCESS if successful, appropriate NTSTATUS error codes otherwise.
+
+--*/
+{
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_STATISTICS, "%!FUNC! Entry");
+
+	NTSTATUS status = STATUS_SUCCESS;
+
+	PIPV6_TO_BLE_STATISTICS statistics = NULL;
+
+	*info = 0;
+
+	//
+	// Step 1
+	// Retrieve the output buffer
+	//
+	status = WdfRequestRetrieveOutputBuffer(Request,
+											sizeof(IPV6_TO_BLE_STATISTICS),
+											(PVOID*)&statistics,
+											NULL
+											);
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_STATISTICS, "Retrieving output buffer from WDFREQUEST failed during %!FUNC! with %!STATUS!", status);
+		goto Exit;
+	}
+
+	RtlZeroMemory(statistics, sizeof(IPV6_TO_BLE_STATISTICS));
+
+	//
+	// Step 2
+	// Add up the per-processor counters
+	//
+	UINT64* total = (UINT64*)statistics;
+	for (ULONG processor = 0; processor < gStatisticsCount; processor++)
+	{
+		const volatile LONG64* counters = (const volatile LONG64*)&gStatistics[processor].counters;
+
+		for (ULONG i = 0; i < sizeof(IPV6_TO_BLE_STATISTICS) / sizeof(UINT64); i++)
+		{
+			total[i] += (UINT64)ReadNoFence64(&counters[i]);
+		}
+	}
+
+	//
+	// Step 3
+	// Add up the counters kept by each listen channel's pend queues, across
+	// priority classes, then read the shared rings' counter
+	//
+	for (ULONG channel = 0; channel < gListenChannelCount; channel++)
+	{
+		PLISTEN_CHANNEL listenChannel = &gListenChannels[channel];
+
+		WdfSpinLockAcquire(listenChannel->lock);
+
+		for (ULONG priority = 0; priority < IPV6_TO_BLE_PRIORITY_COUNT; priority++)
+		{
+			for (ULONG direction = INBOUND; direction <= OUTBOUND; direction++)
+			{
+				PLISTEN_PEND_QUEUE pendQueue = &listenChannel->pendQueues[priority][direction];
+
+				statistics->pendQueuePended[direction] += (UINT64)pendQueue->pendedCount;
+				statistics->pendQueueDelivered[direction] += (UINT64)pendQueue->deliveredCount;
+				statistics->pendQueueDropped[direction] += (UINT64)pendQueue->droppedCount;
+			}
+		}
+
+		WdfSpinLockRelease(listenChannel->lock);
+	}
+
+	WdfSpinLockAcquire(gListenRequestQueueLock);
+	statistics->sharedRingListenDropped = (UINT64)gSharedRings.listenDroppedCount;
+	WdfSpinLockRelease(gListenRequestQueueLock);
+
+	*info = sizeof(IPV6_TO_BLE_STATISTICS);
+
+Exit:
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_STATISTICS, "%!FUNC! Exit");
+
+	return status;
+}
+
+_Use_decl_annotations_
+VOID
+IPv6ToBleStatisticsRecordLatency(
+	LONGLONG	classifyTime
+)
+/*++
+Routine Description:
+
+	Records the time from classify to delivery for one packet in the current
+	processor's latency histogram. Called by the listen functions as a
+	listen request or batched listen request is about to return the packet.
+
+Arguments:
+
+	classifyTime - the performance counter value taken when the classify
+	callout handed the packet to IPv6ToBleListenDeliverPacket.
+
+Return Value:
+
+	None.
+
+--*/
+{
+	LONGLONG ticks = KeQueryPerformanceCounter(NULL).QuadPart - classifyTime;
+	if (ticks < 0)
+	{
+		ticks = 0;
+	}
+
+	// Multiply first for precision unless that would overflow, which takes
+	// days of delay
+	ULONG64 microseconds = 0;
+	if (ticks <= MAXLONGLONG / 1000000)
+	{
+		microseconds = (ULONG64)(ticks * 1000000 / gPerformanceFrequency);
+	}
+	else
+	{
+		microseconds = (ULONG64)(ticks / gPerformanceFrequency) * 1000000;
+	}
+
+	// Bucket 0 is under 1 microsecond; bucket i is [2^(i-1), 2^i)
+	ULONG bucket = 0;
+	ULONG highestBit = 0;
+	if (_BitScanReverse64(&highestBit, microseconds))
+	{
+		bucket = min(highestBit + 1, IPV6_TO_BLE_LATENCY_BUCKET_COUNT - 1);
+	}
+
+	PIPV6_TO_BLE_LATENCY_HISTOGRAM latency = &gStatistics[KeGetCurrentProcessorIndex()].latency;
+
+	// packetCount isn't kept per processor; it is the sum of the buckets
+	InterlockedAddNoFence64((LONG64*)&latency->totalMicroseconds, (LONG64)microseconds);
+	InterlockedIncrementNoFence64((LONG64*)&latency->buckets[bucket]);
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleStatisticsQueryLatency(
+	WDFREQUEST	Request,
+	ULONG_PTR*	info
+)
+/*++
+Routine Description:
+
+	Adds up every processor's latency histogram into the request's output
+	buffer, resetting each counter as it is read if the caller asked for it.
+	The packet count is the sum of the buckets, so the two always agree.
+
+Arguments:
+
+	Request - the WDFREQUEST from user mode. Its optional input buffer is an
+	IPV6_TO_BLE_LATENCY_QUERY_INPUT, and its output buffer receives an
+	IPV6_TO_BLE_LATENCY_HISTOGRAM.
+
+	info - receives the number of bytes written to the output buffer.
+
+Return Value:
+
+	STATUS_SUCCESS if successful, appropriate NTSTATUS error codes otherwise.
+
+--*/
+{
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_STATISTICS, "%!FUNC! Entry");
+
+	NTSTATUS status = STATUS_SUCCESS;
+
+	PIPV6_TO_BLE_LATENCY_QUERY_INPUT input = NULL;
+	PIPV6_TO_BLE_LATENCY_HISTOGRAM histogram = NULL;
+	BOOLEAN reset = FALSE;
+
+	*info = 0;
+
+	//
+	// Step 1
+	// Retrieve the flags, if any, and the output buffer
+	//
+	status = WdfRequestRetrieveInputBuffer(Request,
+										   sizeof(IPV6_TO_BLE_LATENCY_QUERY_INPUT),
+										   (PVOID*)&input,
+										   NULL
+										   );
+	if (NT_SUCCESS(status))
+	{
+		reset = (input->flags & IPV6_TO_BLE_LATENCY_QUERY_RESET) != 0;
+	}
+
+	status = WdfRequestRetrieveOutputBuffer(Request,
+											sizeof(IPV6_TO_BLE_LATENCY_HISTOGRAM),
+											(PVOID*)&histogram,
+											NULL
+											);
+	if (!NT_SUCCESS(status))
+	{
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_STATISTICS, "Retrieving output buffer from WDFREQUEST failed during %!FUNC! with %!STATUS!", status);
+		goto Exit;
+	}
+
+	// With METHOD_BUFFERED the input and output share a buffer, so the flags
+	// were read before this clears it
+	RtlZeroMemory(histogram, sizeof(IPV6_TO_BLE_LATENCY_HISTOGRAM));
+
+	//
+	// Step 2
+	// Add up, and optionally reset, the per-processor histograms
+	//
+	UINT64* total = (UINT64*)histogram;
+	for (ULONG processor = 0; processor < gStatisticsCount; processor++)
+	{
+		volatile LONG64* counters = (volatile LONG64*)&gStatistics[processor].latency;
+
+		for (ULONG i = 0; i < sizeof(IPV6_TO_BLE_LATENCY_HISTOGRAM) / sizeof(UINT64); i++)
+		{
+			if (reset)
+			{
+				total[i] += (UINT64)InterlockedExchange64(&counters[i], 0);
+			}
+			else
+			{
+				total[i] += (UINT64)ReadNoFence64(&counters[i]);
+			}
+		}
+	}
+
+	for (ULONG bucket = 0; bucket < IPV6_TO_BLE_LATENCY_BUCKET_COUNT; bucket++)
+	{
+		histogram->packetCount += histogram->buckets[bucket];
+	}
+
+	*info = sizeof(IPV6_TO_BLE_LATENCY_HISTOGRAM);
+
+Exit:
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_STATISTICS, "%!FUNC! Exit");
+
+	return status;
+}
@@ -0,0 +1,93 @@
+/*++
+
+Module Name:
+
+	Statistics.h
+
+Abstract:
+
+	This file contains definitions for the functions that keep the data path
+	statistics: per-processor counters for every outcome of the classify
+	callouts and the injection functions, and a per-processor histogram of
+	the time from classify to delivery, added up on request for the query
+	IOCTLs. The output structures are defined in Public.h; the per-processor
+	structure is defined in Driver.h.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#ifndef _STATISTICS_H_
+#define _STATISTICS_H_
+
+EXTERN_C_START
+
+//-----------------------------------------------------------------------------
+// Macro to count a packet. Counter is an IPV6_TO_BLE_STATISTICS field, with
+// its direction index if it has one, e.g. classifyPermitted[INBOUND].
+//
+// The thread may move to another processor between looking up its counters
+// and incrementing them, so the increment is interlocked, but the cache line
+// is almost always already owned by the current processor.
+//-----------------------------------------------------------------------------
+
+#define IPV6_TO_BLE_STATISTICS_INCREMENT(Counter)                          \
+    InterlockedIncrementNoFence64(                                          \
+        (LONG64*)&gStatistics[KeGetCurrentProcessorIndex()].counters.Counter \
+        )
+
+//-----------------------------------------------------------------------------
+// Functions to create and destroy the per-processor counters
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+_Check_return_
+_Success_(return == STATUS_SUCCESS)
+NTSTATUS
+IPv6ToBleStatisticsInitialize();
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+VOID
+IPv6ToBleStatisticsCleanup();
+
+//-----------------------------------------------------------------------------
+// Function called by the listen functions when a packet reaches the app
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+VOID
+IPv6ToBleStatisticsRecordLatency(
+	_In_	LONGLONG	classifyTime
+);
+
+//-----------------------------------------------------------------------------
+// Functions called by the I/O control callback for the query IOCTLs
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+NTSTATUS
+IPv6ToBleStatisticsQuery(
+	_In_	WDFREQUEST	Request,
+	_Out_	ULONG_PTR*	info
+);
+
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+NTSTATUS
+IPv6ToBleStatisticsQueryLatency(
+	_In_	WDFREQUEST	Request,
+	_Out_	ULONG_PTR*	info
+);
+
+EXTERN_C_END
+
+#endif	// _STATISTICS_H_
@@ -46,6 +46,13 @@ Environment:
         WPP_DEFINE_BIT(TRACE_HELPERS_REGISTRY)                         \
         WPP_DEFINE_BIT(TRACE_RUNTIME_LIST)                             \
         WPP_DEFINE_BIT(TRACE_TIMER)                                    \
+        WPP_DEFINE_BIT(TRACE_LISTEN)                                   \
+        WPP_DEFINE_BIT(TRACE_SHARED_RING)                              \
+        WPP_DEFINE_BIT(TRACE_STATISTICS)                               \
+        WPP_DEFINE_BIT(TRACE_PACKET_TRACE)                             \
+        WPP_DEFINE_BIT(TRACE_SHAPING)                                  \
+        WPP_DEFINE_BIT(TRACE_HELPERS_TCP)                              \
+        WPP_DEFINE_BIT(TRACE_LIST_CHANGE)                              \
         )                             
 
 #define WPP_FLAG_LEVEL_LOGGER(flag, level)                                  \
@@ -69,6 +76,40 @@ Environment:
 #define WPP_RECORDER_FLAGS_LEVEL_ARGS(flags, lvl) WPP_RECORDER_LEVEL_FLAGS_ARGS(lvl, flags)
 #define WPP_RECORDER_FLAGS_LEVEL_FILTER(flags, lvl) WPP_RECORDER_LEVEL_FLAGS_FILTER(lvl, flags)
 
+//
+// Data path trace points.
+//
+// The classify callouts, the listen functions and the injection functions
+// run for every packet, so their trace points use TraceDataPath instead of
+// TraceEvents. TraceDataPath compiles to nothing unless
+// IPV6_TO_BLE_DATA_PATH_TRACING is nonzero, which by default it only is in
+// debug builds, and even then it only logs, to a trace session or the
+// in-flight recorder, while gDataPathTracing is set by the registry or the
+// packet trace IOCTL. Use the sampled packet trace ring (see PacketTrace.c)
+// to look at production traffic instead.
+//
+#ifndef IPV6_TO_BLE_DATA_PATH_TRACING
+#if DBG
+#define IPV6_TO_BLE_DATA_PATH_TRACING 1
+#else
+#define IPV6_TO_BLE_DATA_PATH_TRACING 0
+#endif  // DBG
+#endif  // IPV6_TO_BLE_DATA_PATH_TRACING
+
+#define WPP_DATAPATH_LEVEL_FLAGS_LOGGER(dp, lvl, flags) \
+           WPP_LEVEL_LOGGER(flags)
+
+#define WPP_DATAPATH_LEVEL_FLAGS_ENABLED(dp, lvl, flags) \
+           (IPV6_TO_BLE_DATA_PATH_TRACING && gDataPathTracing && \
+            WPP_LEVEL_FLAGS_ENABLED(lvl, flags))
+
+#define WPP_RECORDER_DATAPATH_LEVEL_FLAGS_ARGS(dp, lvl, flags) \
+           WPP_RECORDER_LEVEL_FLAGS_ARGS(lvl, flags)
+
+#define WPP_RECORDER_DATAPATH_LEVEL_FLAGS_FILTER(dp, lvl, flags) \
+           (IPV6_TO_BLE_DATA_PATH_TRACING && gDataPathTracing && \
+            WPP_RECORDER_LEVEL_FLAGS_FILTER(lvl, flags))
+
 //
 // This comment block is scanned by the trace preprocessor to define our
 // Trace function.
@@ -76,5 +117,6 @@ Environment:
 // begin_wpp config
 // FUNC Trace{FLAGS=MYDRIVER_ALL_INFO}(LEVEL, MSG, ...);
 // FUNC TraceEvents(LEVEL, FLAGS, MSG, ...);
+// FUNC TraceDataPath{DATAPATH=0}(LEVEL, FLAGS, MSG, ...);
 // end_wpp
 //
@@ -17,6 +17,143 @@ Environment:
 #include "Includes.h"
 #include "callout.tmh"  // auto-generated tracing file
 
+//
+// The classify core (ClassifyCore.c) has its own copies of these values so it
+// doesn't depend on the driver's headers; make sure they agree
+//
+C_ASSERT(CLASSIFY_CORE_ADDRESS_LENGTH == IPV6_ADDRESS_LENGTH);
+C_ASSERT(CLASSIFY_CORE_HEADER_LENGTH == IPV6_HEADER_LENGTH);
+C_ASSERT(CLASSIFY_CORE_MAX_PACKET_LENGTH == LISTEN_PACKET_MAX_LENGTH);
+C_ASSERT(CLASSIFY_CORE_PROTOCOL_TCP == IPPROTO_TCP);
+C_ASSERT(CLASSIFY_CORE_PROTOCOL_UDP == IPPROTO_UDP);
+C_ASSERT(CLASSIFY_CORE_INBOUND == INBOUND);
+C_ASSERT(CLASSIFY_CORE_OUTBOUND == OUTBOUND);
+C_ASSERT(CLASSIFY_CORE_WHITE_LIST == WHITE_LIST);
+C_ASSERT(CLASSIFY_CORE_MESH_LIST == MESH_LIST);
+C_ASSERT(CLASSIFY_CORE_DECISION_PERMIT_INJECTED == IPV6_TO_BLE_DECISION_PERMIT_INJECTED);
+C_ASSERT(CLASSIFY_CORE_DECISION_PERMIT_LOOPBACK == IPV6_TO_BLE_DECISION_PERMIT_LOOPBACK);
+C_ASSERT(CLASSIFY_CORE_DECISION_PERMIT_UNPARSED == IPV6_TO_BLE_DECISION_PERMIT_UNPARSED);
+C_ASSERT(CLASSIFY_CORE_DECISION_PERMIT_NOT_WHITE_LISTED == IPV6_TO_BLE_DECISION_PERMIT_NOT_WHITE_LISTED);
+C_ASSERT(CLASSIFY_CORE_DECISION_PERMIT_NOT_FOR_MESH == IPV6_TO_BLE_DECISION_PERMIT_NOT_FOR_MESH);
+C_ASSERT(CLASSIFY_CORE_DECISION_DROP_NOT_UDP == IPV6_TO_BLE_DECISION_DROP_NOT_UDP);
+C_ASSERT(CLASSIFY_CORE_DECISION_DROP_TOO_LARGE == IPV6_TO_BLE_DECISION_DROP_TOO_LARGE);
+C_ASSERT(CLASSIFY_CORE_DECISION_DELIVER == IPV6_TO_BLE_DECISION_DELIVERED);
+C_ASSERT(CLASSIFY_CORE_DECISION_DROP_EXTENSION_HEADER == IPV6_TO_BLE_DECISION_DROP_EXTENSION_HEADER);
+
+_Use_decl_annotations_
+BOOLEAN
+IPv6ToBleClassifyCoreListContains(
+    UINT32          targetList,
+    const UINT8*    ipv6Address
+)
+/*++
+Routine Description:
+
+    The list lookup the classify core calls while deciding what to do with
+    a packet. In the driver it looks in the published, read-only snapshot
+    of the list, so it takes no lock.
+
+Arguments:
+
+    targetList - WHITE_LIST or MESH_LIST.
+
+    ipv6Address - the address to look for, in network byte order.
+
+Return Value:
+
+    TRUE if the address is in the list, FALSE otherwise.
+
+--*/
+{
+    return IPv6ToBleRuntimeListSnapshotContains(targetList,
+                                                ipv6Address,
+                                                NULL
+                                                );
+}
+
+//
+// Maps a packet's traffic class to the priority class it is pended in. See
+// Public.h for the classes.
+//
+static
+UINT8
+IPv6ToBleCalloutPriorityForTrafficClass(
+    _In_    UINT8   trafficClass
+)
+{
+    UINT8 dscp = trafficClass >> 2;
+
+    if (dscp >= 40)
+    {
+        return IPV6_TO_BLE_PRIORITY_HIGH;
+    }
+
+    if (dscp == 1 || dscp == 8)
+    {
+        return IPV6_TO_BLE_PRIORITY_LOW;
+    }
+
+    return IPV6_TO_BLE_PRIORITY_NORMAL;
+}
+
+//
+// Fills in the metadata that goes with an intercepted packet to the packet
+// processing app, including the capture timestamp. The interface values may
+// be missing from inFixedValues, in which case they are left 0.
+//
+static
+VOID
+IPv6ToBleCalloutFillMetadata(
+    _In_opt_    const FWPS_INCOMING_VALUES0*            inFixedValues,
+    _In_        const FWPS_INCOMING_METADATA_VALUES0*   inMetaValues,
+    _In_        const IPV6_PACKET_INFO*                 packetInfo,
+    _In_        ULONG                                   direction,
+    _Out_       PIPV6_TO_BLE_PACKET_METADATA            metadata
+)
+{
+    LONGLONG captureTime = KeQueryPerformanceCounter(NULL).QuadPart;
+
+    RtlZeroMemory(metadata, sizeof(IPV6_TO_BLE_PACKET_METADATA));
+
+    metadata->version = IPV6_TO_BLE_PACKET_METADATA_VERSION;
+    metadata->length = sizeof(IPV6_TO_BLE_PACKET_METADATA);
+    metadata->direction = (UINT8)direction;
+    metadata->transportProtocol = packetInfo->nextHeader;
+    metadata->flowHash = IPv6ToBleNBLFlowHash(packetInfo);
+    metadata->captureTimeLow = (UINT32)captureTime;
+    metadata->captureTimeHigh = (UINT32)((UINT64)captureTime >> 32);
+    metadata->trafficClass = packetInfo->trafficClass;
+    metadata->priority = IPv6ToBleCalloutPriorityForTrafficClass(packetInfo->trafficClass);
+
+    if (FWPS_IS_METADATA_FIELD_PRESENT(inMetaValues, FWPS_METADATA_FIELD_IP_HEADER_SIZE))
+    {
+        metadata->ipHeaderLength = (UINT16)inMetaValues->ipHeaderSize;
+    }
+    else
+    {
+        metadata->ipHeaderLength = IPV6_HEADER_LENGTH;
+    }
+
+    if (inFixedValues)
+    {
+        UINT32 interfaceField = (direction == INBOUND) ?
+                                FWPS_FIELD_INBOUND_IPPACKET_V6_INTERFACE_INDEX :
+                                FWPS_FIELD_OUTBOUND_IPPACKET_V6_INTERFACE_INDEX;
+        UINT32 subInterfaceField = (direction == INBOUND) ?
+                                   FWPS_FIELD_INBOUND_IPPACKET_V6_SUB_INTERFACE_INDEX :
+                                   FWPS_FIELD_OUTBOUND_IPPACKET_V6_SUB_INTERFACE_INDEX;
+
+        if (inFixedValues->incomingValue[interfaceField].value.type == FWP_UINT32)
+        {
+            metadata->interfaceIndex = inFixedValues->incomingValue[interfaceField].value.uint32;
+        }
+        if (inFixedValues->incomingValue[subInterfaceField].value.type == FWP_UINT32)
+        {
+            metadata->subInterfaceIndex = inFixedValues->incomingValue[subInterfaceField].value.uint32;
+        }
+    }
+}
+
 _Use_decl_annotations_
 VOID
 IPv6ToBleCalloutClassifyInboundIpPacketV6(
@@ -40,39 +177,43 @@ Routine Description:
 	the Bluetooth LE mesh network, it passes the packet up to the usermode
 	packet processing background app.
 
-    Filters in this driver are based on the white list to improve performance
-    in the filter engine itself. This function then compares the received
-    packet's destination to the mesh list addresses to see if it is destined
-    for one of the mesh devices. 
+    Filters in this driver are based on the /64 prefixes of the white list to
+    improve performance in the filter engine itself, so this function checks
+    the exact source address against the white list. This function then
+    compares the received packet's destination to the mesh list addresses to
+    see if it is destined for one of the mesh devices. 
 
     Note: the gateway PC on which this driver runs is assumed not to have been
     added to the mesh list. Therefore, traffic that does not match an address
     in the mesh list will be permitted as it is assumed to be traffic for the
     host.
 
+    The checks in steps 1 to 3 below are made by the platform-neutral
+    classify core in ClassifyCore.c; this function gathers what the core
+    needs from WFP and carries out its decision.
+
     Procedures for incoming traffic:
 
         1. Verify the classifyFn callback has rights to alter the classify and
             didn't inspect the packet itself earlier. If the callback does not
             have rights to alter the classify or already inspected the packet,
             permit.
-        2. Verify the packet is intended for a mesh device by examining the
-            destination address. If it is not, permit.
-        3. Try to retrieve a WDFREQUEST from the listening queue. If
-            unsuccessful, that means the packet processing app is not running
-            so the entire solution won't work. Or, the provided output buffer
-            wasn't big enough to hold the paket. Block.        
-        4. Verify the packet is a UDP datagram packet by examining the size of
-            the transport header (UDP is 8 bytes). If it is a TCP segment,
-            block.              
-        5. Verify the data is no larger than 1280 bytes (octets), the MTU for
-            Bluetooth. If it is larger, block. We do this by going ahead and
-            converting the packet to the usermode byte array; the conversion
-            function takes care of the IP header for us and reports the data
-            size.        
-        6. Put the converted byte array into the WDFREQUEST output buffer and 
-            complete the request.
-        7. Block/absorb the original packet unless it was permitted earlier.
+        2. Parse the IPv6 header once, then verify the source is in the
+            white list (the filters only match its /64 prefixes) and the
+            packet is intended for a mesh device by examining the
+            destination address. If either is not, permit.
+        3. Verify the packet is a UDP datagram or TCP segment by examining
+            the next header field, and that it is no larger than 1280 bytes (octets),
+            the MTU for Bluetooth. If either check fails, block. A packet
+            with an extension header before its UDP or TCP header is
+            blocked too, and counted on its own. These checks
+            use the header parsed in step 2, so no listen request is used
+            up on a packet we would drop anyway.
+        4. Copy the packet into an outstanding listen request and complete
+            it. If no listen request is outstanding, hold a copy of the
+            packet in the bounded pend queue until the next one arrives (see
+            Listen.c).
+        5. Block/absorb the original packet unless it was permitted earlier.
 
 Arguments:
 
@@ -85,7 +226,7 @@ Return Value:
 
 --*/
 {
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CLASSIFY_INBOUND_IP_PACKET_V6, "%!FUNC! Entry");
+    TraceDataPath(TRACE_LEVEL_INFORMATION, TRACE_CLASSIFY_INBOUND_IP_PACKET_V6, "%!FUNC! Entry");
 
     UNREFERENCED_PARAMETER(classifyContext);
     UNREFERENCED_PARAMETER(filter);
@@ -98,17 +239,20 @@ Return Value:
 #endif // DBG
     
     
-    BYTE* outputBuffer = 0;
+    UINT32 ipHeaderSize = inMetaValues->ipHeaderSize;
 
-    WDFREQUEST outRequest = NULL;
-    BOOLEAN requestRetrieved = FALSE;
-    ULONG_PTR bytesTransferred = 0;
+    IPV6_PACKET_INFO packetInfo;
 
-    UINT32 ipHeaderSize = inMetaValues->ipHeaderSize;
-    UINT32 transportHeaderSize = inMetaValues->transportHeaderSize;
+    IPV6_TO_BLE_PACKET_METADATA metadata;
 
     FWPS_PACKET_INJECTION_STATE packetState;
 
+    PIPV6_PACKET_INFO parsedPacketInfo = NULL;
+
+    UINT8 coreFlags = gBorderRouterFlag ? CLASSIFY_CORE_FLAG_BORDER_ROUTER : 0;
+
+    UINT8 decision;
+
     //
     // Step 1
     // Verify rights to alter the classify and check if we previously injected
@@ -116,7 +260,9 @@ Return Value:
     //
     if ((classifyOut->rights & FWPS_RIGHT_ACTION_WRITE) == 0)
     {
-        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CLASSIFY_INBOUND_IP_PACKET_V6, "No rights to alter the classify during %!FUNC!");
+        IPV6_TO_BLE_STATISTICS_INCREMENT(classifyNoRights[INBOUND]);
+        IPV6_TO_BLE_PACKET_TRACE(INBOUND, IPV6_TO_BLE_DECISION_NO_RIGHTS, NULL, status);
+        TraceDataPath(TRACE_LEVEL_INFORMATION, TRACE_CLASSIFY_INBOUND_IP_PACKET_V6, "No rights to alter the classify during %!FUNC!");
 
         return;
     }
@@ -124,8 +270,8 @@ Return Value:
     NT_ASSERT(layerData);
     _Analysis_assume_(layerData);
 
-    // Check to make sure we don't try to re-inspect packets we inspected
-    // earlier; permit and clear the write permissions flag if so
+    // Note whether we injected the packet earlier, so we don't re-inspect
+    // it, and whether it is loopback traffic, which we ignore
     packetState = FwpsQueryPacketInjectionState0(gInjectionHandleNetwork,
                                                  layerData,
                                                  NULL
@@ -133,209 +279,131 @@ Return Value:
     if ((packetState == FWPS_PACKET_INJECTED_BY_SELF) ||
         (packetState == FWPS_PACKET_PREVIOUSLY_INJECTED_BY_SELF))
     {
-        classifyOut->actionType = FWP_ACTION_PERMIT;
-        if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
-        {
-            classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
-        }
-
-        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CLASSIFY_INBOUND_IP_PACKET_V6, "Packet was injected by self earlier");
-
-        return;
+        coreFlags |= CLASSIFY_CORE_FLAG_INJECTED;
     }
 
-    // Check for loopback packets and ignore them
     if (inFixedValues)
     {
-        FWP_DATA_TYPE valueType = inFixedValues->incomingValue->value.type;
+        FWP_DATA_TYPE valueType = inFixedValues->incomingValue[FWPS_FIELD_INBOUND_IPPACKET_V6_FLAGS].value.type;
         if (valueType == FWP_UINT32)
         {
-            UINT32 flags = inFixedValues->incomingValue->value.uint32;
+            UINT32 flags = inFixedValues->incomingValue[FWPS_FIELD_INBOUND_IPPACKET_V6_FLAGS].value.uint32;
             if (flags & FWP_CONDITION_FLAG_IS_LOOPBACK)
             {
-                classifyOut->actionType = FWP_ACTION_PERMIT;
-                if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
-                {
-                    classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
-                }
-
-                TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CLASSIFY_INBOUND_IP_PACKET_V6, "Permitting loopback packet.");
-
-                return;
+                coreFlags |= CLASSIFY_CORE_FLAG_LOOPBACK;
             }
         }
     }
 
     //
     // Step 2
-    // Verify the destination if on the border router.
-    // 
-    // If the packet is intended for a mesh device, continue with the rest of
-    // the function and pass the packet to the usermode packet processing app.
-    //
-    // If the packet is not intended for a mesh device, permit it as it must
-    // be normal traffic destined elsewhere.
-    //
-
-    // Extract the destination address from the IP header by retreating 16
-    // bytes (as it is at the end of the IPv6 header)
-    UINT8 extractedAddress[16] = { 0 };
-    NDIS_STATUS ndisStatus = NDIS_STATUS_SUCCESS;
-    ndisStatus = NdisRetreatNetBufferListDataStart(layerData,
-                                                    (sizeof(BYTE) * 16),
-                                                    0,
-                                                    NULL,
-                                                    NULL
-                                                    );
-    if (ndisStatus != NDIS_STATUS_SUCCESS)
-    {
-        classifyOut->actionType = FWP_ACTION_PERMIT;
-        if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
+    // Parse the IP header once, unless the packet is going to be permitted
+    // without looking at it. On the inbound IP_PACKET layer, the NBL is
+    // positioned at the END of the IP header, so tell the parser how far
+    // back the header starts.
+    //
+    if (!(coreFlags & (CLASSIFY_CORE_FLAG_INJECTED | CLASSIFY_CORE_FLAG_LOOPBACK)))
+    {
+        status = IPv6ToBleNBLParseIpv6Header(layerData,
+                                             ipHeaderSize,
+                                             &packetInfo
+                                             );
+        if (NT_SUCCESS(status))
         {
-            classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+            parsedPacketInfo = &packetInfo;
+        }
+        else
+        {
+            TraceDataPath(TRACE_LEVEL_ERROR, TRACE_CLASSIFY_INBOUND_IP_PACKET_V6, "Parsing IPv6 header failed during %!FUNC! with %!STATUS!", status);
         }
-
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CLASSIFY_INBOUND_IP_PACKET_V6, "Retreating NBL failed during %!FUNC! with %!STATUS!, permitting packet", status);
-
-        return;
     }
 
-    // Copy the destination address
-    RtlCopyMemory(extractedAddress, layerData, IPV6_ADDRESS_LENGTH);
-
-    // Advance back to the end of the IP header if the retreat operation
-    // succeeded
-    NdisAdvanceNetBufferListDataStart(layerData,
-                                        (sizeof(BYTE) * 16),
-                                        FALSE,
-                                        NULL
-                                        );
-
-    BOOLEAN isInMeshList = FALSE;
-
-    // Compare each address in the mesh list to the destination address
-    PLIST_ENTRY entry = gMeshListHead->Flink;
-    while (entry != gMeshListHead)
+    //
+    // Step 3
+    // Decide what to do with the packet (see ClassifyCore.c). Packets that
+    // aren't for the mesh are permitted. Packets for the mesh that aren't
+    // UDP or TCP directly after the fixed header, or are larger than the
+    // Bluetooth MTU, are dropped before taking a listen request or pend
+    // queue slot.
+    //
+    decision = IPv6ToBleClassifyCoreDecide(parsedPacketInfo,
+                                           INBOUND,
+                                           coreFlags
+                                           );
+    switch (decision)
     {
-        PMESH_LIST_ENTRY meshListEntry = CONTAINING_RECORD(entry,
-                                                            MESH_LIST_ENTRY,
-                                                            listEntry
-                                                            );
-        // Compare the extracted address to this entry's address
-        if (RtlEqualMemory(extractedAddress,
-            &meshListEntry->ipv6Address,
-            IPV6_ADDRESS_LENGTH))
-        {
-            // It is in the mesh list!
-            isInMeshList = TRUE;
+        case CLASSIFY_CORE_DECISION_DELIVER:
             break;
-        }
 
-        // Advance the list
-        entry = entry->Flink;
-    }
+        case CLASSIFY_CORE_DECISION_DROP_NOT_UDP:
+            IPV6_TO_BLE_STATISTICS_INCREMENT(classifyDroppedNotUdp[INBOUND]);
+            IPV6_TO_BLE_PACKET_TRACE(INBOUND, decision, &packetInfo, status);
+            TraceDataPath(TRACE_LEVEL_ERROR, TRACE_CLASSIFY_INBOUND_IP_PACKET_V6, "Packet is not a UDP or TCP packet, next header is %d when it should be %d or %d", packetInfo.nextHeader, IPPROTO_UDP, IPPROTO_TCP);
 
-    // Permit the packet if it wasn't in the mesh list, as that means the
-    // packet is destined elsewhere (normal traffic)
-    if (!isInMeshList)
-    {
-        classifyOut->actionType = FWP_ACTION_PERMIT;
-        if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
-        {
-            classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
-        }
+            goto Exit;
 
-        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CLASSIFY_INBOUND_IP_PACKET_V6, "Packet was not destined for a device in the mesh; must be destined for the border router");
+        case CLASSIFY_CORE_DECISION_DROP_EXTENSION_HEADER:
+            IPV6_TO_BLE_STATISTICS_INCREMENT(classifyDroppedExtensionHeader[INBOUND]);
+            IPV6_TO_BLE_PACKET_TRACE(INBOUND, decision, &packetInfo, status);
+            TraceDataPath(TRACE_LEVEL_ERROR, TRACE_CLASSIFY_INBOUND_IP_PACKET_V6, "Packet has extension header %d after the fixed header; only UDP or TCP directly after it is carried", packetInfo.nextHeader);
 
-        return;
-    }
+            goto Exit;
 
-    //
-    // Step 3
-    // Verify the packet is a UDP packet by checking the transport header size
-    // (should be 8 bytes)
-    //    
-    if (transportHeaderSize > 8)
-    {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CLASSIFY_INBOUND_IP_PACKET_V6, "Packet is not a UDP packet, transport header size is %d when it should be 8", transportHeaderSize);
+        case CLASSIFY_CORE_DECISION_DROP_TOO_LARGE:
+            IPV6_TO_BLE_STATISTICS_INCREMENT(classifyDroppedTooLarge[INBOUND]);
+            IPV6_TO_BLE_PACKET_TRACE(INBOUND, decision, &packetInfo, status);
+            TraceDataPath(TRACE_LEVEL_ERROR, TRACE_CLASSIFY_INBOUND_IP_PACKET_V6, "Packet is too large; it must be no larger than 1280 octets for Bluetooth MTU");
 
-        goto Exit;
-    }
+            goto Exit;
 
-    //
-    // Step 4
-    // Attempt to retrieve a WDFREQUEST from the listen request queue in the
-    // device context, then retrieve its output buffer.
-    //    
-
-    // Retrieve the output buffer. It should be large enough to hold the MTU of
-    // 1280 bytes because the EvtIoControl callback verifies that before even
-    // adding the request to the listening queue.      
-    WdfSpinLockAcquire(gListenRequestQueueLock);
-    status = WdfIoQueueRetrieveNextRequest(gListenRequestQueue,
-        &outRequest
-    );
-    WdfSpinLockRelease(gListenRequestQueueLock);
-    if (!NT_SUCCESS(status))
-    {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CLASSIFY_INBOUND_IP_PACKET_V6, "Retrieving request to listen for outbound IPv6 packets failed %!STATUS!", status);
-        goto Exit;
-    }
+        default:
+            classifyOut->actionType = FWP_ACTION_PERMIT;
+            if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
+            {
+                classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+            }
 
-    NT_ASSERT(irql == KeGetCurrentIrql());
-    requestRetrieved = TRUE;
-
-    // Retrieve the output buffer
-    size_t outputBufferLength = 0;
-    status = WdfRequestRetrieveOutputBuffer(outRequest,
-                                            sizeof(BYTE) * 48,  // Min 48 bytes
-                                            (PVOID*)&outputBuffer,
-                                            &outputBufferLength
-                                            );
-    if (!NT_SUCCESS(status))
-    {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CLASSIFY_INBOUND_IP_PACKET_V6, "Retrieving output buffer from WDFREQUEST failed during %!FUNC! with %!STATUS!", status);
-        goto Exit;
+            IPV6_TO_BLE_STATISTICS_INCREMENT(classifyPermitted[INBOUND]);
+            IPV6_TO_BLE_PACKET_TRACE(INBOUND, decision, parsedPacketInfo, status);
+            TraceDataPath(TRACE_LEVEL_INFORMATION, TRACE_CLASSIFY_INBOUND_IP_PACKET_V6, "Permitting packet, decision %d", decision);
+
+            return;
     }
 
     //
-    // Step 5
-    // Verify the NBL is no larger than 1280 bytes (octects), the maximum MTU
-    // for Bluetooth. This includes the IP header. 
-    //
-    // We can acquire the size by going ahead and converting the NBL to the 
-    // byte array, as this function reports the size to us.
-    //
-    // We can then use this size to also verify the request output buffer is
-    // big enough in the next step.
+    // Step 4
+    // Hand the packet, including the IP header, to the packet processing
+    // app along with its metadata. This completes an outstanding listen
+    // request if there is one, or holds the packet in the pend queue until
+    // the next one arrives.
     //
-    status = IPv6ToBleNBLCopyToBuffer(layerData,
-                                      ipHeaderSize,
-                                      outputBuffer,
-                                      (UINT32*)&outputBufferLength
-                                      );
-    if (!NT_SUCCESS(status))
+    IPv6ToBleCalloutFillMetadata(inFixedValues,
+                                 inMetaValues,
+                                 &packetInfo,
+                                 INBOUND,
+                                 &metadata
+                                 );
+
+    status = IPv6ToBleListenDeliverPacket(layerData,
+                                          ipHeaderSize,
+                                          &metadata
+                                          );
+    if (NT_SUCCESS(status))
     {
-        goto Exit;
+        IPV6_TO_BLE_STATISTICS_INCREMENT(classifyDelivered[INBOUND]);
+        IPV6_TO_BLE_PACKET_TRACE(INBOUND, IPV6_TO_BLE_DECISION_DELIVERED, &packetInfo, status);
     }
-
-    if (outputBufferLength > 1280)
+    else
     {
-
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CLASSIFY_INBOUND_IP_PACKET_V6, "Packet is too large; it must be no larger than 1280 octets for Bluetooth MTU");
-
-        goto Exit;
+        IPV6_TO_BLE_STATISTICS_INCREMENT(classifyDroppedNoListener[INBOUND]);
+        IPV6_TO_BLE_PACKET_TRACE(INBOUND, IPV6_TO_BLE_DECISION_DROP_NO_LISTENER, &packetInfo, status);
+        TraceDataPath(TRACE_LEVEL_ERROR, TRACE_CLASSIFY_INBOUND_IP_PACKET_V6, "Packet could not be delivered to the packet processing app, %!STATUS!", status);
     }
 
-    bytesTransferred = outputBufferLength;
+    NT_ASSERT(irql == KeGetCurrentIrql());
 
 Exit:
 
-    if (requestRetrieved)
-    {
-        WdfRequestCompleteWithInformation(outRequest, status, bytesTransferred);
-    }
-
     //
     // Always set these variables upon exiting; the callout must either block
     // or permit.
@@ -344,7 +412,7 @@ Exit:
     classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
     classifyOut->flags |= FWPS_CLASSIFY_OUT_FLAG_ABSORB;
 
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CLASSIFY_INBOUND_IP_PACKET_V6, "%!FUNC! Exit");
+    TraceDataPath(TRACE_LEVEL_INFORMATION, TRACE_CLASSIFY_INBOUND_IP_PACKET_V6, "%!FUNC! Exit");
 
     return;
 }
@@ -399,28 +467,26 @@ Routine Description:
     it filters based on the white list, then compares to the mesh list to make
     a determination to permit or block.
 
+    The checks in steps 1 to 3 below are made by the platform-neutral
+    classify core in ClassifyCore.c; this function gathers what the core
+    needs from WFP and carries out its decision.
+
 Procedures for outgoing traffic:
 
      1. Verify the classifyFn callback has rights to alter the classify and
          didn't inspect the packet itself earlier.
-     2. If on the border router device, inspect the destination address to
-         verify if the packet is intended for a mesh device. If it is not,
-         permit. If it is, continue.
-     3. Try to retrieve a WDFREQUEST from the listening queue. If
-         unsuccessful, that means the packet processing app is not running
-         so the entire solution won't work. Or, the provided output buffer
-         wasn't big enough to hold the paket. Block.     
-     4. Verify the packet is a UDP datagram packet by examining the size of
-         the transport header (UDP is 8 bytes). If it is a TCP segment,
-         block. 
-     5. Verify the data is no larger than 1280 bytes (octets), the MTU for
-         Bluetooth. If it is larger, block. We do this by going ahead and
-         converting the packet to the usermode byte array; the conversion
-         function takes care of the IP header for us and reports the data
-         size.     
-     6. Put the converted byte array into the WDFREQUEST output buffer and 
-         complete the request.
-     7. Block/absorb the original packet.
+     2. Parse the IPv6 header once. If on the border router device, inspect
+         the destination address to verify if the packet is intended for a
+         mesh device. If it is not, permit. If it is, continue.
+     3. Verify the packet is a UDP datagram or TCP segment by examining
+         the next header field, and that it is no larger than 1280 bytes (octets),
+         the MTU for Bluetooth. If either check fails, block. A packet with
+         an extension header before its UDP or TCP header is blocked too,
+         and counted on its own.
+     4. Copy the packet into an outstanding listen request and complete it.
+         If no listen request is outstanding, hold a copy of the packet in
+         the bounded pend queue until the next one arrives (see Listen.c).
+     5. Block/absorb the original packet.
     
 
 Arguments:
@@ -434,7 +500,7 @@ Return Value:
 
 --*/
 {
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CLASSIFY_OUTBOUND_IP_PACKET_V6, "%!FUNC! Entry");
+    TraceDataPath(TRACE_LEVEL_INFORMATION, TRACE_CLASSIFY_OUTBOUND_IP_PACKET_V6, "%!FUNC! Entry");
 
     UNREFERENCED_PARAMETER(classifyContext);
     UNREFERENCED_PARAMETER(filter);
@@ -447,16 +513,18 @@ Return Value:
 #endif // DBG
 
     
-    BYTE* outputBuffer = 0;
-    
-    WDFREQUEST outRequest = NULL;
-    BOOLEAN requestRetrieved = FALSE;   
-    ULONG_PTR bytesTransferred = 0;
+    IPV6_PACKET_INFO packetInfo;
 
-    UINT32 transportHeaderSize = inMetaValues->transportHeaderSize;
+    IPV6_TO_BLE_PACKET_METADATA metadata;
 
     FWPS_PACKET_INJECTION_STATE packetState;
 
+    PIPV6_PACKET_INFO parsedPacketInfo = NULL;
+
+    UINT8 coreFlags = gBorderRouterFlag ? CLASSIFY_CORE_FLAG_BORDER_ROUTER : 0;
+
+    UINT8 decision;
+
     //
     // Step 1
     // Verify rights to alter the classify and check if we previously injected
@@ -464,7 +532,9 @@ Return Value:
     //
     if ((classifyOut->rights & FWPS_RIGHT_ACTION_WRITE) == 0)
     {
-        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CLASSIFY_OUTBOUND_IP_PACKET_V6, "No rights to alter the classify during %!FUNC!");
+        IPV6_TO_BLE_STATISTICS_INCREMENT(classifyNoRights[OUTBOUND]);
+        IPV6_TO_BLE_PACKET_TRACE(OUTBOUND, IPV6_TO_BLE_DECISION_NO_RIGHTS, NULL, status);
+        TraceDataPath(TRACE_LEVEL_INFORMATION, TRACE_CLASSIFY_OUTBOUND_IP_PACKET_V6, "No rights to alter the classify during %!FUNC!");
 
         return;
     }
@@ -472,8 +542,8 @@ Return Value:
     NT_ASSERT(layerData);
     _Analysis_assume_(layerData);
 
-    // Check to make sure we don't try to re-inspect packets we inspected
-    // earlier; permit and clear the write permissions flag if so
+    // Note whether we injected the packet earlier, so we don't re-inspect
+    // it, and whether it is loopback traffic, which we ignore
     packetState = FwpsQueryPacketInjectionState0(gInjectionHandleNetwork,
                                                  layerData,
                                                  NULL
@@ -481,215 +551,144 @@ Return Value:
     if ((packetState == FWPS_PACKET_INJECTED_BY_SELF) ||
         (packetState == FWPS_PACKET_PREVIOUSLY_INJECTED_BY_SELF))
     {
-        classifyOut->actionType = FWP_ACTION_PERMIT;
-        if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
-        {
-            classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
-        }
-
-        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CLASSIFY_OUTBOUND_IP_PACKET_V6, "Packet was injected by self earlier");
-
-        return;
+        coreFlags |= CLASSIFY_CORE_FLAG_INJECTED;
     }
 
-    // Check for loopback packets and ignore them
     if (inFixedValues)
     {
-        FWP_DATA_TYPE valueType = inFixedValues->incomingValue->value.type;
+        FWP_DATA_TYPE valueType = inFixedValues->incomingValue[FWPS_FIELD_OUTBOUND_IPPACKET_V6_FLAGS].value.type;
         if (valueType == FWP_UINT32)
         {
-            UINT32 flags = inFixedValues->incomingValue->value.uint32;
+            UINT32 flags = inFixedValues->incomingValue[FWPS_FIELD_OUTBOUND_IPPACKET_V6_FLAGS].value.uint32;
             if (flags & FWP_CONDITION_FLAG_IS_LOOPBACK)
             {
-                classifyOut->actionType = FWP_ACTION_PERMIT;
-                if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
-                {
-                    classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
-                }
-
-                TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CLASSIFY_OUTBOUND_IP_PACKET_V6, "Permitting loopback packet.");
-
-                return;
+                coreFlags |= CLASSIFY_CORE_FLAG_LOOPBACK;
             }
         }
     }
 
     //
     // Step 2
-    // Verify the destination if on the border router.
-    // 
-    // If the packet is intended for a mesh device, continue with the rest of
-    // the function and pass the packet to the usermode packet processing app.
-    //
-    // If the packet is not intended for a mesh device, permit it as it must
-    // be normal traffic destined elsewhere.
+    // Parse the IP header once, unless the packet is going to be permitted
+    // without looking at it. On the outbound IP_PACKET layer, the NBL
+    // is positioned at the BEGINNING of the IP header, so the offset is 0.
     //
+    if (!(coreFlags & (CLASSIFY_CORE_FLAG_INJECTED | CLASSIFY_CORE_FLAG_LOOPBACK)))
+    {
+        status = IPv6ToBleNBLParseIpv6Header(layerData,
+                                             0,
+                                             &packetInfo
+                                             );
+        if (NT_SUCCESS(status))
+        {
+            parsedPacketInfo = &packetInfo;
+        }
+        else
+        {
+            TraceDataPath(TRACE_LEVEL_ERROR, TRACE_CLASSIFY_OUTBOUND_IP_PACKET_V6, "Parsing IPv6 header failed during %!FUNC! with %!STATUS!", status);
+        }
+    }
 
-	if (gBorderRouterFlag)
-	{
-		// Extract the destination address from the IP header by retreating 16
-		// bytes (as it is at the end of the IPv6 header)
-		UINT8 extractedAddress[16] = { 0 };
-		NDIS_STATUS ndisStatus = NDIS_STATUS_SUCCESS;
-		ndisStatus = NdisRetreatNetBufferListDataStart(layerData,
-													   (sizeof(BYTE) * 16),
-													   0,
-													   NULL,
-													   NULL
-													   );
-		if (ndisStatus != NDIS_STATUS_SUCCESS)
-		{
-			classifyOut->actionType = FWP_ACTION_PERMIT;
-			if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
-			{
-				classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
-			}
-
-			TraceEvents(TRACE_LEVEL_ERROR, TRACE_CLASSIFY_OUTBOUND_IP_PACKET_V6, "Retreating NBL failed during %!FUNC! with %!STATUS!, permitting packet", status);
+    //
+    // Step 3
+    // Decide what to do with the packet (see ClassifyCore.c). Packets that
+    // aren't for the mesh are permitted. Packets for the mesh that aren't
+    // UDP or TCP directly after the fixed header, or are larger than the
+    // Bluetooth MTU, are dropped before taking a listen request or pend
+    // queue slot.
+    //
+    decision = IPv6ToBleClassifyCoreDecide(parsedPacketInfo,
+                                           OUTBOUND,
+                                           coreFlags
+                                           );
+    switch (decision)
+    {
+        case CLASSIFY_CORE_DECISION_DELIVER:
+            break;
 
-			return;
-		}
+        case CLASSIFY_CORE_DECISION_DROP_NOT_UDP:
+            IPV6_TO_BLE_STATISTICS_INCREMENT(classifyDroppedNotUdp[OUTBOUND]);
+            IPV6_TO_BLE_PACKET_TRACE(OUTBOUND, decision, &packetInfo, status);
+            TraceDataPath(TRACE_LEVEL_ERROR, TRACE_CLASSIFY_OUTBOUND_IP_PACKET_V6, "Packet is not a UDP or TCP packet, next header is %d when it should be %d or %d", packetInfo.nextHeader, IPPROTO_UDP, IPPROTO_TCP);
 
-		// Copy the destination address
-		RtlCopyMemory(extractedAddress, layerData, IPV6_ADDRESS_LENGTH);
+            goto Exit;
 
-		// Advance back to the end of the IP header if the retreat operation
-		// succeeded
-		NdisAdvanceNetBufferListDataStart(layerData,
-										  (sizeof(BYTE) * 16),
-										  FALSE,
-										  NULL
-										  );
+        case CLASSIFY_CORE_DECISION_DROP_EXTENSION_HEADER:
+            IPV6_TO_BLE_STATISTICS_INCREMENT(classifyDroppedExtensionHeader[OUTBOUND]);
+            IPV6_TO_BLE_PACKET_TRACE(OUTBOUND, decision, &packetInfo, status);
+            TraceDataPath(TRACE_LEVEL_ERROR, TRACE_CLASSIFY_OUTBOUND_IP_PACKET_V6, "Packet has extension header %d after the fixed header; only UDP or TCP directly after it is carried", packetInfo.nextHeader);
 
-		BOOLEAN isInMeshList = FALSE;
+            goto Exit;
 
-		// Compare each address in the mesh list to the destination address
-		PLIST_ENTRY entry = gMeshListHead->Flink;
-		while (entry != gMeshListHead)
-		{
-			PMESH_LIST_ENTRY meshListEntry = CONTAINING_RECORD(entry,
-															   MESH_LIST_ENTRY,
-															   listEntry
-															   );
-			// Compare the extracted address to this entry's address
-			if (RtlEqualMemory(extractedAddress,
-				&meshListEntry->ipv6Address,
-				IPV6_ADDRESS_LENGTH))
-			{
-				// It is in the mesh list!
-				isInMeshList = TRUE;
-				break;
-			}
+        case CLASSIFY_CORE_DECISION_DROP_TOO_LARGE:
+            IPV6_TO_BLE_STATISTICS_INCREMENT(classifyDroppedTooLarge[OUTBOUND]);
+            IPV6_TO_BLE_PACKET_TRACE(OUTBOUND, decision, &packetInfo, status);
+            TraceDataPath(TRACE_LEVEL_ERROR, TRACE_CLASSIFY_OUTBOUND_IP_PACKET_V6, "Packet is too large; it must be no larger than 1280 octets for Bluetooth MTU");
 
-			// Advance the list
-			entry = entry->Flink;
-		}
+            goto Exit;
 
-		// Permit the packet if it wasn't in the mesh list, as that means the
-		// packet is destined elsewhere (normal traffic)
-		if (!isInMeshList)
-		{
-			classifyOut->actionType = FWP_ACTION_PERMIT;
-			if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
-			{
-				classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
-			}
+        default:
+            classifyOut->actionType = FWP_ACTION_PERMIT;
+            if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
+            {
+                classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+            }
 
-			TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CLASSIFY_OUTBOUND_IP_PACKET_V6, "Packet was not destined for a device in the mesh; must be destined elsewhere");
+            IPV6_TO_BLE_STATISTICS_INCREMENT(classifyPermitted[OUTBOUND]);
+            IPV6_TO_BLE_PACKET_TRACE(OUTBOUND, decision, parsedPacketInfo, status);
+            TraceDataPath(TRACE_LEVEL_INFORMATION, TRACE_CLASSIFY_OUTBOUND_IP_PACKET_V6, "Permitting packet, decision %d", decision);
 
-			return;
-		}
-	}        
+            return;
+    }
 
-    //
-    // Step 3
-    // Verify the packet is a UDP packet by checking the transport header size
-    // (should be 8 bytes)
-    //    
-    if (transportHeaderSize > 8)
+    // Drop the packet if its destination is over its shaping rate, so a
+    // busy host can't use up the mesh's airtime. See Shaping.c.
+    if (!IPV6_TO_BLE_SHAPING_ADMIT(&packetInfo))
     {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CLASSIFY_OUTBOUND_IP_PACKET_V6, "Packet is not a UDP packet, transport header size is %d when it should be 8", transportHeaderSize);
+        IPV6_TO_BLE_STATISTICS_INCREMENT(classifyDroppedOverRate);
+        IPV6_TO_BLE_PACKET_TRACE(OUTBOUND, IPV6_TO_BLE_DECISION_DROP_OVER_RATE, &packetInfo, status);
+        TraceDataPath(TRACE_LEVEL_WARNING, TRACE_CLASSIFY_OUTBOUND_IP_PACKET_V6, "Packet destination is over its shaping rate; dropping");
 
         goto Exit;
-    }   
+    }
 
     //
     // Step 4
-    // Attempt to retrieve a WDFREQUEST from the listen request queue in the
-    // device context, then retrieve its output buffer.
-    //    
-
-    // Retrieve the output buffer. It should be large enough to hold the MTU of
-    // 1280 bytes because the EvtIoControl callback verifies that before even
-    // adding the request to the listening queue.      
-    WdfSpinLockAcquire(gListenRequestQueueLock);
-    status = WdfIoQueueRetrieveNextRequest(gListenRequestQueue,
-                                           &outRequest
-                                           );
-    WdfSpinLockRelease(gListenRequestQueueLock);
-    if (!NT_SUCCESS(status))
-    {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CLASSIFY_OUTBOUND_IP_PACKET_V6, "Retrieving request to listen for outbound IPv6 packets failed %!STATUS!", status);
-        goto Exit;
-    }
-
-    NT_ASSERT(irql == KeGetCurrentIrql());
-    requestRetrieved = TRUE;
-
-    // Retrieve the output buffer
-    size_t outputBufferLength = 0;
-    status = WdfRequestRetrieveOutputBuffer(outRequest,
-                                            sizeof(BYTE) * 48,  // Min 48 bytes
-                                            (PVOID*)&outputBuffer,
-                                            &outputBufferLength
-                                            );
-    if (!NT_SUCCESS(status))
-    {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CLASSIFY_OUTBOUND_IP_PACKET_V6, "Retrieving output buffer from WDFREQUEST failed during %!FUNC! with %!STATUS!", status);
-        goto Exit;
-    }
-
+    // Hand the packet, including the IP header, to the packet processing
+    // app along with its metadata. This completes an outstanding listen
+    // request if there is one, or holds the packet in the pend queue until
+    // the next one arrives.
     //
-    // Step 5
-    // Verify the NBL is no larger than 1280 bytes (octects), the maximum MTU
-    // for Bluetooth. This includes the IP header. 
-    //
-    // We can acquire the size by going ahead and converting the NBL to the 
-    // byte array, as this function reports the size to us.
-    //
-    // We can then use this size to also verify the request output buffer is
-    // big enough in the next step.
-    //
-    status = IPv6ToBleNBLCopyToBuffer(layerData,
-                                      0, // On outbound IP_PACKET
-                                         // layer, NBL is positioned
-                                         // at the BEGINNING of the
-                                         // IP header. So this is 0.
-                                      outputBuffer,
-                                      (UINT32*)&outputBufferLength
-                                      );
-    if (!NT_SUCCESS(status))
+    IPv6ToBleCalloutFillMetadata(inFixedValues,
+                                 inMetaValues,
+                                 &packetInfo,
+                                 OUTBOUND,
+                                 &metadata
+                                 );
+
+    status = IPv6ToBleListenDeliverPacket(layerData,
+                                          0, // On outbound IP_PACKET
+                                             // layer, NBL is positioned
+                                             // at the BEGINNING of the
+                                             // IP header. So this is 0.
+                                          &metadata
+                                          );
+    if (NT_SUCCESS(status))
     {
-        goto Exit;
+        IPV6_TO_BLE_STATISTICS_INCREMENT(classifyDelivered[OUTBOUND]);
+        IPV6_TO_BLE_PACKET_TRACE(OUTBOUND, IPV6_TO_BLE_DECISION_DELIVERED, &packetInfo, status);
     }
-
-    if (outputBufferLength > 1280)
+    else
     {
-
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CLASSIFY_OUTBOUND_IP_PACKET_V6, "Packet is too large; it must be no larger than 1280 octets for Bluetooth MTU");
-        
-        goto Exit;
+        IPV6_TO_BLE_STATISTICS_INCREMENT(classifyDroppedNoListener[OUTBOUND]);
+        IPV6_TO_BLE_PACKET_TRACE(OUTBOUND, IPV6_TO_BLE_DECISION_DROP_NO_LISTENER, &packetInfo, status);
+        TraceDataPath(TRACE_LEVEL_ERROR, TRACE_CLASSIFY_OUTBOUND_IP_PACKET_V6, "Packet could not be delivered to the packet processing app, %!STATUS!", status);
     }
 
-    bytesTransferred = outputBufferLength;
+    NT_ASSERT(irql == KeGetCurrentIrql());
 
 Exit:
 
-    if (requestRetrieved)
-    {
-        WdfRequestCompleteWithInformation(outRequest, status, bytesTransferred);
-    }
-
     //
     // Always set these variables upon exiting; the callout must either block
     // or permit.
@@ -698,7 +697,7 @@ Exit:
     classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
     classifyOut->flags |= FWPS_CLASSIFY_OUT_FLAG_ABSORB;
 
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CLASSIFY_OUTBOUND_IP_PACKET_V6, "%!FUNC! Exit");
+    TraceDataPath(TRACE_LEVEL_INFORMATION, TRACE_CLASSIFY_OUTBOUND_IP_PACKET_V6, "%!FUNC! Exit");
 
     return;
 }
@@ -918,6 +917,11 @@ Exit:
             FwpmEngineClose0(gFilterEngineHandle);
             gFilterEngineHandle = NULL;
         }
+        if (gBorderRouterFlag)
+        {
+            IPv6ToBleCalloutFilterGroupsFree(WHITE_LIST);
+            IPv6ToBleCalloutFilterGroupsFree(MESH_LIST);
+        }
     }
     else
     {
@@ -1017,36 +1021,9 @@ Return Value:
 
     //
     // Step 3
-    // Add a filter for each entry in the white list
+    // Add a filter for each /64 prefix in the white list
     //
-
-    // Traverse the list and add a filter for each entry
-    PLIST_ENTRY entry = gWhiteListHead->Flink;
-    while (entry != gWhiteListHead)
-    {
-        PWHITE_LIST_ENTRY whiteListEntry = CONTAINING_RECORD(entry,
-                                                             WHITE_LIST_ENTRY,
-                                                             listEntry
-                                                             );
-        UINT8* remoteAddress = whiteListEntry->ipv6Address.u.Byte;
-
-        // Add the filter
-        status = IPv6ToBleCalloutFilterAdd(L"Inbound IPv6 packet filter",
-            L"A filter to match packets if source is from the white list. \
-            There are as many filters as there are white list entries.",
-            remoteAddress,
-            INBOUND,
-            layerKey,
-            calloutKey
-        );
-        if (!NT_SUCCESS(status))
-        {
-            break;
-        }
-
-        // Advance the list
-        entry = entry->Flink;
-    }
+    status = IPv6ToBleCalloutFilterGroupsBuild(WHITE_LIST);
 
 Exit:
 
@@ -1077,7 +1054,7 @@ Routine Description:
 
     This function registers the callout at the outbound IP_PACKET_V6 layer and
     adds the filter. This callout and its accompanying filter are designed to
-    catch all outbound IPv6 UDP traffic on the Pi/IoT device. On the border
+    catch all outbound IPv6 UDP and TCP traffic on the Pi/IoT device. On the border
     router, it is designed to catch outbound traffic destined for a device
     in the mesh.
 
@@ -1154,39 +1131,13 @@ Return Value:
 
     //
     // Step 3
-    // Add the filter - one for each entry in the white list if on the border
-    // router, or just one for the nodes
+    // Add the filter - one for each /64 prefix in the mesh list if on the
+    // border router, or just one for the nodes
     //
 
 	if (gBorderRouterFlag)
 	{
-		// Traverse the list and add a filter for each entry
-		PLIST_ENTRY entry = gMeshListHead->Flink;
-		while (entry != gMeshListHead)
-		{
-			PMESH_LIST_ENTRY meshListEntry = CONTAINING_RECORD(entry,
-				MESH_LIST_ENTRY,
-				listEntry
-			);
-			UINT8* destinationAddress = meshListEntry->ipv6Address.u.Byte;
-
-			// Add the filter
-			status = IPv6ToBleCalloutFilterAdd(L"Outbound IPv6 packet filter",
-				L"A filter to match packets if destination is in mesh list. \
-				There are as many filters as there are mesh list entries.",
-				destinationAddress,
-				OUTBOUND,
-				layerKey,
-				calloutKey
-			);
-			if (!NT_SUCCESS(status))
-			{
-				break;
-			}
-
-			// Advance the list
-			entry = entry->Flink;
-		}
+		status = IPv6ToBleCalloutFilterGroupsBuild(MESH_LIST);
 	}
 	else
 	{
@@ -1195,9 +1146,11 @@ Return Value:
 										   L"A filter to match all outbound IPv6 UDP traffic and redirect to the \
 										   usermode packet processing app, which sends it out over BLE.",
 										   NULL,
+										   0,
 										   OUTBOUND,
 										   layerKey,
-										   calloutKey
+										   calloutKey,
+										   NULL
 										   );
 	}
 
@@ -1224,9 +1177,11 @@ IPv6ToBleCalloutFilterAdd(
     wchar_t *	    filterName,
     wchar_t *	    filterDesc,
     const UINT8*	ipv6Address,
+    UINT8           prefixLength,
     int             direction,
     const GUID *	layerKey,
-    const GUID *	calloutKey
+    const GUID *	calloutKey,
+    UINT64*         filterId
 )
 /*++
 Routine Description:
@@ -1234,10 +1189,12 @@ Routine Description:
     Adds a filter to the filter engine.
 
     For the gateway device, this is called for each filter, of which there are
-    as many as there are white list entries.
+    as many as there are /64 prefixes among the runtime list entries (see
+    IPv6ToBleCalloutFilterGroupsBuild).
 
     For the Pi/IoT device, this is called once. The outbound IP packet classify
-    catches all traffic and so only has one filter with no conditions.
+    catches all non-loopback traffic and so only has one filter, with no
+    address condition.
 
 Arguments:
 
@@ -1245,12 +1202,18 @@ Arguments:
 
     filterDesc - the description of the filter in human-readable form.
 
-    remoteAddr - the remote address to use in this filter (if applicable).
+    ipv6Address - the remote address to use in this filter (if applicable).
+
+    prefixLength - how many leading bits of ipv6Address the filter matches.
+    128 matches the exact address.
 
     layerKey - the GUID for the layer at which we are adding the filter
 
     calloutKey - the GUID for the callout associated with this filter
 
+    filterId - optionally receives the runtime ID of the new filter, so it
+    can later be deleted on its own
+
 Return Value:
 
     STATUS_SUCCESS if the callout driver successfully registers its filter.
@@ -1323,61 +1286,74 @@ Return Value:
 
     //
     // Step 3
-    // Create the filtering condition based on the passed in IPv6 address.
+    // Create the filtering conditions.
+    //
+    // Every filter excludes loopback traffic, so the filter engine doesn't
+    // call the classifyFn for packets it would only permit anyway.
+    //
+    // On the gateway machine, each filter also matches a runtime list
+    // address or prefix: the source for inbound (white list) and the
+    // destination for outbound (mesh list). The Pi/IoT devices have no
+    // address condition and thus filter all other outbound traffic.
     //
-    // Note:
-    // This is only for the gateway machine, since the Pi/IoT devices will 
-    // have 0 filter conditions and thus will filter all outbound traffic.
-    //	
+    // Note: the IP_PACKET layers don't offer the IP protocol as a filtering
+    // condition, and there is no condition for packets we injected
+    // ourselves, so the classifyFn still checks both of those.
+    //
+    FWPM_FILTER_CONDITION0 filterConditions[2] = { 0 };
+    UINT32 numFilterConditions = 0;
+
+    // Must stay in scope until the filter is added
+    FWP_V6_ADDR_AND_MASK addressAndMask = { 0 };
+
+    filterConditions[numFilterConditions].fieldKey = FWPM_CONDITION_FLAGS;
+    filterConditions[numFilterConditions].matchType = FWP_MATCH_FLAGS_NONE_SET;
+    filterConditions[numFilterConditions].conditionValue.type = FWP_UINT32;
+    filterConditions[numFilterConditions].conditionValue.uint32 =
+        FWP_CONDITION_FLAG_IS_LOOPBACK;
+    numFilterConditions++;
 
 	if (gBorderRouterFlag)
 	{
-		FWPM_FILTER_CONDITION0 filterCondition = { 0 };
-
 		// This should never be null because this function only would have been
 		// called after verifying the runtime list had at least one entry, but  
 		// check for good practice. At least, on the border router machine.
 		if (ipv6Address)
 		{
-			if (direction == INBOUND)
+			// The IP_PACKET layers expose the remote address in both
+			// directions: the source for inbound and the destination for
+			// outbound
+			filterConditions[numFilterConditions].fieldKey = 
+				FWPM_CONDITION_IP_REMOTE_ADDRESS;
+			filterConditions[numFilterConditions].matchType = FWP_MATCH_EQUAL;
+
+			if (prefixLength >= 128)
 			{
-				filterCondition.fieldKey = FWPM_CONDITION_IP_REMOTE_ADDRESS;
-				filterCondition.matchType = FWP_MATCH_EQUAL;
-				filterCondition.conditionValue.type = FWP_BYTE_ARRAY16_TYPE;
-				filterCondition.conditionValue.byteArray16 =
+				filterConditions[numFilterConditions].conditionValue.type = 
+					FWP_BYTE_ARRAY16_TYPE;
+				filterConditions[numFilterConditions].conditionValue.byteArray16 =
 					(FWP_BYTE_ARRAY16*)ipv6Address;
 			}
-			else    // OUTBOUND
+			else
 			{
-				filterCondition.fieldKey = FWPM_CONDITION_IP_DESTINATION_ADDRESS;
-				filterCondition.matchType = FWP_MATCH_EQUAL;
-				filterCondition.conditionValue.type = FWP_BYTE_ARRAY16_TYPE;
-				filterCondition.conditionValue.byteArray16 =
-					(FWP_BYTE_ARRAY16*)ipv6Address;
+				RtlCopyMemory(addressAndMask.addr,
+							  ipv6Address,
+							  IPV6_ADDRESS_LENGTH
+							  );
+				addressAndMask.prefixLength = prefixLength;
+
+				filterConditions[numFilterConditions].conditionValue.type = 
+					FWP_V6_ADDR_MASK;
+				filterConditions[numFilterConditions].conditionValue.v6AddrMask =
+					&addressAndMask;
 			}
+			numFilterConditions++;
 		}
-
-		// Add the filter condition to the filter
-		filter.filterCondition = &filterCondition;
 	}
-	else
-	{
-        // For the non-border router, this will shunt ALL IPv6 outbound traffic
-        // to the callout
 
-        FWPM_FILTER_CONDITION0 filterCondition = { 0 };
-
-        filterCondition.fieldKey = FWPM_CONDITION_IP_DESTINATION_ADDRESS;
-        filterCondition.matchType = FWP_MATCH_EQUAL;
-        filterCondition.conditionValue.type = FWP_V6_ADDR_MASK;
-
-        // Zeroing out the address and mask ensures that ALL traffic is affected
-        FWP_V6_ADDR_AND_MASK localAddressAndMask = { 0 };
-        filterCondition.conditionValue.v6AddrMask = &localAddressAndMask;
-
-        // Add the filter condition to the filter
-        filter.filterCondition = &filterCondition;
-	}
+    // Add the filter conditions to the filter
+    filter.filterCondition = filterConditions;
+    filter.numFilterConditions = numFilterConditions;
 
     //
     // Step 4
@@ -1386,7 +1362,7 @@ Return Value:
     status = FwpmFilterAdd0(gFilterEngineHandle,
                             &filter,
                             NULL,
-                            NULL
+                            filterId
                             );
     if (!NT_SUCCESS(status))
     {
@@ -1405,35 +1381,765 @@ Return Value:
     return status;
 }
 
+//
+// Finds the group in a list of filter prefix groups whose /64 prefix matches
+// an address, or returns NULL if none does
+//
+static
+PFILTER_PREFIX_GROUP
+IPv6ToBleCalloutFilterGroupFindIn(
+    _In_    PLIST_ENTRY     groupsHead,
+    _In_    const IN6_ADDR* ipv6Address
+)
+{
+    for (PLIST_ENTRY entry = groupsHead->Flink;
+         entry != groupsHead;
+         entry = entry->Flink)
+    {
+        PFILTER_PREFIX_GROUP group = CONTAINING_RECORD(entry,
+                                                       FILTER_PREFIX_GROUP,
+                                                       listEntry
+                                                       );
+        if (RtlEqualMemory(&group->prefix,
+                           ipv6Address,
+                           FILTER_GROUP_PREFIX_LENGTH / 8))
+        {
+            return group;
+        }
+    }
+
+    return NULL;
+}
+
 _Use_decl_annotations_
-VOID
-IPv6ToBleCalloutsUnregister()
+PFILTER_PREFIX_GROUP
+IPv6ToBleCalloutFilterGroupFind(
+    ULONG           TargetList,
+    const IN6_ADDR* ipv6Address
+)
 /*++
 Routine Description:
 
-    Unregisters the inbound IPV6 packet callout. This can be called either
-    during driver unload or by the functions that add/remove entries from
-    the white list and mesh list.
+    Finds the filter prefix group that covers an address, if there is one.
 
-    The functions to add and remove entries from the white list and mesh list
-    only call this function if the callouts are currently registered. Driver
-    unload means the driver is unloading so the results of this function aren't
-    particularly important. Therefore, we don't need to check the NTSTATUS
-    that FwpsCalloutUnregisterById0 returns (the samples don't, either).
+    The caller must hold gRuntimeListWriteLock.
 
 Arguments:
 
-    None.
+    TargetList - the runtime list whose groups to search.
+
+    ipv6Address - the address to look for.
 
 Return Value:
 
-    VOID.
+    The group whose /64 prefix matches the address, or NULL if none does.
 
----*/
+--*/
 {
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CALLOUT_REGISTRATION, "%!FUNC! Entry");
+    return IPv6ToBleCalloutFilterGroupFindIn((TargetList == WHITE_LIST) ? 
+                                             &gWhiteListFilterGroups : 
+                                             &gMeshListFilterGroups,
+                                             ipv6Address
+                                             );
+}
 
-    NTSTATUS status = STATUS_SUCCESS;
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleCalloutFilterGroupAddFilter(
+    ULONG                   TargetList,
+    PFILTER_PREFIX_GROUP    group
+)
+/*++
+Routine Description:
+
+    Adds the filter for one filter prefix group. White list groups get an
+    inbound filter on the source and mesh list groups get an outbound filter
+    on the destination.
+
+    The caller must be in a transaction with the filter engine.
+
+Arguments:
+
+    TargetList - the runtime list the group belongs to.
+
+    group - the group; receives the runtime ID of its filter.
+
+Return Value:
+
+    STATUS_SUCCESS if successful, appropriate NTSTATUS error codes otherwise.
+
+--*/
+{
+    if (TargetList == WHITE_LIST)
+    {
+        return IPv6ToBleCalloutFilterAdd(L"Inbound IPv6 packet filter",
+            L"A filter to match packets if source is in a /64 prefix of the \
+            white list. There is one filter per white list prefix.",
+            group->prefix.u.Byte,
+            FILTER_GROUP_PREFIX_LENGTH,
+            INBOUND,
+            &FWPM_LAYER_INBOUND_IPPACKET_V6,
+            &IPV6_TO_BLE_INBOUND_IP_PACKET_V6,
+            &group->filterId
+        );
+    }
+    else
+    {
+        return IPv6ToBleCalloutFilterAdd(L"Outbound IPv6 packet filter",
+            L"A filter to match packets if destination is in a /64 prefix of \
+            the mesh list. There is one filter per mesh list prefix.",
+            group->prefix.u.Byte,
+            FILTER_GROUP_PREFIX_LENGTH,
+            OUTBOUND,
+            &FWPM_LAYER_OUTBOUND_IPPACKET_V6,
+            &IPV6_TO_BLE_OUTBOUND_IP_PACKET_V6,
+            &group->filterId
+        );
+    }
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleCalloutFilterGroupsBuild(
+    ULONG   TargetList
+)
+/*++
+Routine Description:
+
+    Compacts a runtime list into filter prefix groups, one per distinct /64
+    prefix among its entries, and adds one filter for each group.
+
+    Mesh devices derive their addresses from a shared prefix, so a whole mesh
+    usually collapses into a single filter. Because a group's filter also
+    matches addresses under the prefix that aren't in the list, the classify
+    callouts verify the exact address against the list snapshot.
+
+    This is called while registering the callouts, inside the registration
+    transaction. The caller must hold gRuntimeListWriteLock (or be loading
+    the lists during driver initialization).
+
+Arguments:
+
+    TargetList - the runtime list to compact.
+
+Return Value:
+
+    STATUS_SUCCESS if successful, appropriate NTSTATUS error codes otherwise.
+    On failure the caller is expected to abort the transaction and free the
+    groups.
+
+--*/
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CALLOUT_REGISTRATION, "%!FUNC! Entry");
+
+    NTSTATUS status = STATUS_SUCCESS;
+
+    PLIST_ENTRY listHead = (TargetList == WHITE_LIST) ? 
+                           gWhiteListHead : gMeshListHead;
+    PLIST_ENTRY groupsHead = (TargetList == WHITE_LIST) ? 
+                             &gWhiteListFilterGroups : &gMeshListFilterGroups;
+
+    //
+    // Step 1
+    // Sort every entry in the list into a group by its /64 prefix
+    //
+    for (PLIST_ENTRY entry = listHead->Flink;
+         entry != listHead;
+         entry = entry->Flink)
+    {
+        // The address is the first member of both entry types
+        const IN6_ADDR* ipv6Address = (TargetList == WHITE_LIST) ?
+            &CONTAINING_RECORD(entry, WHITE_LIST_ENTRY, listEntry)->ipv6Address :
+            &CONTAINING_RECORD(entry, MESH_LIST_ENTRY, listEntry)->ipv6Address;
+
+        PFILTER_PREFIX_GROUP group = IPv6ToBleCalloutFilterGroupFind(TargetList,
+                                                                     ipv6Address
+                                                                     );
+        if (!group)
+        {
+            group = (PFILTER_PREFIX_GROUP)ExAllocatePoolWithTag(
+                                                NonPagedPoolNx,
+                                                sizeof(FILTER_PREFIX_GROUP),
+                                                IPV6_TO_BLE_FILTER_GROUP_TAG
+                                                );
+            if (!group)
+            {
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                TraceEvents(TRACE_LEVEL_ERROR, TRACE_CALLOUT_REGISTRATION, "Filter group allocation failed during %!FUNC! with %!STATUS!", status);
+                goto Exit;
+            }
+
+            RtlZeroMemory(group, sizeof(FILTER_PREFIX_GROUP));
+            RtlCopyMemory(&group->prefix,
+                          ipv6Address,
+                          FILTER_GROUP_PREFIX_LENGTH / 8
+                          );
+            InsertTailList(groupsHead, &group->listEntry);
+        }
+
+        group->entryCount++;
+    }
+
+    //
+    // Step 2
+    // Add one filter per group
+    //
+    for (PLIST_ENTRY entry = groupsHead->Flink;
+         entry != groupsHead;
+         entry = entry->Flink)
+    {
+        PFILTER_PREFIX_GROUP group = CONTAINING_RECORD(entry,
+                                                       FILTER_PREFIX_GROUP,
+                                                       listEntry
+                                                       );
+
+        status = IPv6ToBleCalloutFilterGroupAddFilter(TargetList, group);
+        if (!NT_SUCCESS(status))
+        {
+            goto Exit;
+        }
+    }
+
+Exit:
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CALLOUT_REGISTRATION, "%!FUNC! Exit");
+
+    return status;
+}
+
+_Use_decl_annotations_
+VOID
+IPv6ToBleCalloutFilterGroupsFree(
+    ULONG   TargetList
+)
+/*++
+Routine Description:
+
+    Frees the filter prefix groups for a runtime list. This does not delete
+    their filters; it is called once the filter engine session that owns the
+    filters has been closed (or the transaction that added them aborted).
+
+Arguments:
+
+    TargetList - the runtime list whose groups to free.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PLIST_ENTRY groupsHead = (TargetList == WHITE_LIST) ? 
+                             &gWhiteListFilterGroups : &gMeshListFilterGroups;
+
+    while (!IsListEmpty(groupsHead))
+    {
+        PLIST_ENTRY entry = RemoveHeadList(groupsHead);
+        ExFreePoolWithTag(CONTAINING_RECORD(entry,
+                                            FILTER_PREFIX_GROUP,
+                                            listEntry
+                                            ),
+                          IPV6_TO_BLE_FILTER_GROUP_TAG
+                          );
+    }
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleCalloutFilterAddForListEntry(
+    ULONG           TargetList,
+    const IN6_ADDR* ipv6Address
+)
+/*++
+Routine Description:
+
+    Updates the filters for a single new runtime list entry on the border
+    router device.
+
+    If the entry's /64 prefix already has a group, the group's filter already
+    covers it and only the entry count changes. Otherwise a new group and its
+    filter are added in a single transaction with the filter engine.
+
+    This lets the runtime list functions keep the filters in step with the
+    lists one entry at a time, instead of tearing down and re-registering
+    the callouts (and every filter) whenever an entry is added.
+
+    The caller must hold gRuntimeListWriteLock and the callouts must be
+    registered.
+
+Arguments:
+
+    TargetList - the list the entry belongs to.
+
+    ipv6Address - the address of the new entry.
+
+Return Value:
+
+    STATUS_SUCCESS if successful, appropriate NTSTATUS error codes otherwise.
+
+--*/
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CALLOUT_REGISTRATION, "%!FUNC! Entry");
+
+    NTSTATUS status = STATUS_SUCCESS;
+    BOOLEAN inTransaction = FALSE;
+    PFILTER_PREFIX_GROUP newGroup = NULL;
+
+    if (!gCalloutsRegistered || !gFilterEngineHandle)
+    {
+        status = STATUS_INVALID_DEVICE_STATE;
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CALLOUT_REGISTRATION, "Callouts are not registered during %!FUNC! with %!STATUS!", status);
+        goto Exit;
+    }
+
+    //
+    // Step 1
+    // If an existing group covers the address, just count the new entry
+    //
+    PFILTER_PREFIX_GROUP group = IPv6ToBleCalloutFilterGroupFind(TargetList,
+                                                                 ipv6Address
+                                                                 );
+    if (group)
+    {
+        group->entryCount++;
+        goto Exit;
+    }
+
+    //
+    // Step 2
+    // Otherwise create a new group for the prefix
+    //
+    newGroup = (PFILTER_PREFIX_GROUP)ExAllocatePoolWithTag(
+                                        NonPagedPoolNx,
+                                        sizeof(FILTER_PREFIX_GROUP),
+                                        IPV6_TO_BLE_FILTER_GROUP_TAG
+                                        );
+    if (!newGroup)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CALLOUT_REGISTRATION, "Filter group allocation failed during %!FUNC! with %!STATUS!", status);
+        goto Exit;
+    }
+
+    RtlZeroMemory(newGroup, sizeof(FILTER_PREFIX_GROUP));
+    RtlCopyMemory(&newGroup->prefix,
+                  ipv6Address,
+                  FILTER_GROUP_PREFIX_LENGTH / 8
+                  );
+    newGroup->entryCount = 1;
+
+    //
+    // Step 3
+    // Add the group's filter in its own transaction
+    //
+    status = FwpmTransactionBegin0(gFilterEngineHandle, 0);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CALLOUT_REGISTRATION, "Beginning the transaction with the filter engine failed %!STATUS!", status);
+        goto Exit;
+    }
+    inTransaction = TRUE;
+
+    status = IPv6ToBleCalloutFilterGroupAddFilter(TargetList, newGroup);
+    if (!NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
+
+    status = FwpmTransactionCommit0(gFilterEngineHandle);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CALLOUT_REGISTRATION, "Committing the transaction to the filter engine failed %!STATUS!", status);
+        goto Exit;
+    }
+    inTransaction = FALSE;
+
+    InsertTailList((TargetList == WHITE_LIST) ? 
+                   &gWhiteListFilterGroups : &gMeshListFilterGroups,
+                   &newGroup->listEntry
+                   );
+    newGroup = NULL;
+
+Exit:
+
+    if (inTransaction)
+    {
+        FwpmTransactionAbort0(gFilterEngineHandle);
+        _Analysis_assume_lock_not_held_(gFilterEngineHandle);
+    }
+
+    if (newGroup)
+    {
+        ExFreePoolWithTag(newGroup, IPV6_TO_BLE_FILTER_GROUP_TAG);
+    }
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CALLOUT_REGISTRATION, "%!FUNC! Exit");
+
+    return status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleCalloutFilterDeleteForListEntry(
+    ULONG           TargetList,
+    const IN6_ADDR* ipv6Address
+)
+/*++
+Routine Description:
+
+    Updates the filters for a single runtime list entry that is being
+    removed. When the last entry under a /64 prefix goes away, the group's
+    filter is deleted in a single transaction with the filter engine.
+
+    The caller must hold gRuntimeListWriteLock.
+
+Arguments:
+
+    TargetList - the list the entry belongs to.
+
+    ipv6Address - the address of the entry being removed.
+
+Return Value:
+
+    STATUS_SUCCESS if successful, appropriate NTSTATUS error codes otherwise.
+
+--*/
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CALLOUT_REGISTRATION, "%!FUNC! Entry");
+
+    NTSTATUS status = STATUS_SUCCESS;
+    BOOLEAN inTransaction = FALSE;
+
+    if (!gCalloutsRegistered || !gFilterEngineHandle)
+    {
+        goto Exit;
+    }
+
+    //
+    // Step 1
+    // Find the group covering the address. If other entries still share its
+    // prefix, keep the filter.
+    //
+    PFILTER_PREFIX_GROUP group = IPv6ToBleCalloutFilterGroupFind(TargetList,
+                                                                 ipv6Address
+                                                                 );
+    if (!group)
+    {
+        goto Exit;
+    }
+
+    if (group->entryCount > 1)
+    {
+        group->entryCount--;
+        goto Exit;
+    }
+
+    //
+    // Step 2
+    // Delete the group's filter in its own transaction
+    //
+    status = FwpmTransactionBegin0(gFilterEngineHandle, 0);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CALLOUT_REGISTRATION, "Beginning the transaction with the filter engine failed %!STATUS!", status);
+        goto Exit;
+    }
+    inTransaction = TRUE;
+
+    status = FwpmFilterDeleteById0(gFilterEngineHandle, group->filterId);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CALLOUT_REGISTRATION, "Deleting filter %llu failed during %!FUNC! with %!STATUS!", group->filterId, status);
+        goto Exit;
+    }
+
+    status = FwpmTransactionCommit0(gFilterEngineHandle);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CALLOUT_REGISTRATION, "Committing the transaction to the filter engine failed %!STATUS!", status);
+        goto Exit;
+    }
+    inTransaction = FALSE;
+
+    //
+    // Step 3
+    // Free the now empty group
+    //
+    RemoveEntryList(&group->listEntry);
+    ExFreePoolWithTag(group, IPV6_TO_BLE_FILTER_GROUP_TAG);
+
+Exit:
+
+    if (inTransaction)
+    {
+        FwpmTransactionAbort0(gFilterEngineHandle);
+        _Analysis_assume_lock_not_held_(gFilterEngineHandle);
+    }
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CALLOUT_REGISTRATION, "%!FUNC! Exit");
+
+    return status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+IPv6ToBleCalloutFilterGroupsUpdate(
+    ULONG   TargetList
+)
+/*++
+Routine Description:
+
+    Brings the filters for a runtime list in line with the list after many
+    entries changed at once, such as after a bulk list change.
+
+    The list is compacted into a new set of filter prefix groups and compared
+    with the current groups. Filters are added for the /64 prefixes that are
+    new and deleted for the prefixes that are gone, all in a single
+    transaction with the filter engine; prefixes in both keep their filters.
+    Unlike unregistering and re-registering the callouts, this never leaves
+    a moment in which the list's traffic isn't matched.
+
+    The caller must hold gRuntimeListWriteLock and the callouts must be
+    registered.
+
+Arguments:
+
+    TargetList - the runtime list whose filters to update.
+
+Return Value:
+
+    STATUS_SUCCESS if successful, appropriate NTSTATUS error codes otherwise.
+    On failure the filters and groups are left as they were, so the caller
+    can fall back to re-registering the callouts.
+
+--*/
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CALLOUT_REGISTRATION, "%!FUNC! Entry");
+
+    NTSTATUS status = STATUS_SUCCESS;
+    BOOLEAN inTransaction = FALSE;
+    ULONG addedCount = 0;
+    ULONG deletedCount = 0;
+
+    PLIST_ENTRY listHead = (TargetList == WHITE_LIST) ? 
+                           gWhiteListHead : gMeshListHead;
+    PLIST_ENTRY groupsHead = (TargetList == WHITE_LIST) ? 
+                             &gWhiteListFilterGroups : &gMeshListFilterGroups;
+
+    // Groups for the list as it is now, and current groups whose prefix is
+    // still in the list
+    LIST_ENTRY newGroups;
+    LIST_ENTRY keptGroups;
+    InitializeListHead(&newGroups);
+    InitializeListHead(&keptGroups);
+
+    if (!gCalloutsRegistered || !gFilterEngineHandle)
+    {
+        status = STATUS_INVALID_DEVICE_STATE;
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CALLOUT_REGISTRATION, "Callouts are not registered during %!FUNC! with %!STATUS!", status);
+        goto Exit;
+    }
+
+    //
+    // Step 1
+    // Sort every entry in the list into a new group by its /64 prefix
+    //
+    for (PLIST_ENTRY entry = listHead->Flink;
+         entry != listHead;
+         entry = entry->Flink)
+    {
+        // The address is the first member of both entry types
+        const IN6_ADDR* ipv6Address = (TargetList == WHITE_LIST) ?
+            &CONTAINING_RECORD(entry, WHITE_LIST_ENTRY, listEntry)->ipv6Address :
+            &CONTAINING_RECORD(entry, MESH_LIST_ENTRY, listEntry)->ipv6Address;
+
+        PFILTER_PREFIX_GROUP group = IPv6ToBleCalloutFilterGroupFindIn(&newGroups,
+                                                                       ipv6Address
+                                                                       );
+        if (!group)
+        {
+            group = (PFILTER_PREFIX_GROUP)ExAllocatePoolWithTag(
+                                                NonPagedPoolNx,
+                                                sizeof(FILTER_PREFIX_GROUP),
+                                                IPV6_TO_BLE_FILTER_GROUP_TAG
+                                                );
+            if (!group)
+            {
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                TraceEvents(TRACE_LEVEL_ERROR, TRACE_CALLOUT_REGISTRATION, "Filter group allocation failed during %!FUNC! with %!STATUS!", status);
+                goto Exit;
+            }
+
+            RtlZeroMemory(group, sizeof(FILTER_PREFIX_GROUP));
+            RtlCopyMemory(&group->prefix,
+                          ipv6Address,
+                          FILTER_GROUP_PREFIX_LENGTH / 8
+                          );
+            InsertTailList(&newGroups, &group->listEntry);
+        }
+
+        group->entryCount++;
+    }
+
+    //
+    // Step 2
+    // In one transaction, give each new group the filter of the current
+    // group with the same prefix, or add a filter for it if there is none,
+    // then delete the filters of the current groups left over
+    //
+    status = FwpmTransactionBegin0(gFilterEngineHandle, 0);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CALLOUT_REGISTRATION, "Beginning the transaction with the filter engine failed %!STATUS!", status);
+        goto Exit;
+    }
+    inTransaction = TRUE;
+
+    for (PLIST_ENTRY entry = newGroups.Flink;
+         entry != &newGroups;
+         entry = entry->Flink)
+    {
+        PFILTER_PREFIX_GROUP group = CONTAINING_RECORD(entry,
+                                                       FILTER_PREFIX_GROUP,
+                                                       listEntry
+                                                       );
+
+        PFILTER_PREFIX_GROUP currentGroup = IPv6ToBleCalloutFilterGroupFindIn(groupsHead,
+                                                                              &group->prefix
+                                                                              );
+        if (currentGroup)
+        {
+            group->filterId = currentGroup->filterId;
+            RemoveEntryList(&currentGroup->listEntry);
+            InsertTailList(&keptGroups, &currentGroup->listEntry);
+            continue;
+        }
+
+        status = IPv6ToBleCalloutFilterGroupAddFilter(TargetList, group);
+        if (!NT_SUCCESS(status))
+        {
+            goto Exit;
+        }
+        addedCount++;
+    }
+
+    for (PLIST_ENTRY entry = groupsHead->Flink;
+         entry != groupsHead;
+         entry = entry->Flink)
+    {
+        PFILTER_PREFIX_GROUP group = CONTAINING_RECORD(entry,
+                                                       FILTER_PREFIX_GROUP,
+                                                       listEntry
+                                                       );
+
+        status = FwpmFilterDeleteById0(gFilterEngineHandle, group->filterId);
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_CALLOUT_REGISTRATION, "Deleting filter %llu failed during %!FUNC! with %!STATUS!", group->filterId, status);
+            goto Exit;
+        }
+        deletedCount++;
+    }
+
+    status = FwpmTransactionCommit0(gFilterEngineHandle);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CALLOUT_REGISTRATION, "Committing the transaction to the filter engine failed %!STATUS!", status);
+        goto Exit;
+    }
+    inTransaction = FALSE;
+
+    //
+    // Step 3
+    // The filters now match the new groups, so swap them in. The current
+    // groups, kept or not, are freed at Exit.
+    //
+    while (!IsListEmpty(groupsHead))
+    {
+        InsertTailList(&keptGroups, RemoveHeadList(groupsHead));
+    }
+
+    while (!IsListEmpty(&newGroups))
+    {
+        InsertTailList(groupsHead, RemoveHeadList(&newGroups));
+    }
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CALLOUT_REGISTRATION, "%s list filters updated: %u added, %u deleted", TargetList == WHITE_LIST ? "White" : "Mesh", addedCount, deletedCount);
+
+Exit:
+
+    if (inTransaction)
+    {
+        FwpmTransactionAbort0(gFilterEngineHandle);
+        _Analysis_assume_lock_not_held_(gFilterEngineHandle);
+    }
+
+    //
+    // On failure the aborted transaction left the current filters in place,
+    // so put back the current groups that were set aside
+    //
+    if (!NT_SUCCESS(status))
+    {
+        while (!IsListEmpty(&keptGroups))
+        {
+            InsertTailList(groupsHead, RemoveHeadList(&keptGroups));
+        }
+    }
+
+    while (!IsListEmpty(&keptGroups))
+    {
+        ExFreePoolWithTag(CONTAINING_RECORD(RemoveHeadList(&keptGroups),
+                                            FILTER_PREFIX_GROUP,
+                                            listEntry
+                                            ),
+                          IPV6_TO_BLE_FILTER_GROUP_TAG
+                          );
+    }
+
+    while (!IsListEmpty(&newGroups))
+    {
+        ExFreePoolWithTag(CONTAINING_RECORD(RemoveHeadList(&newGroups),
+                                            FILTER_PREFIX_GROUP,
+                                            listEntry
+                                            ),
+                          IPV6_TO_BLE_FILTER_GROUP_TAG
+                          );
+    }
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CALLOUT_REGISTRATION, "%!FUNC! Exit");
+
+    return status;
+}
+
+_Use_decl_annotations_
+VOID
+IPv6ToBleCalloutsUnregister()
+/*++
+Routine Description:
+
+    Unregisters the inbound IPV6 packet callout. This can be called either
+    during driver unload or by the functions that add/remove entries from
+    the white list and mesh list.
+
+    The functions to add and remove entries from the white list and mesh list
+    only call this function if the callouts are currently registered. Driver
+    unload means the driver is unloading so the results of this function aren't
+    particularly important. Therefore, we don't need to check the NTSTATUS
+    that FwpsCalloutUnregisterById0 returns (the samples don't, either).
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    VOID.
+
+---*/
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CALLOUT_REGISTRATION, "%!FUNC! Entry");
+
+    NTSTATUS status = STATUS_SUCCESS;
 
     //
     // Step 1
@@ -1478,5 +2184,16 @@ Return Value:
         gCalloutsRegistered = FALSE;
     }
 
+    //
+    // Step 3
+    // Free the filter prefix groups. Their filters went away with the
+    // session in step 1.
+    //
+    if (gBorderRouterFlag)
+    {
+        IPv6ToBleCalloutFilterGroupsFree(WHITE_LIST);
+        IPv6ToBleCalloutFilterGroupsFree(MESH_LIST);
+    }
+
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CALLOUT_REGISTRATION, "%!FUNC! Exit");
 }
@@ -109,16 +109,82 @@ IPv6ToBleCalloutFilterAdd(
     _In_				wchar_t*	    filterName,
     _In_				wchar_t*	    filterDesc,
     _In_reads_opt_(16)	const UINT8*	ipv6Address,
+    _In_                UINT8           prefixLength,
     _In_                int             direction,
     _In_				const GUID*		layerKey,
-    _In_				const GUID*		calloutKey
+    _In_				const GUID*		calloutKey,
+    _Out_opt_           UINT64*         filterId
 );
 
+
 _IRQL_requires_(PASSIVE_LEVEL)
 _IRQL_requires_same_
 VOID
 IPv6ToBleCalloutsUnregister();
 
+//-----------------------------------------------------------------------------
+// Functions to maintain the border router's filters, which are compacted
+// into one filter per /64 prefix of each runtime list
+//-----------------------------------------------------------------------------
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+PFILTER_PREFIX_GROUP
+IPv6ToBleCalloutFilterGroupFind(
+    _In_    ULONG           TargetList,
+    _In_    const IN6_ADDR* ipv6Address
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+_Success_(return == STATUS_SUCCESS)
+NTSTATUS
+IPv6ToBleCalloutFilterGroupAddFilter(
+    _In_    ULONG                   TargetList,
+    _Inout_ PFILTER_PREFIX_GROUP    group
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+_Success_(return == STATUS_SUCCESS)
+NTSTATUS
+IPv6ToBleCalloutFilterGroupsBuild(
+    _In_    ULONG   TargetList
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+VOID
+IPv6ToBleCalloutFilterGroupsFree(
+    _In_    ULONG   TargetList
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+_Success_(return == STATUS_SUCCESS)
+NTSTATUS
+IPv6ToBleCalloutFilterAddForListEntry(
+    _In_    ULONG           TargetList,
+    _In_    const IN6_ADDR* ipv6Address
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+_Success_(return == STATUS_SUCCESS)
+NTSTATUS
+IPv6ToBleCalloutFilterDeleteForListEntry(
+    _In_    ULONG           TargetList,
+    _In_    const IN6_ADDR* ipv6Address
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+_Success_(return == STATUS_SUCCESS)
+NTSTATUS
+IPv6ToBleCalloutFilterGroupsUpdate(
+    _In_    ULONG   TargetList
+);
+
 //-----------------------------------------------------------------------------
 // Callout and sublayer GUIDs
 //-----------------------------------------------------------------------------
@@ -123,5 +123,133 @@ namespace IPv6ToBleDriverInterfaceForUWP
                 METHOD_BUFFERED,
                 FILE_ANY_ACCESS
                 );
+
+        public static readonly int IOCTL_IPV6_TO_BLE_LISTEN_NETWORK_V6_BATCH =
+            CTL_CODE(
+                FILE_DEVICE_IPV6_TO_BLE,
+                0x8091,
+                METHOD_BUFFERED,
+                FILE_ANY_ACCESS
+                );
+
+        public static readonly int IOCTL_IPV6_TO_BLE_MAP_SHARED_RINGS =
+            CTL_CODE(
+                FILE_DEVICE_IPV6_TO_BLE,
+                0x8092,
+                METHOD_BUFFERED,
+                FILE_ANY_ACCESS
+                );
+
+        public static readonly int IOCTL_IPV6_TO_BLE_UNMAP_SHARED_RINGS =
+            CTL_CODE(
+                FILE_DEVICE_IPV6_TO_BLE,
+                0x8093,
+                METHOD_BUFFERED,
+                FILE_ANY_ACCESS
+                );
+
+        public static readonly int IOCTL_IPV6_TO_BLE_KICK_INJECT_RING =
+            CTL_CODE(
+                FILE_DEVICE_IPV6_TO_BLE,
+                0x8094,
+                METHOD_BUFFERED,
+                FILE_ANY_ACCESS
+                );
+
+        public static readonly int IOCTL_IPV6_TO_BLE_INJECT_INBOUND_NETWORK_V6_BATCH =
+            CTL_CODE(
+                FILE_DEVICE_IPV6_TO_BLE,
+                0x8095,
+                METHOD_BUFFERED,
+                FILE_ANY_ACCESS
+                );
+
+        public static readonly int IOCTL_IPV6_TO_BLE_INJECT_OUTBOUND_NETWORK_V6_BATCH =
+            CTL_CODE(
+                FILE_DEVICE_IPV6_TO_BLE,
+                0x8096,
+                METHOD_BUFFERED,
+                FILE_ANY_ACCESS
+                );
+
+        public static readonly int IOCTL_IPV6_TO_BLE_BULK_ADD_TO_LIST =
+            CTL_CODE(
+                FILE_DEVICE_IPV6_TO_BLE,
+                0x8097,
+                METHOD_BUFFERED,
+                FILE_ANY_ACCESS
+                );
+
+        public static readonly int IOCTL_IPV6_TO_BLE_BULK_REMOVE_FROM_LIST =
+            CTL_CODE(
+                FILE_DEVICE_IPV6_TO_BLE,
+                0x8098,
+                METHOD_BUFFERED,
+                FILE_ANY_ACCESS
+                );
+
+        public static readonly int IOCTL_IPV6_TO_BLE_BULK_REPLACE_LIST =
+            CTL_CODE(
+                FILE_DEVICE_IPV6_TO_BLE,
+                0x8099,
+                METHOD_BUFFERED,
+                FILE_ANY_ACCESS
+                );
+
+        public static readonly int IOCTL_IPV6_TO_BLE_QUERY_STATISTICS =
+            CTL_CODE(
+                FILE_DEVICE_IPV6_TO_BLE,
+                0x809A,
+                METHOD_BUFFERED,
+                FILE_ANY_ACCESS
+                );
+
+        public static readonly int IOCTL_IPV6_TO_BLE_QUERY_LATENCY_HISTOGRAM =
+            CTL_CODE(
+                FILE_DEVICE_IPV6_TO_BLE,
+                0x809B,
+                METHOD_BUFFERED,
+                FILE_ANY_ACCESS
+                );
+
+        public static readonly int IOCTL_IPV6_TO_BLE_QUERY_READINESS =
+            CTL_CODE(
+                FILE_DEVICE_IPV6_TO_BLE,
+                0x809C,
+                METHOD_BUFFERED,
+                FILE_ANY_ACCESS
+                );
+
+        public static readonly int IOCTL_IPV6_TO_BLE_SET_PACKET_TRACE =
+            CTL_CODE(
+                FILE_DEVICE_IPV6_TO_BLE,
+                0x809D,
+                METHOD_BUFFERED,
+                FILE_ANY_ACCESS
+                );
+
+        public static readonly int IOCTL_IPV6_TO_BLE_QUERY_PACKET_TRACE =
+            CTL_CODE(
+                FILE_DEVICE_IPV6_TO_BLE,
+                0x809E,
+                METHOD_BUFFERED,
+                FILE_ANY_ACCESS
+                );
+
+        public static readonly int IOCTL_IPV6_TO_BLE_SET_SHAPING =
+            CTL_CODE(
+                FILE_DEVICE_IPV6_TO_BLE,
+                0x809F,
+                METHOD_BUFFERED,
+                FILE_ANY_ACCESS
+                );
+
+        public static readonly int IOCTL_IPV6_TO_BLE_WAIT_FOR_LIST_CHANGE =
+            CTL_CODE(
+                FILE_DEVICE_IPV6_TO_BLE,
+                0x80A0,
+                METHOD_BUFFERED,
+                FILE_ANY_ACCESS
+                );
     }
 }
@@ -73,9 +73,15 @@ namespace IPv6ToBleDriverInterfaceForUWP
         /// operations with the driver. In other words, it is used with
         /// requests to listen for packets, which may come in at arbitrary times.
         /// 
-        /// This version of DeviceIoControl() is to be used with this IOCTLs:
+        /// This version of DeviceIoControl() is to be used with these IOCTLs:
         /// 
         /// IOCTL_IPV6_TO_BLE_LISTEN_NETWORK_V6 
+        /// IOCTL_IPV6_TO_BLE_LISTEN_NETWORK_V6_BATCH
+        /// IOCTL_IPV6_TO_BLE_WAIT_FOR_LIST_CHANGE
+        /// 
+        /// The list change IOCTL takes an IPV6_TO_BLE_LIST_CHANGE_REQUEST as
+        /// a byte array and returns an IPV6_TO_BLE_LIST_CHANGE_HEADER followed
+        /// by the list changes, once the white list or mesh list changes.
         /// 
         /// For more information about this function, see
         /// https://msdn.microsoft.com/library/windows/desktop/aa363216.
@@ -102,6 +108,32 @@ namespace IPv6ToBleDriverInterfaceForUWP
         /// 
         /// IOCTL_IPV6_TO_BLE_INJECT_INBOUND_NETWORK_V6    
         /// IOCTL_IPV6_TO_BLE_INJECT_OUTBOUND_NETWORK_V6
+        /// IOCTL_IPV6_TO_BLE_INJECT_INBOUND_NETWORK_V6_BATCH
+        /// IOCTL_IPV6_TO_BLE_INJECT_OUTBOUND_NETWORK_V6_BATCH
+        /// IOCTL_IPV6_TO_BLE_MAP_SHARED_RINGS
+        /// IOCTL_IPV6_TO_BLE_UNMAP_SHARED_RINGS
+        /// IOCTL_IPV6_TO_BLE_KICK_INJECT_RING
+        /// IOCTL_IPV6_TO_BLE_BULK_ADD_TO_LIST
+        /// IOCTL_IPV6_TO_BLE_BULK_REMOVE_FROM_LIST
+        /// IOCTL_IPV6_TO_BLE_BULK_REPLACE_LIST
+        /// IOCTL_IPV6_TO_BLE_QUERY_STATISTICS
+        /// IOCTL_IPV6_TO_BLE_QUERY_LATENCY_HISTOGRAM
+        /// IOCTL_IPV6_TO_BLE_QUERY_READINESS
+        /// IOCTL_IPV6_TO_BLE_SET_PACKET_TRACE
+        /// IOCTL_IPV6_TO_BLE_QUERY_PACKET_TRACE
+        /// IOCTL_IPV6_TO_BLE_SET_SHAPING
+        /// 
+        /// The map IOCTL takes and returns the structures defined in Public.h
+        /// of IPv6ToBle.sys, marshaled as byte arrays. The unmap and kick
+        /// IOCTLs don't use the input or output buffers. The statistics IOCTL
+        /// returns an IPV6_TO_BLE_STATISTICS structure as a byte array, and
+        /// the latency histogram IOCTL returns an
+        /// IPV6_TO_BLE_LATENCY_HISTOGRAM, optionally resetting it. The
+        /// readiness IOCTL returns an IPV6_TO_BLE_READINESS. The set packet
+        /// trace IOCTL takes an IPV6_TO_BLE_PACKET_TRACE_SETTINGS, and the
+        /// query packet trace IOCTL returns an IPV6_TO_BLE_PACKET_TRACE_HEADER
+        /// followed by the sampled records. The shaping IOCTL takes an
+        /// IPV6_TO_BLE_SHAPING_SETTINGS.
         /// 
         /// For more information about this function, see
         /// https://msdn.microsoft.com/library/windows/desktop/aa363216.